@@ -32,6 +32,7 @@ displayUsage() {
   std::cout << "    call         discover and genotype structural variants" << std::endl;
   std::cout << "    merge        merge structural variants across VCF/BCF files and within a single VCF/BCF file" << std::endl;
   std::cout << "    filter       filter somatic or germline structural variants" << std::endl;
+  std::cout << "    combine      combine per-sample evidence files of a site panel into one genotyped BCF" << std::endl;
   std::cout << std::endl;
   std::cout << "Long-read SV calling:" << std::endl;
   std::cout << "    lr           long-read SV discovery" << std::endl;
@@ -39,6 +40,7 @@ displayUsage() {
   std::cout << "Copy-number variant calling:" << std::endl;
   std::cout << "    cnv          discover and genotype copy-number variants" << std::endl;
   std::cout << "    classify     classify somatic or germline copy-number variants" << std::endl;
+  std::cout << "    tracks       precompute GC and mappability tracks for cnv" << std::endl;
   std::cout << std::endl;
   std::cout << std::endl;
 }
@@ -78,6 +80,9 @@ int main(int argc, char **argv) {
     else if ((std::string(argv[1]) == "cnv")) {
       return coral(argc-1,argv+1);
     }
+    else if ((std::string(argv[1]) == "tracks")) {
+      return tracks(argc-1,argv+1);
+    }
     else if ((std::string(argv[1]) == "classify")) {
       return classify(argc-1,argv+1);
     }
@@ -87,6 +92,9 @@ int main(int argc, char **argv) {
     else if ((std::string(argv[1]) == "merge")) {
       return merge(argc-1,argv+1);
     }
+    else if ((std::string(argv[1]) == "combine")) {
+      return combine(argc-1,argv+1);
+    }
 
     std::cerr << "Unrecognized command " << std::string(argv[1]) << std::endl;
     return 1;
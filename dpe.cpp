@@ -1,6 +1,5 @@
 #include <iostream>
 #include <fstream>
-#include <boost/dynamic_bitset.hpp>
 #include <boost/unordered_map.hpp>
 #include <boost/graph/adjacency_list.hpp>
 #include <boost/graph/connected_components.hpp>
@@ -40,20 +39,30 @@ using namespace torali;
 struct DoublePEConfig {
   int32_t wiggle;
   int32_t svsize;
+  uint32_t threads;
   float carconc;
   boost::filesystem::path outfile;
   boost::filesystem::path infile;
 };
 
-struct SVCarrier {
-  typedef boost::dynamic_bitset<> TBitSet;
+// Carrier sets of one chromosome in two contiguous pools: 64-bit words for dense sets, sorted sample indices for sparse sets
+struct CarrierPool {
+  uint32_t nwords;
+  std::vector<uint64_t> words;
+  std::vector<uint32_t> index;
+
+  explicit CarrierPool(uint32_t const nsamples) : nwords((nsamples + 63) / 64) {}
+};
 
+struct SVCarrier {
   int32_t start;
   int32_t end;
   std::string id;
-  TBitSet carrier;
+  uint32_t ncarrier;
+  bool sparse;
+  uint64_t offset;
   
-  SVCarrier(int32_t s, int32_t e, std::string i, TBitSet c) : start(s), end(e), id(i), carrier(c) {}
+  SVCarrier(int32_t s, int32_t e, std::string i, uint32_t n, bool sp, uint64_t o) : start(s), end(e), id(i), ncarrier(n), sparse(sp), offset(o) {}
 };
 
 struct DPERecord {
@@ -69,26 +78,141 @@ struct DPERecord {
 };
 
 
+// Store the sorted carrier indices of an SV, sets with fewer carriers than words are kept sparse
+inline void
+_addCarriers(CarrierPool& pool, std::vector<uint32_t> const& car, bool& sparse, uint64_t& offset) {
+  sparse = (car.size() < pool.nwords);
+  if (sparse) {
+    offset = pool.index.size();
+    pool.index.insert(pool.index.end(), car.begin(), car.end());
+  } else {
+    offset = pool.words.size();
+    pool.words.resize(offset + pool.nwords, 0);
+    uint64_t* w = &pool.words[offset];
+    for(uint32_t k = 0; k < car.size(); ++k) w[car[k] >> 6] |= (uint64_t) 1 << (car[k] & 63);
+  }
+}
+
+// Carrier concordance |a & b| / |a | b|, the union follows from the carrier counts
+inline float
+_carrierConcordance(CarrierPool const& pool, SVCarrier const& a, SVCarrier const& b) {
+  if ((a.ncarrier == 0) || (b.ncarrier == 0)) return 0;
+  uint32_t common = 0;
+  if ((a.sparse) && (b.sparse)) {
+    uint32_t const* ia = &pool.index[0] + a.offset;
+    uint32_t const* ib = &pool.index[0] + b.offset;
+    uint32_t i = 0;
+    uint32_t j = 0;
+    while ((i < a.ncarrier) && (j < b.ncarrier)) {
+      if (ia[i] < ib[j]) ++i;
+      else if (ib[j] < ia[i]) ++j;
+      else {
+	++common;
+	++i;
+	++j;
+      }
+    }
+  } else if ((a.sparse) || (b.sparse)) {
+    SVCarrier const& sp = (a.sparse) ? a : b;
+    SVCarrier const& dn = (a.sparse) ? b : a;
+    uint32_t const* idx = &pool.index[0] + sp.offset;
+    uint64_t const* w = &pool.words[0] + dn.offset;
+    for(uint32_t k = 0; k < sp.ncarrier; ++k) common += (w[idx[k] >> 6] >> (idx[k] & 63)) & 1;
+  } else {
+    uint64_t const* wa = &pool.words[0] + a.offset;
+    uint64_t const* wb = &pool.words[0] + b.offset;
+    for(uint32_t k = 0; k < pool.nwords; ++k) common += __builtin_popcountll(wa[k] & wb[k]);
+  }
+  uint32_t all = a.ncarrier + b.ncarrier - common;
+  if (all == 0) return 0;
+  return (float) common / (float) all;
+}
+
+
+// Sort SVs of a CT bucket by start, ties in input order
+struct SortSVCarrierStart {
+  std::vector<SVCarrier> const& sv;
+
+  explicit SortSVCarrierStart(std::vector<SVCarrier> const& s) : sv(s) {}
+
+  inline bool operator()(int32_t const a, int32_t const b) const {
+    return ((sv[a].start < sv[b].start) || ((sv[a].start == sv[b].start) && (a < b)));
+  }
+};
+
+
+// Pair two CT buckets: each SV of ctI takes its most concordant overlapping SV of ctJ, each SV of ctJ keeps its best partner
+inline void
+_pairCTs(DoublePEConfig const& c, CarrierPool const& pool, std::vector<SVCarrier> const& ctI, std::vector<SVCarrier> const& ctJ, std::vector<DPERecord>& dper, boost::unordered_map<std::string, std::vector<uint32_t> >& links) {
+  // Bucket j by start, the longest SV bounds the sweep window
+  std::vector<int32_t> order(ctJ.size());
+  int32_t maxLen = 0;
+  for(int32_t jp = 0; jp < (int32_t) ctJ.size(); ++jp) {
+    order[jp] = jp;
+    if (ctJ[jp].end - ctJ[jp].start > maxLen) maxLen = ctJ[jp].end - ctJ[jp].start;
+  }
+  std::sort(order.begin(), order.end(), SortSVCarrierStart(ctJ));
+  std::vector<int32_t> starts(order.size());
+  for(uint32_t k = 0; k < order.size(); ++k) starts[k] = ctJ[order[k]].start;
+
+  // Best partner of each SV in bucket i, overlapping SVs of bucket j start within [start - maxLen, end]
+  std::vector<int32_t> bestJP(ctI.size(), -1);
+  std::vector<float> bestCC(ctI.size(), -1);
+  for(int32_t ip = 0; ip < (int32_t) ctI.size(); ++ip) {
+    SVCarrier const& svI = ctI[ip];
+    uint32_t k = std::lower_bound(starts.begin(), starts.end(), svI.start - maxLen) - starts.begin();
+    for(; ((k < starts.size()) && (starts[k] <= svI.end)); ++k) {
+      int32_t jp = order[k];
+      SVCarrier const& svJ = ctJ[jp];
+      if (svJ.end < svI.start) continue;
+      if (((svI.start - c.wiggle < svJ.start) && (svJ.start < svI.end) && (svI.end - c.wiggle < svJ.end)) || ((svJ.start - c.wiggle < svI.start) && (svI.start < svJ.end) && (svJ.end - c.wiggle < svI.end))) {
+	float cc = _carrierConcordance(pool, svI, svJ);
+	// Ties keep the first SV in input order
+	if ((cc >= c.carconc) && ((cc > bestCC[ip]) || ((cc == bestCC[ip]) && (jp < bestJP[ip])))) {
+	  bestJP[ip] = jp;
+	  bestCC[ip] = cc;
+	}
+      }
+    }
+  }
+
+  // Winner of each SV in bucket j: highest concordance, ties keep the first SV of bucket i
+  std::vector<int32_t> winner(ctJ.size(), -1);
+  for(int32_t ip = 0; ip < (int32_t) ctI.size(); ++ip) {
+    if (bestJP[ip] < 0) continue;
+    int32_t& w = winner[bestJP[ip]];
+    if ((w < 0) || (bestCC[ip] > bestCC[w])) w = ip;
+  }
+  for(int32_t ip = 0; ip < (int32_t) ctI.size(); ++ip) {
+    if ((bestJP[ip] < 0) || (winner[bestJP[ip]] != ip)) continue;
+    SVCarrier const& svI = ctI[ip];
+    SVCarrier const& svJ = ctJ[bestJP[ip]];
+    uint32_t idx = dper.size();
+    dper.push_back(DPERecord(svI.start, svI.end, svJ.start, svJ.end, bestCC[ip], svI.id, svJ.id));
+    std::vector<uint32_t>& linkI = links[svI.id];
+    if (!linkI.empty()) std::cerr << "SV already exists!" << std::endl;
+    linkI.push_back(idx);
+    if (svJ.id == svI.id) continue;
+    std::vector<uint32_t>& linkJ = links[svJ.id];
+    if (!linkJ.empty()) std::cerr << "SV already exists!" << std::endl;
+    linkJ.push_back(idx);
+  }
+}
+
+
 inline int
 dpeRun(DoublePEConfig const& c)
 {
 
   // Open BCF file
   htsFile* ifile = bcf_open(c.infile.string().c_str(), "r");
-  hts_idx_t* bcfidx = bcf_index_load(c.infile.string().c_str());
   bcf_hdr_t* hdr = bcf_hdr_read(ifile);
 
-  // Read BCF file
-  int32_t nsvend = 0;
-  int32_t* svend = NULL;
-  int32_t nsvt = 0;
-  char* svt = NULL;
-  int32_t nchr2 = 0;
-  char* chr2 = NULL;
-  int32_t nct = 0;
-  char* ct = NULL;
-  int ngt = 0;
-  int32_t* gt = NULL;
+  // Header IDs
+  int32_t endId = bcf_hdr_id2int(hdr, BCF_DT_ID, "END");
+  int32_t ctId = bcf_hdr_id2int(hdr, BCF_DT_ID, "CT");
+  FormatField gtProto;
+  _formatField(hdr, "GT", gtProto);
 
   // Get sequences
   int32_t nseq = 0;
@@ -114,149 +238,143 @@ dpeRun(DoublePEConfig const& c)
   bcf_hdr_remove(hdr_out, BCF_HL_INFO, "CARCONC");
   bcf_hdr_append(hdr_out, "##INFO=<ID=CARCONC,Number=1,Type=Float,Description=\"Carrier concordance of the linked paired-end calls.\">");
   if (bcf_hdr_write(ofile, hdr_out) != 0) std::cerr << "Error: Failed to write BCF header!" << std::endl;
-  
-  // Parse BCF
-  for(int32_t refIndex = 0; refIndex < nseq; ++refIndex) {
-    ++show_progress;
-
-    // Fetch SVs on this chromosome
-    int32_t maxCTs = 5;
-    typedef std::vector<SVCarrier> TSVCarrier;
-    typedef std::vector<TSVCarrier> TCTs;
-    TCTs cts(maxCTs);
-    hts_itr_t* itervcf = bcf_itr_querys(bcfidx, hdr, bcf_hdr_id2name(hdr, refIndex));
-    bcf1_t* rec = bcf_init();
-    while (bcf_itr_next(ifile, itervcf, rec) >= 0) {
-      // Fetch info
-      bcf_unpack(rec, BCF_UN_ALL);
-      bcf_get_format_int32(hdr, rec, "GT", &gt, &ngt);
-      bcf_get_info_int32(hdr, rec, "END", &svend, &nsvend);
-      bcf_get_info_string(hdr, rec, "SVTYPE", &svt, &nsvt);
-      std::string chr2Name("NA");
-      if (bcf_get_info_string(hdr, rec, "CHR2", &chr2, &nchr2) > 0) chr2Name = std::string(chr2);
-      uint8_t ict = 0;
-      if (bcf_get_info_string(hdr, rec, "CT", &ct, &nct) > 0) ict = _decodeOrientation(std::string(ct));
-
-      // Fetch carriers
-      if ((*svend - rec->pos) < c.svsize) {
-	SVCarrier::TBitSet car(bcf_hdr_nsamples(hdr));
-	for (int i = 0; i < bcf_hdr_nsamples(hdr); ++i) {
-	  if ((bcf_gt_allele(gt[i*2]) != -1) && (bcf_gt_allele(gt[i*2 + 1]) != -1)) {
-	    int gt_type = bcf_gt_allele(gt[i*2]) + bcf_gt_allele(gt[i*2 + 1]);
-	    if (gt_type > 0) car[i] = true;
+
+  // Linked records of each chromosome, written in chromosome order as soon as all previous chromosomes are done
+  typedef std::vector<bcf1_t*> TChrRecords;
+  std::vector<TChrRecords> chrOut(nseq);
+  std::vector<bool> chrDone(nseq, false);
+  int32_t nextChr = 0;
+
+  // Parse BCF, chromosomes in parallel, each thread with its own reader
+#pragma omp parallel default(shared)
+  {
+    htsFile* tfile = bcf_open(c.infile.string().c_str(), "r");
+    hts_idx_t* tidx = bcf_index_load(c.infile.string().c_str());
+    bcf_hdr_t* thdr = bcf_hdr_read(tfile);
+    std::string ct;
+    FormatField gtField(gtProto);
+
+#pragma omp for schedule(dynamic)
+    for(int32_t refIndex = 0; refIndex < nseq; ++refIndex) {
+      TChrRecords out;
+      hts_itr_t* itervcf = bcf_itr_querys(tidx, thdr, bcf_hdr_id2name(thdr, refIndex));
+      if (itervcf != NULL) {
+	// Fetch SVs on this chromosome
+	int32_t maxCTs = 5;
+	typedef std::vector<SVCarrier> TSVCarrier;
+	typedef std::vector<TSVCarrier> TCTs;
+	TCTs cts(maxCTs);
+	CarrierPool pool(bcf_hdr_nsamples(thdr));
+	std::vector<uint32_t> car;
+	bcf1_t* rec = bcf_init();
+	while (bcf_itr_next(tfile, itervcf, rec) >= 0) {
+	  // Fetch info
+	  bcf_unpack(rec, BCF_UN_INFO);
+	  int32_t svEnd = 0;
+	  if (!_getInfoInt32(rec, endId, svEnd)) continue;
+	  uint8_t ict = 0;
+	  if (_getInfoString(rec, ctId, ct)) ict = _decodeOrientation(ct);
+
+	  // Fetch carriers
+	  if ((svEnd - rec->pos) < c.svsize) {
+	    if ((!_getFormatInt32(rec, gtField)) || (gtField.n < 2)) continue;
+	    car.clear();
+	    for (int i = 0; i < bcf_hdr_nsamples(thdr); ++i) {
+	      int32_t const* gt = _formatInt32(gtField, i);
+	      if ((bcf_gt_allele(gt[0]) != -1) && (bcf_gt_allele(gt[1]) != -1)) {
+		int gt_type = bcf_gt_allele(gt[0]) + bcf_gt_allele(gt[1]);
+		if (gt_type > 0) car.push_back(i);
+	      }
+	    }
+	    bool sparse = false;
+	    uint64_t offset = 0;
+	    _addCarriers(pool, car, sparse, offset);
+	    cts[(int32_t) ict].push_back(SVCarrier(rec->pos, svEnd, rec->d.id, car.size(), sparse, offset));
 	  }
 	}
-	cts[(int32_t) ict].push_back(SVCarrier(rec->pos, *svend, rec->d.id, car));
-      }
-    }
-    bcf_destroy(rec);
-    hts_itr_destroy(itervcf);
-
-    // Process SVs
-    typedef std::vector<DPERecord> Tdper;
-    Tdper dper;
-    typedef std::set<std::string> TSvIds;
-    TSvIds svIds;
-    for(int32_t i = 0; i<maxCTs; ++i) {
-      if (!cts[i].empty()) {
-	for(int32_t j = i+1; j<maxCTs; ++j) {
-	  if (!cts[j].empty()) {
-	    // Compare these 2 CTs
-	    typedef std::vector<int32_t> TJPCount;
-	    TJPCount jpc(cts[j].size(), 0);
-	    typedef std::map<std::pair<int32_t, int32_t>, float> TScoreMap;
-	    TScoreMap scm;
-	    for(int32_t ip = 0; ip < (int32_t) cts[i].size(); ++ip) {
-	      int32_t bestJP = -1;
-	      float bestCC = -1;
-	      for(int32_t jp = 0; jp < (int32_t) cts[j].size(); ++jp) {
-		if ((cts[i][ip].end < cts[j][jp].start) || (cts[j][jp].end < cts[i][ip].start)) continue;
-		if (((cts[i][ip].start - c.wiggle < cts[j][jp].start) && (cts[j][jp].start < cts[i][ip].end) && (cts[i][ip].end - c.wiggle < cts[j][jp].end)) || ((cts[j][jp].start - c.wiggle < cts[i][ip].start) && (cts[i][ip].start < cts[j][jp].end) && (cts[j][jp].end - c.wiggle < cts[i][ip].end))) {
-		  int32_t common = (cts[i][ip].carrier & cts[j][jp].carrier).count();
-		  int32_t all = (cts[i][ip].carrier | cts[j][jp].carrier).count();
-		  float cc = 0;
-		  if (all > 0) cc = (float) common / (float) all;
-		  if ((cc >= c.carconc) && (cc > bestCC)) {
-		    bestJP = jp;
-		    bestCC = cc;
-		  }
-		}
-	      }
-	      if (bestJP >= 0) {
-		scm.insert(std::make_pair(std::make_pair(ip, bestJP), bestCC));
-		++jpc[bestJP];
-	      }
+	bcf_destroy(rec);
+	hts_itr_destroy(itervcf);
+
+	// Process SVs
+	typedef std::vector<DPERecord> Tdper;
+	Tdper dper;
+	typedef boost::unordered_map<std::string, std::vector<uint32_t> > TLinks;
+	TLinks links;
+	for(int32_t i = 0; i<maxCTs; ++i) {
+	  if (!cts[i].empty()) {
+	    for(int32_t j = i+1; j<maxCTs; ++j) {
+	      if (!cts[j].empty()) _pairCTs(c, pool, cts[i], cts[j], dper, links);
 	    }
-	    for(TScoreMap::iterator scmIt = scm.begin(); scmIt != scm.end(); ++scmIt) {
-	      int32_t ip = scmIt->first.first;
-	      int32_t jp = scmIt->first.second;
-	      float cc = scmIt->second;
-	      bool savePair = true;
-	      if (jpc[jp] > 1) {
-		for(TScoreMap::iterator scmSec = scm.begin(); scmSec != scm.end(); ++scmSec) {
-		  if ((ip != scmSec->first.first) && (jp == scmSec->first.second)) {
-		    if ((cc < scmSec->second) || ((cc == scmSec->second) && (ip > scmSec->first.first))) {
-		      savePair = false;
-		      break;
-		    }
-		  }
-		}
-	      }
-	      if (savePair) {
-		dper.push_back(DPERecord(cts[i][ip].start, cts[i][ip].end, cts[j][jp].start, cts[j][jp].end, cc, cts[i][ip].id, cts[j][jp].id));
-		if (!svIds.insert(cts[i][ip].id).second) std::cerr << "SV already exists!" << std::endl;
-		if (!svIds.insert(cts[j][jp].id).second) std::cerr << "SV already exists!" << std::endl;
+	  }
+	}
+
+	if (!dper.empty()) {
+	  hts_itr_t* ivcf = bcf_itr_querys(tidx, thdr, bcf_hdr_id2name(thdr, refIndex));
+	  bcf1_t* r = bcf_init();
+	  while (bcf_itr_next(tfile, ivcf, r) >= 0) {
+	    bcf_unpack(r, BCF_UN_ALL);
+	    int32_t svEnd = 0;
+	    if (!_getInfoInt32(r, endId, svEnd)) continue;
+	    std::string id = std::string(r->d.id);
+	    TLinks::const_iterator itL = links.find(id);
+	    if (itL == links.end()) continue;
+	    // Find matching DPERecords
+	    for(uint32_t k = 0; k < itL->second.size(); ++k) {
+	      uint32_t i = itL->second[k];
+	      if (((dper[i].id1 == id) && (dper[i].start1 == r->pos) && (dper[i].end1 == svEnd)) || ((dper[i].id2 == id) && (dper[i].start2 == r->pos) && (dper[i].end2 == svEnd))) {
+
+		std::string linkid = dper[i].id1 + "," + dper[i].id2;
+		_remove_info_tag(hdr_out, r, "LINKID");
+		bcf_update_info_string(hdr_out, r, "LINKID", linkid.c_str());
+		_remove_info_tag(hdr_out, r, "CARCONC");
+		bcf_update_info_float(hdr_out, r, "CARCONC", &dper[i].carconc, 1);
+		std::string reg = bcf_hdr_id2name(thdr, refIndex);
+		reg += "," + boost::lexical_cast<std::string>(std::min(dper[i].start1 + 1, dper[i].start2 + 1));
+		reg += "," + boost::lexical_cast<std::string>(std::max(dper[i].end1, dper[i].end2));
+		_remove_info_tag(hdr_out, r, "REGION");
+		bcf_update_info_string(hdr_out, r, "REGION", reg.c_str());
+		std::string reg1 = bcf_hdr_id2name(thdr, refIndex);
+		reg1 += "," + boost::lexical_cast<std::string>(std::min(dper[i].start1 + 1, dper[i].start2 + 1));
+		reg1 += "," + boost::lexical_cast<std::string>(std::max(dper[i].start1 + 1, dper[i].start2 + 1));
+		_remove_info_tag(hdr_out, r, "REGION1");
+		bcf_update_info_string(hdr_out, r, "REGION1", reg1.c_str());
+		std::string reg2 = bcf_hdr_id2name(thdr, refIndex);
+		reg2 += "," + boost::lexical_cast<std::string>(std::max(dper[i].start1 + 1, dper[i].start2 + 1));
+		reg2 += "," + boost::lexical_cast<std::string>(std::min(dper[i].end1, dper[i].end2));
+		_remove_info_tag(hdr_out, r, "REGION2");
+		bcf_update_info_string(hdr_out, r, "REGION2", reg2.c_str());
+		std::string reg3 = bcf_hdr_id2name(thdr, refIndex);
+		reg3 += "," + boost::lexical_cast<std::string>(std::min(dper[i].end1, dper[i].end2));
+		reg3 += "," + boost::lexical_cast<std::string>(std::max(dper[i].end1, dper[i].end2));
+		_remove_info_tag(hdr_out, r, "REGION3");
+		bcf_update_info_string(hdr_out, r, "REGION3", reg3.c_str());
+		out.push_back(bcf_dup(r));
 	      }
 	    }
 	  }
+	  bcf_destroy(r);
+	  hts_itr_destroy(ivcf);
 	}
       }
-    }
 
-    
-    hts_itr_t* ivcf = bcf_itr_querys(bcfidx, hdr, bcf_hdr_id2name(hdr, refIndex));
-    bcf1_t* r = bcf_init();
-    while (bcf_itr_next(ifile, ivcf, r) >= 0) {
-      bcf_unpack(r, BCF_UN_ALL);
-      bcf_get_info_int32(hdr, r, "END", &svend, &nsvend);
-      std::string id = std::string(r->d.id);
-      if (svIds.find(id) != svIds.end()) {
-	// Find matching DPERecord
-	for(int32_t i = 0; i < (int32_t) dper.size(); ++i) {
-	  if (((dper[i].id1 == id) && (dper[i].start1 == r->pos) && (dper[i].end1 == *svend)) || ((dper[i].id2 == id) && (dper[i].start2 == r->pos) && (dper[i].end2 == *svend))) {
-
-	    std::string linkid = dper[i].id1 + "," + dper[i].id2;
-	    _remove_info_tag(hdr_out, r, "LINKID");
-	    bcf_update_info_string(hdr_out, r, "LINKID", linkid.c_str());
-	    _remove_info_tag(hdr_out, r, "CARCONC");
-	    bcf_update_info_float(hdr_out, r, "CARCONC", &dper[i].carconc, 1);
-	    std::string reg = bcf_hdr_id2name(hdr, refIndex);
-	    reg += "," + boost::lexical_cast<std::string>(std::min(dper[i].start1 + 1, dper[i].start2 + 1));
-	    reg += "," + boost::lexical_cast<std::string>(std::max(dper[i].end1, dper[i].end2));
-	    _remove_info_tag(hdr_out, r, "REGION");
-	    bcf_update_info_string(hdr_out, r, "REGION", reg.c_str());
-	    std::string reg1 = bcf_hdr_id2name(hdr, refIndex);
-	    reg1 += "," + boost::lexical_cast<std::string>(std::min(dper[i].start1 + 1, dper[i].start2 + 1));
-	    reg1 += "," + boost::lexical_cast<std::string>(std::max(dper[i].start1 + 1, dper[i].start2 + 1));
-	    _remove_info_tag(hdr_out, r, "REGION1");
-	    bcf_update_info_string(hdr_out, r, "REGION1", reg1.c_str());
-	    std::string reg2 = bcf_hdr_id2name(hdr, refIndex);
-	    reg2 += "," + boost::lexical_cast<std::string>(std::max(dper[i].start1 + 1, dper[i].start2 + 1));
-	    reg2 += "," + boost::lexical_cast<std::string>(std::min(dper[i].end1, dper[i].end2));
-	    _remove_info_tag(hdr_out, r, "REGION2");
-	    bcf_update_info_string(hdr_out, r, "REGION2", reg2.c_str());
-	    std::string reg3 = bcf_hdr_id2name(hdr, refIndex);
-	    reg3 += "," + boost::lexical_cast<std::string>(std::min(dper[i].end1, dper[i].end2));
-	    reg3 += "," + boost::lexical_cast<std::string>(std::max(dper[i].end1, dper[i].end2));
-	    _remove_info_tag(hdr_out, r, "REGION3");
-	    bcf_update_info_string(hdr_out, r, "REGION3", reg3.c_str());
-	    bcf_write1(ofile, hdr_out, r);
+      // Write all finished chromosomes in order
+#pragma omp critical
+      {
+	++show_progress;
+	chrOut[refIndex].swap(out);
+	chrDone[refIndex] = true;
+	for(; ((nextChr < nseq) && (chrDone[nextChr])); ++nextChr) {
+	  for(uint32_t k = 0; k < chrOut[nextChr].size(); ++k) {
+	    bcf_write1(ofile, hdr_out, chrOut[nextChr][k]);
+	    bcf_destroy(chrOut[nextChr][k]);
 	  }
+	  TChrRecords().swap(chrOut[nextChr]);
 	}
       }
     }
-    bcf_destroy(r);
-    hts_itr_destroy(ivcf);    
+    bcf_hdr_destroy(thdr);
+    hts_idx_destroy(tidx);
+    bcf_close(tfile);
   }
   if (nseq) free(seqnames);
 
@@ -267,16 +385,8 @@ dpeRun(DoublePEConfig const& c)
   // Build index
   bcf_index_build(c.outfile.string().c_str(), 14);
 
-  // Clean-up
-  if (svend != NULL) free(svend);
-  if (svt != NULL) free(svt);
-  if (chr2 != NULL) free(chr2);
-  if (ct != NULL) free(ct);
-  if (gt != NULL) free(gt);
-  
   // BCF clean-up
   bcf_hdr_destroy(hdr);
-  hts_idx_destroy(bcfidx);
   bcf_close(ifile);
 
   
@@ -297,6 +407,7 @@ int main(int argc, char **argv) {
     ("svsize,s", boost::program_options::value<int32_t>(&c.svsize)->default_value(50000), "max. SV size")
     ("carconc,c", boost::program_options::value<float>(&c.carconc)->default_value(0.75), "min. carrier concordance")
     ("outfile,f", boost::program_options::value<boost::filesystem::path>(&c.outfile)->default_value("complexSV.bcf"), "complex SV output file")
+    ("threads,t", boost::program_options::value<uint32_t>(&c.threads)->default_value(0), "max. threads (0: OMP_NUM_THREADS)")
     ;
 
   // Define hidden options
@@ -359,6 +470,11 @@ int main(int argc, char **argv) {
     bcf_close(ifile);
   }
   
+  // Thread budget
+#ifdef OPENMP
+  if (c.threads > 0) omp_set_num_threads(c.threads);
+#endif
+
   // Show cmd
   boost::posix_time::ptime now = boost::posix_time::second_clock::local_time();
   std::cout << '[' << boost::posix_time::to_simple_string(now) << "] ";
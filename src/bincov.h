@@ -0,0 +1,294 @@
+#ifndef BINCOV_H
+#define BINCOV_H
+
+#include <iostream>
+#include <fstream>
+#include <cstring>
+#include <limits>
+#include <vector>
+#include <algorithm>
+
+#include <boost/filesystem.hpp>
+
+#include <htslib/sam.h>
+#include <htslib/bgzf.h>
+
+#include "util.h"
+
+namespace torali
+{
+
+  // Indexed binary coverage file
+  //
+  // BGZF stream of: magic, version, sample name, #chromosomes, chromosome names, followed by
+  // chunks of at most DELLY_COV_CHUNK windows of one chromosome: refIndex, #windows and the
+  // columns start, end, mappable (-1: NA), counts and CN (float). The index <covfile>.cvi
+  // lists refIndex, first start, max. end, #windows and BGZF virtual offset of every chunk.
+  // All values of both files are little-endian.
+  #ifndef DELLY_COV_MAGIC
+  #define DELLY_COV_MAGIC "DELLYCOV"
+  #endif
+
+  #ifndef DELLY_COV_INDEX_MAGIC
+  #define DELLY_COV_INDEX_MAGIC "DELLYCVI"
+  #endif
+
+  #ifndef DELLY_COV_VERSION
+  #define DELLY_COV_VERSION 1
+  #endif
+
+  #ifndef DELLY_COV_CHUNK
+  #define DELLY_COV_CHUNK 4096
+  #endif
+
+  struct CoverageWindow {
+    int32_t start;
+    int32_t end;
+    int32_t mappable;
+    double counts;
+    double cn;
+
+    CoverageWindow() : start(0), end(0), mappable(-1), counts(0), cn(0) {}
+    CoverageWindow(int32_t const s, int32_t const e) : start(s), end(e), mappable(-1), counts(0), cn(0) {}
+    CoverageWindow(int32_t const s, int32_t const e, int32_t const m, double const cnt, double const c) : start(s), end(e), mappable(m), counts(cnt), cn(c) {}
+  };
+
+  struct CoverageChunk {
+    int32_t refIndex;
+    int32_t start;
+    int32_t end;
+    uint32_t nwin;
+    int64_t voffset;
+  };
+
+  struct CoverageWriter {
+    BGZF* fp;
+    std::vector<CoverageChunk> chunks;
+
+    CoverageWriter() : fp(NULL) {}
+  };
+
+  struct CoverageReader {
+    BGZF* fp;
+    std::string sampleName;
+    std::vector<std::string> chrNames;
+    std::vector<CoverageChunk> chunks;
+
+    CoverageReader() : fp(NULL) {}
+  };
+
+  inline boost::filesystem::path
+  _coverageIndex(boost::filesystem::path const& covfile) {
+    return boost::filesystem::path(covfile.string() + ".cvi");
+  }
+
+  // Reverse the bytes of every value, big-endian hosts swap the little-endian columns
+  template<typename TValue>
+  inline void
+  _swapBytes(char* buf, std::size_t const n) {
+    for(std::size_t i = 0; i < n; ++i) std::reverse(buf + i * sizeof(TValue), buf + (i + 1) * sizeof(TValue));
+  }
+
+  template<typename TValue>
+  inline bool
+  _bgzfWrite(BGZF* fp, TValue const* val, std::size_t const n) {
+    if (!n) return true;
+    if ((sizeof(TValue) > 1) && (!_hostLittleEndian())) {
+      std::vector<char> buf(reinterpret_cast<char const*>(val), reinterpret_cast<char const*>(val + n));
+      _swapBytes<TValue>(&buf[0], n);
+      return (bgzf_write(fp, &buf[0], buf.size()) == (ssize_t) buf.size());
+    }
+    return (bgzf_write(fp, val, n * sizeof(TValue)) == (ssize_t) (n * sizeof(TValue)));
+  }
+
+  template<typename TValue>
+  inline bool
+  _bgzfRead(BGZF* fp, TValue* val, std::size_t const n) {
+    if (!n) return true;
+    if (bgzf_read(fp, val, n * sizeof(TValue)) != (ssize_t) (n * sizeof(TValue))) return false;
+    if ((sizeof(TValue) > 1) && (!_hostLittleEndian())) _swapBytes<TValue>(reinterpret_cast<char*>(val), n);
+    return true;
+  }
+
+  inline bool
+  _bgzfWriteString(BGZF* fp, std::string const& str) {
+    uint32_t len = str.size();
+    return _bgzfWrite(fp, &len, 1) && _bgzfWrite(fp, str.c_str(), len);
+  }
+
+  inline bool
+  _bgzfReadString(BGZF* fp, std::string& str) {
+    uint32_t len = 0;
+    if (!_bgzfRead(fp, &len, 1)) return false;
+    str.resize(len);
+    return (!len) || (_bgzfRead(fp, &str[0], len));
+  }
+
+  inline bool
+  openCoverageWriter(boost::filesystem::path const& covfile, std::string const& sampleName, bam_hdr_t const* hdr, CoverageWriter& cw) {
+    cw.fp = bgzf_open(covfile.string().c_str(), "w");
+    if (cw.fp == NULL) {
+      std::cerr << "Fail to open file " << covfile.string() << std::endl;
+      return false;
+    }
+    uint32_t version = DELLY_COV_VERSION;
+    uint32_t nchr = hdr->n_targets;
+    bool valid = _bgzfWrite(cw.fp, DELLY_COV_MAGIC, std::strlen(DELLY_COV_MAGIC)) && _bgzfWrite(cw.fp, &version, 1) && _bgzfWriteString(cw.fp, sampleName) && _bgzfWrite(cw.fp, &nchr, 1);
+    for(uint32_t refIndex = 0; ((valid) && (refIndex < nchr)); ++refIndex) valid = _bgzfWriteString(cw.fp, std::string(hdr->target_name[refIndex]));
+    return valid;
+  }
+
+  // Windows of one chromosome, chromosomes in any order
+  inline bool
+  writeCoverage(CoverageWriter& cw, int32_t const refIndex, std::vector<CoverageWindow> const& windows) {
+    std::vector<int32_t> icol;
+    std::vector<float> fcol;
+    for(uint32_t first = 0; first < windows.size(); first += DELLY_COV_CHUNK) {
+      uint32_t last = std::min((uint32_t) windows.size(), first + DELLY_COV_CHUNK);
+      CoverageChunk ck;
+      ck.refIndex = refIndex;
+      ck.start = windows[first].start;
+      ck.end = windows[first].end;
+      ck.nwin = last - first;
+      ck.voffset = bgzf_tell(cw.fp);
+      for(uint32_t i = first; i < last; ++i) ck.end = std::max(ck.end, windows[i].end);
+      bool valid = _bgzfWrite(cw.fp, &ck.refIndex, 1) && _bgzfWrite(cw.fp, &ck.nwin, 1);
+
+      // Columns
+      icol.resize(ck.nwin);
+      fcol.resize(ck.nwin);
+      for(uint32_t i = first; i < last; ++i) icol[i - first] = windows[i].start;
+      valid = valid && _bgzfWrite(cw.fp, &icol[0], ck.nwin);
+      for(uint32_t i = first; i < last; ++i) icol[i - first] = windows[i].end;
+      valid = valid && _bgzfWrite(cw.fp, &icol[0], ck.nwin);
+      for(uint32_t i = first; i < last; ++i) icol[i - first] = windows[i].mappable;
+      valid = valid && _bgzfWrite(cw.fp, &icol[0], ck.nwin);
+      for(uint32_t i = first; i < last; ++i) fcol[i - first] = windows[i].counts;
+      valid = valid && _bgzfWrite(cw.fp, &fcol[0], ck.nwin);
+      for(uint32_t i = first; i < last; ++i) fcol[i - first] = windows[i].cn;
+      valid = valid && _bgzfWrite(cw.fp, &fcol[0], ck.nwin);
+      if (!valid) return false;
+      cw.chunks.push_back(ck);
+    }
+    return true;
+  }
+
+  inline bool
+  closeCoverageWriter(boost::filesystem::path const& covfile, CoverageWriter& cw) {
+    bool valid = (bgzf_close(cw.fp) == 0);
+    cw.fp = NULL;
+    boost::filesystem::path idxfile = _coverageIndex(covfile);
+    std::ofstream out(idxfile.string().c_str(), std::ios_base::out | std::ios_base::binary);
+    out.write(DELLY_COV_INDEX_MAGIC, std::strlen(DELLY_COV_INDEX_MAGIC));
+    _writeBin(out, (uint32_t) DELLY_COV_VERSION);
+    _writeBin(out, (uint32_t) cw.chunks.size());
+    for(uint32_t i = 0; i < cw.chunks.size(); ++i) {
+      _writeBin(out, cw.chunks[i].refIndex);
+      _writeBin(out, cw.chunks[i].start);
+      _writeBin(out, cw.chunks[i].end);
+      _writeBin(out, cw.chunks[i].nwin);
+      _writeBin(out, cw.chunks[i].voffset);
+    }
+    out.close();
+    if ((!valid) || (!out)) {
+      std::cerr << "Fail to write coverage file " << covfile.string() << std::endl;
+      return false;
+    }
+    return true;
+  }
+
+  inline bool
+  openCoverageReader(boost::filesystem::path const& covfile, CoverageReader& cr) {
+    // Index
+    boost::filesystem::path idxfile = _coverageIndex(covfile);
+    std::ifstream in(idxfile.string().c_str(), std::ios_base::in | std::ios_base::binary);
+    std::string magic(std::strlen(DELLY_COV_INDEX_MAGIC), ' ');
+    uint32_t version = 0;
+    uint32_t nchunks = 0;
+    in.read(&magic[0], magic.size());
+    _readBin(in, version);
+    _readBin(in, nchunks);
+    if ((!in) || (magic != DELLY_COV_INDEX_MAGIC) || (version != DELLY_COV_VERSION)) {
+      std::cerr << "Missing or invalid coverage index " << idxfile.string() << std::endl;
+      return false;
+    }
+    cr.chunks.resize(nchunks);
+    for(uint32_t i = 0; i < nchunks; ++i) {
+      _readBin(in, cr.chunks[i].refIndex);
+      _readBin(in, cr.chunks[i].start);
+      _readBin(in, cr.chunks[i].end);
+      _readBin(in, cr.chunks[i].nwin);
+      _readBin(in, cr.chunks[i].voffset);
+    }
+    if (!in) {
+      std::cerr << "Truncated coverage index " << idxfile.string() << std::endl;
+      return false;
+    }
+
+    // Header
+    cr.fp = bgzf_open(covfile.string().c_str(), "r");
+    if (cr.fp == NULL) {
+      std::cerr << "Fail to open file " << covfile.string() << std::endl;
+      return false;
+    }
+    uint32_t nchr = 0;
+    bool valid = _bgzfRead(cr.fp, &magic[0], magic.size()) && (magic == DELLY_COV_MAGIC) && _bgzfRead(cr.fp, &version, 1) && (version == DELLY_COV_VERSION) && _bgzfReadString(cr.fp, cr.sampleName) && _bgzfRead(cr.fp, &nchr, 1);
+    if (valid) cr.chrNames.resize(nchr);
+    for(uint32_t refIndex = 0; ((valid) && (refIndex < nchr)); ++refIndex) valid = _bgzfReadString(cr.fp, cr.chrNames[refIndex]);
+    if (!valid) {
+      std::cerr << "Not a delly coverage file: " << covfile.string() << std::endl;
+      return false;
+    }
+    return true;
+  }
+
+  inline int32_t
+  coverageChrIndex(CoverageReader const& cr, std::string const& chrName) {
+    for(uint32_t refIndex = 0; refIndex < cr.chrNames.size(); ++refIndex) {
+      if (cr.chrNames[refIndex] == chrName) return refIndex;
+    }
+    return -1;
+  }
+
+  // Windows overlapping [start, end) of one chromosome, only the chunks of this region are decompressed
+  inline bool
+  readCoverage(CoverageReader& cr, int32_t const refIndex, int32_t const start, int32_t const end, std::vector<CoverageWindow>& windows) {
+    std::vector<int32_t> scol;
+    std::vector<int32_t> ecol;
+    std::vector<int32_t> mcol;
+    std::vector<float> ccol;
+    std::vector<float> ncol;
+    for(uint32_t i = 0; i < cr.chunks.size(); ++i) {
+      CoverageChunk const& ck = cr.chunks[i];
+      if ((ck.refIndex != refIndex) || (ck.start >= end) || (ck.end <= start)) continue;
+      int32_t ckRef = -1;
+      uint32_t nwin = 0;
+      bool valid = (bgzf_seek(cr.fp, ck.voffset, SEEK_SET) >= 0) && _bgzfRead(cr.fp, &ckRef, 1) && _bgzfRead(cr.fp, &nwin, 1) && (ckRef == refIndex) && (nwin == ck.nwin);
+      if (valid) {
+	scol.resize(nwin);
+	ecol.resize(nwin);
+	mcol.resize(nwin);
+	ccol.resize(nwin);
+	ncol.resize(nwin);
+	valid = _bgzfRead(cr.fp, &scol[0], nwin) && _bgzfRead(cr.fp, &ecol[0], nwin) && _bgzfRead(cr.fp, &mcol[0], nwin) && _bgzfRead(cr.fp, &ccol[0], nwin) && _bgzfRead(cr.fp, &ncol[0], nwin);
+      }
+      if (!valid) {
+	std::cerr << "Corrupted coverage file chunk " << i << std::endl;
+	return false;
+      }
+      for(uint32_t k = 0; k < nwin; ++k) {
+	if ((scol[k] < end) && (ecol[k] > start)) windows.push_back(CoverageWindow(scol[k], ecol[k], mcol[k], ccol[k], ncol[k]));
+      }
+    }
+    return true;
+  }
+
+  inline void
+  closeCoverageReader(CoverageReader& cr) {
+    if (cr.fp != NULL) bgzf_close(cr.fp);
+    cr.fp = NULL;
+  }
+
+}
+
+#endif
@@ -3,6 +3,8 @@
 
 #include <boost/math/special_functions/round.hpp>
 #include <boost/math/distributions/normal.hpp>
+#include <limits>
+#include <vector>
 
 namespace torali {
 
@@ -14,30 +16,70 @@ struct BoLog {
 
   std::vector<TPrecision> phred2prob;
 
+  // Per-quality log10 terms for the genotype likelihoods
+  std::vector<TPrecision> logErr;
+  std::vector<TPrecision> logHet;
+  std::vector<TPrecision> logCorrect;
+
   BoLog() {
     for(int i = 0; i <= boost::math::round(-10 * SMALLEST_GL); ++i) phred2prob.push_back(std::pow(TPrecision(10), -(TPrecision(i)/TPrecision(10))));
+    for(int i = 0; i <= std::numeric_limits<uint8_t>::max(); ++i) {
+      logErr.push_back(std::log10(phred2prob[i]));
+      logHet.push_back(std::log10(phred2prob[i] + (TPrecision(1) - phred2prob[i])));
+      logCorrect.push_back(std::log10(TPrecision(1) - phred2prob[i]));
+    }
   }
 };
 
 
- template<typename TBoLog, typename TMapqVector>
+ // Histogram of uint8_t qualities, sorted by quality. A quality whose count overflows uint16_t continues in a new bin.
+ struct QualityHistogram {
+   typedef std::pair<uint8_t, uint16_t> TQualCount;
+   typedef std::vector<TQualCount> TQualCounts;
+   typedef TQualCounts::const_iterator const_iterator;
+
+   TQualCounts qc;
+   uint32_t total;
+
+   QualityHistogram() : total(0) {}
+
+   inline void
+   push_back(uint8_t const qual) {
+     TQualCounts::iterator it = qc.end();
+     for(; (it != qc.begin()) && ((it - 1)->first > qual); --it);
+     if ((it != qc.begin()) && ((it - 1)->first == qual) && ((it - 1)->second < std::numeric_limits<uint16_t>::max())) ++(it - 1)->second;
+     else qc.insert(it, TQualCount(qual, 1));
+     ++total;
+   }
+
+   inline std::size_t size() const { return total; }
+   inline bool empty() const { return (total == 0); }
+   inline const_iterator begin() const { return qc.begin(); }
+   inline const_iterator end() const { return qc.end(); }
+ };
+
+
+ template<typename TBoLog, typename TQualHistogram>
  inline void
- _computeGLs(TBoLog const& bl, TMapqVector const& mapqRef, TMapqVector const& mapqAlt, float* gls, int32_t* gqval, int32_t* gts, int const file_c) {
+ _computeGLs(TBoLog const& bl, TQualHistogram const& mapqRef, TQualHistogram const& mapqAlt, float* gls, int32_t* gqval, int32_t* gts, int const file_c) {
    typedef typename TBoLog::value_type FLP;
    FLP gl[3];
 
    // Compute genotype likelihoods
    for(unsigned int geno=0; geno<=2; ++geno) gl[geno]=0;
    unsigned int peDepth=mapqRef.size() + mapqAlt.size();
-   for(typename TMapqVector::const_iterator mapqRefIt = mapqRef.begin();mapqRefIt!=mapqRef.end();++mapqRefIt) {
-     gl[0] += std::log10(bl.phred2prob[*mapqRefIt]);
-     gl[1] += std::log10(bl.phred2prob[*mapqRefIt] + (FLP(1) - bl.phred2prob[*mapqRefIt]));
-     gl[2] += std::log10(FLP(1) - bl.phred2prob[*mapqRefIt]);
+   // Table term times count per quality bin
+   for(typename TQualHistogram::const_iterator mapqRefIt = mapqRef.begin();mapqRefIt!=mapqRef.end();++mapqRefIt) {
+     FLP cnt = mapqRefIt->second;
+     gl[0] += cnt * bl.logErr[mapqRefIt->first];
+     gl[1] += cnt * bl.logHet[mapqRefIt->first];
+     gl[2] += cnt * bl.logCorrect[mapqRefIt->first];
    }
-   for(typename TMapqVector::const_iterator mapqAltIt = mapqAlt.begin();mapqAltIt!=mapqAlt.end();++mapqAltIt) {
-     gl[0] += std::log10(FLP(1) - bl.phred2prob[*mapqAltIt]);
-     gl[1] += std::log10((FLP(1) - bl.phred2prob[*mapqAltIt]) + bl.phred2prob[*mapqAltIt]);
-     gl[2] += std::log10(bl.phred2prob[*mapqAltIt]);
+   for(typename TQualHistogram::const_iterator mapqAltIt = mapqAlt.begin();mapqAltIt!=mapqAlt.end();++mapqAltIt) {
+     FLP cnt = mapqAltIt->second;
+     gl[0] += cnt * bl.logCorrect[mapqAltIt->first];
+     gl[1] += cnt * bl.logHet[mapqAltIt->first];
+     gl[2] += cnt * bl.logErr[mapqAltIt->first];
    }
    gl[1] += -FLP(peDepth) * std::log10(FLP(2));
    unsigned int glBest=0;
@@ -51,6 +51,7 @@ struct ClassifyConfig {
   int32_t minsize;
   int32_t maxsize;
   int32_t qual;
+  uint32_t threads;
   uint16_t ploidy;
   float pgerm;
   float maxsd;
@@ -64,16 +65,215 @@ struct ClassifyConfig {
 };
 
 
+// Header IDs and per-thread buffers of the classify workers
+struct ClassifyFields {
+  int32_t svtId;
+  int32_t endId;
+  int32_t passId;
+  int32_t lowQualId;
+  std::string svt;
+  FormatField gq;
+  FormatField cn;
+  FormatField cnl;
+  FormatField rdcn;
+  FormatField rdsd;
+};
+
+
+// Classify a single CNV, updates INFO, QUAL, FILTER and FORMAT fields of passing records (hdr_out is only read)
+template<typename TClassifyConfig>
+inline bool
+_classifyRecord(TClassifyConfig const& c, bcf_hdr_t* hdr, bcf_hdr_t* hdr_out, bcf1_t* rec, ClassifyFields& b) {
+  bool germline = false;
+  if (c.filter == "germline") germline = true;
+  bcf_unpack(rec, BCF_UN_INFO);
+
+  // Check SV type
+  if (!_getInfoString(rec, b.svtId, b.svt)) return false;
+  if (b.svt != "CNV") return false;
+
+  // Check PASS
+  bool pass = true;
+  if (c.filterForPass) pass = (bcf_has_filter(hdr, rec, const_cast<char*>("PASS"))==1);
+  if (!pass) return false;
+
+  // Check size
+  int32_t svStart= rec->pos - 1;
+  int32_t svEnd = 0;
+  if (!_getInfoInt32(rec, b.endId, svEnd)) return false;
+  if (svStart > svEnd) return false;
+  int32_t svlen = svEnd - svStart;
+  if ((svlen < c.minsize) || (svlen > c.maxsize)) return false;
+
+  // Check copy-number
+  if ((!_getFormatFloat(rec, b.rdcn)) || (!_getFormatFloat(rec, b.rdsd))) return false;
+  if ((germline) && ((!_getFormatInt32(rec, b.gq)) || (!_getFormatInt32(rec, b.cn)) || (!_getFormatFloat(rec, b.cnl)) || (b.cnl.n != MAX_CN))) return false;
+  int32_t* gqval = NULL;
+  int32_t* cnval = NULL;
+  float* cnl = NULL;
+  if (germline) {
+    gqval = &b.gq.ival[0];
+    cnval = &b.cn.ival[0];
+    cnl = &b.cnl.fval[0];
+  }
+  float* rdcn = &b.rdcn.fval[0];
+  float* rdsd = &b.rdsd.fval[0];
+
+  typedef std::pair<float, float> TCnSd;
+  typedef std::vector<TCnSd> TSampleDist;
+  TSampleDist control;
+  TSampleDist tumor;
+  for (int i = 0; i < bcf_hdr_nsamples(hdr); ++i) {
+    if ((!std::isfinite(rdcn[i])) || (rdcn[i] == -1)) return false;
+    if ((germline) || (c.controlSet.find(hdr->samples[i]) != c.controlSet.end())) {
+      // Control or population genomics
+      control.push_back(std::make_pair(rdcn[i], rdsd[i]));
+    } else if ((!germline) && (c.tumorSet.find(hdr->samples[i]) != c.tumorSet.end())) {
+      // Tumor
+      tumor.push_back(std::make_pair(rdcn[i], rdsd[i]));
+    }
+  }
+
+  // Classify
+  if (!germline) {
+    // Somatic mode
+    double bestCnOffset = 0;
+    bool somaticcnv = false;
+    double lowestp = 1;
+    for(uint32_t i = 0; i < tumor.size(); ++i) {
+      bool germcnv = false;
+      double highestprob = 0;
+      double tcnoffset = -1;
+      for(uint32_t k = 0; k < control.size(); ++k) {
+	boost::math::normal s1(control[k].first, control[k].second);
+	double prob1 = boost::math::pdf(s1, tumor[i].first);
+	boost::math::normal s2(tumor[i].first, tumor[i].second);
+	double prob2 = boost::math::pdf(s2, control[k].first);
+	double prob = std::max(prob1, prob2);
+	if (prob > c.pgerm) germcnv = true;
+	else {
+	  // Among all controls, take highest p-value (most likely germline CNV)
+	  if (prob > highestprob) highestprob = prob;
+	}
+	double cndiff = std::abs(tumor[i].first - control[k].first);
+	if (cndiff < c.cn_offset) germcnv = true;
+	else {
+	  // Among all controls, take smallest CN difference
+	  if ((tcnoffset == -1) || (cndiff < tcnoffset)) tcnoffset = cndiff;
+	}
+      }
+      // Among all tumors take best CN difference and lowest p-value
+      if (!germcnv) {
+	somaticcnv = true;
+	if ((highestprob < lowestp) && (tcnoffset > bestCnOffset)) {
+	  lowestp = highestprob;
+	  bestCnOffset = tcnoffset;
+	}
+      }
+    }
+    if (!somaticcnv) return false;
+    _remove_info_tag(hdr_out, rec, "SOMATIC");
+    bcf_update_info_flag(hdr_out, rec, "SOMATIC", NULL, 1);
+    float pgerm = (float) lowestp;
+    _remove_info_tag(hdr_out, rec, "PGERM");
+    bcf_update_info_float(hdr_out, rec, "PGERM", &pgerm, 1);
+    float cndiv = (float) bestCnOffset;
+    _remove_info_tag(hdr_out, rec, "CNDIFF");
+    bcf_update_info_float(hdr_out, rec, "CNDIFF", &cndiv, 1);
+  } else {
+    // Correct CN shift
+    int32_t cnmain = 0;
+    {
+      std::vector<int32_t> cncount(MAX_CN, 0);
+      {
+	bool validsite = true;
+	boost::accumulators::accumulator_set<double, boost::accumulators::features<boost::accumulators::tag::mean, boost::accumulators::tag::variance> > acc;
+	for(uint32_t k = 0; k < control.size(); ++k) {
+	  if ((boost::math::isinf(control[k].first)) || (boost::math::isnan(control[k].first))) validsite = false;
+	  else acc(boost::math::round(control[k].first) - control[k].first);
+	}
+	if (!validsite) return false;
+	double cnshift = boost::accumulators::mean(acc);
+	float cnshiftval = cnshift;
+	_remove_info_tag(hdr_out, rec, "CNSHIFT");
+	bcf_update_info_float(hdr_out, rec, "CNSHIFT", &cnshiftval, 1);
+	for (int i = 0; i < bcf_hdr_nsamples(hdr); ++i) {
+	  rdcn[i] += cnshift;
+	  cnval[i] = boost::math::round(rdcn[i]);
+	  if ((cnval[i] >= 0) && (cnval[i] < MAX_CN)) ++cncount[cnval[i]];
+	}
+      }
+
+      // Find max CN
+      for(uint32_t i = 1; i < MAX_CN; ++i) {
+	if (cncount[i] > cncount[cnmain]) cnmain = i;
+      }
+    }
+
+    // Calculate SD
+    boost::accumulators::accumulator_set<double, boost::accumulators::features<boost::accumulators::tag::mean, boost::accumulators::tag::variance> > accLocal;
+    for (int i = 0; i < bcf_hdr_nsamples(hdr); ++i) {
+      if (cnval[i] == cnmain) accLocal(rdcn[i]);
+    }
+    double sd = sqrt(boost::accumulators::variance(accLocal));
+    if (sd < 0.025) sd = 0.025;
+    float cnsdval = sd;
+    _remove_info_tag(hdr_out, rec, "CNSD");
+    bcf_update_info_float(hdr_out, rec, "CNSD", &cnsdval, 1);
+    if (cnsdval > c.maxsd) return false;
+
+    // Re-compute CNLs
+    std::vector<std::string> ftarr(bcf_hdr_nsamples(hdr));
+    int32_t altqual = 0;
+    int32_t altcount = 0;
+    for (int i = 0; i < bcf_hdr_nsamples(hdr); ++i) {
+      int32_t qval = _computeCNLs(c, rdcn[i], sd, cnl, gqval, i);
+      if (cnval[i] != c.ploidy) {
+	altqual += qval;
+	++altcount;
+      }
+      if (gqval[i] < 15) ftarr[i] = "LowQual";
+      else ftarr[i] = "PASS";
+    }
+    if (altcount == 0) return false;
+    altqual /= altcount;
+    if (altqual < c.qual) return false;
+    if (altqual > 10000) altqual = 10000;
+
+    // Update QUAL and FILTER
+    rec->qual = altqual;
+    int32_t tmpi = b.passId;
+    if (rec->qual < 15) tmpi = b.lowQualId;
+    bcf_update_filter(hdr_out, rec, &tmpi, 1);
+
+    // Update GT fields
+    std::vector<const char*> strp(bcf_hdr_nsamples(hdr));
+    std::transform(ftarr.begin(), ftarr.end(), strp.begin(), cstyle_str());
+    bcf_update_format_int32(hdr_out, rec, "CN", cnval, bcf_hdr_nsamples(hdr));
+    bcf_update_format_float(hdr_out, rec, "CNL",  cnl, bcf_hdr_nsamples(hdr) * MAX_CN);
+    bcf_update_format_int32(hdr_out, rec, "GQ", gqval, bcf_hdr_nsamples(hdr));
+    bcf_update_format_string(hdr_out, rec, "FT", &strp[0], bcf_hdr_nsamples(hdr));
+    bcf_update_format_float(hdr_out, rec, "RDCN",  rdcn, bcf_hdr_nsamples(hdr));
+  }
+  return true;
+}
+
+
 template<typename TClassifyConfig>
 inline int
 classifyRun(TClassifyConfig const& c) {
 
   // Load bcf file
   htsFile* ifile = hts_open(c.vcffile.string().c_str(), "r");
-  bcf_hdr_t* hdr = bcf_hdr_read(ifile);
 
   // Open output VCF file
   htsFile *ofile = hts_open(c.outfile.string().c_str(), "wb");
+
+  // BGZF decompression and compression threads
+  htsThreadPool tpool;
+  _vcfThreadPool(ifile, ofile, tpool);
+
+  bcf_hdr_t* hdr = bcf_hdr_read(ifile);
   bcf_hdr_t *hdr_out = bcf_hdr_dup(hdr);
   if (c.filter == "somatic") {
     bcf_hdr_remove(hdr_out, BCF_HL_INFO, "SOMATIC");
@@ -90,220 +290,56 @@ classifyRun(TClassifyConfig const& c) {
   }
   if (bcf_hdr_write(ofile, hdr_out) != 0) std::cerr << "Error: Failed to write BCF header!" << std::endl;
 
-  // VCF fields
-  int32_t nsvend = 0;
-  int32_t* svend = NULL;
-  int32_t nsvt = 0;
-  char* svt = NULL;
-  int ngqval = 0;
-  int32_t* gqval = NULL;
-  int ncnval = 0;
-  int32_t* cnval = NULL;
-  int ncnl = 0;
-  float* cnl = NULL;
-  int nrdcn = 0;
-  float* rdcn = NULL;
-  int nrdsd = 0;
-  float* rdsd = NULL;
-  bool germline = false;
-  if (c.filter == "germline") germline = true;
-
-  // Parse BCF
+  // Header IDs resolved once, copied into each worker
+  ClassifyFields fields;
+  fields.svtId = bcf_hdr_id2int(hdr, BCF_DT_ID, "SVTYPE");
+  fields.endId = bcf_hdr_id2int(hdr, BCF_DT_ID, "END");
+  fields.passId = bcf_hdr_id2int(hdr_out, BCF_DT_ID, "PASS");
+  fields.lowQualId = bcf_hdr_id2int(hdr_out, BCF_DT_ID, "LowQual");
+  _formatField(hdr, "GQ", fields.gq);
+  _formatField(hdr, "CN", fields.cn);
+  _formatField(hdr, "CNL", fields.cnl);
+  _formatField(hdr, "RDCN", fields.rdcn);
+  _formatField(hdr, "RDSD", fields.rdsd);
+
+  // Parse BCF in batches: read, classify records in parallel, write in input order
   boost::posix_time::ptime now = boost::posix_time::second_clock::local_time();
   std::cout << '[' << boost::posix_time::to_simple_string(now) << "] " << "Filtering VCF/BCF file" << std::endl;
-  bcf1_t* rec = bcf_init1();
-  while (bcf_read(ifile, hdr, rec) == 0) {
-    bcf_unpack(rec, BCF_UN_INFO);
-
-    // Check SV type
-    bcf_get_info_string(hdr, rec, "SVTYPE", &svt, &nsvt);
-    if (std::string(svt) != "CNV") continue;
-
-    // Check PASS
-    bool pass = true;
-    if (c.filterForPass) pass = (bcf_has_filter(hdr, rec, const_cast<char*>("PASS"))==1);
-    if (!pass) continue;
-
-    // Check size
-    int32_t svStart= rec->pos - 1;
-    bcf_get_info_int32(hdr, rec, "END", &svend, &nsvend);
-    int32_t svEnd = *svend;
-    if (svStart > svEnd) continue;
-    int32_t svlen = svEnd - svStart;
-    if ((svlen < c.minsize) || (svlen > c.maxsize)) continue;
-
-    // Check copy-number
-    bcf_unpack(rec, BCF_UN_ALL);
-    bcf_get_format_int32(hdr, rec, "GQ", &gqval, &ngqval);
-    bcf_get_format_int32(hdr, rec, "CN", &cnval, &ncnval);
-    bcf_get_format_float(hdr, rec, "CNL", &cnl, &ncnl);
-    bcf_get_format_float(hdr, rec, "RDCN", &rdcn, &nrdcn);
-    bcf_get_format_float(hdr, rec, "RDSD", &rdsd, &nrdsd);
-
-    typedef std::pair<float, float> TCnSd;
-    typedef std::vector<TCnSd> TSampleDist;
-    TSampleDist control;
-    TSampleDist tumor;
-    bool invalidCNV = false;
-    for (int i = 0; i < bcf_hdr_nsamples(hdr); ++i) {
-      if ((!std::isfinite(rdcn[i])) || (rdcn[i] == -1)) {
-	invalidCNV = true;
+  std::vector<bcf1_t*> batch(DELLY_VCF_BATCH);
+  for(uint32_t i = 0; i < batch.size(); ++i) batch[i] = bcf_init1();
+  std::vector<char> keep(batch.size(), 0);
+  bool eof = false;
+  while (!eof) {
+    int32_t nrec = 0;
+    for(; nrec < (int32_t) batch.size(); ++nrec) {
+      if (bcf_read(ifile, hdr, batch[nrec]) != 0) {
+	eof = true;
 	break;
       }
-      if ((germline) || (c.controlSet.find(hdr->samples[i]) != c.controlSet.end())) {
-	// Control or population genomics
-	control.push_back(std::make_pair(rdcn[i], rdsd[i]));
-      } else if ((!germline) && (c.tumorSet.find(hdr->samples[i]) != c.tumorSet.end())) {
-	// Tumor
-	tumor.push_back(std::make_pair(rdcn[i], rdsd[i]));
-      }
     }
-    if (invalidCNV) continue;
-
-    // Classify
-    if (!germline) {
-      // Somatic mode
-      double bestCnOffset = 0;
-      bool somaticcnv = false;
-      double lowestp = 1;
-      for(uint32_t i = 0; i < tumor.size(); ++i) {
-	bool germcnv = false;
-	double highestprob = 0;
-	double tcnoffset = -1;
-	for(uint32_t k = 0; k < control.size(); ++k) {
-	  boost::math::normal s1(control[k].first, control[k].second);
-	  double prob1 = boost::math::pdf(s1, tumor[i].first);
-	  boost::math::normal s2(tumor[i].first, tumor[i].second);
-	  double prob2 = boost::math::pdf(s2, control[k].first);
-	  double prob = std::max(prob1, prob2);
-	  if (prob > c.pgerm) germcnv = true;
-	  else {
-	    // Among all controls, take highest p-value (most likely germline CNV)
-	    if (prob > highestprob) highestprob = prob;
-	  }
-	  double cndiff = std::abs(tumor[i].first - control[k].first);
-	  if (cndiff < c.cn_offset) germcnv = true;
-	  else {
-	    // Among all controls, take smallest CN difference
-	    if ((tcnoffset == -1) || (cndiff < tcnoffset)) tcnoffset = cndiff;
-	  }
-	}
-	// Among all tumors take best CN difference and lowest p-value
-	if (!germcnv) {
-	  somaticcnv = true;
-	  if ((highestprob < lowestp) && (tcnoffset > bestCnOffset)) {
-	    lowestp = highestprob;
-	    bestCnOffset = tcnoffset;
-	  }
-	}
-      }
-      if (!somaticcnv) continue;
-      _remove_info_tag(hdr_out, rec, "SOMATIC");
-      bcf_update_info_flag(hdr_out, rec, "SOMATIC", NULL, 1);
-      float pgerm = (float) lowestp;
-      _remove_info_tag(hdr_out, rec, "PGERM");
-      bcf_update_info_float(hdr_out, rec, "PGERM", &pgerm, 1);
-      float cndiv = (float) bestCnOffset;
-      _remove_info_tag(hdr_out, rec, "CNDIFF");
-      bcf_update_info_float(hdr_out, rec, "CNDIFF", &cndiv, 1);
-    } else {
-      // Correct CN shift
-      int32_t cnmain = 0;
-      {
-	std::vector<int32_t> cncount(MAX_CN, 0);
-	{
-	  bool validsite = true;
-	  boost::accumulators::accumulator_set<double, boost::accumulators::features<boost::accumulators::tag::mean, boost::accumulators::tag::variance> > acc;
-	  for(uint32_t k = 0; k < control.size(); ++k) {
-	    if ((boost::math::isinf(control[k].first)) || (boost::math::isnan(control[k].first))) validsite = false;
-	    else acc(boost::math::round(control[k].first) - control[k].first);
-	  }
-	  if (!validsite) continue;
-	  double cnshift = boost::accumulators::mean(acc);
-	  float cnshiftval = cnshift;
-	  _remove_info_tag(hdr_out, rec, "CNSHIFT");
-	  bcf_update_info_float(hdr_out, rec, "CNSHIFT", &cnshiftval, 1);
-	  for (int i = 0; i < bcf_hdr_nsamples(hdr); ++i) {
-	    rdcn[i] += cnshift;
-	    cnval[i] = boost::math::round(rdcn[i]);
-	    if ((cnval[i] >= 0) && (cnval[i] < MAX_CN)) ++cncount[cnval[i]];
-	  }
-	}
-	
-	// Find max CN
-	for(uint32_t i = 1; i < MAX_CN; ++i) {
-	  if (cncount[i] > cncount[cnmain]) cnmain = i;
-	}
-      }
-
-      // Calculate SD
-      boost::accumulators::accumulator_set<double, boost::accumulators::features<boost::accumulators::tag::mean, boost::accumulators::tag::variance> > accLocal;
-      for (int i = 0; i < bcf_hdr_nsamples(hdr); ++i) {
-	if (cnval[i] == cnmain) accLocal(rdcn[i]);
-      }
-      double sd = sqrt(boost::accumulators::variance(accLocal));
-      if (sd < 0.025) sd = 0.025;
-      float cnsdval = sd;
-      _remove_info_tag(hdr_out, rec, "CNSD");
-      bcf_update_info_float(hdr_out, rec, "CNSD", &cnsdval, 1);
-      if (cnsdval > c.maxsd) continue;
-      
-      // Re-compute CNLs
-      std::vector<std::string> ftarr(bcf_hdr_nsamples(hdr));
-      int32_t altqual = 0;
-      int32_t altcount = 0;
-      for (int i = 0; i < bcf_hdr_nsamples(hdr); ++i) {
-	int32_t qval = _computeCNLs(c, rdcn[i], sd, cnl, gqval, i);
-	if (cnval[i] != c.ploidy) {
-	  altqual += qval;
-	  ++altcount;
-	}
-	if (gqval[i] < 15) ftarr[i] = "LowQual";
-	else ftarr[i] = "PASS";
-      }
-      if (altcount == 0) continue;
-      altqual /= altcount;
-      if (altqual < c.qual) continue;
-      if (altqual > 10000) altqual = 10000;
-      
-      // Update QUAL and FILTER
-      rec->qual = altqual;
-      int32_t tmpi = bcf_hdr_id2int(hdr_out, BCF_DT_ID, "PASS");
-      if (rec->qual < 15) tmpi = bcf_hdr_id2int(hdr_out, BCF_DT_ID, "LowQual");
-      bcf_update_filter(hdr_out, rec, &tmpi, 1);
-
-      // Update GT fields
-      std::vector<const char*> strp(bcf_hdr_nsamples(hdr));
-      std::transform(ftarr.begin(), ftarr.end(), strp.begin(), cstyle_str());
-      bcf_update_format_int32(hdr_out, rec, "CN", cnval, bcf_hdr_nsamples(hdr));
-      bcf_update_format_float(hdr_out, rec, "CNL",  cnl, bcf_hdr_nsamples(hdr) * MAX_CN);
-      bcf_update_format_int32(hdr_out, rec, "GQ", gqval, bcf_hdr_nsamples(hdr));
-      bcf_update_format_string(hdr_out, rec, "FT", &strp[0], bcf_hdr_nsamples(hdr));
-      bcf_update_format_float(hdr_out, rec, "RDCN",  rdcn, bcf_hdr_nsamples(hdr));
+#pragma omp parallel default(shared)
+    {
+      ClassifyFields buf(fields);
+#pragma omp for schedule(dynamic)
+      for(int32_t i = 0; i < nrec; ++i) keep[i] = _classifyRecord(c, hdr, hdr_out, batch[i], buf);
+    }
+    for(int32_t i = 0; i < nrec; ++i) {
+      if (keep[i]) bcf_write1(ofile, hdr_out, batch[i]);
     }
-    bcf_write1(ofile, hdr_out, rec);
   }
-  bcf_destroy(rec);
-
-  // Clean-up
-  if (svend != NULL) free(svend);
-  if (svt != NULL) free(svt);
-  if (gqval != NULL) free(gqval);
-  if (cnval != NULL) free(cnval);
-  if (cnl != NULL) free(cnl);
-  if (rdcn != NULL) free(rdcn);
-  if (rdsd != NULL) free(rdsd);
+  for(uint32_t i = 0; i < batch.size(); ++i) bcf_destroy(batch[i]);
 
   // Close output VCF
   bcf_hdr_destroy(hdr_out);
   hts_close(ofile);
 
-  // Build index
-  bcf_index_build(c.outfile.string().c_str(), 14);
-
   // Close VCF
   bcf_hdr_destroy(hdr);
   bcf_close(ifile);
+  if (tpool.pool != NULL) hts_tpool_destroy(tpool.pool);
+
+  // Build index
+  bcf_index_build(c.outfile.string().c_str(), 14);
 
   // End
   now = boost::posix_time::second_clock::local_time();
@@ -325,6 +361,7 @@ int classify(int argc, char **argv) {
     ("minsize,m", boost::program_options::value<int32_t>(&c.minsize)->default_value(1000), "min. CNV size")
     ("maxsize,n", boost::program_options::value<int32_t>(&c.maxsize)->default_value(500000000), "max. CNV size")
     ("pass,p", "Filter sites for PASS")
+    ("threads", boost::program_options::value<uint32_t>(&c.threads)->default_value(0), "max. threads (0: OMP_NUM_THREADS)")
     ;
 
   // Define somatic options
@@ -373,6 +410,11 @@ int classify(int argc, char **argv) {
   if (vm.count("pass")) c.filterForPass = true;
   else c.filterForPass = false;
 
+  // Thread budget
+#ifdef OPENMP
+  if (c.threads > 0) omp_set_num_threads(c.threads);
+#endif
+
   // Check sample file
   std::set<std::string> tSet;
   std::set<std::string> cSet;
@@ -104,9 +104,9 @@ namespace torali
   }
 
 
-  template<typename TConfig, typename TGcBias, typename TCoverage, typename TGenomicBreakpoints>
+  template<typename TConfig, typename TContent, typename TGcBias, typename TCoverage, typename TGenomicBreakpoints>
   inline void
-  breakpointRefinement(TConfig const& c, std::pair<uint32_t, uint32_t> const& gcbound, std::vector<uint16_t> const& gcContent, std::vector<uint16_t> const& uniqContent, TGcBias const& gcbias, TCoverage const& cov, bam_hdr_t const* hdr, int32_t const refIndex, TGenomicBreakpoints const& svbp, std::vector<CNV>& cnvs) {
+  breakpointRefinement(TConfig const& c, std::pair<uint32_t, uint32_t> const& gcbound, TContent const& gcContent, TContent const& uniqContent, TGcBias const& gcbias, TCoverage const& cov, bam_hdr_t const* hdr, int32_t const refIndex, TGenomicBreakpoints const& svbp, std::vector<CNV>& cnvs) {
     typedef typename TGenomicBreakpoints::value_type TSVs;
     
     // Estimate CN shift
@@ -180,9 +180,9 @@ namespace torali
   }
   
 
-  template<typename TConfig, typename TGcBias, typename TCoverage>
+  template<typename TConfig, typename TContent, typename TGcBias, typename TCoverage>
   inline void
-  breakpointRefinement2(TConfig const& c, std::pair<uint32_t, uint32_t> const& gcbound, std::vector<uint16_t> const& gcContent, std::vector<uint16_t> const& uniqContent, TGcBias const& gcbias, TCoverage const& cov, bam_hdr_t const* hdr, int32_t const refIndex, std::vector<CNV>& cnvs) {
+  breakpointRefinement2(TConfig const& c, std::pair<uint32_t, uint32_t> const& gcbound, TContent const& gcContent, TContent const& uniqContent, TGcBias const& gcbias, TCoverage const& cov, bam_hdr_t const* hdr, int32_t const refIndex, std::vector<CNV>& cnvs) {
 
     int32_t maxbpshift = 10000;
 	
@@ -244,9 +244,9 @@ namespace torali
   }
   
 
-  template<typename TConfig, typename TGcBias, typename TCoverage>
+  template<typename TConfig, typename TContent, typename TGcBias, typename TCoverage>
   inline void
-  genotypeCNVs(TConfig const& c, std::pair<uint32_t, uint32_t> const& gcbound, std::vector<uint16_t> const& gcContent, std::vector<uint16_t> const& uniqContent, TGcBias const& gcbias, TCoverage const& cov, bam_hdr_t const* hdr, int32_t const refIndex, std::vector<CNV>& cnvs) {
+  genotypeCNVs(TConfig const& c, std::pair<uint32_t, uint32_t> const& gcbound, TContent const& gcContent, TContent const& uniqContent, TGcBias const& gcbias, TCoverage const& cov, bam_hdr_t const* hdr, int32_t const refIndex, std::vector<CNV>& cnvs) {
     for(uint32_t n = 0; n < cnvs.size(); ++n) {
       if (cnvs[n].chr != refIndex) continue;
       double covsum = 0;
@@ -300,9 +300,88 @@ namespace torali
     }
   }
   
-  template<typename TConfig, typename TGcBias, typename TCoverage>
+  // Filtered coverage and expected coverage of consecutive windows of winsize callable bases
+  template<typename TConfig, typename TContent, typename TGcBias, typename TCoverage>
   inline void
-  callCNVs(TConfig const& c, std::pair<uint32_t, uint32_t> const& gcbound, std::vector<uint16_t> const& gcContent, std::vector<uint16_t> const& uniqContent, TGcBias const& gcbias, TCoverage const& cov, bam_hdr_t const* hdr, int32_t const refIndex, std::vector<CNV>& cnvs) {
+  _cnvBaseWindows(TConfig const& c, std::pair<uint32_t, uint32_t> const& gcbound, TContent const& gcContent, TContent const& uniqContent, TGcBias const& gcbias, TCoverage const& cov, bam_hdr_t const* hdr, int32_t const refIndex, int32_t const winsize, std::vector<int32_t>& basepos, std::vector<uint64_t>& basecov, std::vector<double>& baseexp) {
+    uint64_t covsum = 0;
+    double expcov = 0;
+    int32_t winlen = 0;
+    uint32_t wstart = 0;
+    for(uint32_t pos = 0; pos < hdr->target_len[refIndex]; ++pos) {
+      if ((gcContent[pos] > gcbound.first) && (gcContent[pos] < gcbound.second) && (uniqContent[pos] >= c.fragmentUnique * c.meanisize)) {
+	covsum += cov[pos];
+	expcov += gcbias[gcContent[pos]].coverage;
+	++winlen;
+	if (winlen == winsize) {
+	  basepos.push_back(wstart);
+	  basecov.push_back(covsum);
+	  baseexp.push_back(expcov);
+	  covsum = 0;
+	  expcov = 0;
+	  winlen = 0;
+	  wstart = pos + 1;
+	}
+      }
+    }
+  }
+
+  // Sum of squared deviations from the mean of windows [s, t)
+  inline double
+  _segmentCost(std::vector<double> const& sx, std::vector<double> const& sxx, uint32_t const s, uint32_t const t) {
+    double sum = sx[t] - sx[s];
+    return (sxx[t] - sxx[s]) - sum * sum / (double) (t - s);
+  }
+
+  // CNVs between consecutive breakpoints
+  template<typename TConfig, typename TContent, typename TGcBias, typename TCoverage>
+  inline void
+  _cnvSegments(TConfig const& c, std::pair<uint32_t, uint32_t> const& gcbound, TContent const& gcContent, TContent const& uniqContent, TGcBias const& gcbias, TCoverage const& cov, bam_hdr_t const* hdr, int32_t const refIndex, std::vector<BpCNV> const& bpmax, std::vector<CNV>& cnvs) {
+    for(uint32_t n = 0; n <= bpmax.size(); ++n) {
+      int32_t cil = 0;
+      int32_t cih = 0;
+      if (n > 0) {
+	cil = bpmax[n-1].start;
+	cih = bpmax[n-1].end;
+      }
+      int32_t cel = hdr->target_len[refIndex] - 1;
+      int32_t ceh = hdr->target_len[refIndex] - 1;
+      if (n < bpmax.size()) {
+	cel = bpmax[n].start;
+	ceh = bpmax[n].end;
+      }
+      //std::cerr << (cih - cil) << ';' << (ceh - cel) << std::endl;
+      int32_t cnvstart = (int32_t) ((cil + cih)/2);
+      int32_t cnvend = (int32_t) ((cel + ceh)/2);
+      int32_t estcnvstart = -1;
+      int32_t estcnvend = -1;
+      double covsum = 0;
+      double expcov = 0;
+      int32_t winlen = 0;
+      int32_t pos = cnvstart;
+      while((pos < cnvend) && (pos < (int32_t) hdr->target_len[refIndex])) {
+	if ((gcContent[pos] > gcbound.first) && (gcContent[pos] < gcbound.second) && (uniqContent[pos] >= c.fragmentUnique * c.meanisize)) {
+	  if (estcnvstart == -1) estcnvstart = pos;
+	  estcnvend = pos;
+	  covsum += cov[pos];
+	  expcov += gcbias[gcContent[pos]].coverage;
+	  ++winlen;
+	}
+	++pos;
+      }
+      if ((estcnvstart != -1) && (estcnvend != -1) && (estcnvend - estcnvstart > 0)) {
+	double cn = c.ploidy;
+	if (expcov > 0) cn = c.ploidy * covsum / expcov;
+	double mp = (double) winlen / (double) (estcnvend - estcnvstart);
+	cnvs.push_back(CNV(refIndex, estcnvstart, estcnvend, cil, cih, cel, ceh, cn, mp));
+	//std::cerr << hdr->target_name[refIndex] << '\t' << estcnvstart << '\t' << estcnvend << '\t' << '(' << cil << ',' << cih << ')' << '\t' << '(' << cel << ',' << ceh << ')' << '\t' << cn << '\t' << mp << std::endl;
+      }
+    }
+  }
+
+  template<typename TConfig, typename TContent, typename TGcBias, typename TCoverage>
+  inline void
+  callCNVs(TConfig const& c, std::pair<uint32_t, uint32_t> const& gcbound, TContent const& gcContent, TContent const& uniqContent, TGcBias const& gcbias, TCoverage const& cov, bam_hdr_t const* hdr, int32_t const refIndex, std::vector<CNV>& cnvs) {
 
     // Parameters
     int32_t smallestWin = c.minCnvSize / 10;
@@ -320,87 +399,76 @@ namespace torali
 	wsize *= 2;
       }
 
-      // Iterate window sizes
+      // Filtered coverage and expected coverage of the smallest windows, a single pass over the chromosome
       typedef int32_t TCnVal;
       typedef std::vector<TCnVal> TCN;
-      typedef std::vector<int32_t> TChrPos;
-      std::vector<BpCNV> bpvec;
-      for(uint32_t idx = 0; idx < winsize.size(); ++idx) {
+      std::vector<int32_t> basepos;
+      std::vector<uint64_t> basecov;
+      std::vector<double> baseexp;
+      _cnvBaseWindows(c, gcbound, gcContent, uniqContent, gcbias, cov, hdr, refIndex, winsize[0], basepos, basecov, baseexp);
+
+      // Window sizes in parallel, a window of winsize[idx] spans winsize[idx] / winsize[0] consecutive smallest windows
+      std::vector<TCN> cnvec(winsize.size());
+      std::vector< std::vector<double> > zvec(winsize.size());
+#pragma omp parallel for default(shared) schedule(dynamic)
+      for(int32_t idx = 0; idx < (int32_t) winsize.size(); ++idx) {
 	uint32_t idxOffset = winsize[idx] / winsize[0];
-	//std::cerr << idx << ',' << winsize[idx] << ',' << idxOffset << ',' << bpvec.size() << ',' << hdr->target_len[refIndex] << std::endl;
-	TCN cnvec;
-	TChrPos wpos;
-	uint32_t wstart = 0;
-	while(wstart < hdr->target_len[refIndex]) {
-	  double covsum = 0;
+	uint32_t nwin = basecov.size() / idxOffset;
+	cnvec[idx].resize(nwin);
+	for(uint32_t k = 0; k < nwin; ++k) {
+	  uint64_t covsum = 0;
 	  double expcov = 0;
-	  int32_t winlen = 0;
-	  uint32_t pos = wstart;
-	  while ((winlen < winsize[idx]) && (pos < hdr->target_len[refIndex])) {
-	    if ((gcContent[pos] > gcbound.first) && (gcContent[pos] < gcbound.second) && (uniqContent[pos] >= c.fragmentUnique * c.meanisize)) {
-	      covsum += cov[pos];
-	      expcov += gcbias[gcContent[pos]].coverage;
-	      ++winlen;
-	    }
-	    ++pos;
+	  for(uint32_t b = k * idxOffset; b < (k + 1) * idxOffset; ++b) {
+	    covsum += basecov[b];
+	    expcov += baseexp[b];
 	  }
-	  if (winlen == winsize[idx]) {
-	    // Full window
-	    if (expcov > 0) cnvec.push_back((int32_t) boost::math::round(c.ploidy * covsum / expcov * 100.0));
-	    else cnvec.push_back((int32_t) boost::math::round(c.ploidy * 100.0));
-	    wpos.push_back(wstart);
+	  if (expcov > 0) cnvec[idx][k] = (int32_t) boost::math::round(c.ploidy * covsum / expcov * 100.0);
+	  else cnvec[idx][k] = (int32_t) boost::math::round(c.ploidy * 100.0);
+	}
+
+	// Rolling sums of x and x^2 for the pre and suc chains around each midpoint
+	std::vector<int64_t> sx(nwin + 1, 0);
+	std::vector<int64_t> sxx(nwin + 1, 0);
+	for(uint32_t k = 0; k < nwin; ++k) {
+	  sx[k+1] = sx[k] + cnvec[idx][k];
+	  sxx[k+1] = sxx[k] + (int64_t) cnvec[idx][k] * (int64_t) cnvec[idx][k];
+	}
+	for(uint32_t k = 2 * chain; k < nwin; ++k) {
+	  // Midpoint k - chain, pre chain [k - 2 * chain, k - chain), suc chain (k - chain, k]
+	  int64_t preS = sx[k - chain] - sx[k - 2 * chain];
+	  int64_t preQ = sxx[k - chain] - sxx[k - 2 * chain];
+	  int64_t sucS = sx[k + 1] - sx[k - chain + 1];
+	  int64_t sucQ = sxx[k + 1] - sxx[k - chain + 1];
+	  double n = chain;
+	  double varpre = (double) (chain * preQ - preS * preS) / (n * n);
+	  double varsuc = (double) (chain * sucQ - sucS * sucS) / (n * n);
+
+	  // Any shift in CN?
+	  double diff = std::abs((double) sucS / n - (double) preS / n);
+	  // Breakpoint candidate
+	  double zscore = 0;
+	  if ((diff > c.stringency * sqrt(varpre)) && (diff > c.stringency * sqrt(varsuc))) {
+	    zscore = diff / std::max(sqrt(varpre), sqrt(varsuc));
 	  }
-	  wstart = pos;
+	  zvec[idx].push_back(zscore);
 	}
-	
-	// Identify breakpoints
-	TCN pre(chain, -1);
-	TCN suc(chain, -1);
-	TChrPos prep(chain, 0);
-	TChrPos sucp(chain, 0);
+      }
+
+      // Sum z-scores across window sizes at the resolution of the smallest windows
+      std::vector<BpCNV> bpvec;
+      for(uint32_t idx = 0; idx < winsize.size(); ++idx) {
+	uint32_t idxOffset = winsize[idx] / winsize[0];
 	uint32_t idxbp = 0;
-	for(uint32_t k = 0; k < cnvec.size(); ++k) {
-	  if (k < chain) {
-	    pre[k % chain] = cnvec[k];
-	    prep[k % chain] = wpos[k];
-	    if (k + 1 < cnvec.size()) {
-	      if (idx == 0 ) bpvec.push_back(BpCNV(wpos[k], wpos[k+1], 0));
-	      else idxbp += idxOffset;
-	    }
-	  } else if (k < 2 * chain) {
-	    suc[k % chain] = cnvec[k];
-	    sucp[k % chain] = wpos[k];
-	  } else {
-	    // Midpoint
-	    TCnVal val = suc[k%chain];	  
-	    int32_t pos = sucp[k%chain];
-	    int32_t posNext = sucp[(k+1)%chain];
-	    suc[k%chain] = cnvec[k];
-	    sucp[k%chain] = wpos[k];
-	    
-	    // Debug
-	    //for(uint32_t m = 0; m < pre.size(); ++m) std::cerr << prep[m] << '\t' << pre[m] << std::endl;
-	    //std::cerr << "M:" << pos << '\t' << val << std::endl;
-	    //for(uint32_t m = 0; m < suc.size(); ++m) std::cerr << sucp[m] << '\t' << suc[m] << std::endl;
-	    
-	    // Any shift in CN?
-	    boost::accumulators::accumulator_set<TCnVal, boost::accumulators::features<boost::accumulators::tag::mean, boost::accumulators::tag::variance> > accpre;
-	    boost::accumulators::accumulator_set<TCnVal, boost::accumulators::features<boost::accumulators::tag::mean, boost::accumulators::tag::variance> > accsuc;
-	    for(uint32_t m = 0; m < pre.size(); ++m) accpre(pre[m]);
-	    for(uint32_t m = 0; m < suc.size(); ++m) accsuc(suc[m]);
-	    double diff = std::abs(boost::accumulators::mean(accsuc) - boost::accumulators::mean(accpre));
-	    // Breakpoint candidate
-	    double zscore = 0;
-	    if ((diff > c.stringency * sqrt(boost::accumulators::variance(accpre))) && (diff > c.stringency * sqrt(boost::accumulators::variance(accsuc)))) {
-	      zscore = diff / std::max(sqrt(boost::accumulators::variance(accpre)), sqrt(boost::accumulators::variance(accsuc)));
-	    }
-	    if (idx == 0) bpvec.push_back(BpCNV(pos, posNext, zscore));
-	    else {
-	      for(uint32_t sub = idxbp; sub < idxbp + idxOffset; ++sub) bpvec[sub].zscore += zscore;
-	      idxbp += idxOffset;
-	    }
-	    pre[k%chain] = val;
-	    prep[k%chain] = pos;
+	for(uint32_t k = 0; ((k < chain) && (k + 1 < cnvec[idx].size())); ++k) {
+	  if (idx == 0) bpvec.push_back(BpCNV(basepos[k], basepos[k+1], 0));
+	  else idxbp += idxOffset;
+	}
+	for(uint32_t k = 2 * chain; k < cnvec[idx].size(); ++k) {
+	  double zscore = zvec[idx][k - 2 * chain];
+	  if (idx == 0) bpvec.push_back(BpCNV(basepos[k - chain], basepos[k - chain + 1], zscore));
+	  else {
+	    for(uint32_t sub = idxbp; sub < idxbp + idxOffset; ++sub) bpvec[sub].zscore += zscore;
+	    idxbp += idxOffset;
 	  }
 	}
       }
@@ -435,47 +503,88 @@ namespace torali
       }
     }
 
-    // Breakpoints
-    for(uint32_t n = 0; n <= bpmax.size(); ++n) {
-      int32_t cil = 0;
-      int32_t cih = 0;
-      if (n > 0) {
-	cil = bpmax[n-1].start;
-	cih = bpmax[n-1].end;
+    // CNV segments between breakpoints
+    _cnvSegments(c, gcbound, gcContent, uniqContent, gcbias, cov, hdr, refIndex, bpmax, cnvs);
+  }
+
+  // Exact changepoint search (PELT, Killick et al. 2012) on the copy-number track of the smallest windows
+  template<typename TConfig, typename TContent, typename TGcBias, typename TCoverage>
+  inline void
+  peltCNVs(TConfig const& c, std::pair<uint32_t, uint32_t> const& gcbound, TContent const& gcContent, TContent const& uniqContent, TGcBias const& gcbias, TCoverage const& cov, bam_hdr_t const* hdr, int32_t const refIndex, std::vector<CNV>& cnvs, uint64_t& evaluated) {
+    // Parameters, the minimum segment length matches the z-score chains
+    int32_t smallestWin = c.minCnvSize / 10;
+    uint32_t minseglen = 10;
+
+    // Copy-number track
+    std::vector<int32_t> basepos;
+    std::vector<uint64_t> basecov;
+    std::vector<double> baseexp;
+    _cnvBaseWindows(c, gcbound, gcContent, uniqContent, gcbias, cov, hdr, refIndex, smallestWin, basepos, basecov, baseexp);
+    uint32_t nwin = basecov.size();
+    std::vector<BpCNV> bpmax;
+    if (nwin >= 2 * minseglen) {
+      std::vector<double> cn(nwin);
+      for(uint32_t k = 0; k < nwin; ++k) {
+	if (baseexp[k] > 0) cn[k] = c.ploidy * basecov[k] / baseexp[k];
+	else cn[k] = c.ploidy;
       }
-      int32_t cel = hdr->target_len[refIndex] - 1;
-      int32_t ceh = hdr->target_len[refIndex] - 1;
-      if (n < bpmax.size()) {
-	cel = bpmax[n].start;
-	ceh = bpmax[n].end;
+
+      // Noise level from the MAD of successive differences, robust to the changepoints
+      std::vector<double> dev(nwin - 1);
+      for(uint32_t k = 0; k + 1 < nwin; ++k) dev[k] = std::abs(cn[k+1] - cn[k]);
+      std::nth_element(dev.begin(), dev.begin() + dev.size() / 2, dev.end());
+      double sd = dev[dev.size() / 2] / (0.6745 * std::sqrt(2.0));
+      if (sd <= 0) sd = 0.01;
+      double penalty = c.penalty * sd * sd * std::log((double) nwin);
+
+      // Gaussian change-in-mean cost from prefix sums
+      std::vector<double> sx(nwin + 1, 0);
+      std::vector<double> sxx(nwin + 1, 0);
+      for(uint32_t k = 0; k < nwin; ++k) {
+	sx[k+1] = sx[k] + cn[k];
+	sxx[k+1] = sxx[k] + cn[k] * cn[k];
       }
-      //std::cerr << (cih - cil) << ';' << (ceh - cel) << std::endl;
-      int32_t cnvstart = (int32_t) ((cil + cih)/2);
-      int32_t cnvend = (int32_t) ((cel + ceh)/2);
-      int32_t estcnvstart = -1;
-      int32_t estcnvend = -1;
-      double covsum = 0;
-      double expcov = 0;
-      int32_t winlen = 0;
-      int32_t pos = cnvstart;
-      while((pos < cnvend) && (pos < (int32_t) hdr->target_len[refIndex])) {
-	if ((gcContent[pos] > gcbound.first) && (gcContent[pos] < gcbound.second) && (uniqContent[pos] >= c.fragmentUnique * c.meanisize)) {
-	  if (estcnvstart == -1) estcnvstart = pos;
-	  estcnvend = pos;
-	  covsum += cov[pos];
-	  expcov += gcbias[gcContent[pos]].coverage;
-	  ++winlen;
+
+      // Optimal partitioning over the candidate changepoints
+      std::vector<double> opt(nwin + 1, std::numeric_limits<double>::infinity());
+      std::vector<uint32_t> last(nwin + 1, 0);
+      std::vector<uint32_t> cand(1, 0);
+      opt[0] = -penalty;
+      for(uint32_t t = minseglen; t <= nwin; ++t) {
+	if (t >= 2 * minseglen) {
+	  // New candidate tp, prune all candidates that can never beat tp again
+	  uint32_t tp = t - minseglen;
+	  uint32_t kept = 0;
+	  for(uint32_t i = 0; i < cand.size(); ++i) {
+	    if (opt[cand[i]] + _segmentCost(sx, sxx, cand[i], tp) <= opt[tp]) cand[kept++] = cand[i];
+	  }
+	  cand.resize(kept);
+	  cand.push_back(tp);
 	}
-	++pos;
+	for(uint32_t i = 0; i < cand.size(); ++i) {
+	  double cost = opt[cand[i]] + _segmentCost(sx, sxx, cand[i], t) + penalty;
+	  if (cost < opt[t]) {
+	    opt[t] = cost;
+	    last[t] = cand[i];
+	  }
+	}
+	evaluated += cand.size();
       }
-      if ((estcnvstart != -1) && (estcnvend != -1) && (estcnvend - estcnvstart > 0)) {
-	double cn = c.ploidy;
-	if (expcov > 0) cn = c.ploidy * covsum / expcov;
-	double mp = (double) winlen / (double) (estcnvend - estcnvstart);
-	cnvs.push_back(CNV(refIndex, estcnvstart, estcnvend, cil, cih, cel, ceh, cn, mp));
-	//std::cerr << hdr->target_name[refIndex] << '\t' << estcnvstart << '\t' << estcnvend << '\t' << '(' << cil << ',' << cih << ')' << '\t' << '(' << cel << ',' << ceh << ')' << '\t' << cn << '\t' << mp << std::endl;
+
+      // Backtrack, the breakpoint of changepoint s spans the centers of windows s-1 and s
+      std::vector<uint32_t> cpts;
+      for(uint32_t t = last[nwin]; t > 0; t = last[t]) cpts.push_back(t);
+      std::reverse(cpts.begin(), cpts.end());
+      for(uint32_t i = 0; i < cpts.size(); ++i) {
+	uint32_t s = cpts[i];
+	int32_t wend = hdr->target_len[refIndex];
+	if (s + 1 < nwin) wend = basepos[s + 1];
+	bpmax.push_back(BpCNV((basepos[s-1] + basepos[s]) / 2, (basepos[s] + wend) / 2, 0));
       }
     }
+
+    // CNV segments between breakpoints
+    _cnvSegments(c, gcbound, gcContent, uniqContent, gcbias, cov, hdr, refIndex, bpmax, cnvs);
   }
 
 
@@ -630,7 +739,8 @@ namespace torali
       // Iterate all structural variants
       now = boost::posix_time::second_clock::local_time();
       std::cout << '[' << boost::posix_time::to_simple_string(now) << "] " << "Genotyping" << std::endl;
-      boost::progress_display show_progress( cnvs.size() );
+      std::ostream nullOut(NULL);
+      boost::progress_display show_progress( cnvs.size(), (c.showProgress) ? std::cout : nullOut );
       bcf1_t *rec = bcf_init();
       for(uint32_t i = 0; i < cnvs.size(); ++i) {
 	++show_progress;
@@ -18,6 +18,7 @@
 #include "scan.h"
 #include "gcbias.h"
 #include "cnv.h"
+#include "bincov.h"
 #include "version.h"
 
 namespace torali
@@ -30,8 +31,13 @@ namespace torali
     bool hasScanFile;
     bool noScanWindowSelection;
     bool segmentation;
+    bool pelt;
     bool hasGenoFile;
     bool hasVcfFile;
+    bool hasTrackFile;
+    bool binaryCoverage;
+    bool gcSampling;
+    bool showProgress;
     uint32_t nchr;
     uint32_t meanisize;
     uint32_t window_size;
@@ -49,6 +55,8 @@ namespace torali
     float controlMaf;
     float stringency;
     float cn_offset;
+    float penalty;
+    float gcError;
     std::string sampleName;
     boost::filesystem::path vcffile;
     boost::filesystem::path genofile;
@@ -60,6 +68,9 @@ namespace torali
     boost::filesystem::path bamFile;
     boost::filesystem::path bedFile;
     boost::filesystem::path scanFile;
+    boost::filesystem::path trackFile;
+    TrackFile tracks;
+    std::vector<boost::filesystem::path> files;
   };
   
   struct CountDNAConfigLib {
@@ -69,13 +80,237 @@ namespace torali
     std::vector<boost::filesystem::path> files;
   };
   
+  // Text coverage track of one chromosome
+  inline void
+  _coverageText(std::ostream& dataOut, std::string const& chrName, std::vector<CoverageWindow> const& windows) {
+    for(uint32_t i = 0; i < windows.size(); ++i) {
+      if (windows[i].mappable < 0) dataOut << chrName << "\t" << windows[i].start << "\t" << windows[i].end << "\tNA\tNA\tNA" << std::endl;
+      else dataOut << chrName << "\t" << windows[i].start << "\t" << windows[i].end << "\t" << windows[i].mappable << "\t" << windows[i].counts << "\t" << windows[i].cn << std::endl;
+    }
+  }
+
+  // Read-depth windows and CNVs of one chromosome
+  template<typename TConfig, typename TRegionsGenome, typename TGenomicBreakpoints>
+  inline void
+  _readDepthChr(TConfig const& c, bam_hdr_t* hdr, int32_t const refIndex, faidx_t* faiMap, faidx_t* faiRef, std::vector<FragmentCounts> const& fragCounts, std::vector<GcBias> const& gcbias, std::pair<uint32_t, uint32_t> const& gcbound, TRegionsGenome const& bedRegions, TGenomicBreakpoints const& svbp, std::vector<CNV>& cnvs, std::vector<CoverageWindow>& windows, uint64_t& evaluated) {
+    typedef typename TRegionsGenome::value_type TChrIntervals;
+    if ((!c.hasGenoFile) && (!fragCounts[refIndex].counted)) return;
+    
+    // Get GC and Mappability
+    std::string tname(hdr->target_name[refIndex]);
+    WindowTrack uniqContent;
+    WindowTrack gcContent;
+    if (!uniqueTrack(c, faiMap, tname, hdr->target_len[refIndex], uniqContent)) return;
+    if (!gcTrack(c, faiRef, tname, hdr->target_len[refIndex], gcContent)) return;
+    
+    // Coverage track
+    typedef uint16_t TCount;
+    typedef std::vector<TCount> TCoverage;
+    TCoverage cov;
+    fragmentCoverage(fragCounts[refIndex], hdr->target_len[refIndex], false, cov);
+
+    // CNV discovery
+    if (!c.hasGenoFile) {
+      // Call CNVs
+      std::vector<CNV> chrcnv;
+      if (c.pelt) peltCNVs(c, gcbound, gcContent, uniqContent, gcbias, cov, hdr, refIndex, chrcnv, evaluated);
+      else callCNVs(c, gcbound, gcContent, uniqContent, gcbias, cov, hdr, refIndex, chrcnv);
+
+      // Merge adjacent CNVs lacking read-depth shift
+      mergeCNVs(c, chrcnv, cnvs);
+
+      // Refine breakpoints
+      if (c.hasVcfFile) breakpointRefinement(c, gcbound, gcContent, uniqContent, gcbias, cov, hdr, refIndex, svbp, cnvs);
+    }
+    
+    // CNV genotyping
+    genotypeCNVs(c, gcbound, gcContent, uniqContent, gcbias, cov, hdr, refIndex, cnvs);
+
+    // BED File (target intervals)
+    if (c.hasBedFile) {
+      if (c.adaptive) {
+	// Merge overlapping BED entries
+	TChrIntervals citv;
+	_mergeOverlappingBedEntries(bedRegions[refIndex], citv);
+
+	// Tile merged intervals
+	double covsum = 0;
+	double expcov = 0;
+	double obsexp = 0;
+	uint32_t winlen = 0;
+	uint32_t start = 0;
+	bool endOfWindow = true;
+	typename TChrIntervals::iterator it = citv.begin();
+	if (it != citv.end()) start = it->first;
+	while(endOfWindow) {
+	  endOfWindow = false;
+	  for(it = citv.begin(); ((it != citv.end()) && (!endOfWindow)); ++it) {
+	    if ((it->first < it->second) && (it->second <= hdr->target_len[refIndex])) {
+	      if (start >= it->second) {
+		if (start == it->second) {
+		  // Special case
+		  typename TChrIntervals::iterator itNext = it;
+		  ++itNext;
+		  if (itNext != citv.end()) start = itNext->first;
+		}
+		continue;
+	      }
+	      for(uint32_t pos = it->first; ((pos < it->second) && (!endOfWindow)); ++pos) {
+		if (pos < start) continue;
+		if ((gcContent[pos] > gcbound.first) && (gcContent[pos] < gcbound.second) && (uniqContent[pos] >= c.fragmentUnique * c.meanisize)) {
+		  covsum += cov[pos];
+		  obsexp += gcbias[gcContent[pos]].obsexp;
+		  expcov += gcbias[gcContent[pos]].coverage;
+		  ++winlen;
+		  if (winlen == c.window_size) {
+		    obsexp /= (double) winlen;
+		    double count = ((double) covsum / obsexp ) * (double) c.window_size / (double) winlen;
+		    double cn = c.ploidy;
+		    if (expcov > 0) cn = c.ploidy * covsum / expcov;
+		    windows.push_back(CoverageWindow(start, pos + 1, winlen, count, cn));
+		    // reset
+		    covsum = 0;
+		    expcov = 0;
+		    obsexp = 0;
+		    winlen = 0;
+		    if (c.window_offset == c.window_size) {
+		      // Move on
+		      start = pos + 1;
+		      endOfWindow = true;
+		    } else {
+		      // Rewind
+		      for(typename TChrIntervals::iterator sit = citv.begin(); ((sit != citv.end()) && (!endOfWindow)); ++sit) {
+			if ((sit->first < sit->second) && (sit->second <= hdr->target_len[refIndex])) {
+			  if (start >= sit->second) continue;
+			  for(uint32_t k = sit->first; ((k < sit->second) && (!endOfWindow)); ++k) {
+			    if (k < start) continue;
+			    if ((gcContent[k] > gcbound.first) && (gcContent[k] < gcbound.second) && (uniqContent[k] >= c.fragmentUnique * c.meanisize)) {
+			      ++winlen;
+			      if (winlen == c.window_offset) {
+				start = k + 1;
+				winlen = 0;
+				endOfWindow = true;
+			      }
+			    }
+			  }
+			}
+		      }
+		    }
+		  }
+		}
+	      }
+	    }
+	  }
+	}
+      } else {
+	// Fixed Window Length
+	for(typename TChrIntervals::iterator it = bedRegions[refIndex].begin(); it != bedRegions[refIndex].end(); ++it) {
+	  if ((it->first < it->second) && (it->second <= hdr->target_len[refIndex])) {
+	    double covsum = 0;
+	    double expcov = 0;
+	    double obsexp = 0;
+	    uint32_t winlen = 0;
+	    for(uint32_t pos = it->first; pos < it->second; ++pos) {
+	      if ((gcContent[pos] > gcbound.first) && (gcContent[pos] < gcbound.second) && (uniqContent[pos] >= c.fragmentUnique * c.meanisize)) {
+		covsum += cov[pos];
+		obsexp += gcbias[gcContent[pos]].obsexp;
+		expcov += gcbias[gcContent[pos]].coverage;
+		++winlen;
+	      }
+	    }
+	    if (winlen >= c.fracWindow * (it->second - it->first)) {
+	      obsexp /= (double) winlen;
+	      double count = ((double) covsum / obsexp ) * (double) (it->second - it->first) / (double) winlen;
+	      double cn = c.ploidy;
+	      if (expcov > 0) cn = c.ploidy * covsum / expcov;
+	      windows.push_back(CoverageWindow(it->first, it->second, winlen, count, cn));
+	    } else {
+	      windows.push_back(CoverageWindow(it->first, it->second));
+	    }
+	  }
+	}
+      }
+    } else {
+      // Genome-wide
+      if (c.adaptive) {
+	double covsum = 0;
+	double expcov = 0;
+	double obsexp = 0;
+	uint32_t winlen = 0;
+	uint32_t start = 0;
+	uint32_t pos = 0;
+	while(pos < hdr->target_len[refIndex]) {
+	  if ((gcContent[pos] > gcbound.first) && (gcContent[pos] < gcbound.second) && (uniqContent[pos] >= c.fragmentUnique * c.meanisize)) {
+	    covsum += cov[pos];
+	    obsexp += gcbias[gcContent[pos]].obsexp;
+	    expcov += gcbias[gcContent[pos]].coverage;
+	    ++winlen;
+	    if (winlen == c.window_size) {
+	      obsexp /= (double) winlen;
+	      double count = ((double) covsum / obsexp ) * (double) c.window_size / (double) winlen;
+	      double cn = c.ploidy;
+	      if (expcov > 0) cn = c.ploidy * covsum / expcov;
+	      windows.push_back(CoverageWindow(start, pos + 1, winlen, count, cn));
+	      // reset
+	      covsum = 0;
+	      expcov = 0;
+	      obsexp = 0;
+	      winlen = 0;
+	      if (c.window_offset == c.window_size) {
+		// Move on
+		start = pos + 1;
+	      } else {
+		// Rewind
+		for(uint32_t k = start; k < hdr->target_len[refIndex]; ++k) {
+		  if ((gcContent[k] > gcbound.first) && (gcContent[k] < gcbound.second) && (uniqContent[k] >= c.fragmentUnique * c.meanisize)) {
+		    ++winlen;
+		    if (winlen == c.window_offset) {
+		      start = k + 1;
+		      pos = k;
+		      winlen = 0;
+		      break;
+		    }
+		  }
+		}
+	      }
+	    }
+	  }
+	  ++pos;
+	}
+      } else {
+	// Fixed windows (genomic tiling)
+	for(uint32_t start = 0; start < hdr->target_len[refIndex]; start = start + c.window_offset) {
+	  if (start + c.window_size < hdr->target_len[refIndex]) {
+	    double covsum = 0;
+	    double expcov = 0;
+	    double obsexp = 0;
+	    uint32_t winlen = 0;
+	    for(uint32_t pos = start; pos < start + c.window_size; ++pos) {
+	      if ((gcContent[pos] > gcbound.first) && (gcContent[pos] < gcbound.second) && (uniqContent[pos] >= c.fragmentUnique * c.meanisize)) {
+		covsum += cov[pos];
+		obsexp += gcbias[gcContent[pos]].obsexp;
+		expcov += gcbias[gcContent[pos]].coverage;
+		++winlen;
+	      }
+	    }
+	    if (winlen >= c.fracWindow * c.window_size) {
+	      obsexp /= (double) winlen;
+	      double count = ((double) covsum / obsexp ) * (double) c.window_size / (double) winlen;
+	      double cn = c.ploidy;
+	      if (expcov > 0) cn = c.ploidy * covsum / expcov;
+	      windows.push_back(CoverageWindow(start, start + c.window_size, winlen, count, cn));
+	    }
+	  }
+	}
+      }
+    }
+  }
+
   template<typename TConfig>
   inline int32_t
-  bamCount(TConfig const& c, LibraryInfo const& li, std::vector<GcBias> const& gcbias, std::pair<uint32_t, uint32_t> const& gcbound) {
-    // Load bam file
+  bamCount(TConfig const& c, std::vector<FragmentCounts> const& fragCounts, std::vector<GcBias> const& gcbias, std::pair<uint32_t, uint32_t> const& gcbound) {
+    // Load bam header
     samFile* samfile = sam_open(c.bamFile.string().c_str(), "r");
-    hts_set_fai_filename(samfile, c.genome.string().c_str());
-    hts_idx_t* idx = sam_index_load(samfile, c.bamFile.string().c_str());
     bam_hdr_t* hdr = sam_hdr_read(samfile);
 
     // BED regions
@@ -89,16 +324,22 @@ namespace torali
       }
     }
 
-    // Parse BAM file
+    // Read-depth windows from fragment counts
     boost::posix_time::ptime now = boost::posix_time::second_clock::local_time();
-    std::cout << '[' << boost::posix_time::to_simple_string(now) << "] " << "Count fragments" << std::endl;
-    boost::progress_display show_progress( hdr->n_targets );
+    std::cout << '[' << boost::posix_time::to_simple_string(now) << "] " << "Read-depth windows" << std::endl;
+    std::ostream nullOut(NULL);
+    boost::progress_display show_progress( hdr->n_targets, (c.showProgress) ? std::cout : nullOut );
 
     // Open output files
     boost::iostreams::filtering_ostream dataOut;
-    dataOut.push(boost::iostreams::gzip_compressor());
-    dataOut.push(boost::iostreams::file_sink(c.covfile.c_str(), std::ios_base::out | std::ios_base::binary));
-    dataOut << "chr\tstart\tend\t" << c.sampleName << "_mappable\t" << c.sampleName << "_counts\t" << c.sampleName << "_CN" << std::endl;
+    CoverageWriter cw;
+    if (c.binaryCoverage) {
+      if (!openCoverageWriter(c.covfile, c.sampleName, hdr, cw)) return 1;
+    } else {
+      dataOut.push(boost::iostreams::gzip_compressor());
+      dataOut.push(boost::iostreams::file_sink(c.covfile.c_str(), std::ios_base::out | std::ios_base::binary));
+      dataOut << "chr\tstart\tend\t" << c.sampleName << "_mappable\t" << c.sampleName << "_counts\t" << c.sampleName << "_CN" << std::endl;
+    }
 
     // CNVs
     std::vector<CNV> cnvs;
@@ -118,333 +359,270 @@ namespace torali
       for (uint32_t i = 0; i < svbp.size(); ++i) sort(svbp[i].begin(), svbp[i].end(), SortSVBreakpoint<SVBreakpoint>());
     }
     
-    // Iterate chromosomes
-    faidx_t* faiMap = fai_load(c.mapFile.string().c_str());
-    faidx_t* faiRef = fai_load(c.genome.string().c_str());
-    for(int32_t refIndex=0; refIndex < (int32_t) hdr->n_targets; ++refIndex) {
-      ++show_progress;
-      if ((!c.hasGenoFile) && (chrNoData(c, refIndex, idx))) continue;
-      
-      // Check presence in mappability map
-      std::string tname(hdr->target_name[refIndex]);
-      int32_t seqlen = faidx_seq_len(faiMap, tname.c_str());
-      if (seqlen == - 1) continue;
-      else seqlen = -1;
-      char* seq = faidx_fetch_seq(faiMap, tname.c_str(), 0, faidx_seq_len(faiMap, tname.c_str()), &seqlen);
-
-      // Check presence in reference
-      seqlen = faidx_seq_len(faiRef, tname.c_str());
-      if (seqlen == - 1) continue;
-      else seqlen = -1;
-      char* ref = faidx_fetch_seq(faiRef, tname.c_str(), 0, faidx_seq_len(faiRef, tname.c_str()), &seqlen);
-
-      // Get GC and Mappability
-      std::vector<uint16_t> uniqContent(hdr->target_len[refIndex], 0);
-      std::vector<uint16_t> gcContent(hdr->target_len[refIndex], 0);
-      {
-	// Mappability map
-	typedef boost::dynamic_bitset<> TBitSet;
-	TBitSet uniq(hdr->target_len[refIndex], false);
-	for(uint32_t i = 0; i < hdr->target_len[refIndex]; ++i) {
-	  if (seq[i] == 'C') uniq[i] = 1;
-	}
+    // Chromosome-parallel, each thread with its own faidx handles
+    std::vector< std::vector<CNV> > chrCnvs(hdr->n_targets);
+    std::vector<std::string> chrData(hdr->n_targets);
+    std::vector< std::vector<CoverageWindow> > chrWindows(hdr->n_targets);
+    std::vector<uint8_t> chrDone(hdr->n_targets, 0);
+    std::vector<uint64_t> chrEvaluated(hdr->n_targets, 0);
+    int32_t nextOut = 0;
+    bool covError = false;
+#pragma omp parallel default(shared)
+    {
+      faidx_t* faiMap = NULL;
+      faidx_t* faiRef = NULL;
+      if (!c.hasTrackFile) {
+	faiMap = fai_load(c.mapFile.string().c_str());
+	faiRef = fai_load(c.genome.string().c_str());
+      }
 
-	// GC map
-	typedef boost::dynamic_bitset<> TBitSet;
-	TBitSet gcref(hdr->target_len[refIndex], false);
-	for(uint32_t i = 0; i < hdr->target_len[refIndex]; ++i) {
-	  if ((ref[i] == 'c') || (ref[i] == 'C') || (ref[i] == 'g') || (ref[i] == 'G')) gcref[i] = 1;
+#pragma omp for schedule(dynamic)
+      for(int32_t refIndex=0; refIndex < (int32_t) hdr->n_targets; ++refIndex) {
+	// Genotyping updates the CNVs of this chromosome in place, discovery collects them per chromosome
+	std::vector<CoverageWindow> windows;
+	if (c.hasGenoFile) _readDepthChr(c, hdr, refIndex, faiMap, faiRef, fragCounts, gcbias, gcbound, bedRegions, svbp, cnvs, windows, chrEvaluated[refIndex]);
+	else _readDepthChr(c, hdr, refIndex, faiMap, faiRef, fragCounts, gcbias, gcbound, bedRegions, svbp, chrCnvs[refIndex], windows, chrEvaluated[refIndex]);
+	std::string chrText;
+	if (!c.binaryCoverage) {
+	  std::ostringstream chrOut;
+	  _coverageText(chrOut, std::string(hdr->target_name[refIndex]), windows);
+	  chrText = chrOut.str();
+	  std::vector<CoverageWindow>().swap(windows);
 	}
 
-	// Sum across fragment
-	int32_t halfwin = (int32_t) (c.meanisize / 2);
-	int32_t usum = 0;
-	int32_t gcsum = 0;
-	for(int32_t pos = halfwin; pos < (int32_t) hdr->target_len[refIndex] - halfwin; ++pos) {
-	  if (pos == halfwin) {
-	    for(int32_t i = pos - halfwin; i<=pos+halfwin; ++i) {
-	      usum += uniq[i];
-	      gcsum += gcref[i];
-	    }
-	  } else {
-	    usum -= uniq[pos - halfwin - 1];
-	    gcsum -= gcref[pos - halfwin - 1];
-	    usum += uniq[pos + halfwin];
-	    gcsum += gcref[pos + halfwin];
+	// Ordered writer, coverage windows are written in chromosome order
+#pragma omp critical
+	{
+	  ++show_progress;
+	  chrData[refIndex].swap(chrText);
+	  chrWindows[refIndex].swap(windows);
+	  chrDone[refIndex] = 1;
+	  for(; ((nextOut < (int32_t) hdr->n_targets) && (chrDone[nextOut])); ++nextOut) {
+	    if (c.binaryCoverage) {
+	      if (!writeCoverage(cw, nextOut, chrWindows[nextOut])) covError = true;
+	    } else dataOut << chrData[nextOut];
+	    std::string().swap(chrData[nextOut]);
+	    std::vector<CoverageWindow>().swap(chrWindows[nextOut]);
 	  }
-	  gcContent[pos] = gcsum;
-	  uniqContent[pos] = usum;
 	}
       }
-      
-      // Coverage track
-      typedef uint16_t TCount;
-      uint32_t maxCoverage = std::numeric_limits<TCount>::max();
-      typedef std::vector<TCount> TCoverage;
-      TCoverage cov(hdr->target_len[refIndex], 0);
+      if (faiRef != NULL) fai_destroy(faiRef);
+      if (faiMap != NULL) fai_destroy(faiMap);
+    }
+    for(int32_t refIndex=0; refIndex < (int32_t) hdr->n_targets; ++refIndex) cnvs.insert(cnvs.end(), chrCnvs[refIndex].begin(), chrCnvs[refIndex].end());
+    if ((c.pelt) && (!c.hasGenoFile)) {
+      uint64_t evaluated = 0;
+      for(int32_t refIndex=0; refIndex < (int32_t) hdr->n_targets; ++refIndex) evaluated += chrEvaluated[refIndex];
+      now = boost::posix_time::second_clock::local_time();
+      std::cout << '[' << boost::posix_time::to_simple_string(now) << "] " << "PELT segmentation evaluated " << evaluated << " candidate changepoints" << std::endl;
+    }
 
-      {
-	// Mate map
-	typedef boost::unordered_map<std::size_t, bool> TMateMap;
-	TMateMap mateMap;
-	
-	// Count reads
-	hts_itr_t* iter = sam_itr_queryi(idx, refIndex, 0, hdr->target_len[refIndex]);
-	bam1_t* rec = bam_init1();
-	int32_t lastAlignedPos = 0;
-	std::set<std::size_t> lastAlignedPosReads;
-	while (sam_itr_next(samfile, iter, rec) >= 0) {
-	  if (rec->core.flag & (BAM_FQCFAIL | BAM_FDUP | BAM_FUNMAP | BAM_FSECONDARY | BAM_FSUPPLEMENTARY)) continue;
-	  if (rec->core.qual < c.minQual) continue;	  
-	  if ((rec->core.flag & BAM_FPAIRED) && ((rec->core.flag & BAM_FMUNMAP) || (rec->core.tid != rec->core.mtid))) continue;
-
-	  int32_t midPoint = rec->core.pos + halfAlignmentLength(rec);
-	  if (rec->core.flag & BAM_FPAIRED) {
-	    // Clean-up the read store for identical alignment positions
-	    if (rec->core.pos > lastAlignedPos) {
-	      lastAlignedPosReads.clear();
-	      lastAlignedPos = rec->core.pos;
-	    }
-	    
-	    if ((rec->core.pos < rec->core.mpos) || ((rec->core.pos == rec->core.mpos) && (lastAlignedPosReads.find(hash_string(bam_get_qname(rec))) == lastAlignedPosReads.end()))) {
-	      // First read
-	      lastAlignedPosReads.insert(hash_string(bam_get_qname(rec)));
-	      std::size_t hv = hash_pair(rec);
-	      mateMap[hv] = true;
-	      continue;
-	    } else {
-	      // Second read
-	      std::size_t hv = hash_pair_mate(rec);
-	      if ((mateMap.find(hv) == mateMap.end()) || (!mateMap[hv])) continue; // Mate discarded
-	      mateMap[hv] = false;
-	    }
-	    
-	    // update midpoint
-	    int32_t isize = (rec->core.pos + alignmentLength(rec)) - rec->core.mpos;
-	    if ((li.minNormalISize < isize) && (isize < li.maxNormalISize)) midPoint = rec->core.mpos + (int32_t) (isize/2);
-	  }
-	  
-	  // Count fragment
-	  if ((midPoint >= 0) && (midPoint < (int32_t) hdr->target_len[refIndex]) && (cov[midPoint] < maxCoverage - 1)) ++cov[midPoint];
-	}
-	// Clean-up
-	if (seq != NULL) free(seq);
-	if (ref != NULL) free(ref);
-	bam_destroy1(rec);
-	hts_itr_destroy(iter);
-      }
+    // Sort CNVs
+    sort(cnvs.begin(), cnvs.end(), SortCNVs<CNV>());
 
-      // CNV discovery
-      if (!c.hasGenoFile) {
-	// Call CNVs
-	std::vector<CNV> chrcnv;
-	callCNVs(c, gcbound, gcContent, uniqContent, gcbias, cov, hdr, refIndex, chrcnv);
+    // Genotype CNVs
+    cnvVCF(c, cnvs);
 
-	// Merge adjacent CNVs lacking read-depth shift
-	mergeCNVs(c, chrcnv, cnvs);
+    // clean-up
+    bam_hdr_destroy(hdr);
+    sam_close(samfile);
+    if (c.binaryCoverage) {
+      if ((!closeCoverageWriter(c.covfile, cw)) || (covError)) return 1;
+    } else {
+      dataOut.pop();
+      dataOut.pop();
+    }
+    
+    return 0;
+  }
 
-	// Refine breakpoints
-	if (c.hasVcfFile) breakpointRefinement(c, gcbound, gcContent, uniqContent, gcbias, cov, hdr, refIndex, svbp, cnvs);
+  // Outputs of one sample in a multi-sample run, <sample prefix>.<file name>
+  inline boost::filesystem::path
+  _sampleOutput(boost::filesystem::path const& outfile, std::string const& prefix) {
+    return outfile.parent_path() / (prefix + "." + outfile.filename().string());
+  }
+
+  // Output prefixes of all samples: the alignment file stem, duplicate stems get the 1-based input index
+  inline bool
+  _samplePrefixes(std::vector<boost::filesystem::path> const& files, std::vector<std::string>& prefix) {
+    std::map<std::string, uint32_t> stemCount;
+    for(uint32_t file_c = 0; file_c < files.size(); ++file_c) ++stemCount[files[file_c].stem().string()];
+    std::set<std::string> used;
+    prefix.resize(files.size());
+    for(uint32_t file_c = 0; file_c < files.size(); ++file_c) {
+      prefix[file_c] = files[file_c].stem().string();
+      if (stemCount[prefix[file_c]] > 1) prefix[file_c] += "_" + boost::lexical_cast<std::string>(file_c + 1);
+      if (!used.insert(prefix[file_c]).second) {
+	std::cerr << "Per-sample outputs would collide for " << files[file_c].string() << std::endl;
+	return false;
       }
-      
-      // CNV genotyping
-      genotypeCNVs(c, gcbound, gcContent, uniqContent, gcbias, cov, hdr, refIndex, cnvs);
-
-      // BED File (target intervals)
-      if (c.hasBedFile) {
-	if (c.adaptive) {
-	  // Merge overlapping BED entries
-	  TChrIntervals citv;
-	  _mergeOverlappingBedEntries(bedRegions[refIndex], citv);
-
-	  // Tile merged intervals
-	  double covsum = 0;
-	  double expcov = 0;
-	  double obsexp = 0;
-	  uint32_t winlen = 0;
-	  uint32_t start = 0;
-	  bool endOfWindow = true;
-	  typename TChrIntervals::iterator it = citv.begin();
-	  if (it != citv.end()) start = it->first;
-	  while(endOfWindow) {
-	    endOfWindow = false;
-	    for(it = citv.begin(); ((it != citv.end()) && (!endOfWindow)); ++it) {
-	      if ((it->first < it->second) && (it->second <= hdr->target_len[refIndex])) {
-		if (start >= it->second) {
-		  if (start == it->second) {
-		    // Special case
-		    typename TChrIntervals::iterator itNext = it;
-		    ++itNext;
-		    if (itNext != citv.end()) start = itNext->first;
-		  }
-		  continue;
-		}
-		for(uint32_t pos = it->first; ((pos < it->second) && (!endOfWindow)); ++pos) {
-		  if (pos < start) continue;
-		  if ((gcContent[pos] > gcbound.first) && (gcContent[pos] < gcbound.second) && (uniqContent[pos] >= c.fragmentUnique * c.meanisize)) {
-		    covsum += cov[pos];
-		    obsexp += gcbias[gcContent[pos]].obsexp;
-		    expcov += gcbias[gcContent[pos]].coverage;
-		    ++winlen;
-		    if (winlen == c.window_size) {
-		      obsexp /= (double) winlen;
-		      double count = ((double) covsum / obsexp ) * (double) c.window_size / (double) winlen;
-		      double cn = c.ploidy;
-		      if (expcov > 0) cn = c.ploidy * covsum / expcov;
-		      dataOut << std::string(hdr->target_name[refIndex]) << "\t" << start << "\t" << (pos + 1) << "\t" << winlen << "\t" << count << "\t" << cn << std::endl;
-		      // reset
-		      covsum = 0;
-		      expcov = 0;
-		      obsexp = 0;
-		      winlen = 0;
-		      if (c.window_offset == c.window_size) {
-			// Move on
-			start = pos + 1;
-			endOfWindow = true;
-		      } else {
-			// Rewind
-			for(typename TChrIntervals::iterator sit = citv.begin(); ((sit != citv.end()) && (!endOfWindow)); ++sit) {
-			  if ((sit->first < sit->second) && (sit->second <= hdr->target_len[refIndex])) {
-			    if (start >= sit->second) continue;
-			    for(uint32_t k = sit->first; ((k < sit->second) && (!endOfWindow)); ++k) {
-			      if (k < start) continue;
-			      if ((gcContent[k] > gcbound.first) && (gcContent[k] < gcbound.second) && (uniqContent[k] >= c.fragmentUnique * c.meanisize)) {
-				++winlen;
-				if (winlen == c.window_offset) {
-				  start = k + 1;
-				  winlen = 0;
-				  endOfWindow = true;
-				}
-			      }
-			    }
-			  }
-			}
-		      }
-		    }
-		  }
-		}
-	      }
-	    }
+    }
+    return true;
+  }
+
+  template<typename TConfig>
+  inline int32_t
+  coralRun(TConfig& c) {
+    // Check bam file
+    LibraryInfo li;
+    if (!(boost::filesystem::exists(c.bamFile) && boost::filesystem::is_regular_file(c.bamFile) && boost::filesystem::file_size(c.bamFile))) {
+      std::cerr << "Alignment file is missing: " << c.bamFile.string() << std::endl;
+      return 1;
+    } else {
+      // Get scan regions
+      typedef boost::icl::interval_set<uint32_t> TChrIntervals;
+      typedef typename TChrIntervals::interval_type TIVal;
+      typedef std::vector<TChrIntervals> TRegionsGenome;
+      TRegionsGenome scanRegions;
+
+      // Open BAM file
+      samFile* samfile = sam_open(c.bamFile.string().c_str(), "r");
+      if (samfile == NULL) {
+	std::cerr << "Fail to open file " << c.bamFile.string() << std::endl;
+	return 1;
+      }
+      hts_idx_t* idx = sam_index_load(samfile, c.bamFile.string().c_str());
+      if (idx == NULL) {
+	if (bam_index_build(c.bamFile.string().c_str(), 0) != 0) {
+	  std::cerr << "Fail to open index for " << c.bamFile.string() << std::endl;
+	  return 1;
+	}
+      }
+      bam_hdr_t* hdr = sam_hdr_read(samfile);
+      if (hdr == NULL) {
+	std::cerr << "Fail to open header for " << c.bamFile.string() << std::endl;
+	return 1;
+      }
+      c.nchr = hdr->n_targets;
+      c.minChrLen = setMinChrLen(hdr, 0.95);
+      std::string sampleName = "unknown";
+      getSMTag(std::string(hdr->text), c.bamFile.stem().string(), sampleName);
+      c.sampleName = sampleName;
+
+      // Check matching chromosome names
+      faidx_t* faiRef = fai_load(c.genome.string().c_str());
+      faidx_t* faiMap = NULL;
+      if (!c.hasTrackFile) faiMap = fai_load(c.mapFile.string().c_str());
+      uint32_t mapFound = 0;
+      uint32_t refFound = 0;
+      for(int32_t refIndex=0; refIndex < hdr->n_targets; ++refIndex) {
+	std::string tname(hdr->target_name[refIndex]);
+	if (c.hasTrackFile) {
+	  TrackEntry const* te = c.tracks.find(tname);
+	  if ((te != NULL) && (te->len != hdr->target_len[refIndex])) {
+	    std::cerr << "Warning: BAM chromosome " << tname << " differs in length from the track file!" << std::endl;
+	    te = NULL;
 	  }
+	  if ((te != NULL) && (te->uniqBits)) ++mapFound;
+	  if ((te != NULL) && (te->gcBits)) ++refFound;
+	} else if (faidx_has_seq(faiMap, tname.c_str())) ++mapFound;
+	if (faidx_has_seq(faiRef, tname.c_str())) {
+	  if (!c.hasTrackFile) ++refFound;
 	} else {
-	  // Fixed Window Length
-	  for(typename TChrIntervals::iterator it = bedRegions[refIndex].begin(); it != bedRegions[refIndex].end(); ++it) {
-	    if ((it->first < it->second) && (it->second <= hdr->target_len[refIndex])) {
-	      double covsum = 0;
-	      double expcov = 0;
-	      double obsexp = 0;
-	      uint32_t winlen = 0;
-	      for(uint32_t pos = it->first; pos < it->second; ++pos) {
-		if ((gcContent[pos] > gcbound.first) && (gcContent[pos] < gcbound.second) && (uniqContent[pos] >= c.fragmentUnique * c.meanisize)) {
-		  covsum += cov[pos];
-		  obsexp += gcbias[gcContent[pos]].obsexp;
-		  expcov += gcbias[gcContent[pos]].coverage;
-		  ++winlen;
-		}
-	      }
-	      if (winlen >= c.fracWindow * (it->second - it->first)) {
-		obsexp /= (double) winlen;
-		double count = ((double) covsum / obsexp ) * (double) (it->second - it->first) / (double) winlen;
-		double cn = c.ploidy;
-		if (expcov > 0) cn = c.ploidy * covsum / expcov;
-		dataOut << std::string(hdr->target_name[refIndex]) << "\t" << it->first << "\t" << it->second << "\t" << winlen << "\t" << count << "\t" << cn << std::endl;
-	      } else {
-		dataOut << std::string(hdr->target_name[refIndex]) << "\t" << it->first << "\t" << it->second << "\tNA\tNA\tNA" << std::endl;
-	      }
-	    }
-	  }
+	  std::cerr << "Warning: BAM chromosome " << tname << " not present in reference genome!" << std::endl;
+	}
+      }
+      fai_destroy(faiRef);
+      if (faiMap != NULL) fai_destroy(faiMap);
+      if (!mapFound) {
+	std::cerr << "Mappability map chromosome naming disagrees with BAM file!" << std::endl;
+	return 1;
+      }
+      if (!refFound) {
+	std::cerr << "Reference genome chromosome naming disagrees with BAM file!" << std::endl;
+	return 1;
+      }
+
+      // Estimate library params
+      if (c.hasScanFile) {
+	if (!_parseBedIntervals(c.scanFile.string(), c.hasScanFile, hdr, scanRegions)) {
+	  std::cerr << "Warning: Couldn't parse BED intervals. Do the chromosome names match?" << std::endl;
+	  return 1;
 	}
       } else {
-	// Genome-wide
-	if (c.adaptive) {
-	  double covsum = 0;
-	  double expcov = 0;
-	  double obsexp = 0;
-	  uint32_t winlen = 0;
-	  uint32_t start = 0;
-	  uint32_t pos = 0;
-	  while(pos < hdr->target_len[refIndex]) {
-	    if ((gcContent[pos] > gcbound.first) && (gcContent[pos] < gcbound.second) && (uniqContent[pos] >= c.fragmentUnique * c.meanisize)) {
-	      covsum += cov[pos];
-	      obsexp += gcbias[gcContent[pos]].obsexp;
-	      expcov += gcbias[gcContent[pos]].coverage;
-	      ++winlen;
-	      if (winlen == c.window_size) {
-		obsexp /= (double) winlen;
-		double count = ((double) covsum / obsexp ) * (double) c.window_size / (double) winlen;
-		double cn = c.ploidy;
-		if (expcov > 0) cn = c.ploidy * covsum / expcov;
-		dataOut << std::string(hdr->target_name[refIndex]) << "\t" << start << "\t" << (pos + 1) << "\t" << winlen << "\t" << count << "\t" << cn << std::endl;
-		// reset
-		covsum = 0;
-		expcov = 0;
-		obsexp = 0;
-		winlen = 0;
-		if (c.window_offset == c.window_size) {
-		  // Move on
-		  start = pos + 1;
-		} else {
-		  // Rewind
-		  for(uint32_t k = start; k < hdr->target_len[refIndex]; ++k) {
-		    if ((gcContent[k] > gcbound.first) && (gcContent[k] < gcbound.second) && (uniqContent[k] >= c.fragmentUnique * c.meanisize)) {
-		      ++winlen;
-		      if (winlen == c.window_offset) {
-			start = k + 1;
-			pos = k;
-			winlen = 0;
-			break;
-		      }
-		    }
-		  }
-		}
-	      }
-	    }
-	    ++pos;
-	  }
-	} else {
-	  // Fixed windows (genomic tiling)
-	  for(uint32_t start = 0; start < hdr->target_len[refIndex]; start = start + c.window_offset) {
-	    if (start + c.window_size < hdr->target_len[refIndex]) {
-	      double covsum = 0;
-	      double expcov = 0;
-	      double obsexp = 0;
-	      uint32_t winlen = 0;
-	      for(uint32_t pos = start; pos < start + c.window_size; ++pos) {
-		if ((gcContent[pos] > gcbound.first) && (gcContent[pos] < gcbound.second) && (uniqContent[pos] >= c.fragmentUnique * c.meanisize)) {
-		  covsum += cov[pos];
-		  obsexp += gcbias[gcContent[pos]].obsexp;
-		  expcov += gcbias[gcContent[pos]].coverage;
-		  ++winlen;
-		}
-	      }
-	      if (winlen >= c.fracWindow * c.window_size) {
-		obsexp /= (double) winlen;
-		double count = ((double) covsum / obsexp ) * (double) c.window_size / (double) winlen;
-		double cn = c.ploidy;
-		if (expcov > 0) cn = c.ploidy * covsum / expcov;
-		dataOut << std::string(hdr->target_name[refIndex]) << "\t" << start << "\t" << (start + c.window_size) << "\t" << winlen << "\t" << count << "\t" << cn << std::endl;
-	      }
-	    }
-	  }
+	scanRegions.resize(hdr->n_targets);
+	for (int32_t refIndex = 0; refIndex < hdr->n_targets; ++refIndex) {
+	  scanRegions[refIndex].insert(TIVal::right_open(0, hdr->target_len[refIndex]));
 	}
       }
+      typedef std::vector<LibraryInfo> TSampleLibrary;
+      TSampleLibrary sampleLib(1, LibraryInfo());
+      CountDNAConfigLib dellyConf;
+      dellyConf.genome = c.genome;
+      dellyConf.files.push_back(c.bamFile);
+      dellyConf.madCutoff = 9;
+      dellyConf.madNormalCutoff = c.mad;
+      getLibraryParams(dellyConf, scanRegions, sampleLib);
+      li = sampleLib[0];
+      if (!li.median) {
+	li.median = 250;
+	li.mad = 15;
+	li.minNormalISize = 0;
+	li.maxNormalISize = 400;
+      }
+      c.meanisize = ((int32_t) (li.median / 2)) * 2 + 1;
+      
+      // Clean-up
+      bam_hdr_destroy(hdr);
+      hts_idx_destroy(idx);
+      sam_close(samfile);
     }
 
-    // Sort CNVs
-    sort(cnvs.begin(), cnvs.end(), SortCNVs<CNV>());
+    // GC bias estimation
+    typedef std::pair<uint32_t, uint32_t> TGCBound;
+    TGCBound gcbound;
+    std::vector<GcBias> gcbias(c.meanisize + 1, GcBias());
+    std::vector<FragmentCounts> fragCounts(c.nchr, FragmentCounts());
+    {
+      // Count fragments and scan genomic windows (single pass over the alignments)
+      typedef std::vector<ScanWindow> TWindowCounts;
+      typedef std::vector<TWindowCounts> TGenomicWindowCounts;
+      TGenomicWindowCounts scanCounts(c.nchr, TWindowCounts());
+      scan(c, li, scanCounts, fragCounts);
+    
+      // Select stable windows
+      selectWindows(c, scanCounts);
 
-    // Genotype CNVs
-    cnvVCF(c, cnvs);
+      // Estimate GC bias
+      gcBias(c, scanCounts, fragCounts, gcbias, gcbound);
+
+      // Statistics output
+      if (c.hasStatsFile) {
+	// Open stats file
+	boost::iostreams::filtering_ostream statsOut;
+	statsOut.push(boost::iostreams::gzip_compressor());
+	statsOut.push(boost::iostreams::file_sink(c.statsFile.string().c_str(), std::ios_base::out | std::ios_base::binary));
+	
+	// Library Info
+	statsOut << "LP\t" << li.rs << ',' << li.median << ',' << li.mad << ',' << li.minNormalISize << ',' << li.maxNormalISize << std::endl;
+	
+	// Scan window summry
+	samFile* samfile = sam_open(c.bamFile.string().c_str(), "r");
+	bam_hdr_t* hdr = sam_hdr_read(samfile);
+	statsOut << "SW\tchrom\tstart\tend\tselected\tcoverage\tuniqcov" <<  std::endl;
+	for(uint32_t refIndex = 0; refIndex < (uint32_t) hdr->n_targets; ++refIndex) {
+	  for(uint32_t i = 0; i < scanCounts[refIndex].size(); ++i) {
+	    statsOut << "SW\t" <<  hdr->target_name[refIndex] << '\t' << scanCounts[refIndex][i].start << '\t' << scanCounts[refIndex][i].end << '\t' << scanCounts[refIndex][i].select << '\t' << scanCounts[refIndex][i].cov << '\t' << scanCounts[refIndex][i].uniqcov << std::endl;
+	  }
+	}
+	bam_hdr_destroy(hdr);
+	sam_close(samfile);
+	
+	// GC bias summary
+	statsOut << "GC\tgcsum\tsample\treference\tpercentileSample\tpercentileReference\tfractionSample\tfractionReference\tobsexp\tmeancoverage" << std::endl;
+	for(uint32_t i = 0; i < gcbias.size(); ++i) statsOut << "GC\t" << i << "\t" << gcbias[i].sample << "\t" << gcbias[i].reference << "\t" << gcbias[i].percentileSample << "\t" << gcbias[i].percentileReference << "\t" << gcbias[i].fractionSample << "\t" << gcbias[i].fractionReference << "\t" << gcbias[i].obsexp << "\t" << gcbias[i].coverage << std::endl;
+	statsOut << "BoundsGC\t" << gcbound.first << "," << gcbound.second << std::endl;
+	statsOut.pop();
+	statsOut.pop();
+      }
+    }
+      
+    // Read-depth windows and CNV calling
+    if (bamCount(c, fragCounts, gcbias, gcbound)) {
+      std::cerr << "Read counting error!" << std::endl;
+      return 1;
+    }
 
-    // clean-up
-    fai_destroy(faiRef);
-    fai_destroy(faiMap);
-    bam_hdr_destroy(hdr);
-    hts_idx_destroy(idx);
-    sam_close(samfile);
-    dataOut.pop();
-    dataOut.pop();
-    
     return 0;
   }
 
@@ -459,9 +637,11 @@ namespace torali
       ("genome,g", boost::program_options::value<boost::filesystem::path>(&c.genome), "genome file")
       ("quality,q", boost::program_options::value<uint16_t>(&c.minQual)->default_value(10), "min. mapping quality")
       ("mappability,m", boost::program_options::value<boost::filesystem::path>(&c.mapFile), "input mappability map")
+      ("tracks", boost::program_options::value<boost::filesystem::path>(&c.trackFile), "precomputed GC and mappability tracks (delly tracks), replaces -m")
       ("ploidy,y", boost::program_options::value<uint16_t>(&c.ploidy)->default_value(2), "baseline ploidy")
       ("outfile,o", boost::program_options::value<boost::filesystem::path>(&c.cnvfile)->default_value("cnv.bcf"), "output CNV file")
       ("covfile,c", boost::program_options::value<boost::filesystem::path>(&c.covfile)->default_value("cov.gz"), "output coverage file")
+      ("binary-coverage,B", "indexed binary coverage output (BGZF) instead of gzipped text")
       ;
 
     boost::program_options::options_description cnv("CNV calling");
@@ -472,6 +652,8 @@ namespace torali
       ("svfile,l", boost::program_options::value<boost::filesystem::path>(&c.vcffile), "delly SV file for breakpoint refinement")
       ("vcffile,v", boost::program_options::value<boost::filesystem::path>(&c.genofile), "input VCF/BCF file for re-genotyping")
       ("segmentation,u", "copy-number segmentation")
+      ("pelt", "exact PELT breakpoint search instead of the multi-window z-score scan")
+      ("penalty", boost::program_options::value<float>(&c.penalty)->default_value(2), "PELT penalty per changepoint (x variance x log(#windows))")
       ;
     
     boost::program_options::options_description window("Read-depth windows");
@@ -491,11 +673,13 @@ namespace torali
       ("mad-cutoff,d", boost::program_options::value<uint16_t>(&c.mad)->default_value(3), "median + 3 * mad count cutoff")
       ("percentile,p", boost::program_options::value<float>(&c.exclgc)->default_value(0.0005), "excl. extreme GC fraction")
       ("no-window-selection,n", "no scan window selection")
+      ("gc-sampling", "estimate GC bias from randomly sampled genome tiles")
+      ("gc-error", boost::program_options::value<float>(&c.gcError)->default_value(0.02), "max. relative error of the sampled GC bins")
       ;
     
     boost::program_options::options_description hidden("Hidden options");
     hidden.add_options()
-      ("input-file", boost::program_options::value<boost::filesystem::path>(&c.bamFile), "input bam file")
+      ("input-file", boost::program_options::value< std::vector<boost::filesystem::path> >(&c.files), "input bam files")
       ("fragment,e", boost::program_options::value<float>(&c.fragmentUnique)->default_value(0.97), "min. fragment uniqueness [0,1]")
       ("statsfile,s", boost::program_options::value<boost::filesystem::path>(&c.statsFile), "gzipped stats output file (optional)")
       ;
@@ -515,9 +699,9 @@ namespace torali
     boost::program_options::notify(vm);
 
     // Check command line arguments
-    if ((vm.count("help")) || (!vm.count("input-file")) || (!vm.count("genome")) || (!vm.count("mappability"))) {
+    if ((vm.count("help")) || (!vm.count("input-file")) || (!vm.count("genome")) || ((!vm.count("mappability")) && (!vm.count("tracks")))) {
       std::cout << std::endl;
-      std::cout << "Usage: delly " << argv[0] << " [OPTIONS] -g <genome.fa> -m <genome.map> <aligned.bam>" << std::endl;
+      std::cout << "Usage: delly " << argv[0] << " [OPTIONS] -g <genome.fa> (-m <genome.map> | --tracks <tracks.bin>) <sample1.bam> <sample2.bam> ..." << std::endl;
       std::cout << visible_options << "\n";
       return 1;
     }
@@ -529,6 +713,22 @@ namespace torali
     for(int i=0; i<argc; ++i) { std::cout << argv[i] << ' '; }
     std::cout << std::endl;
 
+    // Coverage output format
+    if (vm.count("binary-coverage")) {
+      c.binaryCoverage = true;
+      if (vm["covfile"].defaulted()) c.covfile = "cov.bin";
+    } else c.binaryCoverage = false;
+
+    // Precomputed tracks
+    if (vm.count("tracks")) {
+      if (!(boost::filesystem::exists(c.trackFile) && boost::filesystem::is_regular_file(c.trackFile) && boost::filesystem::file_size(c.trackFile))) {
+	std::cerr << "Track file is missing: " << c.trackFile.string() << std::endl;
+	return 1;
+      }
+      if (!openTrackFile(c.trackFile, c.tracks)) return 1;
+      c.hasTrackFile = true;
+    } else c.hasTrackFile = false;
+
     // Stats file
     if (vm.count("statsfile")) c.hasStatsFile = true;
     else c.hasStatsFile = false;
@@ -545,6 +745,11 @@ namespace torali
     if (vm.count("no-window-selection")) c.noScanWindowSelection = true;
     else c.noScanWindowSelection = false;
 
+    // Sampled GC bias estimation
+    if (vm.count("gc-sampling")) c.gcSampling = true;
+    else c.gcSampling = false;
+    c.showProgress = true;
+
     // Adaptive windowing
     if (vm.count("adaptive-windowing")) c.adaptive = true;
     else c.adaptive = false;
@@ -553,6 +758,10 @@ namespace torali
     if (vm.count("segmentation")) c.segmentation = true;
     else c.segmentation = false;
 
+    // Breakpoint search
+    if (vm.count("pelt")) c.pelt = true;
+    else c.pelt = false;
+
     // Check window size
     if (c.window_offset > c.window_size) c.window_offset = c.window_size;
     if (c.window_size == 0) c.window_size = 1;
@@ -600,154 +809,55 @@ namespace torali
       c.hasVcfFile = true;
     } else c.hasVcfFile = false;
     
-    // Check bam file
-    LibraryInfo li;
-    if (!(boost::filesystem::exists(c.bamFile) && boost::filesystem::is_regular_file(c.bamFile) && boost::filesystem::file_size(c.bamFile))) {
-      std::cerr << "Alignment file is missing: " << c.bamFile.string() << std::endl;
-      return 1;
-    } else {
-      // Get scan regions
-      typedef boost::icl::interval_set<uint32_t> TChrIntervals;
-      typedef typename TChrIntervals::interval_type TIVal;
-      typedef std::vector<TChrIntervals> TRegionsGenome;
-      TRegionsGenome scanRegions;
-
-      // Open BAM file
-      samFile* samfile = sam_open(c.bamFile.string().c_str(), "r");
-      if (samfile == NULL) {
-	std::cerr << "Fail to open file " << c.bamFile.string() << std::endl;
-	return 1;
-      }
-      hts_idx_t* idx = sam_index_load(samfile, c.bamFile.string().c_str());
-      if (idx == NULL) {
-	if (bam_index_build(c.bamFile.string().c_str(), 0) != 0) {
-	  std::cerr << "Fail to open index for " << c.bamFile.string() << std::endl;
-	  return 1;
-	}
-      }
-      bam_hdr_t* hdr = sam_hdr_read(samfile);
-      if (hdr == NULL) {
-	std::cerr << "Fail to open header for " << c.bamFile.string() << std::endl;
-	return 1;
-      }
-      c.nchr = hdr->n_targets;
-      c.minChrLen = setMinChrLen(hdr, 0.95);
-      std::string sampleName = "unknown";
-      getSMTag(std::string(hdr->text), c.bamFile.stem().string(), sampleName);
-      c.sampleName = sampleName;
-
-      // Check matching chromosome names
-      faidx_t* faiRef = fai_load(c.genome.string().c_str());
-      faidx_t* faiMap = fai_load(c.mapFile.string().c_str());
-      uint32_t mapFound = 0;
-      uint32_t refFound = 0;
-      for(int32_t refIndex=0; refIndex < hdr->n_targets; ++refIndex) {
-	std::string tname(hdr->target_name[refIndex]);
-	if (faidx_has_seq(faiMap, tname.c_str())) ++mapFound;
-	if (faidx_has_seq(faiRef, tname.c_str())) ++refFound;
-	else {
-	  std::cerr << "Warning: BAM chromosome " << tname << " not present in reference genome!" << std::endl;
-	}
-      }
-      fai_destroy(faiRef);
-      fai_destroy(faiMap);
-      if (!mapFound) {
-	std::cerr << "Mappability map chromosome naming disagrees with BAM file!" << std::endl;
-	return 1;
-      }
-      if (!refFound) {
-	std::cerr << "Reference genome chromosome naming disagrees with BAM file!" << std::endl;
+    // Check bam files
+    for(uint32_t file_c = 0; file_c < c.files.size(); ++file_c) {
+      if (!(boost::filesystem::exists(c.files[file_c]) && boost::filesystem::is_regular_file(c.files[file_c]) && boost::filesystem::file_size(c.files[file_c]))) {
+	std::cerr << "Alignment file is missing: " << c.files[file_c].string() << std::endl;
 	return 1;
       }
+    }
+    std::vector<std::string> prefix;
+    if (!_samplePrefixes(c.files, prefix)) return 1;
+
+    // Reference tracks are shared read-only by all samples
+    if ((c.files.size() > 1) && (!c.hasTrackFile)) {
+      now = boost::posix_time::second_clock::local_time();
+      std::cout << '[' << boost::posix_time::to_simple_string(now) << "] " << "Load GC and mappability tracks" << std::endl;
+      if (!loadTracks(c.genome, c.mapFile, c.tracks)) return 1;
+      c.hasTrackFile = true;
+    }
 
-      // Estimate library params
-      if (c.hasScanFile) {
-	if (!_parseBedIntervals(c.scanFile.string(), c.hasScanFile, hdr, scanRegions)) {
-	  std::cerr << "Warning: Couldn't parse BED intervals. Do the chromosome names match?" << std::endl;
-	  return 1;
-	}
-      } else {
-	scanRegions.resize(hdr->n_targets);
-	for (int32_t refIndex = 0; refIndex < hdr->n_targets; ++refIndex) {
-	  scanRegions[refIndex].insert(TIVal::right_open(0, hdr->target_len[refIndex]));
-	}
+    // Worker pool over samples, each sample with its own outputs and GC-bias estimation
+    std::vector<int32_t> status(c.files.size(), 0);
+    std::ostream nullOut(NULL);
+    if (c.files.size() > 1) {
+      now = boost::posix_time::second_clock::local_time();
+      std::cout << '[' << boost::posix_time::to_simple_string(now) << "] " << "Processing " << c.files.size() << " samples" << std::endl;
+    }
+    boost::progress_display show_progress( c.files.size(), (c.files.size() > 1) ? std::cout : nullOut );
+#pragma omp parallel for default(shared) schedule(dynamic) if (c.files.size() > 1)
+    for(int32_t file_c = 0; file_c < (int32_t) c.files.size(); ++file_c) {
+      CountDNAConfig sc(c);
+      sc.bamFile = c.files[file_c];
+      if (c.files.size() > 1) {
+	// Concurrent samples share one progress bar over samples
+	sc.showProgress = false;
+	sc.cnvfile = _sampleOutput(c.cnvfile, prefix[file_c]);
+	sc.covfile = _sampleOutput(c.covfile, prefix[file_c]);
+	sc.statsFile = _sampleOutput(c.statsFile, prefix[file_c]);
       }
-      typedef std::vector<LibraryInfo> TSampleLibrary;
-      TSampleLibrary sampleLib(1, LibraryInfo());
-      CountDNAConfigLib dellyConf;
-      dellyConf.genome = c.genome;
-      dellyConf.files.push_back(c.bamFile);
-      dellyConf.madCutoff = 9;
-      dellyConf.madNormalCutoff = c.mad;
-      getLibraryParams(dellyConf, scanRegions, sampleLib);
-      li = sampleLib[0];
-      if (!li.median) {
-	li.median = 250;
-	li.mad = 15;
-	li.minNormalISize = 0;
-	li.maxNormalISize = 400;
+      status[file_c] = coralRun(sc);
+#pragma omp critical
+      {
+	++show_progress;
       }
-      c.meanisize = ((int32_t) (li.median / 2)) * 2 + 1;
-      
-      // Clean-up
-      bam_hdr_destroy(hdr);
-      hts_idx_destroy(idx);
-      sam_close(samfile);
     }
-
-    // GC bias estimation
-    typedef std::pair<uint32_t, uint32_t> TGCBound;
-    TGCBound gcbound;
-    std::vector<GcBias> gcbias(c.meanisize + 1, GcBias());
-    {
-      // Scan genomic windows
-      typedef std::vector<ScanWindow> TWindowCounts;
-      typedef std::vector<TWindowCounts> TGenomicWindowCounts;
-      TGenomicWindowCounts scanCounts(c.nchr, TWindowCounts());
-      scan(c, li, scanCounts);
-    
-      // Select stable windows
-      selectWindows(c, scanCounts);
-
-      // Estimate GC bias
-      gcBias(c, scanCounts, li, gcbias, gcbound);
-
-      // Statistics output
-      if (c.hasStatsFile) {
-	// Open stats file
-	boost::iostreams::filtering_ostream statsOut;
-	statsOut.push(boost::iostreams::gzip_compressor());
-	statsOut.push(boost::iostreams::file_sink(c.statsFile.string().c_str(), std::ios_base::out | std::ios_base::binary));
-	
-	// Library Info
-	statsOut << "LP\t" << li.rs << ',' << li.median << ',' << li.mad << ',' << li.minNormalISize << ',' << li.maxNormalISize << std::endl;
-	
-	// Scan window summry
-	samFile* samfile = sam_open(c.bamFile.string().c_str(), "r");
-	bam_hdr_t* hdr = sam_hdr_read(samfile);
-	statsOut << "SW\tchrom\tstart\tend\tselected\tcoverage\tuniqcov" <<  std::endl;
-	for(uint32_t refIndex = 0; refIndex < (uint32_t) hdr->n_targets; ++refIndex) {
-	  for(uint32_t i = 0; i < scanCounts[refIndex].size(); ++i) {
-	    statsOut << "SW\t" <<  hdr->target_name[refIndex] << '\t' << scanCounts[refIndex][i].start << '\t' << scanCounts[refIndex][i].end << '\t' << scanCounts[refIndex][i].select << '\t' << scanCounts[refIndex][i].cov << '\t' << scanCounts[refIndex][i].uniqcov << std::endl;
-	  }
-	}
-	bam_hdr_destroy(hdr);
-	sam_close(samfile);
-	
-	// GC bias summary
-	statsOut << "GC\tgcsum\tsample\treference\tpercentileSample\tpercentileReference\tfractionSample\tfractionReference\tobsexp\tmeancoverage" << std::endl;
-	for(uint32_t i = 0; i < gcbias.size(); ++i) statsOut << "GC\t" << i << "\t" << gcbias[i].sample << "\t" << gcbias[i].reference << "\t" << gcbias[i].percentileSample << "\t" << gcbias[i].percentileReference << "\t" << gcbias[i].fractionSample << "\t" << gcbias[i].fractionReference << "\t" << gcbias[i].obsexp << "\t" << gcbias[i].coverage << std::endl;
-	statsOut << "BoundsGC\t" << gcbound.first << "," << gcbound.second << std::endl;
-	statsOut.pop();
-	statsOut.pop();
+    for(uint32_t file_c = 0; file_c < c.files.size(); ++file_c) {
+      if (status[file_c]) {
+	std::cerr << "CNV calling failed for " << c.files[file_c].string() << std::endl;
+	return 1;
       }
     }
-      
-    // Count reads
-    if (bamCount(c, li, gcbias, gcbound)) {
-      std::cerr << "Read counting error!" << std::endl;
-      return 1;
-    }
 
     // Done
     now = boost::posix_time::second_clock::local_time();
@@ -15,6 +15,8 @@
 
 #include "tags.h"
 #include "util.h"
+#include "bolog.h"
+#include "matetable.h"
 #include "msa.h"
 #include "split.h"
 
@@ -60,8 +62,8 @@ namespace torali {
     int32_t refh2;
     int32_t alth1;
     int32_t alth2;
-    std::vector<uint8_t> ref;
-    std::vector<uint8_t> alt;
+    QualityHistogram ref;
+    QualityHistogram alt;
 
     SpanningCount() : refh1(0), refh2(0), alth1(0), alth2(0) {}
   };
@@ -72,8 +74,8 @@ namespace torali {
     int32_t refh2;
     int32_t alth1;
     int32_t alth2;
-    std::vector<uint8_t> ref;
-    std::vector<uint8_t> alt;
+    QualityHistogram ref;
+    QualityHistogram alt;
 
     JunctionCount() : refh1(0), refh2(0), alth1(0), alth2(0) {}
   };
@@ -247,9 +249,65 @@ namespace torali {
     }
   }
 
+  // Breakpoints and reads per breakpoint probed for HP tags before batched genotyping
+  #ifndef DELLY_HP_PROBE_SITES
+  #define DELLY_HP_PROBE_SITES 64
+  #endif
+
+  #ifndef DELLY_HP_PROBE_READS
+  #define DELLY_HP_PROBE_READS 1000
+  #endif
+
+  // Any HP-tagged read at a sample of the SV start breakpoints in any input file
+  template<typename TConfig, typename TSVs>
+  inline bool
+  _probeHaplotagged(TConfig const& c, TSVs const& svs) {
+    if (svs.empty()) return false;
+    std::size_t step = std::max((std::size_t) 1, svs.size() / DELLY_HP_PROBE_SITES);
+    std::vector<uint8_t> haplotagged(c.files.size(), 0);
+#pragma omp parallel for default(shared)
+    for(unsigned int file_c = 0; file_c < c.files.size(); ++file_c) {
+      samFile* samfile = sam_open(c.files[file_c].string().c_str(), "r");
+      hts_set_fai_filename(samfile, c.genome.string().c_str());
+      requiredFields(samfile, DELLY_FIELDS_GENOTYPE);
+      hts_idx_t* idx = sam_index_load(samfile, c.files[file_c].string().c_str());
+      bam_hdr_t* hdr = sam_hdr_read(samfile);
+      bam1_t* rec = bam_init1();
+      for(std::size_t i = 0; ((!haplotagged[file_c]) && (i < svs.size())); i += step) {
+	hts_itr_t* iter = sam_itr_queryi(idx, svs[i].chr, std::max(0, svs[i].svStart - 1), svs[i].svStart + 1);
+	for(uint32_t nreads = 0; ((nreads < DELLY_HP_PROBE_READS) && (sam_itr_next(samfile, iter, rec) >= 0)); ++nreads) {
+	  if (rec->core.flag & (BAM_FSECONDARY | BAM_FQCFAIL | BAM_FDUP | BAM_FSUPPLEMENTARY | BAM_FUNMAP)) continue;
+	  PhaseTags phase;
+	  if (_haplotype(rec, phase)) {
+	    haplotagged[file_c] = 1;
+	    break;
+	  }
+	}
+	hts_itr_destroy(iter);
+      }
+      bam_destroy1(rec);
+      bam_hdr_destroy(hdr);
+      hts_idx_destroy(idx);
+      sam_close(samfile);
+    }
+    for(unsigned int file_c = 0; file_c < c.files.size(); ++file_c) {
+      if (haplotagged[file_c]) return true;
+    }
+    return false;
+  }
+
+  // Open the gzipped SV-read dump and write its header
+  template<typename TConfig>
+  inline void
+  _dumpHeader(TConfig const& c, boost::iostreams::filtering_ostream& dumpOut) {
+    dumpOut.push(boost::iostreams::gzip_compressor());
+    dumpOut.push(boost::iostreams::file_sink(c.dumpfile.string().c_str(), std::ios_base::out | std::ios_base::binary));
+    dumpOut << "#svid\tbam\tqname\tchr\tpos\tmatechr\tmatepos\tmapq\ttype" << std::endl;
+  }
+
   template<typename TConfig, typename TSampleLibrary, typename TSVs, typename TCoverageCount, typename TCountMap, typename TSpanMap>
   inline void
-  annotateCoverage(TConfig& c, TSampleLibrary& sampleLib, TSVs& svs, TCoverageCount& covCount, TCountMap& countMap, TSpanMap& spanMap)
+  annotateCoverage(TConfig& c, TSampleLibrary& sampleLib, TSVs& svs, TCoverageCount& covCount, TCountMap& countMap, TSpanMap& spanMap, int32_t const idOffset, std::ostream& dumpOut)
   {
     typedef typename TCoverageCount::value_type::value_type TCovPair;
     typedef typename TSpanMap::value_type::value_type TSpanPair;
@@ -267,6 +325,7 @@ namespace torali {
     for(unsigned int file_c = 0; file_c < c.files.size(); ++file_c) {
       samfile[file_c] = sam_open(c.files[file_c].string().c_str(), "r");
       hts_set_fai_filename(samfile[file_c], c.genome.string().c_str());
+      requiredFields(samfile[file_c], DELLY_FIELDS_GENOTYPE);
       idx[file_c] = sam_index_load(samfile[file_c], c.files[file_c].string().c_str());
       hdr[file_c] = sam_hdr_read(samfile[file_c]);
       totalTarget += hdr[file_c]->n_targets;
@@ -321,23 +380,15 @@ namespace torali {
       refAlignedSpanCount[file_c].resize(svs.size(), 0);
     }
     
-    // Dump file
-    boost::iostreams::filtering_ostream dumpOut;
-    if (c.hasDumpFile) {
-      dumpOut.push(boost::iostreams::gzip_compressor());
-      dumpOut.push(boost::iostreams::file_sink(c.dumpfile.string().c_str(), std::ios_base::out | std::ios_base::binary));
-      dumpOut << "#svid\tbam\tqname\tchr\tpos\tmatechr\tmatepos\tmapq\ttype" << std::endl;
-    }
+    // Haplotagged samples, merged into the config after the parallel section
+    std::vector<uint8_t> haplotagged(c.files.size(), 0);
 
 #pragma omp parallel for default(shared)
     for(unsigned int file_c = 0; file_c < c.files.size(); ++file_c) {
       // Pair qualities and features
-      typedef boost::unordered_map<std::size_t, uint8_t> TQualities;
-      TQualities qualities;
-      TQualities qualitiestra;
-      typedef boost::unordered_map<std::size_t, bool> TClip;
-      TClip clip;
-      TClip cliptra;
+      typedef std::pair<uint8_t, bool> TQualClip;
+      MateTable<TQualClip> qualities(sampleLib[file_c].maxISizeCutoff);
+      TraMateTable<TQualClip> qualitiestra(hdr[file_c]->n_targets, sampleLib[file_c].maxISizeCutoff);
       
       // Iterate chromosomes
       for(int32_t refIndex=0; refIndex < (int32_t) hdr[file_c]->n_targets; ++refIndex) {
@@ -390,15 +441,39 @@ namespace torali {
 	  }
 	}
 	std::sort(spanPoint.begin(), spanPoint.end(), SortBp<SpanPoint>());
-      
+
+	// Query span: breakpoint regions, spanning points and read-count windows padded by the insert size
+	int32_t qbeg = hdr[file_c]->target_len[refIndex];
+	int32_t qend = 0;
+	for(uint32_t i = 0; i < bpRegion[refIndex].size(); ++i) {
+	  qbeg = std::min(qbeg, bpRegion[refIndex][i].regionStart);
+	  qend = std::max(qend, bpRegion[refIndex][i].regionEnd);
+	}
+	for(typename TSVs::iterator itSV = svs.begin(); itSV != svs.end(); ++itSV) {
+	  if (itSV->chr == refIndex) {
+	    int32_t halfSize = (itSV->svEnd - itSV->svStart)/2;
+	    if ((_translocation(itSV->svt)) || (itSV->svt == 4)) halfSize = 500;
+	    qbeg = std::min(qbeg, itSV->svStart - halfSize);
+	    qend = std::max(qend, std::max(itSV->svStart, itSV->svEnd) + halfSize);
+	  }
+	  if (itSV->chr2 == refIndex) {
+	    qbeg = std::min(qbeg, itSV->svEnd);
+	    qend = std::max(qend, itSV->svEnd + 1);
+	  }
+	}
+	qbeg = std::max(qbeg - sampleLib[file_c].maxISizeCutoff, 0);
+	qend = std::min(qend + sampleLib[file_c].maxISizeCutoff, (int32_t) hdr[file_c]->target_len[refIndex]);
+	if (qbeg >= qend) continue;
+
 	// Count reads
-	hts_itr_t* iter = sam_itr_queryi(idx[file_c], refIndex, 0, hdr[file_c]->target_len[refIndex]);
+	hts_itr_t* iter = sam_itr_queryi(idx[file_c], refIndex, qbeg, qend);
 	bam1_t* rec = bam_init1();
 	int32_t lastAlignedPos = 0;
-	std::set<std::size_t> lastAlignedPosReads;
+	TAlignedReads lastAlignedPosReads;
 	while (sam_itr_next(samfile[file_c], iter, rec) >= 0) {
 	  if (rec->core.flag & (BAM_FSECONDARY | BAM_FQCFAIL | BAM_FDUP | BAM_FSUPPLEMENTARY | BAM_FUNMAP | BAM_FMUNMAP)) continue;
 	  if (rec->core.qual < c.minGenoQual) continue;
+	  PhaseTags phase;
 	  
 	  // Count aligned basepair (small InDels)
 	  {
@@ -495,16 +570,13 @@ namespace torali {
 			for (int i = 0; i < rec->core.l_qseq; ++i) quality[i] = qualptr[i];
 			uint32_t rq = _getAlignmentQual(alignRef, quality);
 			if (rq >= c.minGenoQual) {
-			  uint8_t* hpptr = bam_aux_get(rec, "HP");
+			  uint8_t hap = _haplotype(rec, phase);
+			  if (hap) haplotagged[file_c] = 1;
 #pragma omp critical
 			  {
 			    countMap[file_c][itBp->id].ref.push_back((uint8_t) std::min(rq, (uint32_t) rec->core.qual));
-			    if (hpptr) {
-			      c.isHaplotagged = true;
-			      int hap = bam_aux2i(hpptr);
-			      if (hap == 1) ++countMap[file_c][itBp->id].refh1;
-			      else ++countMap[file_c][itBp->id].refh2;
-			    }
+			    if (hap == 1) ++countMap[file_c][itBp->id].refh1;
+			    else if (hap == 2) ++countMap[file_c][itBp->id].refh2;
 			  }
 			}
 		      }
@@ -515,23 +587,20 @@ namespace torali {
 		      for (int i = 0; i < rec->core.l_qseq; ++i) quality[i] = qualptr[i];
 		      uint32_t aq = _getAlignmentQual(alignAlt, quality);
 		      if (aq >= c.minGenoQual) {
-			uint8_t* hpptr = bam_aux_get(rec, "HP");
+			uint8_t hap = _haplotype(rec, phase);
+			if (hap) haplotagged[file_c] = 1;
 #pragma omp critical
 			{
 			  if (c.hasDumpFile) {
 			    std::string svid(_addID(itBp->svt));
-			    std::string padNumber = boost::lexical_cast<std::string>(itBp->id);
+			    std::string padNumber = boost::lexical_cast<std::string>(itBp->id + idOffset);
 			    padNumber.insert(padNumber.begin(), 8 - padNumber.length(), '0');
 			    svid += padNumber;
 			    dumpOut << svid << "\t" << c.files[file_c].string() << "\t" << bam_get_qname(rec) << "\t" << hdr[file_c]->target_name[rec->core.tid] << "\t" << rec->core.pos << "\t" << hdr[file_c]->target_name[rec->core.mtid] << "\t" << rec->core.mpos << "\t" << (int32_t) rec->core.qual << "\tSR" << std::endl;
 			  }
 			  countMap[file_c][itBp->id].alt.push_back((uint8_t) std::min(aq, (uint32_t) rec->core.qual));
-			  if (hpptr) {
-			    c.isHaplotagged = true;
-			    int hap = bam_aux2i(hpptr);
-			    if (hap == 1) ++countMap[file_c][itBp->id].alth1;
-			    else ++countMap[file_c][itBp->id].alth2;
-			  }
+			  if (hap == 1) ++countMap[file_c][itBp->id].alth1;
+			  else if (hap == 2) ++countMap[file_c][itBp->id].alth2;
 			}
 		      }
 		    }
@@ -554,31 +623,20 @@ namespace torali {
 	    // First read
 	    lastAlignedPosReads.insert(hash_string(bam_get_qname(rec)));
 	    std::size_t hv = hash_pair(rec);
-	    if (rec->core.tid == rec->core.mtid) {
-	      qualities[hv] = rec->core.qual;
-	      clip[hv] = hasSoftClip;
-	    } else {
-	      qualitiestra[hv] = rec->core.qual;
-	      cliptra[hv] = hasSoftClip;
-	    }
+	    if (rec->core.tid == rec->core.mtid) qualities.insert(hv, rec->core.pos, rec->core.mpos, std::make_pair((uint8_t) rec->core.qual, hasSoftClip));
+	    else qualitiestra.insert(hv, rec->core.mtid, rec->core.mpos, std::make_pair((uint8_t) rec->core.qual, hasSoftClip));
 	  } else {
 	    // Second read
 	    std::size_t hv = hash_pair_mate(rec);
-	    uint8_t pairQuality = 0;
+	    TQualClip* mate = NULL;
+	    if (rec->core.tid == rec->core.mtid) mate = qualities.find(hv);
+	    else mate = qualitiestra.find(rec->core.tid, hv);
+	    if (mate == NULL) continue; // Mate discarded
+	    uint8_t pairQuality = std::min((uint8_t) mate->first, (uint8_t) rec->core.qual);
 	    bool pairClip = false;
-	    if (rec->core.tid == rec->core.mtid) {
-	      if (qualities.find(hv) == qualities.end()) continue; // Mate discarded
-	      pairQuality = std::min((uint8_t) qualities[hv], (uint8_t) rec->core.qual);
-	      if ((clip[hv]) || (hasSoftClip)) pairClip = true;
-	      qualities[hv] = 0;
-	      clip[hv] = false;
-	    } else {
-	      if (qualitiestra.find(hv) == qualitiestra.end()) continue; // Mate discarded
-	      pairQuality = std::min((uint8_t) qualitiestra[hv], (uint8_t) rec->core.qual);
-	      if ((cliptra[hv]) || (hasSoftClip)) pairClip = true;
-	      qualitiestra[hv] = 0;
-	      cliptra[hv] = false;
-	    }
+	    if ((mate->second) || (hasSoftClip)) pairClip = true;
+	    mate->first = 0;
+	    mate->second = false;
 
 	    // Pair quality
 	    if (pairQuality < c.minGenoQual) continue; // Low quality pair
@@ -617,16 +675,13 @@ namespace torali {
 		for(; ((itSpan != spanPoint.end()) && (st + spanlen >= itSpan->bppos)); ++itSpan) {
 		  // Account for reference bias
 		  if (++refAlignedSpanCount[file_c][itSpan->id] % 2) {
-		    uint8_t* hpptr = bam_aux_get(rec, "HP");
+		    uint8_t hap = _haplotype(rec, phase);
+		    if (hap) haplotagged[file_c] = 1;
 #pragma omp critical
 		    {
 		      spanMap[file_c][itSpan->id].ref.push_back(pairQuality);
-		      if (hpptr) {
-			c.isHaplotagged = true;
-			int hap = bam_aux2i(hpptr);
-			if (hap == 1) ++spanMap[file_c][itSpan->id].refh1;
-			else ++spanMap[file_c][itSpan->id].refh2;
-		      }
+		      if (hap == 1) ++spanMap[file_c][itSpan->id].refh1;
+		      else if (hap == 2) ++spanMap[file_c][itSpan->id].refh2;
 		    }
 		  }
 		}
@@ -661,23 +716,20 @@ namespace torali {
 		    // Make sure, mate is correct
 		    if (rec->core.mtid == itSpan->chr2) {
 		      if (std::abs((int32_t) rec->core.mpos - itSpan->otherBppos) < sampleLib[file_c].maxNormalISize) {
-			uint8_t* hpptr = bam_aux_get(rec, "HP");
+			uint8_t hap = _haplotype(rec, phase);
+			if (hap) haplotagged[file_c] = 1;
 #pragma omp critical
 			{
 			  if (c.hasDumpFile) {
 			    std::string svid(_addID(itSpan->svt));
-			    std::string padNumber = boost::lexical_cast<std::string>(itSpan->id);
+			    std::string padNumber = boost::lexical_cast<std::string>(itSpan->id + idOffset);
 			    padNumber.insert(padNumber.begin(), 8 - padNumber.length(), '0');
 			    svid += padNumber;
 			    dumpOut << svid << "\t" << c.files[file_c].string() << "\t" << bam_get_qname(rec) << "\t" << hdr[file_c]->target_name[rec->core.tid] << "\t" << rec->core.pos << "\t" << hdr[file_c]->target_name[rec->core.mtid] << "\t" << rec->core.mpos << "\t" << (int32_t) rec->core.qual << "\tPE" << std::endl;
 			  }
 			  spanMap[file_c][itSpan->id].alt.push_back(pairQuality);
-			  if (hpptr) {
-			    c.isHaplotagged = true;
-			    int hap = bam_aux2i(hpptr);
-			    if (hap == 1) ++spanMap[file_c][itSpan->id].alth1;
-			    else ++spanMap[file_c][itSpan->id].alth2;
-			  }
+			  if (hap == 1) ++spanMap[file_c][itSpan->id].alth1;
+			  else if (hap == 2) ++spanMap[file_c][itSpan->id].alth2;
 			}
 		      }
 		    }
@@ -691,7 +743,7 @@ namespace torali {
 	bam_destroy1(rec);
 	hts_itr_destroy(iter);
 	qualities.clear();
-	clip.clear();
+	qualitiestra.release(refIndex);
 	
 	// Assign fragment and base counts to SVs
 	for(uint32_t i = 0; i < svs.size(); ++i) {
@@ -747,6 +799,10 @@ namespace torali {
 	}
       }
     }
+    for(unsigned int file_c = 0; file_c < c.files.size(); ++file_c) {
+      if (haplotagged[file_c]) c.isHaplotagged = true;
+    }
+    
     // Clean-up
     for(unsigned int file_c = 0; file_c < c.files.size(); ++file_c) {
       bam_hdr_destroy(hdr[file_c]);
@@ -755,6 +811,15 @@ namespace torali {
     }
   }
 
+  template<typename TConfig, typename TSampleLibrary, typename TSVs, typename TCoverageCount, typename TCountMap, typename TSpanMap>
+  inline void
+  annotateCoverage(TConfig& c, TSampleLibrary& sampleLib, TSVs& svs, TCoverageCount& covCount, TCountMap& countMap, TSpanMap& spanMap) {
+    // Dump file
+    boost::iostreams::filtering_ostream dumpOut;
+    if (c.hasDumpFile) _dumpHeader(c, dumpOut);
+    annotateCoverage(c, sampleLib, svs, covCount, countMap, spanMap, 0, dumpOut);
+  }
+
 }
 
 #endif
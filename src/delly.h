@@ -28,6 +28,7 @@
 #include <htslib/faidx.h>
 #include <htslib/vcf.h>
 #include <htslib/sam.h>
+#include <htslib/bgzf.h>
 
 #include "version.h"
 #include "util.h"
@@ -38,6 +39,7 @@
 #include "split.h"
 #include "shortpe.h"
 #include "modvcf.h"
+#include "evidence.h"
 
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -64,12 +66,14 @@ namespace torali
     uint32_t maxReadSep;
     uint32_t minClip;
     uint32_t maxGenoReadCount;
+    uint32_t genoBatch;
     uint32_t minCliqueSize;
     float flankQuality;
     bool hasExcludeFile;
     bool hasVcfFile;
     bool isHaplotagged;
     bool hasDumpFile;
+    bool hasEvidenceFile;
     bool svtcmd;
     std::set<int32_t> svtset;
     DnaScore<int> aliscore;
@@ -78,11 +82,87 @@ namespace torali
     boost::filesystem::path genome;
     boost::filesystem::path exclude;
     boost::filesystem::path dumpfile;
+    boost::filesystem::path evidencefile;
     std::vector<boost::filesystem::path> files;
     std::vector<std::string> sampleName;
   };
 
 
+  template<typename TConfig, typename TSampleLibrary, typename TSVs>
+  inline void
+  _genotypeBatches(TConfig& c, TSampleLibrary& sampleLib, TSVs& svs) {
+    // Open one bam file header
+    samFile* samfile = sam_open(c.files[0].string().c_str(), "r");
+    hts_set_fai_filename(samfile, c.genome.string().c_str());
+    bam_hdr_t* bamhd = sam_hdr_read(samfile);
+
+    // The header is written before any batch is annotated, haplotype FORMAT fields are declared if the inputs carry HP tags
+    c.isHaplotagged = _probeHaplotagged(c, svs);
+
+    // Output file
+    htsFile *fp = hts_open(c.outfile.string().c_str(), "wb");
+    bcf_hdr_t *hdr = _vcfHeader(c, bamhd);
+    if (bcf_hdr_write(fp, hdr) != 0) std::cerr << "Error: Failed to write BCF header!" << std::endl;
+
+    // Evidence file
+    boost::iostreams::filtering_ostream evOut;
+    if (c.hasEvidenceFile) {
+      evOut.push(boost::iostreams::gzip_compressor());
+      evOut.push(boost::iostreams::file_sink(c.evidencefile.string().c_str(), std::ios_base::out | std::ios_base::binary));
+      _evidenceHeader(c, bamhd, svs, evOut);
+    }
+
+    // SV-read dump of all batches
+    boost::iostreams::filtering_ostream dumpOut;
+    if (c.hasDumpFile) _dumpHeader(c, dumpOut);
+
+    // Genomic batches of sorted SVs
+    uint32_t numBatches = (svs.size() - 1) / c.genoBatch + 1;
+    for(uint32_t b = 0; b < svs.size(); b += c.genoBatch) {
+      boost::posix_time::ptime now = boost::posix_time::second_clock::local_time();
+      std::cout << '[' << boost::posix_time::to_simple_string(now) << "] " << "Genotyping batch " << (b / c.genoBatch + 1) << '/' << numBatches << std::endl;
+
+      // Batch SVs with local ids
+      TSVs batch(svs.begin() + b, svs.begin() + std::min((std::size_t) (b + c.genoBatch), svs.size()));
+      for(uint32_t i = 0; i < batch.size(); ++i) batch[i].id = i;
+
+      // Annotate junction reads, spanning coverage and read-depth of this batch
+      typedef std::vector<JunctionCount> TSVJunctionMap;
+      typedef std::vector<TSVJunctionMap> TSampleSVJunctionMap;
+      TSampleSVJunctionMap jctMap;
+      typedef std::vector<SpanningCount> TSVSpanningMap;
+      typedef std::vector<TSVSpanningMap> TSampleSVSpanningMap;
+      TSampleSVSpanningMap spanMap;
+      typedef std::vector<ReadCount> TSVReadCount;
+      typedef std::vector<TSVReadCount> TSampleSVReadCount;
+      TSampleSVReadCount rcMap;
+      annotateCoverage(c, sampleLib, batch, rcMap, jctMap, spanMap, b, dumpOut);
+
+      _vcfRecords(c, fp, hdr, bamhd, batch, jctMap, rcMap, spanMap, b);
+      if (c.hasEvidenceFile) _evidenceSites(evOut, batch.size(), jctMap, rcMap, spanMap);
+
+      // Flush so that finished batches are readable
+      bgzf_flush(fp->fp.bgzf);
+    }
+
+    // Clean-up
+    if (c.hasEvidenceFile) {
+      evOut.pop();
+      evOut.pop();
+    }
+    if (c.hasDumpFile) {
+      dumpOut.pop();
+      dumpOut.pop();
+    }
+    bam_hdr_destroy(bamhd);
+    sam_close(samfile);
+    bcf_hdr_destroy(hdr);
+    hts_close(fp);
+
+    // Build index
+    bcf_index_build(c.outfile.string().c_str(), 14);
+  }
+
   template<typename TConfigStruct>
   inline int dellyRun(TConfigStruct& c) {
 #ifdef PROFILE
@@ -158,26 +238,34 @@ namespace torali
     uint32_t cliqueCount = 0;
     for(typename TVariants::iterator svIt = svs.begin(); svIt != svs.end(); ++svIt, ++cliqueCount) svIt->id = cliqueCount;
     
-    // Annotate junction reads
-    typedef std::vector<JunctionCount> TSVJunctionMap;
-    typedef std::vector<TSVJunctionMap> TSampleSVJunctionMap;
-    TSampleSVJunctionMap jctMap;
+    if ((c.genoBatch) && (svs.size() > c.genoBatch)) {
+      // SV Genotyping and VCF output in batches
+      _genotypeBatches(c, sampleLib, svs);
+    } else {
+      // Annotate junction reads
+      typedef std::vector<JunctionCount> TSVJunctionMap;
+      typedef std::vector<TSVJunctionMap> TSampleSVJunctionMap;
+      TSampleSVJunctionMap jctMap;
     
-    // Annotate spanning coverage
-    typedef std::vector<SpanningCount> TSVSpanningMap;
-    typedef std::vector<TSVSpanningMap> TSampleSVSpanningMap;
-    TSampleSVSpanningMap spanMap;
-
-    // Annotate coverage
-    typedef std::vector<ReadCount> TSVReadCount;
-    typedef std::vector<TSVReadCount> TSampleSVReadCount;
-    TSampleSVReadCount rcMap;
+      // Annotate spanning coverage
+      typedef std::vector<SpanningCount> TSVSpanningMap;
+      typedef std::vector<TSVSpanningMap> TSampleSVSpanningMap;
+      TSampleSVSpanningMap spanMap;
+
+      // Annotate coverage
+      typedef std::vector<ReadCount> TSVReadCount;
+      typedef std::vector<TSVReadCount> TSampleSVReadCount;
+      TSampleSVReadCount rcMap;
     
-    // SV Genotyping
-    if (!svs.empty()) annotateCoverage(c, sampleLib, svs, rcMap, jctMap, spanMap);
+      // SV Genotyping
+      if (!svs.empty()) annotateCoverage(c, sampleLib, svs, rcMap, jctMap, spanMap);
     
-    // VCF output
-    vcfOutput(c, svs, jctMap, rcMap, spanMap);
+      // VCF output
+      vcfOutput(c, svs, jctMap, rcMap, spanMap);
+
+      // Per-sample evidence for delly combine
+      if (c.hasEvidenceFile) evidenceOutput(c, svs, jctMap, rcMap, spanMap);
+    }
     
     // Output library statistics
     boost::posix_time::ptime now = boost::posix_time::second_clock::local_time();
@@ -230,6 +318,8 @@ namespace torali
       ("vcffile,v", boost::program_options::value<boost::filesystem::path>(&c.vcffile), "input VCF/BCF file for genotyping")
       ("geno-qual,u", boost::program_options::value<uint16_t>(&c.minGenoQual)->default_value(5), "min. mapping quality for genotyping")
       ("dump,d", boost::program_options::value<boost::filesystem::path>(&c.dumpfile), "gzipped output file for SV-reads (optional)")
+      ("evidence,e", boost::program_options::value<boost::filesystem::path>(&c.evidencefile), "binary evidence output file for delly combine (requires -v)")
+      ("batch,b", boost::program_options::value<uint32_t>(&c.genoBatch)->default_value(0), "genotype and write SVs in genomic batches of this size (0: all at once)")
       ;
 
     // Define hidden options
@@ -267,6 +357,8 @@ namespace torali
     // Dump PE and SR support?
     if (vm.count("dump")) c.hasDumpFile = true;
     else c.hasDumpFile = false;
+    if (vm.count("evidence")) c.hasEvidenceFile = true;
+    else c.hasEvidenceFile = false;
 
     // Clique size
     if (c.minCliqueSize < 2) c.minCliqueSize = 2;
@@ -374,6 +466,12 @@ namespace torali
       bcf_close(ifile);
       c.hasVcfFile = true;
     } else c.hasVcfFile = false;
+
+    // Evidence files are only combinable for a fixed site panel
+    if ((c.hasEvidenceFile) && (!c.hasVcfFile)) {
+      std::cerr << "Evidence output (-e) requires a site panel (-v)!" << std::endl;
+      return 1;
+    }
     
     // Check output directory
     if (!_outfileValid(c.outfile)) return 1;
@@ -0,0 +1,431 @@
+#ifndef EVIDENCE_H
+#define EVIDENCE_H
+
+#include <iostream>
+#include <fstream>
+
+#include <boost/program_options/cmdline.hpp>
+#include <boost/program_options/options_description.hpp>
+#include <boost/program_options/parsers.hpp>
+#include <boost/program_options/variables_map.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include <boost/iostreams/device/file.hpp>
+#include <boost/iostreams/filtering_stream.hpp>
+#include <boost/iostreams/filter/gzip.hpp>
+#include <boost/filesystem.hpp>
+
+#include <htslib/faidx.h>
+#include <htslib/sam.h>
+#include <htslib/vcf.h>
+
+#include "version.h"
+#include "util.h"
+#include "tags.h"
+#include "coverage.h"
+#include "modvcf.h"
+
+namespace torali
+{
+
+  // Binary evidence file
+  //
+  // gzip stream of: magic, version, site-panel hash, #sites, haplotag flag, contigs, samples,
+  // followed site-major by ReadCount, JunctionCount and SpanningCount of every sample.
+  // Integers are little-endian.
+  #ifndef DELLY_EVIDENCE_MAGIC
+  #define DELLY_EVIDENCE_MAGIC "DELLYEVD"
+  #endif
+
+  #ifndef DELLY_EVIDENCE_VERSION
+  #define DELLY_EVIDENCE_VERSION 3
+  #endif
+
+  struct CombineConfig {
+    bool isHaplotagged;
+    uint32_t genoBatch;
+    boost::filesystem::path outfile;
+    boost::filesystem::path vcffile;
+    boost::filesystem::path genome;
+    std::vector<boost::filesystem::path> evidence;
+    std::vector<boost::filesystem::path> files; // One entry per sample
+    std::vector<std::string> sampleName;
+  };
+
+
+  inline void
+  _writeHistogram(std::ostream& out, QualityHistogram const& hist) {
+    _writeBin(out, (uint32_t) hist.qc.size());
+    for(QualityHistogram::const_iterator it = hist.begin(); it != hist.end(); ++it) {
+      _writeBin(out, it->first);
+      _writeBin(out, it->second);
+    }
+  }
+
+  inline void
+  _readHistogram(std::istream& in, QualityHistogram& hist) {
+    uint32_t n = 0;
+    _readBin(in, n);
+    hist.qc.resize(n);
+    hist.total = 0;
+    for(uint32_t i = 0; i < n; ++i) {
+      _readBin(in, hist.qc[i].first);
+      _readBin(in, hist.qc[i].second);
+      hist.total += hist.qc[i].second;
+    }
+  }
+
+  template<typename TCount>
+  inline void
+  _writeSupport(std::ostream& out, TCount const& cnt) {
+    _writeBin(out, cnt.refh1);
+    _writeBin(out, cnt.refh2);
+    _writeBin(out, cnt.alth1);
+    _writeBin(out, cnt.alth2);
+    _writeHistogram(out, cnt.ref);
+    _writeHistogram(out, cnt.alt);
+  }
+
+  template<typename TCount>
+  inline void
+  _readSupport(std::istream& in, TCount& cnt) {
+    _readBin(in, cnt.refh1);
+    _readBin(in, cnt.refh2);
+    _readBin(in, cnt.alth1);
+    _readBin(in, cnt.alth2);
+    _readHistogram(in, cnt.ref);
+    _readHistogram(in, cnt.alt);
+  }
+
+  // 64-bit FNV-1a over the little-endian bytes of an integer
+  template<typename TValue>
+  inline void
+  _fnv1a(uint64_t& h, TValue const val) {
+    uint64_t v = (uint64_t) val;
+    for(uint32_t i = 0; i < sizeof(TValue); ++i) {
+      h ^= (v >> (8 * i)) & 0xff;
+      h *= 1099511628211ULL;
+    }
+  }
+
+  inline void
+  _fnv1a(uint64_t& h, std::string const& str) {
+    _fnv1a(h, (uint32_t) str.size());
+    for(uint32_t i = 0; i < str.size(); ++i) {
+      h ^= (uint8_t) str[i];
+      h *= 1099511628211ULL;
+    }
+  }
+
+  // Hash of everything in the parsed site panel that genotyping depends on, stable across platforms
+  template<typename TSVs>
+  inline uint64_t
+  _panelHash(bam_hdr_t const* hdr, TSVs const& svs) {
+    uint64_t h = 14695981039346656037ULL;
+    for(int32_t refIndex = 0; refIndex < hdr->n_targets; ++refIndex) {
+      _fnv1a(h, std::string(hdr->target_name[refIndex]));
+      _fnv1a(h, (uint32_t) hdr->target_len[refIndex]);
+    }
+    for(typename TSVs::const_iterator itSV = svs.begin(); itSV != svs.end(); ++itSV) {
+      _fnv1a(h, (int32_t) itSV->chr);
+      _fnv1a(h, (int32_t) itSV->svStart);
+      _fnv1a(h, (int32_t) itSV->chr2);
+      _fnv1a(h, (int32_t) itSV->svEnd);
+      _fnv1a(h, (int32_t) itSV->svt);
+      _fnv1a(h, (uint8_t) itSV->precise);
+      _fnv1a(h, (int32_t) itSV->insLen);
+      _fnv1a(h, (int32_t) itSV->homLen);
+      _fnv1a(h, (int32_t) itSV->peSupport);
+      _fnv1a(h, (int32_t) itSV->srSupport);
+      _fnv1a(h, itSV->consensus);
+    }
+    return h;
+  }
+
+  template<typename TConfig, typename TSVs>
+  inline void
+  _evidenceHeader(TConfig const& c, bam_hdr_t const* hdr, TSVs const& svs, std::ostream& out) {
+    out.write(DELLY_EVIDENCE_MAGIC, 8);
+    _writeBin(out, (uint32_t) DELLY_EVIDENCE_VERSION);
+    _writeBin(out, _panelHash(hdr, svs));
+    _writeBin(out, (uint32_t) svs.size());
+    _writeBin(out, (uint8_t) c.isHaplotagged);
+    _writeBin(out, (uint32_t) hdr->n_targets);
+    for(int32_t refIndex = 0; refIndex < hdr->n_targets; ++refIndex) {
+      _writeString(out, std::string(hdr->target_name[refIndex]));
+      _writeBin(out, (uint32_t) hdr->target_len[refIndex]);
+    }
+    _writeBin(out, (uint32_t) c.files.size());
+    for(uint32_t file_c = 0; file_c < c.files.size(); ++file_c) _writeString(out, c.sampleName[file_c]);
+  }
+
+  template<typename TJunctionCountMap, typename TReadCountMap, typename TCountMap>
+  inline void
+  _evidenceSites(std::ostream& out, uint32_t const nsites, TJunctionCountMap const& jctCountMap, TReadCountMap const& readCountMap, TCountMap const& spanCountMap) {
+    for(uint32_t id = 0; id < nsites; ++id) {
+      for(uint32_t file_c = 0; file_c < readCountMap.size(); ++file_c) {
+	_writeBin(out, readCountMap[file_c][id].leftRC);
+	_writeBin(out, readCountMap[file_c][id].rc);
+	_writeBin(out, readCountMap[file_c][id].rightRC);
+	_writeSupport(out, jctCountMap[file_c][id]);
+	_writeSupport(out, spanCountMap[file_c][id]);
+      }
+    }
+  }
+
+  template<typename TConfig, typename TSVs, typename TJunctionCountMap, typename TReadCountMap, typename TCountMap>
+  inline void
+  evidenceOutput(TConfig const& c, TSVs const& svs, TJunctionCountMap const& jctCountMap, TReadCountMap const& readCountMap, TCountMap const& spanCountMap) {
+    samFile* samfile = sam_open(c.files[0].string().c_str(), "r");
+    bam_hdr_t* bamhd = sam_hdr_read(samfile);
+    boost::iostreams::filtering_ostream evOut;
+    evOut.push(boost::iostreams::gzip_compressor());
+    evOut.push(boost::iostreams::file_sink(c.evidencefile.string().c_str(), std::ios_base::out | std::ios_base::binary));
+    _evidenceHeader(c, bamhd, svs, evOut);
+    _evidenceSites(evOut, svs.size(), jctCountMap, readCountMap, spanCountMap);
+    evOut.pop();
+    evOut.pop();
+    bam_hdr_destroy(bamhd);
+    sam_close(samfile);
+  }
+
+
+  // Evidence file header as read back by combine
+  struct EvidenceHeader {
+    bool isHaplotagged;
+    uint64_t panelHash;
+    uint32_t nsites;
+    std::string contigs; // SAM @SQ header text
+    std::vector<std::string> samples;
+  };
+
+  inline bool
+  _readEvidenceHeader(std::istream& in, EvidenceHeader& eh) {
+    char magic[8];
+    in.read(magic, 8);
+    if ((!in) || (std::string(magic, 8) != DELLY_EVIDENCE_MAGIC)) return false;
+    uint32_t version = 0;
+    _readBin(in, version);
+    if (version != DELLY_EVIDENCE_VERSION) return false;
+    _readBin(in, eh.panelHash);
+    _readBin(in, eh.nsites);
+    uint8_t hp = 0;
+    _readBin(in, hp);
+    eh.isHaplotagged = hp;
+    uint32_t ncontigs = 0;
+    _readBin(in, ncontigs);
+    eh.contigs.clear();
+    for(uint32_t i = 0; i < ncontigs; ++i) {
+      std::string name;
+      _readString(in, name);
+      uint32_t len = 0;
+      _readBin(in, len);
+      eh.contigs += "@SQ\tSN:" + name + "\tLN:" + boost::lexical_cast<std::string>(len) + "\n";
+    }
+    uint32_t nsamples = 0;
+    _readBin(in, nsamples);
+    eh.samples.resize(nsamples);
+    for(uint32_t i = 0; i < nsamples; ++i) _readString(in, eh.samples[i]);
+    return (bool) in;
+  }
+
+  template<typename TConfig, typename TSVs>
+  inline void
+  _setAlleles(TConfig const& c, bam_hdr_t* hdr, TSVs& svs) {
+    faidx_t* fai = fai_load(c.genome.string().c_str());
+    for(int32_t refIndex=0; refIndex < (int32_t) hdr->n_targets; ++refIndex) {
+      char* seq = NULL;
+      for(typename TSVs::iterator itSV = svs.begin(); itSV != svs.end(); ++itSV) {
+	if (itSV->chr != refIndex) continue;
+	// Lazy loading of reference sequence
+	if (seq == NULL) {
+	  int32_t seqlen = -1;
+	  std::string tname(hdr->target_name[refIndex]);
+	  seq = faidx_fetch_seq(fai, tname.c_str(), 0, hdr->target_len[refIndex], &seqlen);
+	}
+	itSV->alleles = _addAlleles(boost::to_upper_copy(std::string(seq + itSV->svStart - 1, seq + itSV->svStart)), std::string(hdr->target_name[itSV->chr2]), *itSV, itSV->svt);
+      }
+      if (seq != NULL) free(seq);
+    }
+    fai_destroy(fai);
+  }
+
+  inline void
+  _closeEvidence(std::vector<boost::iostreams::filtering_istream*>& evIn) {
+    for(uint32_t ev = 0; ev < evIn.size(); ++ev) {
+      if (evIn[ev] != NULL) delete evIn[ev];
+      evIn[ev] = NULL;
+    }
+  }
+
+  template<typename TConfig>
+  inline int
+  combineRun(TConfig& c) {
+    // Open evidence files
+    typedef boost::iostreams::filtering_istream TEvidenceStream;
+    std::vector<TEvidenceStream*> evIn(c.evidence.size(), NULL);
+    std::vector<uint32_t> nsamples(c.evidence.size());
+    EvidenceHeader first;
+    c.isHaplotagged = false;
+    for(uint32_t ev = 0; ev < c.evidence.size(); ++ev) {
+      evIn[ev] = new TEvidenceStream();
+      evIn[ev]->push(boost::iostreams::gzip_decompressor());
+      evIn[ev]->push(boost::iostreams::file_source(c.evidence[ev].string().c_str(), std::ios_base::in | std::ios_base::binary));
+      EvidenceHeader eh;
+      if (!_readEvidenceHeader(*evIn[ev], eh)) {
+	std::cerr << "Error: " << c.evidence[ev].string() << " is not a delly evidence file!" << std::endl;
+	_closeEvidence(evIn);
+	return 1;
+      }
+      if (!ev) first = eh;
+      else if ((eh.panelHash != first.panelHash) || (eh.nsites != first.nsites)) {
+	std::cerr << "Error: " << c.evidence[ev].string() << " was genotyped with a different site panel than " << c.evidence[0].string() << std::endl;
+	_closeEvidence(evIn);
+	return 1;
+      }
+      if (eh.isHaplotagged) c.isHaplotagged = true;
+      nsamples[ev] = eh.samples.size();
+      for(uint32_t k = 0; k < eh.samples.size(); ++k) {
+	c.sampleName.push_back(eh.samples[k]);
+	c.files.push_back(c.evidence[ev]);
+      }
+    }
+
+    // Site panel
+    bam_hdr_t* bamhd = sam_hdr_parse(first.contigs.size(), first.contigs.c_str());
+    typedef std::vector<StructuralVariantRecord> TVariants;
+    TVariants svs;
+    vcfParse(c, bamhd, svs);
+    sort(svs.begin(), svs.end(), SortSVs<StructuralVariantRecord>());
+    uint32_t cliqueCount = 0;
+    for(typename TVariants::iterator svIt = svs.begin(); svIt != svs.end(); ++svIt, ++cliqueCount) svIt->id = cliqueCount;
+    if ((svs.size() != first.nsites) || (_panelHash(bamhd, svs) != first.panelHash)) {
+      std::cerr << "Error: Evidence files were not generated with site panel " << c.vcffile.string() << std::endl;
+      bam_hdr_destroy(bamhd);
+      _closeEvidence(evIn);
+      return 1;
+    }
+    _setAlleles(c, bamhd, svs);
+
+    // Output file
+    htsFile *fp = hts_open(c.outfile.string().c_str(), "wb");
+    bcf_hdr_t *hdr = _vcfHeader(c, bamhd);
+    if (bcf_hdr_write(fp, hdr) != 0) std::cerr << "Error: Failed to write BCF header!" << std::endl;
+
+    // Combine site batches
+    uint32_t batchSize = c.genoBatch;
+    if ((!batchSize) || (batchSize > svs.size())) batchSize = std::max((std::size_t) 1, svs.size());
+    bool valid = true;
+    for(uint32_t b = 0; ((valid) && (b < svs.size())); b += batchSize) {
+      TVariants batch(svs.begin() + b, svs.begin() + std::min((std::size_t) (b + batchSize), svs.size()));
+      for(uint32_t i = 0; i < batch.size(); ++i) batch[i].id = i;
+
+      // Read evidence of all samples
+      std::vector<std::vector<JunctionCount> > jctMap(c.files.size(), std::vector<JunctionCount>(batch.size()));
+      std::vector<std::vector<SpanningCount> > spanMap(c.files.size(), std::vector<SpanningCount>(batch.size()));
+      std::vector<std::vector<ReadCount> > rcMap(c.files.size(), std::vector<ReadCount>(batch.size()));
+      for(uint32_t i = 0; i < batch.size(); ++i) {
+	uint32_t file_c = 0;
+	for(uint32_t ev = 0; ev < c.evidence.size(); ++ev) {
+	  for(uint32_t k = 0; k < nsamples[ev]; ++k, ++file_c) {
+	    _readBin(*evIn[ev], rcMap[file_c][i].leftRC);
+	    _readBin(*evIn[ev], rcMap[file_c][i].rc);
+	    _readBin(*evIn[ev], rcMap[file_c][i].rightRC);
+	    _readSupport(*evIn[ev], jctMap[file_c][i]);
+	    _readSupport(*evIn[ev], spanMap[file_c][i]);
+	  }
+	}
+      }
+      for(uint32_t ev = 0; ev < c.evidence.size(); ++ev) {
+	if (!(*evIn[ev])) {
+	  std::cerr << "Error: Truncated evidence file " << c.evidence[ev].string() << std::endl;
+	  valid = false;
+	  break;
+	}
+      }
+      if (valid) _vcfRecords(c, fp, hdr, bamhd, batch, jctMap, rcMap, spanMap, b);
+    }
+
+    // Clean-up
+    _closeEvidence(evIn);
+    bam_hdr_destroy(bamhd);
+    bcf_hdr_destroy(hdr);
+    hts_close(fp);
+    if (!valid) return 1;
+
+    // Build index
+    bcf_index_build(c.outfile.string().c_str(), 14);
+
+    // End
+    boost::posix_time::ptime now = boost::posix_time::second_clock::local_time();
+    std::cout << '[' << boost::posix_time::to_simple_string(now) << "] Done." << std::endl;
+    return 0;
+  }
+
+  int combine(int argc, char **argv) {
+    CombineConfig c;
+
+    // Define generic options
+    boost::program_options::options_description generic("Generic options");
+    generic.add_options()
+      ("help,?", "show help message")
+      ("genome,g", boost::program_options::value<boost::filesystem::path>(&c.genome), "genome fasta file")
+      ("vcffile,v", boost::program_options::value<boost::filesystem::path>(&c.vcffile), "site panel VCF/BCF file used for genotyping")
+      ("outfile,o", boost::program_options::value<boost::filesystem::path>(&c.outfile)->default_value("sv.bcf"), "SV BCF output file")
+      ("batch,b", boost::program_options::value<uint32_t>(&c.genoBatch)->default_value(10000), "number of sites combined at once")
+      ;
+
+    // Define hidden options
+    boost::program_options::options_description hidden("Hidden options");
+    hidden.add_options()
+      ("input-file", boost::program_options::value< std::vector<boost::filesystem::path> >(&c.evidence), "input file")
+      ;
+    boost::program_options::positional_options_description pos_args;
+    pos_args.add("input-file", -1);
+
+    // Set the visibility
+    boost::program_options::options_description cmdline_options;
+    cmdline_options.add(generic).add(hidden);
+    boost::program_options::options_description visible_options;
+    visible_options.add(generic);
+    boost::program_options::variables_map vm;
+    boost::program_options::store(boost::program_options::command_line_parser(argc, argv).options(cmdline_options).positional(pos_args).run(), vm);
+    boost::program_options::notify(vm);
+
+    // Check command line arguments
+    if ((vm.count("help")) || (!vm.count("input-file")) || (!vm.count("genome")) || (!vm.count("vcffile"))) {
+      std::cout << std::endl;
+      std::cout << "Usage: delly " << argv[0] << " [OPTIONS] -g <ref.fa> -v <sites.bcf> <sample1.evd> <sample2.evd> ..." << std::endl;
+      std::cout << visible_options << "\n";
+      return 0;
+    }
+
+    // Check input files
+    if (!(boost::filesystem::exists(c.genome) && boost::filesystem::is_regular_file(c.genome) && boost::filesystem::file_size(c.genome))) {
+      std::cerr << "Reference file is missing: " << c.genome.string() << std::endl;
+      return 1;
+    }
+    if (!(boost::filesystem::exists(c.vcffile) && boost::filesystem::is_regular_file(c.vcffile) && boost::filesystem::file_size(c.vcffile))) {
+      std::cerr << "Input VCF/BCF file is missing: " << c.vcffile.string() << std::endl;
+      return 1;
+    }
+    for(uint32_t ev = 0; ev < c.evidence.size(); ++ev) {
+      if (!(boost::filesystem::exists(c.evidence[ev]) && boost::filesystem::is_regular_file(c.evidence[ev]) && boost::filesystem::file_size(c.evidence[ev]))) {
+	std::cerr << "Evidence file is missing: " << c.evidence[ev].string() << std::endl;
+	return 1;
+      }
+    }
+    if (!_outfileValid(c.outfile)) return 1;
+
+    // Show cmd
+    boost::posix_time::ptime now = boost::posix_time::second_clock::local_time();
+    std::cout << '[' << boost::posix_time::to_simple_string(now) << "] ";
+    std::cout << "delly ";
+    for(int i=0; i<argc; ++i) { std::cout << argv[i] << ' '; }
+    std::cout << std::endl;
+
+    return combineRun(c);
+  }
+
+}
+
+#endif
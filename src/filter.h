@@ -49,6 +49,7 @@ struct FilterConfig {
   int32_t minsize;
   int32_t maxsize;
   int32_t coverage;
+  uint32_t threads;
   float ratiogeno;
   float altaf;
   float controlcont;
@@ -64,16 +65,173 @@ struct FilterConfig {
 };
 
 
+// Header IDs and per-thread buffers of the filter workers
+struct FilterFields {
+  int32_t svtId;
+  int32_t endId;
+  int32_t inslenId;
+  int32_t preciseId;
+  std::string svt;
+  SVFormat fmt;
+};
+
+
+// Filter a single record, updates the INFO fields of passing records (hdr_out is only read)
+template<typename TFilterConfig>
+inline bool
+_filterRecord(TFilterConfig const& c, bcf_hdr_t* hdr, bcf_hdr_t* hdr_out, bcf1_t* rec, FilterFields& b) {
+  bool germline = false;
+  if (c.filter == "germline") germline = true;
+  bcf_unpack(rec, BCF_UN_INFO);
+
+  // Check SV type
+  if (!_getInfoString(rec, b.svtId, b.svt)) return false;
+  std::string const& svt = b.svt;
+
+  // Check size and PASS
+  bool pass = true;
+  if (c.filterForPass) pass = (bcf_has_filter(hdr, rec, const_cast<char*>("PASS"))==1);
+  if (!pass) return false;
+  int32_t svlen = 1;
+  int32_t val = 0;
+  if (_getInfoInt32(rec, b.endId, val)) svlen = val - rec->pos;
+  int32_t inslenVal = 0;
+  if (_getInfoInt32(rec, b.inslenId, val)) inslenVal = val;
+  if (!((svt == "BND") || ((svt == "INS") && (inslenVal >= c.minsize) && (inslenVal <= c.maxsize)) || ((svt != "BND") && (svt != "INS") && (svlen >= c.minsize) && (svlen <= c.maxsize)))) return false;
+
+  // Check genotypes
+  bool precise = _getInfoFlag(rec, b.preciseId);
+  SVFormat& f = b.fmt;
+  if ((!_getFormatInt32(rec, f.gt)) || (f.gt.n < 2)) return false;
+  if ((!_getFormatInt32(rec, f.rc)) || (!_getFormatInt32(rec, f.dv)) || (!_getFormatInt32(rec, f.dr)) || (!_getFormatInt32(rec, f.rv)) || (!_getFormatInt32(rec, f.rr))) return false;
+  bool hasGq = _getFormat(rec, f.gq);
+  bool rclr = ((_getFormatInt32(rec, f.rcl)) && (_getFormatInt32(rec, f.rcr)));
+  std::vector<float> rcraw;
+  std::vector<float> rcControl;
+  std::vector<float> rcTumor;
+  std::vector<float> rcAlt;
+  std::vector<float> rRefVar;
+  std::vector<float> rAltVar;
+  std::vector<float> gqRef;
+  std::vector<float> gqAlt;
+  uint32_t nCount = 0;
+  uint32_t tCount = 0;
+  uint32_t controlpass = 0;
+  uint32_t tumorpass = 0;
+  int32_t ac[2];
+  ac[0] = 0;
+  ac[1] = 0;
+  for (int i = 0; i < bcf_hdr_nsamples(hdr); ++i) {
+    int32_t const* gt = _formatInt32(f.gt, i);
+    if ((bcf_gt_allele(gt[0]) != -1) && (bcf_gt_allele(gt[1]) != -1)) {
+      int gt_type = bcf_gt_allele(gt[0]) + bcf_gt_allele(gt[1]);
+      ++ac[bcf_gt_allele(gt[0])];
+      ++ac[bcf_gt_allele(gt[1])];
+      int32_t rc = *_formatInt32(f.rc, i);
+      int32_t dv = *_formatInt32(f.dv, i);
+      int32_t dr = *_formatInt32(f.dr, i);
+      int32_t rv = *_formatInt32(f.rv, i);
+      int32_t rr = *_formatInt32(f.rr, i);
+      int32_t rcFlank = 0;
+      if (rclr) rcFlank = *_formatInt32(f.rcl, i) + *_formatInt32(f.rcr, i);
+      if ((germline) || (c.controlSet.find(hdr->samples[i]) != c.controlSet.end())) {
+	// Control or population genomics
+	++nCount;
+	if (gt_type == 0) {
+	  rcraw.push_back(rc);
+	  if (hasGq) gqRef.push_back(_formatValue(f.gq, i));
+	  if (rcFlank != 0) rcControl.push_back((float) rc / ((float) rcFlank));
+	  else rcControl.push_back(rc);
+	  float rVar = 0;
+	  if (!precise) rVar = (float) dv / (float) (dr + dv);
+	  else rVar = (float) rv / (float) (rr + rv);
+	  rRefVar.push_back(rVar);
+	  if (rVar <= c.controlcont) ++controlpass;
+	} else if ((germline) && (gt_type >= 1)) {
+	  if (hasGq) gqAlt.push_back(_formatValue(f.gq, i));
+	  if (rcFlank != 0) rcAlt.push_back((float) rc / ((float) rcFlank));
+	  else rcAlt.push_back(rc);
+	  float rVar = 0;
+	  if (!precise) rVar = (float) dv / (float) (dr + dv);
+	  else rVar = (float) rv / (float) (rr + rv);
+	  rAltVar.push_back(rVar);
+	}
+      } else if ((!germline) && (c.tumorSet.find(hdr->samples[i]) != c.tumorSet.end())) {
+	// Tumor
+	++tCount;
+	if (rcFlank != 0) rcTumor.push_back((float) rc / ((float) rcFlank));
+	else rcTumor.push_back(rc);
+	if (!precise) {
+	  if ((((float) dv / (float) (dr + dv)) >= c.altaf) && (dr + dv >= c.coverage)) ++tumorpass;
+	} else {
+	  if ((((float) rv / (float) (rr + rv)) >= c.altaf) && (rr + rv >= c.coverage)) ++tumorpass;
+	}
+      }
+    }
+  }
+  if (c.filter == "somatic") {
+    float genotypeRatio = (float) (nCount + tCount) / (float) (c.controlSet.size() + c.tumorSet.size());
+    if ((controlpass) && (tumorpass) && (controlpass == nCount) && (genotypeRatio >= c.ratiogeno)) {
+      float rccontrolmed = 0;
+      getMedian(rcControl.begin(), rcControl.end(), rccontrolmed);
+      float rctumormed = 0;
+      getMedian(rcTumor.begin(), rcTumor.end(), rctumormed);
+      float rdRatio = 1;
+      if (rccontrolmed != 0) rdRatio = rctumormed/rccontrolmed;
+      _remove_info_tag(hdr_out, rec, "RDRATIO");
+      bcf_update_info_float(hdr_out, rec, "RDRATIO", &rdRatio, 1);
+      _remove_info_tag(hdr_out, rec, "SOMATIC");
+      bcf_update_info_flag(hdr_out, rec, "SOMATIC", NULL, 1);
+      return true;
+    }
+  } else if (c.filter == "germline") {
+    float genotypeRatio = (float) (nCount + tCount) / (float) (bcf_hdr_nsamples(hdr));
+    float rrefvarpercentile = 0;
+    if (!rRefVar.empty()) getPercentile(rRefVar, 0.9, rrefvarpercentile);
+    float raltvarmed = 0;
+    if (!rAltVar.empty()) getMedian(rAltVar.begin(), rAltVar.end(), raltvarmed);
+    float rccontrolmed = 0;
+    if (!rcControl.empty()) getMedian(rcControl.begin(), rcControl.end(), rccontrolmed);
+    float rcaltmed = 0;
+    if (!rcAlt.empty()) getMedian(rcAlt.begin(), rcAlt.end(), rcaltmed);
+    float rdRatio = 1;
+    if (rccontrolmed != 0) rdRatio = rcaltmed/rccontrolmed;
+    float gqaltmed = 0;
+    if (!gqAlt.empty()) getMedian(gqAlt.begin(), gqAlt.end(), gqaltmed);
+    float gqrefmed = 0;
+    if (!gqRef.empty()) getMedian(gqRef.begin(), gqRef.end(), gqrefmed);
+    float af = (float) ac[1] / (float) (ac[0] + ac[1]);
+
+    //std::cerr << bcf_hdr_id2name(hdr, rec->rid) << '\t' << (rec->pos + 1) << '\t' << (svlen + rec->pos) << '\t' << rec->d.id << '\t' << svlen << '\t' << ac[1] << '\t' << af << '\t' << genotypeRatio << '\t' << svt << '\t' << precise << '\t' << rrefvarpercentile << '\t' << raltvarmed << '\t' << gqrefmed << '\t' << gqaltmed << '\t' << rdRatio << std::endl;
+
+    if ((af>0) && (gqaltmed >= c.gq) && (gqrefmed >= c.gq) && (raltvarmed >= c.altaf) && (genotypeRatio >= c.ratiogeno)) {
+      if ((svt=="DEL") && (rdRatio > c.rddel)) return false;
+      if ((svt=="DUP") && (rdRatio < c.rddup)) return false;
+      if ((svt!="DEL") && (svt!="DUP") && (rrefvarpercentile > 0)) return false;
+      _remove_info_tag(hdr_out, rec, "RDRATIO");
+      bcf_update_info_float(hdr_out, rec, "RDRATIO", &rdRatio, 1);
+      return true;
+    }
+  }
+  return false;
+}
+
+
 template<typename TFilterConfig>
 inline int
 filterRun(TFilterConfig const& c) {
 
   // Load bcf file
   htsFile* ifile = hts_open(c.vcffile.string().c_str(), "r");
-  bcf_hdr_t* hdr = bcf_hdr_read(ifile);
 
   // Open output VCF file
   htsFile *ofile = hts_open(c.outfile.string().c_str(), "wb");
+
+  // BGZF decompression and compression threads
+  htsThreadPool tpool;
+  _vcfThreadPool(ifile, ofile, tpool);
+
+  bcf_hdr_t* hdr = bcf_hdr_read(ifile);
   bcf_hdr_t *hdr_out = bcf_hdr_dup(hdr);
   if (c.filter == "somatic") {
     bcf_hdr_remove(hdr_out, BCF_HL_INFO, "RDRATIO");
@@ -86,200 +244,52 @@ filterRun(TFilterConfig const& c) {
   }
   if (bcf_hdr_write(ofile, hdr_out) != 0) std::cerr << "Error: Failed to write BCF header!" << std::endl;
 
-  // VCF fields
-  int32_t nsvend = 0;
-  int32_t* svend = NULL;
-  int32_t nsvt = 0;
-  char* svt = NULL;
-  int32_t ninslen = 0;
-  int32_t* inslen = NULL;
-  int ngt = 0;
-  int32_t* gt = NULL;
-  int ngq = 0;
-  int32_t* gq = NULL;
-  float* gqf = NULL;
-  int nrc = 0;
-  int32_t* rc = NULL;
-  int nrcl = 0;
-  int32_t* rcl = NULL;
-  int nrcr = 0;
-  int32_t* rcr = NULL;
-  int ndv = 0;
-  int32_t* dv = NULL;
-  int ndr = 0;
-  int32_t* dr = NULL;
-  int nrv = 0;
-  int32_t* rv = NULL;
-  int nrr = 0;
-  int32_t* rr = NULL;
-  bool germline = false;
-  if (c.filter == "germline") germline = true;
+  // Header IDs resolved once, copied into each worker
+  FilterFields fields;
+  fields.svtId = bcf_hdr_id2int(hdr, BCF_DT_ID, "SVTYPE");
+  fields.endId = bcf_hdr_id2int(hdr, BCF_DT_ID, "END");
+  fields.inslenId = bcf_hdr_id2int(hdr, BCF_DT_ID, "INSLEN");
+  fields.preciseId = bcf_hdr_id2int(hdr, BCF_DT_ID, "PRECISE");
+  _svFormat(hdr, fields.fmt);
 
-  // Parse BCF
+  // Parse BCF in batches: read, filter records in parallel, write in input order
   boost::posix_time::ptime now = boost::posix_time::second_clock::local_time();
   std::cout << '[' << boost::posix_time::to_simple_string(now) << "] " << "Filtering VCF/BCF file" << std::endl;
-  bcf1_t* rec = bcf_init1();
-  while (bcf_read(ifile, hdr, rec) == 0) {
-    bcf_unpack(rec, BCF_UN_INFO);
-
-    // Check SV type
-    bcf_get_info_string(hdr, rec, "SVTYPE", &svt, &nsvt);
-
-    // Check size and PASS
-    bcf_get_info_int32(hdr, rec, "END", &svend, &nsvend);
-    bool pass = true;
-    if (c.filterForPass) pass = (bcf_has_filter(hdr, rec, const_cast<char*>("PASS"))==1);
-    int32_t svlen = 1;
-    if (svend != NULL) svlen = *svend - rec->pos;
-    int32_t inslenVal = 0;
-    if (bcf_get_info_int32(hdr, rec, "INSLEN", &inslen, &ninslen) > 0) inslenVal = *inslen;
-    if ((pass) && ((std::string(svt) == "BND") || ((std::string(svt) == "INS") && (inslenVal >= c.minsize) && (inslenVal <= c.maxsize)) || ((std::string(svt) != "BND") && (std::string(svt) != "INS") && (svlen >= c.minsize) && (svlen <= c.maxsize)))) {
-      // Check genotypes
-      bcf_unpack(rec, BCF_UN_ALL);
-      bool precise = false;
-      if (bcf_get_info_flag(hdr, rec, "PRECISE", 0, 0) > 0) precise = true;
-      bcf_get_format_int32(hdr, rec, "GT", &gt, &ngt);
-      if (_getFormatType(hdr, "GQ") == BCF_HT_INT) bcf_get_format_int32(hdr, rec, "GQ", &gq, &ngq);
-      else if (_getFormatType(hdr, "GQ") == BCF_HT_REAL) bcf_get_format_float(hdr, rec, "GQ", &gqf, &ngq);
-      bcf_get_format_int32(hdr, rec, "RC", &rc, &nrc);
-      if (_isKeyPresent(hdr, "RCL")) bcf_get_format_int32(hdr, rec, "RCL", &rcl, &nrcl);
-      if (_isKeyPresent(hdr, "RCR")) bcf_get_format_int32(hdr, rec, "RCR", &rcr, &nrcr);
-      bcf_get_format_int32(hdr, rec, "DV", &dv, &ndv);
-      bcf_get_format_int32(hdr, rec, "DR", &dr, &ndr);
-      bcf_get_format_int32(hdr, rec, "RV", &rv, &nrv);
-      bcf_get_format_int32(hdr, rec, "RR", &rr, &nrr);
-      std::vector<float> rcraw;
-      std::vector<float> rcControl;
-      std::vector<float> rcTumor;
-      std::vector<float> rcAlt;
-      std::vector<float> rRefVar;
-      std::vector<float> rAltVar;
-      std::vector<float> gqRef;
-      std::vector<float> gqAlt;
-      uint32_t nCount = 0;
-      uint32_t tCount = 0;
-      uint32_t controlpass = 0;
-      uint32_t tumorpass = 0;
-      int32_t ac[2];
-      ac[0] = 0;
-      ac[1] = 0;
-      for (int i = 0; i < bcf_hdr_nsamples(hdr); ++i) {
-	if ((bcf_gt_allele(gt[i*2]) != -1) && (bcf_gt_allele(gt[i*2 + 1]) != -1)) {
-	  int gt_type = bcf_gt_allele(gt[i*2]) + bcf_gt_allele(gt[i*2 + 1]);
-	  ++ac[bcf_gt_allele(gt[i*2])];
-	  ++ac[bcf_gt_allele(gt[i*2 + 1])];
-	  if ((germline) || (c.controlSet.find(hdr->samples[i]) != c.controlSet.end())) {
-	    // Control or population genomics
-	    ++nCount;
-	    if (gt_type == 0) {
-	      rcraw.push_back(rc[i]);
-	      if (_getFormatType(hdr, "GQ") == BCF_HT_INT) gqRef.push_back(gq[i]);
-	      else if (_getFormatType(hdr, "GQ") == BCF_HT_REAL) gqRef.push_back(gqf[i]);
-	      if ((rcl != NULL) && (rcr != NULL) && (rcl[i] + rcr[i] != 0)) rcControl.push_back((float) rc[i] / ((float) (rcl[i] + rcr[i])));
-	      else rcControl.push_back(rc[i]);
-	      float rVar = 0;
-	      if (!precise) rVar = (float) dv[i] / (float) (dr[i] + dv[i]);
-	      else rVar = (float) rv[i] / (float) (rr[i] + rv[i]);
-	      rRefVar.push_back(rVar);
-	      if (rVar <= c.controlcont) ++controlpass;
-	    } else if ((germline) && (gt_type >= 1)) {
-	      if (_getFormatType(hdr, "GQ") == BCF_HT_INT) gqAlt.push_back(gq[i]);
-	      else if (_getFormatType(hdr, "GQ") == BCF_HT_REAL) gqAlt.push_back(gqf[i]);
-	      if ((rcl != NULL) && (rcr != NULL) && (rcl[i] + rcr[i] != 0)) rcAlt.push_back((float) rc[i] / ((float) (rcl[i] + rcr[i])));
-	      else rcAlt.push_back(rc[i]);
-	      float rVar = 0;
-	      if (!precise) rVar = (float) dv[i] / (float) (dr[i] + dv[i]);
-	      else rVar = (float) rv[i] / (float) (rr[i] + rv[i]);
-	      rAltVar.push_back(rVar);
-	    }
-	  } else if ((!germline) && (c.tumorSet.find(hdr->samples[i]) != c.tumorSet.end())) {
-	    // Tumor
-	    ++tCount;
-	    if ((rcl != NULL) && (rcr != NULL) && (rcl[i] + rcr[i] != 0)) rcTumor.push_back((float) rc[i] / ((float) (rcl[i] + rcr[i])));
-	    else rcTumor.push_back(rc[i]);
-	    if (!precise) {
-	      if ((((float) dv[i] / (float) (dr[i] + dv[i])) >= c.altaf) && (dr[i] + dv[i] >= c.coverage)) ++tumorpass;
-	    } else {
-	      if ((((float) rv[i] / (float) (rr[i] + rv[i])) >= c.altaf) && (rr[i] + rv[i] >= c.coverage)) ++tumorpass;
-	    }
-	  }
-	}
-      }
-      if (c.filter == "somatic") {
-	float genotypeRatio = (float) (nCount + tCount) / (float) (c.controlSet.size() + c.tumorSet.size());
-	if ((controlpass) && (tumorpass) && (controlpass == nCount) && (genotypeRatio >= c.ratiogeno)) {
-	  float rccontrolmed = 0;
-	  getMedian(rcControl.begin(), rcControl.end(), rccontrolmed);
-	  float rctumormed = 0;
-	  getMedian(rcTumor.begin(), rcTumor.end(), rctumormed);
-	  float rdRatio = 1;
-	  if (rccontrolmed != 0) rdRatio = rctumormed/rccontrolmed;
-	  _remove_info_tag(hdr_out, rec, "RDRATIO");
-	  bcf_update_info_float(hdr_out, rec, "RDRATIO", &rdRatio, 1);
-	  _remove_info_tag(hdr_out, rec, "SOMATIC");
-	  bcf_update_info_flag(hdr_out, rec, "SOMATIC", NULL, 1);
-	  bcf_write1(ofile, hdr_out, rec);
-	}
-      } else if (c.filter == "germline") {
-	float genotypeRatio = (float) (nCount + tCount) / (float) (bcf_hdr_nsamples(hdr));
-	float rrefvarpercentile = 0;
-	if (!rRefVar.empty()) getPercentile(rRefVar, 0.9, rrefvarpercentile);
-	float raltvarmed = 0;
-	if (!rAltVar.empty()) getMedian(rAltVar.begin(), rAltVar.end(), raltvarmed);
-	float rccontrolmed = 0;
-	if (!rcControl.empty()) getMedian(rcControl.begin(), rcControl.end(), rccontrolmed);
-	float rcaltmed = 0;
-	if (!rcAlt.empty()) getMedian(rcAlt.begin(), rcAlt.end(), rcaltmed);
-	float rdRatio = 1;
-	if (rccontrolmed != 0) rdRatio = rcaltmed/rccontrolmed;
-	float gqaltmed = 0;
-	if (!gqAlt.empty()) getMedian(gqAlt.begin(), gqAlt.end(), gqaltmed);
-	float gqrefmed = 0;
-	if (!gqRef.empty()) getMedian(gqRef.begin(), gqRef.end(), gqrefmed);
-	float af = (float) ac[1] / (float) (ac[0] + ac[1]);
-	
-	//std::cerr << bcf_hdr_id2name(hdr, rec->rid) << '\t' << (rec->pos + 1) << '\t' << *svend << '\t' << rec->d.id << '\t' << svlen << '\t' << ac[1] << '\t' << af << '\t' << genotypeRatio << '\t' << std::string(svt) << '\t' << precise << '\t' << rrefvarpercentile << '\t' << raltvarmed << '\t' << gqrefmed << '\t' << gqaltmed << '\t' << rdRatio << std::endl;
-
-	if ((af>0) && (gqaltmed >= c.gq) && (gqrefmed >= c.gq) && (raltvarmed >= c.altaf) && (genotypeRatio >= c.ratiogeno)) {
-	  if ((std::string(svt)=="DEL") && (rdRatio > c.rddel)) continue;
-	  if ((std::string(svt)=="DUP") && (rdRatio < c.rddup)) continue;
-	  if ((std::string(svt)!="DEL") && (std::string(svt)!="DUP") && (rrefvarpercentile > 0)) continue;
-	  _remove_info_tag(hdr_out, rec, "RDRATIO");
-	  bcf_update_info_float(hdr_out, rec, "RDRATIO", &rdRatio, 1);
-	  bcf_write1(ofile, hdr_out, rec);
-	  
-	  
-	}
+  std::vector<bcf1_t*> batch(DELLY_VCF_BATCH);
+  for(uint32_t i = 0; i < batch.size(); ++i) batch[i] = bcf_init1();
+  std::vector<char> keep(batch.size(), 0);
+  bool eof = false;
+  while (!eof) {
+    int32_t nrec = 0;
+    for(; nrec < (int32_t) batch.size(); ++nrec) {
+      if (bcf_read(ifile, hdr, batch[nrec]) != 0) {
+	eof = true;
+	break;
       }
     }
+#pragma omp parallel default(shared)
+    {
+      FilterFields buf(fields);
+#pragma omp for schedule(dynamic)
+      for(int32_t i = 0; i < nrec; ++i) keep[i] = _filterRecord(c, hdr, hdr_out, batch[i], buf);
+    }
+    for(int32_t i = 0; i < nrec; ++i) {
+      if (keep[i]) bcf_write1(ofile, hdr_out, batch[i]);
+    }
   }
-  bcf_destroy(rec);
-
-  // Clean-up
-  if (svend != NULL) free(svend);
-  if (svt != NULL) free(svt);
-  if (inslen != NULL) free(inslen);
-  if (gt != NULL) free(gt);
-  if (gq != NULL) free(gq);
-  if (gqf != NULL) free(gqf);
-  if (rc != NULL) free(rc);
-  if (rcl != NULL) free(rcl);
-  if (rcr != NULL) free(rcr);
-  if (dv != NULL) free(dv);
-  if (dr != NULL) free(dr);
-  if (rv != NULL) free(rv);
-  if (rr != NULL) free(rr);
+  for(uint32_t i = 0; i < batch.size(); ++i) bcf_destroy(batch[i]);
 
   // Close output VCF
   bcf_hdr_destroy(hdr_out);
   hts_close(ofile);
 
-  // Build index
-  bcf_index_build(c.outfile.string().c_str(), 14);
-
   // Close VCF
   bcf_hdr_destroy(hdr);
   bcf_close(ifile);
+  if (tpool.pool != NULL) hts_tpool_destroy(tpool.pool);
+
+  // Build index
+  bcf_index_build(c.outfile.string().c_str(), 14);
 
   // End
   now = boost::posix_time::second_clock::local_time();
@@ -303,6 +313,7 @@ int filter(int argc, char **argv) {
     ("maxsize,n", boost::program_options::value<int32_t>(&c.maxsize)->default_value(500000000), "max. SV size")
     ("ratiogeno,r", boost::program_options::value<float>(&c.ratiogeno)->default_value(0.75), "min. fraction of genotyped samples")
     ("pass,p", "Filter sites for PASS")
+    ("threads,t", boost::program_options::value<uint32_t>(&c.threads)->default_value(0), "max. threads (0: OMP_NUM_THREADS)")
     ;
 
   // Define somatic options
@@ -351,6 +362,11 @@ int filter(int argc, char **argv) {
   if (vm.count("pass")) c.filterForPass = true;
   else c.filterForPass = false;
 
+  // Thread budget
+#ifdef OPENMP
+  if (c.threads > 0) omp_set_num_threads(c.threads);
+#endif
+
   // Population Genomics
   if (c.filter == "germline") c.controlcont = 1.0;
 
@@ -22,6 +22,12 @@
 
 namespace torali
 {
+
+  // Tile size of the sampled GC bias estimation
+  #ifndef DELLY_GC_TILE
+  #define DELLY_GC_TILE 1000000
+  #endif
+
   struct GcBias {
     int32_t sample;
     int32_t reference;
@@ -118,161 +124,225 @@ namespace torali
 
 
   
-  template<typename TConfig, typename TGCBound>
-  inline void
-  gcBias(TConfig const& c, std::vector< std::vector<ScanWindow> > const& scanCounts, LibraryInfo const& li, std::vector<GcBias>& gcbias, TGCBound& gcbound) {
-    // Load bam file
-    samFile* samfile = sam_open(c.bamFile.string().c_str(), "r");
-    hts_set_fai_filename(samfile, c.genome.string().c_str());
-    hts_idx_t* idx = sam_index_load(samfile, c.bamFile.string().c_str());
-    bam_hdr_t* hdr = sam_hdr_read(samfile);
+  struct GcTile {
+    int32_t refIndex;
+    uint32_t start;
+    uint32_t end;
+    uint64_t key;
 
-    // Parse bam (contig by contig)
-    boost::posix_time::ptime now = boost::posix_time::second_clock::local_time();
-    std::cout << '[' << boost::posix_time::to_simple_string(now) << "] " << "Estimate GC bias" << std::endl;
-    boost::progress_display show_progress( hdr->n_targets );
+    GcTile(int32_t const r, uint32_t const s, uint32_t const e, uint64_t const k) : refIndex(r), start(s), end(e), key(k) {}
+  };
 
-    faidx_t* faiMap = fai_load(c.mapFile.string().c_str());
-    faidx_t* faiRef = fai_load(c.genome.string().c_str());
-    for (int refIndex = 0; refIndex < hdr->n_targets; ++refIndex) {
-      ++show_progress;
-      if (scanCounts[refIndex].empty()) continue;
+  template<typename TTile>
+  struct SortGcTileKey : public std::binary_function<TTile, TTile, bool>
+  {
+    inline bool operator()(TTile const& t1, TTile const& t2) {
+      return ((t1.key < t2.key) || ((t1.key == t2.key) && (t1.refIndex < t2.refIndex)) || ((t1.key == t2.key) && (t1.refIndex == t2.refIndex) && (t1.start < t2.start)));
+    }
+  };
 
-      // Bin map
-      std::vector<uint16_t> binMap;
-      if (c.hasScanFile) {
-	// Fill bin map
-	binMap.resize(hdr->target_len[refIndex], LAST_BIN);
-	for(uint32_t bin = 0;((bin < scanCounts[refIndex].size()) && (bin < LAST_BIN)); ++bin) {
-	  for(int32_t k = scanCounts[refIndex][bin].start; k < scanCounts[refIndex][bin].end; ++k) binMap[k] = bin;
-	}
-      }
-      
-      // Check presence in mappability map
-      std::string tname(hdr->target_name[refIndex]);
-      int32_t seqlen = faidx_seq_len(faiMap, tname.c_str());
-      if (seqlen == - 1) continue;
-      else seqlen = -1;
-      char* seq = faidx_fetch_seq(faiMap, tname.c_str(), 0, faidx_seq_len(faiMap, tname.c_str()), &seqlen);
-
-      // Check presence in reference
-      seqlen = faidx_seq_len(faiRef, tname.c_str());
-      if (seqlen == - 1) continue;
-      else seqlen = -1;
-      char* ref = faidx_fetch_seq(faiRef, tname.c_str(), 0, faidx_seq_len(faiRef, tname.c_str()), &seqlen);
+  template<typename TTile>
+  struct SortGcTilePos : public std::binary_function<TTile, TTile, bool>
+  {
+    inline bool operator()(TTile const& t1, TTile const& t2) {
+      return ((t1.refIndex < t2.refIndex) || ((t1.refIndex == t2.refIndex) && (t1.start < t2.start)));
+    }
+  };
 
-      // Get GC and Mappability
-      std::vector<uint16_t> uniqContent(hdr->target_len[refIndex], 0);
-      std::vector<uint16_t> gcContent(hdr->target_len[refIndex], 0);
-      {
-	// Mappability map
-	typedef boost::dynamic_bitset<> TBitSet;
-	TBitSet uniq(hdr->target_len[refIndex], false);
-	for(uint32_t i = 0; i < hdr->target_len[refIndex]; ++i) {
-	  if (seq[i] == 'C') uniq[i] = true;
-	}
+  // Deterministic pseudo-random sampling key of a tile (splitmix64)
+  inline uint64_t
+  _gcTileKey(int32_t const refIndex, uint32_t const tile) {
+    uint64_t z = ((uint64_t) refIndex << 32) + tile + 0x9E3779B97F4A7C15ULL;
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+  }
 
-	// GC map
-	typedef boost::dynamic_bitset<> TBitSet;
-	TBitSet gcref(hdr->target_len[refIndex], false);
-	for(uint32_t i = 0; i < hdr->target_len[refIndex]; ++i) {
-	  if ((ref[i] == 'c') || (ref[i] == 'C') || (ref[i] == 'g') || (ref[i] == 'G')) gcref[i] = 1;
-	}
+  // Fractions, percentiles and observed/expected ratio of the GC histogram
+  inline void
+  _gcPercentiles(std::vector<GcBias>& gcbias) {
+    uint64_t totalSampleCount = 0;
+    uint64_t totalReferenceCount = 0;
+    for(uint32_t i = 0; i < gcbias.size(); ++i) {
+      totalSampleCount += gcbias[i].sample;
+      totalReferenceCount += gcbias[i].reference;
+    }
+    uint64_t cumSample = 0;
+    uint64_t cumReference = 0;
+    for(uint32_t i = 0; i < gcbias.size(); ++i) {
+      cumSample += gcbias[i].sample;
+      cumReference += gcbias[i].reference;
+      gcbias[i].fractionSample = (double) gcbias[i].sample / (double) totalSampleCount;
+      gcbias[i].fractionReference = (double) gcbias[i].reference / (double) totalReferenceCount;
+      gcbias[i].percentileSample = (double) cumSample / (double) totalSampleCount;
+      gcbias[i].percentileReference = (double) cumReference / (double) totalReferenceCount;
+      gcbias[i].obsexp = 1;
+      if (gcbias[i].fractionReference > 0) gcbias[i].obsexp = gcbias[i].fractionSample / gcbias[i].fractionReference;
+    }
+  }
 
-	// Sum across fragments
-	int32_t halfwin = (int32_t) (c.meanisize / 2);
-	int32_t usum = 0;
-	int32_t gcsum = 0;
-	for(int32_t pos = halfwin; pos < (int32_t) hdr->target_len[refIndex] - halfwin; ++pos) {
-	  if (pos == halfwin) {
-	    for(int32_t i = pos - halfwin; i<=pos+halfwin; ++i) {
-	      usum += uniq[i];
-	      gcsum += gcref[i];
-	    }
-	  } else {
-	    usum -= uniq[pos - halfwin - 1];
-	    gcsum -= gcref[pos - halfwin - 1];
-	    usum += uniq[pos + halfwin];
-	    gcsum += gcref[pos + halfwin];
-	  }
-	  gcContent[pos] = gcsum;
-	  uniqContent[pos] = usum;
-	}
+  // Largest relative (Poisson) error of the fragment counts in the non-extreme GC bins
+  template<typename TConfig>
+  inline double
+  _gcError(TConfig const& c, std::vector<GcBias> const& gcbias) {
+    std::vector<GcBias> est(gcbias);
+    _gcPercentiles(est);
+    std::pair<uint32_t, uint32_t> bound = gcBound(c, est);
+    double maxErr = 0;
+    for(uint32_t i = bound.first + 1; i < bound.second; ++i) {
+      if (!est[i].sample) return std::numeric_limits<double>::infinity();
+      maxErr = std::max(maxErr, 1.0 / std::sqrt((double) est[i].sample));
+    }
+    return maxErr;
+  }
+
+  // GC histogram of the given regions [start, end) of one chromosome
+  template<typename TConfig>
+  inline void
+  _gcHistogramChr(TConfig const& c, bam_hdr_t const* hdr, int32_t const refIndex, faidx_t* faiMap, faidx_t* faiRef, std::vector< std::vector<ScanWindow> > const& scanCounts, std::vector<FragmentCounts> const& fragCounts, std::vector< std::pair<uint32_t, uint32_t> > const& regions, std::vector<GcBias>& tgcbias) {
+    // Bin map
+    std::vector<uint16_t> binMap;
+    if (c.hasScanFile) {
+      // Fill bin map
+      binMap.resize(hdr->target_len[refIndex], LAST_BIN);
+      for(uint32_t bin = 0;((bin < scanCounts[refIndex].size()) && (bin < LAST_BIN)); ++bin) {
+	for(int32_t k = scanCounts[refIndex][bin].start; k < scanCounts[refIndex][bin].end; ++k) binMap[k] = bin;
       }
+    }
+
+    std::string tname(hdr->target_name[refIndex]);
+    for(uint32_t r = 0; r < regions.size(); ++r) {
+      uint32_t start = regions[r].first;
+      uint32_t end = regions[r].second;
+
+      // Get GC and Mappability
+      WindowTrack uniqContent;
+      WindowTrack gcContent;
+      if (!uniqueTrack(c, faiMap, tname, hdr->target_len[refIndex], start, end, uniqContent)) return;
+      if (!gcTrack(c, faiRef, tname, hdr->target_len[refIndex], start, end, gcContent)) return;
 
       // Coverage track
       typedef uint16_t TCount;
-      uint32_t maxCoverage = std::numeric_limits<TCount>::max();
       typedef std::vector<TCount> TCoverage;
-      TCoverage cov(hdr->target_len[refIndex], 0);
-      
-      // Mate map
-      typedef boost::unordered_map<std::size_t, bool> TMateMap;
-      TMateMap mateMap;
-      
-      // Parse BAM
-      hts_itr_t* iter = sam_itr_queryi(idx, refIndex, 0, hdr->target_len[refIndex]);
-      bam1_t* rec = bam_init1();
-      int32_t lastAlignedPos = 0;
-      std::set<std::size_t> lastAlignedPosReads;
-      while (sam_itr_next(samfile, iter, rec) >= 0) {
-	if (rec->core.flag & (BAM_FSECONDARY | BAM_FQCFAIL | BAM_FDUP | BAM_FSUPPLEMENTARY | BAM_FUNMAP)) continue;
-	if ((rec->core.flag & BAM_FPAIRED) && ((rec->core.flag & BAM_FMUNMAP) || (rec->core.tid != rec->core.mtid))) continue;
-	if (rec->core.qual < c.minQual) continue;
-
-	int32_t midPoint = rec->core.pos + halfAlignmentLength(rec);
-	if (rec->core.flag & BAM_FPAIRED) {
-	  // Clean-up the read store for identical alignment positions
-	  if (rec->core.pos > lastAlignedPos) {
-	    lastAlignedPosReads.clear();
-	    lastAlignedPos = rec->core.pos;
-	  }
-
-	  // Process pair
-	  if ((rec->core.pos < rec->core.mpos) || ((rec->core.pos == rec->core.mpos) && (lastAlignedPosReads.find(hash_string(bam_get_qname(rec))) == lastAlignedPosReads.end()))) {
-	    // First read
-	    lastAlignedPosReads.insert(hash_string(bam_get_qname(rec)));
-	    std::size_t hv = hash_pair(rec);
-	    mateMap[hv]= true;
-	    continue;
-	  } else {
-	    // Second read
-	    std::size_t hv = hash_pair_mate(rec);
-	    if ((mateMap.find(hv) == mateMap.end()) || (!mateMap[hv])) continue; // Mate discarded
-	    mateMap[hv] = false;
-	  }
-	
-	  // Insert size filter
-	  int32_t isize = (rec->core.pos + alignmentLength(rec)) - rec->core.mpos;
-	  if ((li.minNormalISize < isize) && (isize < li.maxNormalISize)) {
-	    midPoint = rec->core.mpos + (int32_t) (isize/2);
-	  } else {
-	    if (rec->core.flag & BAM_FREVERSE) midPoint = rec->core.pos + alignmentLength(rec) - (c.meanisize / 2);
-	    else midPoint = rec->core.pos + (c.meanisize / 2);
-	  }
-	}
+      TCoverage cov;
+      fragmentCoverage(fragCounts[refIndex], hdr->target_len[refIndex], start, end, true, cov);
 
-	// Count fragment
-	if ((midPoint >= 0) && (midPoint < (int32_t) hdr->target_len[refIndex]) && (cov[midPoint] < maxCoverage - 1)) ++cov[midPoint];
-      }
-      bam_destroy1(rec);
-      hts_itr_destroy(iter);
-      if (seq != NULL) free(seq);
-      if (ref != NULL) free(ref);
-
-      // Summarize GC coverage for this chromosome
-      for(uint32_t i = 0; i < hdr->target_len[refIndex]; ++i) {
-	if (uniqContent[i] >= c.fragmentUnique * c.meanisize) {
+      // Summarize GC coverage
+      for(uint32_t i = start; i < end; ++i) {
+	if (uniqContent[i - start] >= c.fragmentUnique * c.meanisize) {
 	  // Valid bin?
 	  int32_t bin = _findScanWindow(c, hdr->target_len[refIndex], binMap, i);
 	  if ((bin >= 0) && (scanCounts[refIndex][bin].select)) {
-	    ++gcbias[gcContent[i]].reference;
-	    gcbias[gcContent[i]].sample += cov[i];
-	    gcbias[gcContent[i]].coverage += cov[i];
+	    uint16_t gc = gcContent[i - start];
+	    ++tgcbias[gc].reference;
+	    tgcbias[gc].sample += cov[i - start];
+	    tgcbias[gc].coverage += cov[i - start];
 	  }
 	}
       }
     }
+  }
+
+  // GC histogram of a set of tiles, chromosome-parallel with one track load per chromosome
+  template<typename TConfig>
+  inline void
+  _gcHistogramTiles(TConfig const& c, bam_hdr_t const* hdr, std::vector< std::vector<ScanWindow> > const& scanCounts, std::vector<FragmentCounts> const& fragCounts, std::vector<GcTile> tiles, std::vector<GcBias>& gcbias) {
+    // Group tiles by chromosome
+    std::sort(tiles.begin(), tiles.end(), SortGcTilePos<GcTile>());
+    std::vector<uint32_t> groupStart;
+    for(uint32_t i = 0; i < tiles.size(); ++i) {
+      if ((i == 0) || (tiles[i].refIndex != tiles[i-1].refIndex)) groupStart.push_back(i);
+    }
+    groupStart.push_back(tiles.size());
+
+#pragma omp parallel default(shared)
+    {
+      faidx_t* faiMap = NULL;
+      faidx_t* faiRef = NULL;
+      if (!c.hasTrackFile) {
+	faiMap = fai_load(c.mapFile.string().c_str());
+	faiRef = fai_load(c.genome.string().c_str());
+      }
+      std::vector<GcBias> tgcbias(gcbias.size(), GcBias());
+
+#pragma omp for schedule(dynamic)
+      for(int32_t g = 0; g < (int32_t) groupStart.size() - 1; ++g) {
+	std::vector< std::pair<uint32_t, uint32_t> > regions;
+	for(uint32_t i = groupStart[g]; i < groupStart[g+1]; ++i) regions.push_back(std::make_pair(tiles[i].start, tiles[i].end));
+	_gcHistogramChr(c, hdr, tiles[groupStart[g]].refIndex, faiMap, faiRef, scanCounts, fragCounts, regions, tgcbias);
+      }
+
+      // Reduce, all summands are integral so the merge order does not matter
+#pragma omp critical
+      {
+	for(uint32_t i = 0; i < gcbias.size(); ++i) {
+	  gcbias[i].reference += tgcbias[i].reference;
+	  gcbias[i].sample += tgcbias[i].sample;
+	  gcbias[i].coverage += tgcbias[i].coverage;
+	}
+      }
+      if (faiRef != NULL) fai_destroy(faiRef);
+      if (faiMap != NULL) fai_destroy(faiMap);
+    }
+  }
+
+  // Sampled GC histogram, tiles in random order until the non-extreme GC bins converge
+  template<typename TConfig>
+  inline void
+  _gcSampled(TConfig const& c, samFile* samfile, bam_hdr_t const* hdr, std::vector< std::vector<ScanWindow> > const& scanCounts, std::vector<FragmentCounts> const& fragCounts, std::vector<GcBias>& gcbias) {
+    // Tiles of chromosomes with mapped reads and selected scan windows
+    hts_idx_t* idx = sam_index_load(samfile, c.bamFile.string().c_str());
+    std::vector<GcTile> tiles;
+    for(int32_t refIndex = 0; refIndex < hdr->n_targets; ++refIndex) {
+      if (scanCounts[refIndex].empty()) continue;
+      if (idx != NULL) {
+	uint64_t mapped = 0;
+	uint64_t unmapped = 0;
+	if ((hts_idx_get_stat(idx, refIndex, &mapped, &unmapped) >= 0) && (!mapped)) continue;
+      }
+      for(uint32_t tile = 0; tile * DELLY_GC_TILE < hdr->target_len[refIndex]; ++tile) {
+	uint32_t tend = std::min((uint32_t) ((tile + 1) * DELLY_GC_TILE), (uint32_t) hdr->target_len[refIndex]);
+	tiles.push_back(GcTile(refIndex, tile * DELLY_GC_TILE, tend, _gcTileKey(refIndex, tile)));
+      }
+    }
+    if (idx != NULL) hts_idx_destroy(idx);
+    std::sort(tiles.begin(), tiles.end(), SortGcTileKey<GcTile>());
+
+    // Doubling batches of tiles, convergence is checked after every batch
+    uint32_t processed = 0;
+    uint32_t batch = std::max((uint32_t) 1, (uint32_t) (tiles.size() / 32));
+    double err = std::numeric_limits<double>::infinity();
+    while (processed < tiles.size()) {
+      uint32_t next = std::min((uint32_t) tiles.size(), processed + batch);
+      _gcHistogramTiles(c, hdr, scanCounts, fragCounts, std::vector<GcTile>(tiles.begin() + processed, tiles.begin() + next), gcbias);
+      processed = next;
+      batch *= 2;
+      err = _gcError(c, gcbias);
+      if (err <= c.gcError) break;
+    }
+    boost::posix_time::ptime now = boost::posix_time::second_clock::local_time();
+    std::cout << '[' << boost::posix_time::to_simple_string(now) << "] " << "GC bias sampled " << processed << " of " << tiles.size() << " tiles, max. relative error " << err << std::endl;
+  }
+
+  template<typename TConfig, typename TGCBound>
+  inline void
+  gcBias(TConfig const& c, std::vector< std::vector<ScanWindow> > const& scanCounts, std::vector<FragmentCounts> const& fragCounts, std::vector<GcBias>& gcbias, TGCBound& gcbound) {
+    // Load bam header
+    samFile* samfile = sam_open(c.bamFile.string().c_str(), "r");
+    bam_hdr_t* hdr = sam_hdr_read(samfile);
+
+    // Summarize fragment counts
+    boost::posix_time::ptime now = boost::posix_time::second_clock::local_time();
+    std::cout << '[' << boost::posix_time::to_simple_string(now) << "] " << "Estimate GC bias" << std::endl;
+    if (c.gcSampling) _gcSampled(c, samfile, hdr, scanCounts, fragCounts, gcbias);
+    else {
+      // All chromosomes
+      std::vector<GcTile> tiles;
+      for (int32_t refIndex = 0; refIndex < hdr->n_targets; ++refIndex) {
+	if (!scanCounts[refIndex].empty()) tiles.push_back(GcTile(refIndex, 0, hdr->target_len[refIndex], 0));
+      }
+      _gcHistogramTiles(c, hdr, scanCounts, fragCounts, tiles, gcbias);
+    }
     
     // Normalize GC coverage
     for(uint32_t i = 0; i < gcbias.size(); ++i) {
@@ -281,37 +351,20 @@ namespace torali
     }
 
     // Determine percentiles
-    uint64_t totalSampleCount = 0;
-    uint64_t totalReferenceCount = 0;
-    for(uint32_t i = 0; i < gcbias.size(); ++i) {
-      totalSampleCount += gcbias[i].sample;
-      totalReferenceCount += gcbias[i].reference;
-    }
-    uint64_t cumSample = 0;
-    uint64_t cumReference = 0;
-    for(uint32_t i = 0; i < gcbias.size(); ++i) {
-      cumSample += gcbias[i].sample;
-      cumReference += gcbias[i].reference;
-      gcbias[i].fractionSample = (double) gcbias[i].sample / (double) totalSampleCount;
-      gcbias[i].fractionReference = (double) gcbias[i].reference / (double) totalReferenceCount;
-      gcbias[i].percentileSample = (double) cumSample / (double) totalSampleCount;
-      gcbias[i].percentileReference = (double) cumReference / (double) totalReferenceCount;
-      gcbias[i].obsexp = 1;
-      if (gcbias[i].fractionReference > 0) gcbias[i].obsexp = gcbias[i].fractionSample / gcbias[i].fractionReference;
-    }
+    _gcPercentiles(gcbias);
 
     // Estimate correctable GC range
     gcbound = gcBound(c, gcbias);
 
     // Adjust correction to the callable range
-    totalSampleCount = 0;
-    totalReferenceCount = 0;
+    uint64_t totalSampleCount = 0;
+    uint64_t totalReferenceCount = 0;
     for(uint32_t i = gcbound.first + 1; i < gcbound.second; ++i) {
       totalSampleCount += gcbias[i].sample;
       totalReferenceCount += gcbias[i].reference;
     }
-    cumSample = 0;
-    cumReference = 0;
+    uint64_t cumSample = 0;
+    uint64_t cumReference = 0;
     // Re-initialize
     for(uint32_t i = 0; i < gcbias.size(); ++i) {
       gcbias[i].fractionSample = 0;
@@ -331,9 +384,6 @@ namespace torali
       if (gcbias[i].fractionReference > 0) gcbias[i].obsexp = gcbias[i].fractionSample / gcbias[i].fractionReference;
     }
     
-    fai_destroy(faiRef);
-    fai_destroy(faiMap);
-    hts_idx_destroy(idx);
     sam_close(samfile);
     bam_hdr_destroy(hdr);
   }
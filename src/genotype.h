@@ -100,6 +100,7 @@ namespace torali
     typedef std::vector<uint8_t> TQuality;
     typedef boost::multi_array<char, 2> TAlign;
     if (svs.empty()) return;
+    bool haplotagged = false;
 
     // Open file handles
     typedef std::vector<samFile*> TSamFile;
@@ -312,6 +313,7 @@ namespace torali
 	while (sam_itr_next(samfile[file_c], iter, rec) >= 0) {
 	  // Genotyping only primary alignments
 	  if (rec->core.flag & (BAM_FSECONDARY | BAM_FQCFAIL | BAM_FDUP | BAM_FSUPPLEMENTARY | BAM_FUNMAP)) continue;
+	  PhaseTags phase;
 	  
 	  // Read length
 	  int32_t readlen = readLength(rec);
@@ -439,14 +441,11 @@ namespace torali
 		    for (int i = 0; i < rec->core.l_qseq; ++i) quality[i] = qualptr[i];
 		    uint32_t rq = scoreRef * 35;
 		    if (rq >= c.minGenoQual) {
-		      uint8_t* hpptr = bam_aux_get(rec, "HP");
+		      uint8_t hap = _haplotype(rec, phase);
 		      jctMap[file_c][svid].ref.push_back((uint8_t) std::min(rq, (uint32_t) rec->core.qual));
-		      if (hpptr) {
-			c.isHaplotagged = true;
-			int hap = bam_aux2i(hpptr);
-			if (hap == 1) ++jctMap[file_c][svid].refh1;
-			else ++jctMap[file_c][svid].refh2;
-		      }
+		      if (hap) haplotagged = true;
+		      if (hap == 1) ++jctMap[file_c][svid].refh1;
+		      else if (hap == 2) ++jctMap[file_c][svid].refh2;
 		    }
 		  }
 		} else {
@@ -456,7 +455,7 @@ namespace torali
 		  for (int i = 0; i < rec->core.l_qseq; ++i) quality[i] = qualptr[i];
 		  uint32_t aq = scoreAlt * 35;
 		  if (aq >= c.minGenoQual) {
-		    uint8_t* hpptr = bam_aux_get(rec, "HP");
+		    uint8_t hap = _haplotype(rec, phase);
 		    if (c.hasDumpFile) {
 		      std::string svidStr(_addID(gbp[svid].svt));
 		      std::string padNumber = boost::lexical_cast<std::string>(svid);
@@ -465,12 +464,9 @@ namespace torali
 		      dumpOut << svidStr << "\t" << c.files[file_c].string() << "\t" << bam_get_qname(rec) << "\t" << hdr[file_c]->target_name[rec->core.tid] << "\t" << rec->core.pos << "\t" << hdr[file_c]->target_name[rec->core.mtid] << "\t" << rec->core.mpos << "\t" << (int32_t) rec->core.qual << "\tSR" << std::endl;
 		    }
 		    jctMap[file_c][svid].alt.push_back((uint8_t) std::min(aq, (uint32_t) rec->core.qual));
-		    if (hpptr) {
-		      c.isHaplotagged = true;
-		      int hap = bam_aux2i(hpptr);
-		      if (hap == 1) ++jctMap[file_c][svid].alth1;
-		      else ++jctMap[file_c][svid].alth2;
-		    }
+		    if (hap) haplotagged = true;
+		    if (hap == 1) ++jctMap[file_c][svid].alth1;
+		    else if (hap == 2) ++jctMap[file_c][svid].alth2;
 		  }
 		}
 	      }
@@ -583,6 +579,8 @@ namespace torali
       std::cout << "ERR\t" << c.sampleName[file_c] << "\tInsertionRate\t" << (double) insCount[file_c] / (double) alignedbases << std::endl;
     }
 
+    if (haplotagged) c.isHaplotagged = true;
+
     // Clean-up
     for(unsigned int file_c = 0; file_c < c.files.size(); ++file_c) {
       bam_hdr_destroy(hdr[file_c]);	  
@@ -596,6 +594,7 @@ namespace torali
   genotypeLR(TConfig& c, std::vector<StructuralVariantRecord>& svs, TSRStore& srStore, TJunctionMap& jctMap, TReadCountMap& covMap) {
     typedef std::vector<StructuralVariantRecord> TSVs;
     if (svs.empty()) return;
+    bool haplotagged = false;
     
     typedef uint16_t TMaxCoverage;
     uint32_t maxCoverage = std::numeric_limits<TMaxCoverage>::max();
@@ -692,6 +691,7 @@ namespace torali
 	while (sam_itr_next(samfile[file_c], iter, rec) >= 0) {
 	  // Genotyping only primary alignments
 	  if (rec->core.flag & (BAM_FSECONDARY | BAM_FQCFAIL | BAM_FDUP | BAM_FSUPPLEMENTARY | BAM_FUNMAP)) continue;
+	  PhaseTags phase;
 	  
 	  // Read hash
 	  std::size_t seed = hash_lr(rec);
@@ -752,7 +752,7 @@ namespace torali
 	      if (svid == -1) continue;
 	      //if ((svs[svid].svt == 2) || (svs[svid].svt == 4)) continue;
 	      altAssigned.insert(svid);
-	      uint8_t* hpptr = bam_aux_get(rec, "HP");
+	      uint8_t hap = _haplotype(rec, phase);
 	      if (c.hasDumpFile) {
 		std::string svidStr(_addID(svs[svid].svt));
 		std::string padNumber = boost::lexical_cast<std::string>(svid);
@@ -765,12 +765,9 @@ namespace torali
 	      // ToDo
 	      //jctMap[file_c][svid].alt.push_back((uint8_t) std::min((uint32_t) score, (uint32_t) rec->core.qual));
 	      jctMap[file_c][svid].alt.push_back((uint8_t) std::min((uint32_t) 20, (uint32_t) rec->core.qual));
-	      if (hpptr) {
-		c.isHaplotagged = true;
-		int hap = bam_aux2i(hpptr);
-		if (hap == 1) ++jctMap[file_c][svid].alth1;
-		else ++jctMap[file_c][svid].alth2;
-	      }
+	      if (hap) haplotagged = true;
+	      if (hap == 1) ++jctMap[file_c][svid].alth1;
+	      else if (hap == 2) ++jctMap[file_c][svid].alth2;
 	    }
 	  }
 
@@ -799,14 +796,11 @@ namespace torali
 	      if (altAssigned.find(svid) != altAssigned.end()) continue; 
 	      //std::cerr << svs[svid].chr << ',' << svs[svid].svStart << ',' << svs[svid].chr2 << ',' << svs[svid].svEnd << std::endl;
 	      if (++refAlignedReadCount[file_c][svid] % 2) {
-		uint8_t* hpptr = bam_aux_get(rec, "HP");
+		uint8_t hap = _haplotype(rec, phase);
 		jctMap[file_c][svid].ref.push_back((uint8_t) std::min((uint32_t) score, (uint32_t) rec->core.qual));
-		if (hpptr) {
-		  c.isHaplotagged = true;
-		  int hap = bam_aux2i(hpptr);
-		  if (hap == 1) ++jctMap[file_c][svid].refh1;
-		  else ++jctMap[file_c][svid].refh2;
-		}
+		if (hap) haplotagged = true;
+		if (hap == 1) ++jctMap[file_c][svid].refh1;
+		else if (hap == 2) ++jctMap[file_c][svid].refh2;
 	      }
 	    }
 	  }
@@ -857,6 +851,8 @@ namespace torali
     // Clean-up
     fai_destroy(fai);
 
+    if (haplotagged) c.isHaplotagged = true;
+
     // Clean-up
     for(unsigned int file_c = 0; file_c < c.files.size(); ++file_c) {
       bam_hdr_destroy(hdr[file_c]);	  
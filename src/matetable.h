@@ -0,0 +1,173 @@
+#ifndef MATETABLE_H
+#define MATETABLE_H
+
+#include <vector>
+
+#include <boost/container/flat_set.hpp>
+
+namespace torali
+{
+
+  // Read names seen at the current alignment position
+  typedef boost::container::flat_set<std::size_t> TAlignedReads;
+
+  // Open-addressing mate table (linear probing, backward-shift deletion)
+  //
+  // Keys are the pair hashes (hash_pair/hash_pair_mate), each slot also stores the mate position.
+  // Mates are fetched at their own position in coordinate-sorted input, so once the scan position
+  // has passed mpos + window an entry is dead and is dropped the next time the table rehashes.
+  template<typename TValue>
+  struct MateTable {
+    struct Slot {
+      std::size_t key;
+      int32_t mpos;
+      TValue value;
+
+      Slot() : key(0), mpos(0), value() {}
+    };
+    typedef std::vector<Slot> TSlots;
+
+    TSlots slots;
+    std::size_t count;
+    uint32_t shift;
+    int32_t window;
+
+    explicit MateTable(int32_t const w) : count(0), shift(64), window(w) {}
+
+    inline std::size_t size() const { return count; }
+    inline bool empty() const { return (count == 0); }
+
+    inline void
+    clear() {
+      if (count) {
+	for(typename TSlots::iterator it = slots.begin(); it != slots.end(); ++it) it->key = 0;
+	count = 0;
+      }
+    }
+
+    inline void
+    release() {
+      TSlots().swap(slots);
+      count = 0;
+      shift = 64;
+    }
+
+    inline TValue*
+    find(std::size_t const hv) {
+      if (!count) return NULL;
+      std::size_t const k = _key(hv);
+      std::size_t const mask = slots.size() - 1;
+      for(std::size_t i = _slot(k); slots[i].key; i = (i + 1) & mask) {
+	if (slots[i].key == k) return &slots[i].value;
+      }
+      return NULL;
+    }
+
+    // pos is the current scan position on this table's chromosome, used for eviction
+    inline void
+    insert(std::size_t const hv, int32_t const pos, int32_t const mpos, TValue const& value) {
+      if (2 * (count + 1) > slots.size()) _rehash(pos);
+      std::size_t const k = _key(hv);
+      std::size_t const mask = slots.size() - 1;
+      std::size_t i = _slot(k);
+      for(; slots[i].key; i = (i + 1) & mask) {
+	if (slots[i].key == k) break;
+      }
+      if (!slots[i].key) ++count;
+      slots[i].key = k;
+      slots[i].mpos = mpos;
+      slots[i].value = value;
+    }
+
+    inline bool
+    erase(std::size_t const hv) {
+      if (!count) return false;
+      std::size_t const k = _key(hv);
+      std::size_t const mask = slots.size() - 1;
+      std::size_t i = _slot(k);
+      for(; slots[i].key != k; i = (i + 1) & mask) {
+	if (!slots[i].key) return false;
+      }
+      // Backward-shift the cluster behind the hole
+      std::size_t j = i;
+      while (true) {
+	j = (j + 1) & mask;
+	if (!slots[j].key) break;
+	std::size_t home = _slot(slots[j].key);
+	if (((j - home) & mask) >= ((j - i) & mask)) {
+	  slots[i] = slots[j];
+	  i = j;
+	}
+      }
+      slots[i].key = 0;
+      --count;
+      return true;
+    }
+
+  private:
+    static inline std::size_t _key(std::size_t const hv) { return (hv) ? hv : 1; }
+
+    inline std::size_t
+    _slot(std::size_t const k) const {
+      return (std::size_t) (((uint64_t) k * 0x9E3779B97F4A7C15ULL) >> shift);
+    }
+
+    inline void
+    _rehash(int32_t const pos) {
+      // Live entries after positional eviction
+      std::size_t live = 0;
+      for(typename TSlots::const_iterator it = slots.begin(); it != slots.end(); ++it) {
+	if ((it->key) && (it->mpos + window >= pos)) ++live;
+      }
+      std::size_t cap = (slots.empty()) ? 1024 : slots.size();
+      while (4 * (live + 1) > cap) cap *= 2;
+      uint32_t bits = 0;
+      while (((std::size_t) 1 << bits) < cap) ++bits;
+
+      TSlots old(cap);
+      old.swap(slots);
+      shift = 64 - bits;
+      count = 0;
+      std::size_t const mask = cap - 1;
+      for(typename TSlots::const_iterator it = old.begin(); it != old.end(); ++it) {
+	if ((!it->key) || (it->mpos + window < pos)) continue;
+	std::size_t i = _slot(it->key);
+	for(; slots[i].key; i = (i + 1) & mask);
+	slots[i] = *it;
+	++count;
+      }
+    }
+  };
+
+
+  // Inter-chromosomal mates, bucketed by mate chromosome
+  //
+  // A bucket is filled while scanning earlier chromosomes and only probed while its own chromosome
+  // is scanned, so it can be released as soon as that chromosome is done.
+  template<typename TValue>
+  struct TraMateTable {
+    typedef MateTable<TValue> TTable;
+    std::vector<TTable> tables;
+
+    TraMateTable(int32_t const nseq, int32_t const window) : tables(nseq, TTable(window)) {}
+
+    inline void
+    insert(std::size_t const hv, int32_t const mtid, int32_t const mpos, TValue const& value) {
+      // Scan position on the mate chromosome is unknown, nothing is evicted
+      tables[mtid].insert(hv, 0, mpos, value);
+    }
+
+    inline TValue*
+    find(int32_t const tid, std::size_t const hv) {
+      return tables[tid].find(hv);
+    }
+
+    inline void
+    release(int32_t const tid) {
+      tables[tid].release();
+    }
+  };
+
+}
+
+#endif
@@ -27,6 +27,7 @@
 #include <boost/progress.hpp>
 #include <htslib/sam.h>
 #include <htslib/vcf.h>
+#include <htslib/bgzf.h>
 
 #include "tags.h"
 #include "version.h"
@@ -37,12 +38,37 @@
 namespace torali
 {
 
+// BGZF block cache per input file for the seeks of the output pass
+#ifndef DELLY_MERGE_CACHE
+#define DELLY_MERGE_CACHE 1048576
+#endif
+
+// Read-ahead of BGZF blocks per input file in the output pass
+#ifndef DELLY_MERGE_READAHEAD
+#define DELLY_MERGE_READAHEAD 4
+#endif
+
+// Seekable input files kept open across contigs in the output pass
+#ifndef DELLY_MERGE_OPEN_FILES
+#define DELLY_MERGE_OPEN_FILES 64
+#endif
+
+// Intermediate interval files of chunked merging
+#ifndef DELLY_MERGE_MAGIC
+#define DELLY_MERGE_MAGIC "DELLYMIV"
+#endif
+
+#ifndef DELLY_MERGE_VERSION
+#define DELLY_MERGE_VERSION 1
+#endif
 
 struct MergeConfig {
   bool filterForPass;
   bool filterForPrecise;
   bool cnvMode;
   uint32_t chunksize;
+  uint32_t fanin;
+  uint32_t threads;
   uint32_t svcounter;
   uint32_t bpoffset;
   uint32_t minsize;
@@ -51,26 +77,274 @@ struct MergeConfig {
   float recoverlap;
   float vaf;
   boost::filesystem::path outfile;
+  boost::filesystem::path scratch;
   std::vector<boost::filesystem::path> files;
 };
 
+// Interval of one input record, offset is the BGZF virtual offset or the record ordinal of plain text files
 struct IntervalScore {
   uint32_t start;
   uint32_t end;
   int32_t score;
+  uint32_t file;
+  int64_t offset;
   
-  IntervalScore(uint32_t s, uint32_t e, int32_t c) : start(s), end(e), score(c) {}
+  IntervalScore(uint32_t s, uint32_t e, int32_t c, uint32_t f, int64_t o) : start(s), end(e), score(c), file(f), offset(o) {}
 };
 
 template<typename TRecord>
 struct SortIScores : public std::binary_function<TRecord, TRecord, bool>
 {
   inline bool operator()(TRecord const& s1, TRecord const& s2) const {
-    return ((s1.start < s2.start) || ((s1.start == s2.start) && (s1.end < s2.end)));
+    if (s1.start != s2.start) return (s1.start < s2.start);
+    if (s1.end != s2.end) return (s1.end < s2.end);
+    if (s1.score != s2.score) return (s1.score < s2.score);
+    if (s1.file != s2.file) return (s1.file < s2.file);
+    return (s1.offset < s2.offset);
+  }
+
+};
+
+template<typename TRecord>
+struct SameIScores : public std::binary_function<TRecord, TRecord, bool>
+{
+  inline bool operator()(TRecord const& s1, TRecord const& s2) const {
+    return ((s1.start == s2.start) && (s1.end == s2.end) && (s1.score == s2.score));
+  }
+};
+
+// Selected input record in output order
+struct MergeRecord {
+  uint32_t tid;
+  uint32_t start;
+  uint32_t end;
+  int32_t svt;
+  uint32_t file;
+  int64_t offset;
+
+  MergeRecord(uint32_t t, uint32_t s, uint32_t e, int32_t v, uint32_t f, int64_t o) : tid(t), start(s), end(e), svt(v), file(f), offset(o) {}
+};
+
+template<typename TRecord>
+struct SortMergeRecords : public std::binary_function<TRecord, TRecord, bool>
+{
+  inline bool operator()(TRecord const& s1, TRecord const& s2) const {
+    if (s1.tid != s2.tid) return (s1.tid < s2.tid);
+    if (s1.start != s2.start) return (s1.start < s2.start);
+    if (s1.file != s2.file) return (s1.file < s2.file);
+    return (s1.offset < s2.offset);
+  }
+};
+
+// Read order of the selected records of forward-only inputs: file, offset
+template<typename TRecord>
+struct SortMergeRecordFiles : public std::binary_function<uint32_t, uint32_t, bool>
+{
+  std::vector<TRecord> const& mrec;
+
+  explicit SortMergeRecordFiles(std::vector<TRecord> const& m) : mrec(m) {}
+
+  inline bool operator()(uint32_t const a, uint32_t const b) const {
+    if (mrec[a].file != mrec[b].file) return (mrec[a].file < mrec[b].file);
+    return (mrec[a].offset < mrec[b].offset);
+  }
+};
+
+// Read order of the selected records of seekable inputs: contig, file, offset
+template<typename TRecord>
+struct SortMergeRecordContigs : public std::binary_function<uint32_t, uint32_t, bool>
+{
+  std::vector<TRecord> const& mrec;
+
+  explicit SortMergeRecordContigs(std::vector<TRecord> const& m) : mrec(m) {}
+
+  inline bool operator()(uint32_t const a, uint32_t const b) const {
+    if (mrec[a].tid != mrec[b].tid) return (mrec[a].tid < mrec[b].tid);
+    if (mrec[a].file != mrec[b].file) return (mrec[a].file < mrec[b].file);
+    return (mrec[a].offset < mrec[b].offset);
+  }
+};
+
+// Records of one input file at the offsets recorded in the first pass, in increasing offset order
+struct MergeInput {
+  htsFile* ifile;
+  bcf_hdr_t* hdr;
+  BGZF* bgzfp;
+  int64_t nrec;
+  bcf1_t* rec;
+
+  MergeInput() : ifile(NULL), hdr(NULL), bgzfp(NULL), nrec(0), rec(NULL) {}
+};
+
+// Seekable BGZF stream or NULL, plain gzip (bgzip-incompatible) and text files are addressed by record ordinal
+inline BGZF*
+_mergeSeekable(htsFile* ifile) {
+  BGZF* bgzfp = hts_get_bgzfp(ifile);
+  if ((bgzfp == NULL) || (bgzfp->is_gzip)) return NULL;
+  if (bgzf_seek(bgzfp, bgzf_tell(bgzfp), SEEK_SET) < 0) return NULL;
+  return bgzfp;
+}
+
+inline bool
+openMergeInput(boost::filesystem::path const& file, MergeInput& mi, htsThreadPool* tp) {
+  mi = MergeInput();
+  mi.ifile = bcf_open(file.string().c_str(), "r");
+  if (mi.ifile == NULL) return false;
+  if ((tp != NULL) && (tp->pool != NULL)) hts_set_thread_pool(mi.ifile, tp);
+  hts_set_cache_size(mi.ifile, DELLY_MERGE_CACHE);
+  mi.hdr = bcf_hdr_read(mi.ifile);
+  if (mi.hdr == NULL) return false;
+  mi.rec = bcf_init();
+  if (bcf_hdr_set_samples(mi.hdr, NULL, false) != 0) std::cerr << "Error: Failed to set sample information!" << std::endl;
+  mi.bgzfp = _mergeSeekable(mi.ifile);
+  return true;
+}
+
+inline bool
+readMergeInput(MergeInput& mi, int64_t const offset) {
+  if (mi.bgzfp != NULL) {
+    if ((bgzf_tell(mi.bgzfp) != offset) && (bgzf_seek(mi.bgzfp, offset, SEEK_SET) < 0)) return false;
+  } else {
+    // Other files are read forward up to the record ordinal
+    if (offset < mi.nrec) return false;
+    for(; mi.nrec < offset; ++mi.nrec) {
+      if (bcf_read(mi.ifile, mi.hdr, mi.rec) != 0) return false;
+    }
   }
+  if (bcf_read(mi.ifile, mi.hdr, mi.rec) != 0) return false;
+  ++mi.nrec;
+  bcf_unpack(mi.rec, BCF_UN_INFO);
+  return true;
+}
 
+inline void
+closeMergeInput(MergeInput& mi) {
+  if (mi.hdr != NULL) bcf_hdr_destroy(mi.hdr);
+  if (mi.ifile != NULL) bcf_close(mi.ifile);
+  if (mi.rec != NULL) bcf_destroy(mi.rec);
+  mi = MergeInput();
+}
+
+// Input files of the output pass: seekable files stay open across contigs up to DELLY_MERGE_OPEN_FILES,
+// all other files share one transient handle. All files share one BGZF decompression thread pool.
+struct MergeInputPool {
+  htsThreadPool tp;
+  std::vector<MergeInput> pinned;
+  std::vector<int32_t> slot;
+  MergeInput transient;
+  int32_t transientFile;
+
+  explicit MergeInputPool(uint32_t const nfiles) : slot(nfiles, -1), transientFile(-1) {
+    int32_t nthreads = 1;
+#ifdef OPENMP
+    nthreads = std::max(1, omp_get_max_threads());
+#endif
+    tp.pool = hts_tpool_init(nthreads);
+    tp.qsize = DELLY_MERGE_READAHEAD;
+  }
 };
 
+inline MergeInput*
+acquireMergeInput(MergeConfig const& c, MergeInputPool& pool, uint32_t const file) {
+  if (pool.slot[file] >= 0) return &pool.pinned[pool.slot[file]];
+  if ((int32_t) file == pool.transientFile) return &pool.transient;
+  closeMergeInput(pool.transient);
+  pool.transientFile = -1;
+  if (!openMergeInput(c.files[file], pool.transient, &pool.tp)) return NULL;
+  pool.transientFile = file;
+  if ((pool.transient.bgzfp != NULL) && (pool.pinned.size() < DELLY_MERGE_OPEN_FILES)) {
+    pool.slot[file] = pool.pinned.size();
+    pool.pinned.push_back(pool.transient);
+    pool.transient = MergeInput();
+    pool.transientFile = -1;
+    return &pool.pinned.back();
+  }
+  return &pool.transient;
+}
+
+inline void
+closeMergeInputPool(MergeInputPool& pool) {
+  for(uint32_t i = 0; i < pool.pinned.size(); ++i) closeMergeInput(pool.pinned[i]);
+  pool.pinned.clear();
+  closeMergeInput(pool.transient);
+  pool.transientFile = -1;
+  if (pool.tp.pool != NULL) hts_tpool_destroy(pool.tp.pool);
+  pool.tp.pool = NULL;
+}
+
+// Read order of the selected records: forward-only inputs once each in file and offset order, then
+// seekable inputs contig by contig. Every input is opened once here, seekable ones are pinned while the pool has room.
+inline bool
+_mergeReadOrder(MergeConfig const& c, std::vector<MergeRecord> const& mrec, MergeInputPool& pool, std::vector<uint32_t>& readOrder, uint32_t& nforward) {
+  std::vector<uint8_t> seekable(c.files.size(), 0);
+  std::vector<uint8_t> used(c.files.size(), 0);
+  for(uint32_t k = 0; k < mrec.size(); ++k) used[mrec[k].file] = 1;
+  for(uint32_t file_c = 0; file_c < c.files.size(); ++file_c) {
+    if (!used[file_c]) continue;
+    MergeInput* mi = acquireMergeInput(c, pool, file_c);
+    if (mi == NULL) {
+      std::cerr << "Error: Failed to open " << c.files[file_c].string() << std::endl;
+      return false;
+    }
+    seekable[file_c] = (mi->bgzfp != NULL);
+  }
+  readOrder.clear();
+  for(uint32_t k = 0; k < mrec.size(); ++k) {
+    if (!seekable[mrec[k].file]) readOrder.push_back(k);
+  }
+  nforward = readOrder.size();
+  std::sort(readOrder.begin(), readOrder.end(), SortMergeRecordFiles<MergeRecord>(mrec));
+  for(uint32_t k = 0; k < mrec.size(); ++k) {
+    if (seekable[mrec[k].file]) readOrder.push_back(k);
+  }
+  std::sort(readOrder.begin() + nforward, readOrder.end(), SortMergeRecordContigs<MergeRecord>(mrec));
+  return true;
+}
+
+// Write the output records [first, last) in genomic order, records of several input files get new IDs
+inline void
+_writeMergeRecords(MergeConfig& c, htsFile* fp, bcf_hdr_t* hdr_out, std::vector<MergeRecord> const& mrec, std::vector<bcf1_t*>& orec, uint32_t const first, uint32_t const last) {
+  for(uint32_t k = first; k < last; ++k) {
+    if (orec[k] == NULL) continue;
+    if (c.files.size() > 1) {
+      std::string id = _addID(mrec[k].svt);
+      std::string padNumber = boost::lexical_cast<std::string>(c.svcounter++);
+      padNumber.insert(padNumber.begin(), 8 - padNumber.length(), '0');
+      id += padNumber;
+      bcf_update_id(hdr_out, orec[k], id.c_str());
+    }
+    bcf_write1(fp, hdr_out, orec[k]);
+    bcf_destroy(orec[k]);
+    orec[k] = NULL;
+  }
+}
+
+// Release output records after a failed read
+inline void
+_destroyMergeRecords(std::vector<bcf1_t*>& orec) {
+  for(uint32_t k = 0; k < orec.size(); ++k) {
+    if (orec[k] != NULL) bcf_destroy(orec[k]);
+    orec[k] = NULL;
+  }
+}
+
+// Selected records of one SV type, one record per start and end in file order
+template<typename TGenomeIntervals>
+inline void
+_selectedRecords(int32_t const svt, TGenomeIntervals const& iSelected, std::vector<MergeRecord>& mrec) {
+  for(uint32_t tid = 0; tid < iSelected.size(); ++tid) {
+    for(uint32_t i = 0; i < iSelected[tid].size(); ) {
+      uint32_t best = i;
+      uint32_t k = i + 1;
+      for(; (k < iSelected[tid].size()) && (iSelected[tid][k].start == iSelected[tid][i].start) && (iSelected[tid][k].end == iSelected[tid][i].end); ++k) {
+	if ((iSelected[tid][k].file < iSelected[tid][best].file) || ((iSelected[tid][k].file == iSelected[tid][best].file) && (iSelected[tid][k].offset < iSelected[tid][best].offset))) best = k;
+      }
+      mrec.push_back(MergeRecord(tid, iSelected[tid][best].start, iSelected[tid][best].end, svt, iSelected[tid][best].file, iSelected[tid][best].offset));
+      i = k;
+    }
+  }
+}
+
 template<typename TPos>
 double recOverlap(TPos const s1, TPos const e1, TPos const s2, TPos const e2) {
   if ((e1 < s2) || (s1 > e2)) return 0;
@@ -84,173 +358,265 @@ double recOverlap(TPos const s1, TPos const e1, TPos const s2, TPos const e2) {
 }
 
 
-template<typename TGenomeIntervals, typename TContigMap>
-void _fillIntervalMap(MergeConfig const& c, TGenomeIntervals& iScore, TContigMap& cMap, int32_t const svtin) {
+template<typename TSVTypeIntervals, typename TContigMap>
+void _fillIntervalMap(MergeConfig const& c, uint32_t const first, uint32_t const last, TSVTypeIntervals& iScore, TContigMap& cMap) {
+  typedef typename TSVTypeIntervals::value_type TGenomeIntervals;
   typedef typename TGenomeIntervals::value_type TIntervalScores;
   typedef typename TIntervalScores::value_type IntervalScore;
 
   boost::posix_time::ptime now = boost::posix_time::second_clock::local_time();
   std::cout << '[' << boost::posix_time::to_simple_string(now) << "] " << "Reading input VCF/BCF files" << std::endl;
-  boost::progress_display show_progress( c.files.size() );
-
-
-  boost::unordered_map<int32_t, std::string> refmap;
-  for(unsigned int file_c = 0; file_c < c.files.size(); ++file_c) {
-    ++show_progress;
-    htsFile* ifile = bcf_open(c.files[file_c].string().c_str(), "r");
-    bcf_hdr_t* hdr = bcf_hdr_read(ifile);
-    bcf1_t* rec = bcf_init();
-
-    int32_t nsvend = 0;
-    int32_t* svend = NULL;
-    int32_t ninslen = 0;
-    int32_t* inslen = NULL;
-    int32_t nct = 0;
-    char* ct = NULL;
-    int32_t nsvt = 0;
-    char* svt = NULL;
-    while (bcf_read(ifile, hdr, rec) == 0) {
-      bcf_unpack(rec, BCF_UN_INFO);
-      // Check PASS
-      bool pass = true;
-      if (c.filterForPass) pass = (bcf_has_filter(hdr, rec, const_cast<char*>("PASS"))==1);
-      if (!pass) continue;
-
-      // Correct SV type
-      int32_t recsvt = -1;
-      if (bcf_get_info_string(hdr, rec, "SVTYPE", &svt, &nsvt) > 0) {
-	if (bcf_get_info_string(hdr, rec, "CT", &ct, &nct) > 0) recsvt = _decodeOrientation(std::string(ct), std::string(svt));
-	else recsvt = _decodeOrientation(std::string("NA"), std::string(svt));
-      }
-      if (recsvt != svtin) continue;
-
-      // Correct size?
-      std::string chrName(bcf_hdr_id2name(hdr, rec->rid));
-      uint32_t tid = cMap[chrName];
-      uint32_t svStart = rec->pos;
-      uint32_t svEnd = rec->pos + 2;
-      if (bcf_get_info_int32(hdr, rec, "END", &svend, &nsvend) > 0) svEnd = *svend;
-      if (recsvt == 4) {
-	// Insertion
-	uint32_t inslenVal = 0;
-	if (bcf_get_info_int32(hdr, rec, "INSLEN", &inslen, &ninslen) > 0) inslenVal = *inslen;
-	if ((inslenVal < c.minsize) || (inslenVal > c.maxsize)) continue;
-	svEnd = svStart + inslenVal; // To enable reciprocal overlap
-      } else {
-	// Other intra-chr SV
-	if ((svEnd - svStart < c.minsize) || (svEnd - svStart > c.maxsize)) continue;
+  boost::progress_display show_progress( last - first );
+
+  // Parse input files in parallel, each thread collects its own intervals
+#pragma omp parallel default(shared)
+  {
+    TSVTypeIntervals tScore(iScore.size());
+    for(uint32_t svt = 0; svt < iScore.size(); ++svt) tScore[svt].resize(iScore[svt].size(), TIntervalScores());
+
+#pragma omp for schedule(dynamic)
+    for(unsigned int file_c = first; file_c < last; ++file_c) {
+#pragma omp critical
+      {
+	++show_progress;
       }
+      htsFile* ifile = bcf_open(c.files[file_c].string().c_str(), "r");
+      bcf_hdr_t* hdr = bcf_hdr_read(ifile);
+      bcf1_t* rec = bcf_init();
+
+      // Contig and INFO key IDs of this file
+      std::vector<uint32_t> tidmap;
+      int nseq = 0;
+      const char** seqnames = bcf_hdr_seqnames(hdr, &nseq);
+      for(int32_t i = 0; i < nseq; ++i) tidmap.push_back(cMap.find(std::string(bcf_hdr_id2name(hdr, i)))->second);
+      if (seqnames != NULL) free(seqnames);
+      int32_t svtId = bcf_hdr_id2int(hdr, BCF_DT_ID, "SVTYPE");
+      int32_t ctId = bcf_hdr_id2int(hdr, BCF_DT_ID, "CT");
+      int32_t endId = bcf_hdr_id2int(hdr, BCF_DT_ID, "END");
+      int32_t inslenId = bcf_hdr_id2int(hdr, BCF_DT_ID, "INSLEN");
+      int32_t preciseId = bcf_hdr_id2int(hdr, BCF_DT_ID, "PRECISE");
+
+      // Reused buffers
+      std::string svt;
+      std::string ct;
+      SVFormat fmt;
+      _svFormat(hdr, fmt);
+      BGZF* bgzfp = _mergeSeekable(ifile);
+      int64_t nrec = 0;
+      int64_t offset = nrec;
+      if (bgzfp != NULL) offset = bgzf_tell(bgzfp);
+      while (bcf_read(ifile, hdr, rec) == 0) {
+	// Offset of this and the next record
+	int64_t recOffset = offset;
+	++nrec;
+	if (bgzfp != NULL) offset = bgzf_tell(bgzfp);
+	else offset = nrec;
+	bcf_unpack(rec, BCF_UN_INFO);
+	// Check PASS
+	bool pass = true;
+	if (c.filterForPass) pass = (bcf_has_filter(hdr, rec, const_cast<char*>("PASS"))==1);
+	if (!pass) continue;
+
+	// Correct SV type
+	int32_t recsvt = -1;
+	if (_getInfoString(rec, svtId, svt)) {
+	  if (_getInfoString(rec, ctId, ct)) recsvt = _decodeOrientation(ct, svt);
+	  else recsvt = _decodeOrientation(std::string("NA"), svt);
+	}
+	// SV types being merged have one interval vector per contig
+	if ((recsvt < 0) || (recsvt >= (int32_t) iScore.size()) || (iScore[recsvt].empty())) continue;
+
+	// Correct size?
+	uint32_t tid = tidmap[rec->rid];
+	uint32_t svStart = rec->pos;
+	uint32_t svEnd = rec->pos + 2;
+	int32_t val = 0;
+	if (_getInfoInt32(rec, endId, val)) svEnd = val;
+	if (recsvt == 4) {
+	  // Insertion
+	  uint32_t inslenVal = 0;
+	  if (_getInfoInt32(rec, inslenId, val)) inslenVal = val;
+	  if ((inslenVal < c.minsize) || (inslenVal > c.maxsize)) continue;
+	  svEnd = svStart + inslenVal; // To enable reciprocal overlap
+	} else {
+	  // Other intra-chr SV
+	  if ((svEnd - svStart < c.minsize) || (svEnd - svStart > c.maxsize)) continue;
+	}
 
-      // Precise?
-      bool precise = false;
-      if (bcf_get_info_flag(hdr, rec, "PRECISE", 0, 0) > 0) precise=true;
-      if ((c.filterForPrecise) && (!precise)) continue;
-
-      // Variant allele frequency filter
-      if ((c.vaf > 0) || (c.coverage > 0)) {
-	float maxvaf = 0;
-	uint32_t maxcov = 0;
-	bcf_unpack(rec, BCF_UN_ALL);
-	int ndv = 0;
-	int32_t* dv = NULL;
-	int ndr = 0;
-	int32_t* dr = NULL;
-	int nrv = 0;
-	int32_t* rv = NULL;
-	int nrr = 0;
-	int32_t* rr = NULL;
-	int ngt = 0;
-	int32_t* gt = NULL;
-	bcf_get_format_int32(hdr, rec, "DV", &dv, &ndv);
-	bcf_get_format_int32(hdr, rec, "DR", &dr, &ndr);
-	bcf_get_format_int32(hdr, rec, "RV", &rv, &nrv);
-	bcf_get_format_int32(hdr, rec, "RR", &rr, &nrr);
-	bcf_get_format_int32(hdr, rec, "GT", &gt, &ngt);
-	for(int32_t i = 0; i < bcf_hdr_nsamples(hdr); ++i) {
-	  if ((bcf_gt_allele(gt[i*2]) != -1) && (bcf_gt_allele(gt[i*2 + 1]) != -1)) {
-	    uint32_t supportsum = 0;
-	    if (precise) supportsum = rr[i] + rv[i];
-	    else supportsum = dr[i] + dv[i];
-	    if (supportsum > 0) {
-	      double vaf = 0;
-	      if (precise) vaf = (double) rv[i] / (double) supportsum;
-	      else vaf = (double) dv[i] / (double) supportsum;
-	      if (vaf > maxvaf) maxvaf = vaf;
-	      if (supportsum > maxcov) maxcov = supportsum; 
+	// Precise?
+	bool precise = _getInfoFlag(rec, preciseId);
+	if ((c.filterForPrecise) && (!precise)) continue;
+
+	// Variant allele frequency filter
+	if ((c.vaf > 0) || (c.coverage > 0)) {
+	  float maxvaf = 0;
+	  uint32_t maxcov = 0;
+	  // Paired-end support for imprecise, split-read support for precise SVs
+	  FormatField* fsup = &fmt.dv;
+	  FormatField* fref = &fmt.dr;
+	  if (precise) {
+	    fsup = &fmt.rv;
+	    fref = &fmt.rr;
+	  }
+	  if ((_getFormatInt32(rec, fmt.gt)) && (fmt.gt.n >= 2) && (_getFormatInt32(rec, *fsup)) && (_getFormatInt32(rec, *fref))) {
+	    for(int32_t i = 0; i < bcf_hdr_nsamples(hdr); ++i) {
+	      int32_t const* gt = _formatInt32(fmt.gt, i);
+	      if ((bcf_gt_allele(gt[0]) == -1) || (bcf_gt_allele(gt[1]) == -1)) continue;
+	      int32_t sup = *_formatInt32(*fsup, i);
+	      uint32_t supportsum = *_formatInt32(*fref, i) + sup;
+	      if (supportsum > 0) {
+		double vaf = (double) sup / (double) supportsum;
+		if (vaf > maxvaf) maxvaf = vaf;
+		if (supportsum > maxcov) maxcov = supportsum; 
+	      }
 	    }
 	  }
+	  if (recsvt != 9) {
+	    if ((maxvaf < c.vaf) || (maxcov < c.coverage)) continue;
+	  }
 	}
-	// Debug
-	//std::cerr << maxcov << '\t' << maxvaf << std::endl;
-	if (dv != NULL) free(dv);
-	if (dr != NULL) free(dr);
-	if (rv != NULL) free(rv);
-	if (rr != NULL) free(rr);
-	if (gt != NULL) free(gt);
-	if (recsvt != 9) {
-	  if ((maxvaf < c.vaf) || (maxcov < c.coverage)) continue;
-	}
+	// Store the interval
+	tScore[recsvt][tid].push_back(IntervalScore(svStart, svEnd, rec->qual, file_c, recOffset));
+      }
+      bcf_hdr_destroy(hdr);
+      bcf_close(ifile);
+      bcf_destroy(rec);
+    }
+
+    // Collect thread intervals
+#pragma omp critical
+    {
+      for(uint32_t svt = 0; svt < tScore.size(); ++svt) {
+	for(uint32_t tid = 0; tid < tScore[svt].size(); ++tid) iScore[svt][tid].insert(iScore[svt][tid].end(), tScore[svt][tid].begin(), tScore[svt][tid].end());
       }
-      // Store the interval
-      //std::cerr << tid << ',' << svStart << ',' << svEnd << ',' << rec->qual << std::endl;
-      iScore[tid].push_back(IntervalScore(svStart, svEnd, rec->qual));
     }
-    if (svend != NULL) free(svend);
-    if (inslen != NULL) free(inslen);
-    if (ct != NULL) free(ct);
-    if (svt != NULL) free(svt);
-    bcf_hdr_destroy(hdr);
-    bcf_close(ifile);
-    bcf_destroy(rec);
   }
+
+  _sortIntervals(iScore);
 }
 
-template<typename TGenomeIntervals>
-void _processIntervalMap(MergeConfig const& c, TGenomeIntervals const& iScore, TGenomeIntervals& iSelected, int32_t const svtin) {
+// Sort intervals of all SV types and contigs in parallel, identical intervals of several records keep the first record
+template<typename TSVTypeIntervals>
+void _sortIntervals(TSVTypeIntervals& iScore) {
+  typedef typename TSVTypeIntervals::value_type TGenomeIntervals;
   typedef typename TGenomeIntervals::value_type TIntervalScores;
   typedef typename TIntervalScores::value_type IntervalScore;
 
-  boost::posix_time::ptime now = boost::posix_time::second_clock::local_time();
-  std::cout << '[' << boost::posix_time::to_simple_string(now) << "] " << "Merging SVs" << std::endl;
-  boost::progress_display show_progress( iScore.size() );
-
-  unsigned int seqId = 0;
-  for(typename TGenomeIntervals::const_iterator iG = iScore.begin(); iG != iScore.end(); ++iG, ++seqId) {
-    ++show_progress;
-    typedef std::vector<bool> TIntervalSelector;
-    TIntervalSelector keepInterval;
-    keepInterval.resize(iG->size(), true);
-    typename TIntervalSelector::iterator iK = keepInterval.begin();
-    for(typename TIntervalScores::const_iterator iS = iG->begin(); iS != iG->end(); ++iS, ++iK) {
-      typename TIntervalScores::const_iterator iSNext = iS;
-      typename TIntervalSelector::iterator iKNext = iK;
-      ++iSNext; ++iKNext;
-      for(; iSNext != iG->end(); ++iSNext, ++iKNext) {
-	if (iSNext->start - iS->start > c.bpoffset) break;
+  std::vector<std::pair<uint32_t, uint32_t> > slots;
+  for(uint32_t svt = 0; svt < iScore.size(); ++svt) {
+    for(uint32_t tid = 0; tid < iScore[svt].size(); ++tid) {
+      if (!iScore[svt][tid].empty()) slots.push_back(std::make_pair(svt, tid));
+    }
+  }
+#pragma omp parallel for default(shared) schedule(dynamic)
+  for(uint32_t k = 0; k < slots.size(); ++k) {
+    TIntervalScores& iv = iScore[slots[k].first][slots[k].second];
+    std::sort(iv.begin(), iv.end(), SortIScores<IntervalScore>());
+    iv.erase(std::unique(iv.begin(), iv.end(), SameIScores<IntervalScore>()), iv.end());
+  }
+}
+
+// Min-heap of sorted runs keyed on the current interval of each run
+template<typename TIntervalScores>
+struct SortRunHeap : public std::binary_function<uint32_t, uint32_t, bool>
+{
+  typedef typename TIntervalScores::value_type IntervalScore;
+  TIntervalScores const& iv;
+  std::vector<uint64_t> const& pos;
+
+  SortRunHeap(TIntervalScores const& i, std::vector<uint64_t> const& p) : iv(i), pos(p) {}
+
+  inline bool operator()(uint32_t const a, uint32_t const b) const {
+    SortIScores<IntervalScore> lt;
+    if (lt(iv[pos[b]], iv[pos[a]])) return true;
+    if (lt(iv[pos[a]], iv[pos[b]])) return false;
+    return (a > b);
+  }
+};
+
+// K-way merge of the sorted runs [bounds[r], bounds[r+1]) of iv, identical intervals of several records keep the first record
+template<typename TIntervalScores>
+inline void
+_mergeSortedRuns(TIntervalScores& iv, std::vector<uint64_t> const& bounds) {
+  typedef typename TIntervalScores::value_type IntervalScore;
+  std::vector<uint64_t> pos;
+  std::vector<uint32_t> heap;
+  for(uint32_t r = 0; r + 1 < bounds.size(); ++r) {
+    pos.push_back(bounds[r]);
+    if (bounds[r] < bounds[r + 1]) heap.push_back(r);
+  }
+  SortRunHeap<TIntervalScores> cmp(iv, pos);
+  std::make_heap(heap.begin(), heap.end(), cmp);
+  TIntervalScores merged;
+  merged.reserve(iv.size());
+  while (!heap.empty()) {
+    std::pop_heap(heap.begin(), heap.end(), cmp);
+    uint32_t r = heap.back();
+    if ((merged.empty()) || (!SameIScores<IntervalScore>()(merged.back(), iv[pos[r]]))) merged.push_back(iv[pos[r]]);
+    if (++pos[r] < bounds[r + 1]) std::push_heap(heap.begin(), heap.end(), cmp);
+    else heap.pop_back();
+  }
+  iv.swap(merged);
+}
+
+// Best intervals of one SV type and contig, iG is sorted by start and end
+template<typename TIntervalScores>
+void _selectIntervals(MergeConfig const& c, int32_t const svt, TIntervalScores const& iG, TIntervalScores& selected) {
+  // Sweep over starts, active intervals within bpoffset of the current start are indexed by end
+  typedef std::pair<uint32_t, uint32_t> TEndIndex;
+  typedef std::set<TEndIndex> TActive;
+  TActive active;
+  std::vector<bool> keepInterval(iG.size(), true);
+  uint32_t first = 0;
+  for(uint32_t j = 0; j < iG.size(); ++j) {
+    for(; iG[j].start - iG[first].start > c.bpoffset; ++first) active.erase(std::make_pair(iG[first].end, first));
+    uint32_t endLow = 0;
+    if (iG[j].end >= c.bpoffset) endLow = iG[j].end - c.bpoffset + 1;
+    uint64_t endHigh = (uint64_t) iG[j].end + (uint64_t) c.bpoffset;
+    for(typename TActive::const_iterator itA = active.lower_bound(std::make_pair(endLow, (uint32_t) 0)); ((itA != active.end()) && ((uint64_t) itA->first < endHigh)); ++itA) {
+      uint32_t i = itA->second;
+      if ((_translocation(svt)) || (recOverlap(iG[i].start, iG[i].end, iG[j].start, iG[j].end) >= c.recoverlap)) {
+	if (iG[i].score < iG[j].score) keepInterval[i] = false;
+	else if (iG[j].score < iG[i].score) keepInterval[j] = false;
 	else {
-	  if (((iSNext->end > iS->end) && (iSNext->end - iS->end < c.bpoffset)) || ((iSNext->end <= iS->end) &&(iS->end - iSNext->end < c.bpoffset))) {
-	    if ((_translocation(svtin)) || (recOverlap(iS->start, iS->end, iSNext->start, iSNext->end) >= c.recoverlap)) {
-	      if (iS->score < iSNext->score) *iK = false;
-	      else if (iSNext ->score < iS->score) *iKNext = false;
-	      else {
-		if (iS->start < iSNext->start) *iKNext = false;
-		else if (iS->end < iSNext->end) *iKNext = false;
-		else *iK = false;
-	      }
-	    }
-	  }
+	  if (iG[i].start < iG[j].start) keepInterval[j] = false;
+	  else if (iG[i].end < iG[j].end) keepInterval[j] = false;
+	  else keepInterval[i] = false;
 	}
       }
-      if (*iK) iSelected[seqId].push_back(IntervalScore(iS->start, iS->end, iS->score));
     }
+    active.insert(std::make_pair(iG[j].end, j));
+  }
+  for(uint32_t i = 0; i < iG.size(); ++i) {
+    if (keepInterval[i]) selected.push_back(iG[i]);
   }
 }
 
-template<typename TGenomeIntervals, typename TContigMap>
-void _outputSelectedIntervals(MergeConfig& c, TGenomeIntervals const& iSelected, TContigMap& cMap, int32_t const svtin) {
-  typedef typename TGenomeIntervals::value_type TIntervalScores;
-  typedef typename TIntervalScores::value_type IntervalScore;
+template<typename TSVTypeIntervals>
+void _processIntervalMap(MergeConfig const& c, TSVTypeIntervals const& iScore, TSVTypeIntervals& iSelected) {
+  boost::posix_time::ptime now = boost::posix_time::second_clock::local_time();
+  std::cout << '[' << boost::posix_time::to_simple_string(now) << "] " << "Merging SVs" << std::endl;
+
+  // SV types and contigs are independent
+  std::vector<std::pair<uint32_t, uint32_t> > slots;
+  for(uint32_t svt = 0; svt < iScore.size(); ++svt) {
+    for(uint32_t seqId = 0; seqId < iScore[svt].size(); ++seqId) {
+      if (!iScore[svt][seqId].empty()) slots.push_back(std::make_pair(svt, seqId));
+    }
+  }
+  boost::progress_display show_progress( slots.size() );
+#pragma omp parallel for default(shared) schedule(dynamic)
+  for(uint32_t k = 0; k < slots.size(); ++k) {
+    _selectIntervals(c, slots[k].first, iScore[slots[k].first][slots[k].second], iSelected[slots[k].first][slots[k].second]);
+#pragma omp critical
+    {
+      ++show_progress;
+    }
+  }
+}
 
+template<typename TSVTypeIntervals, typename TContigMap>
+bool _outputSelectedIntervals(MergeConfig& c, TSVTypeIntervals const& iSelected, TContigMap& cMap) {
   boost::posix_time::ptime now = boost::posix_time::second_clock::local_time();
   std::cout << '[' << boost::posix_time::to_simple_string(now) << "] " << "Filtering SVs" << std::endl;
 
@@ -303,39 +669,19 @@ void _outputSelectedIntervals(MergeConfig& c, TGenomeIntervals const& iSelected,
   bcf_hdr_add_sample(hdr_out, NULL);
   if (bcf_hdr_write(fp, hdr_out) != 0) std::cerr << "Error: Failed to write BCF header!" << std::endl;
 
-  // Duplicate filter (identical start, end, score values)
-  typedef std::pair<uint32_t, uint32_t> TStartEnd;
-  typedef std::set<TStartEnd> TIntervalSet;
-  typedef std::vector<TIntervalSet> TGenomicIntervalSet;
-  TGenomicIntervalSet gis(numseq);
-
-  // Parse input VCF files
-  bcf1_t *rout = bcf_init();
-  typedef std::vector<htsFile*> THtsFile;
-  typedef std::vector<bcf_hdr_t*> TBcfHeader;
-  typedef std::vector<bcf1_t*> TBcfRecord;
-  typedef std::vector<bool> TEof;
-  THtsFile ifile(c.files.size());
-  TBcfHeader hdr(c.files.size());
-  TBcfRecord rec(c.files.size());
-  TEof eof(c.files.size());
-  uint32_t allEOF = 0;
-  for(unsigned int file_c = 0; file_c < c.files.size(); ++file_c) {
-    ifile[file_c] = bcf_open(c.files[file_c].string().c_str(), "r");
-    hdr[file_c] = bcf_hdr_read(ifile[file_c]);
-    if (bcf_hdr_set_samples(hdr[file_c], NULL, false) != 0) std::cerr << "Error: Failed to set sample information!" << std::endl;
-    rec[file_c] = bcf_init();
-    if (bcf_read(ifile[file_c], hdr[file_c], rec[file_c]) == 0) {
-      bcf_unpack(rec[file_c], BCF_UN_INFO);
-      eof[file_c] = false;
-    } else {
-      ++allEOF;
-      eof[file_c] = true;
-    }
-  }
+  // Selected records in output order
+  std::vector<MergeRecord> mrec;
+  for(uint32_t svt = 0; svt < iSelected.size(); ++svt) _selectedRecords(svt, iSelected[svt], mrec);
+  std::sort(mrec.begin(), mrec.end(), SortMergeRecords<MergeRecord>());
+
+  // Build the output records, records of forward-only inputs are kept until their contig is written
+  MergeInputPool pool(c.files.size());
+  std::vector<uint32_t> readOrder;
+  uint32_t nforward = 0;
+  bool valid = _mergeReadOrder(c, mrec, pool, readOrder, nforward);
+  std::vector<bcf1_t*> orec(mrec.size(), NULL);
+  uint32_t flushed = 0;
 
-  int32_t nsvend = 0;
-  int32_t* svend = NULL;
   int32_t npe = 0;
   int32_t* pe = NULL;
   int32_t nsr = 0;
@@ -352,10 +698,6 @@ void _outputSelectedIntervals(MergeConfig& c, TGenomeIntervals const& iSelected,
   int32_t* srmapq = NULL;
   int32_t nsrq = 0;
   float* srq = NULL;
-  int32_t nct = 0;
-  char* ct = NULL;
-  int32_t nsvt = 0;
-  char* svt = NULL;
   int32_t nchr2 = 0;
   char* chr2 = NULL;
   int32_t ncipos = 0;
@@ -366,163 +708,116 @@ void _outputSelectedIntervals(MergeConfig& c, TGenomeIntervals const& iSelected,
   float* ce = NULL;
   int32_t ncons = 0;
   char* cons = NULL;
-  while (allEOF < c.files.size()) {
-    // Find next sorted record
-    int32_t idx = -1;
-    for(unsigned int file_c = 0; file_c < c.files.size(); ++file_c) {
-      if (!eof[file_c]) {
-	if ((idx < 0) || (rec[idx]->rid > rec[file_c]->rid) || ((rec[idx]->rid == rec[file_c]->rid) && (rec[idx]->pos > rec[file_c]->pos))) idx = file_c;
-      }
+  for(uint32_t i = 0; ((valid) && (i < readOrder.size())); ++i) {
+    uint32_t k = readOrder[i];
+
+    // Seekable inputs are read contig by contig, write the records of all previous contigs
+    if (i >= nforward) {
+      uint32_t contigStart = flushed;
+      for(; mrec[contigStart].tid < mrec[k].tid; ++contigStart);
+      _writeMergeRecords(c, fp, hdr_out, mrec, orec, flushed, contigStart);
+      flushed = contigStart;
     }
 
-    // Correct SV type
-    int32_t recsvt = -1;
-    if ((bcf_get_info_string(hdr[idx], rec[idx], "SVTYPE", &svt, &nsvt) > 0) && (bcf_get_info_string(hdr[idx], rec[idx], "CT", &ct, &nct) > 0)) recsvt = _decodeOrientation(std::string(ct), std::string(svt));
-    if (recsvt == svtin) {
-      // Check PASS
-      bool pass = true;
-      if (c.filterForPass) pass = (bcf_has_filter(hdr[idx], rec[idx], const_cast<char*>("PASS"))==1);
-
-      // Check PRECISE
-      bool precise = false;
-      bool passPrecise = true;
-      if (bcf_get_info_flag(hdr[idx], rec[idx], "PRECISE", 0, 0) > 0) precise=true;
-      if ((c.filterForPrecise) && (!precise)) passPrecise = false;
-
-      // Check PASS and precise
-      if ((passPrecise) && (pass)) {
-	// Correct size
-	std::string chrName(bcf_hdr_id2name(hdr[idx], rec[idx]->rid));
-	uint32_t tid = cMap[chrName];
-	uint32_t svStart = rec[idx]->pos;
-	uint32_t svEnd = svStart + 1;
-	if (bcf_get_info_int32(hdr[idx], rec[idx], "END", &svend, &nsvend) > 0) svEnd = *svend;
-	unsigned int inslenVal = 0;
-	if (bcf_get_info_int32(hdr[idx], rec[idx], "INSLEN", &inslen, &ninslen) > 0) inslenVal = *inslen;
-	if (recsvt == 4) svEnd = svStart + inslenVal; // To enable reciprocal overlap
-
-	// Parse INFO fields
-	if ((std::string(svt) == "BND") || ((std::string(svt) == "INS") && (inslenVal >= c.minsize) && (inslenVal <= c.maxsize)) || ((std::string(svt) != "BND") && (std::string(svt) != "INS") && (svEnd - svStart >= c.minsize) && (svEnd - svStart <= c.maxsize))) {
-	  unsigned int peSupport = 0;
-	  if (bcf_get_info_int32(hdr[idx], rec[idx], "PE", &pe, &npe) > 0) peSupport = *pe;
-	  unsigned int srSupport = 0;
-	  if (bcf_get_info_int32(hdr[idx], rec[idx], "SR", &sr, &nsr) > 0) srSupport = *sr;
-	  // Remove this line
-	  //if (srSupport > 0) precise = true;
-	  
-	  int32_t peMapQuality = 0;
-	  if (bcf_get_info_int32(hdr[idx], rec[idx], "MAPQ", &mapq, &nmapq) > 0) peMapQuality = *mapq;
-	  int32_t srMapQuality = 0;
-	  if (bcf_get_info_int32(hdr[idx], rec[idx], "SRMAPQ", &srmapq, &nsrmapq) > 0) srMapQuality = *srmapq;
-	  std::string chr2Name = chrName;
-	  int32_t pos2val = 0;
-	  if (bcf_get_info_string(hdr[idx], rec[idx], "CHR2", &chr2, &nchr2) > 0) {
-	    chr2Name = std::string(chr2);
-	    if (bcf_get_info_int32(hdr[idx], rec[idx], "POS2", &pos2, &npos2) > 0) pos2val = *pos2;
-	    //mtid = cMap[chr2Name];
-	  }
-	  int32_t score = rec[idx]->qual;
-	  
-	  // Is this a selected interval
-	  typename TIntervalScores::const_iterator iter = std::lower_bound(iSelected[tid].begin(), iSelected[tid].end(), IntervalScore(svStart, svEnd, score), SortIScores<IntervalScore>());
-	  bool foundInterval = false;
-	  for(; (iter != iSelected[tid].end()) && (iter->start == svStart); ++iter) {
-	    if ((iter->start == svStart) && (iter->end == svEnd) && (iter->score == score)) {
-	      // Duplicate?
-	      if (gis[tid].find(std::make_pair(svStart, svEnd)) == gis[tid].end()) {
-		foundInterval = true;
-		gis[tid].insert(std::make_pair(svStart, svEnd));
-	      }
-	      break;
-	    }
-	  }
-	  if (foundInterval) {
-	    // Fetch missing INFO fields
-	    unsigned int homlenVal = 0;
-	    if (bcf_get_info_int32(hdr[idx], rec[idx], "HOMLEN", &homlen, &nhomlen) > 0) homlenVal = *homlen;
-	    bcf_get_info_int32(hdr[idx], rec[idx], "CIPOS", &cipos, &ncipos);
-	    bcf_get_info_int32(hdr[idx], rec[idx], "CIEND", &ciend, &nciend);
-	    float srAlignQuality = 0;
-	    if (bcf_get_info_float(hdr[idx], rec[idx], "SRQ", &srq, &nsrq) > 0) srAlignQuality = *srq;
-
-	    std::string consensus;
-	    float ceVal = 0;
-	    if (precise) {
-	      if (bcf_get_info_float(hdr[idx], rec[idx], "CE", &ce, &nce) > 0) ceVal = *ce;
-	      if (bcf_get_info_string(hdr[idx], rec[idx], "CONSENSUS", &cons, &ncons) > 0) consensus = boost::to_upper_copy(std::string(cons));
-	    }
-	    
-	    // Create new record
-	    rout->rid = bcf_hdr_name2id(hdr_out, chrName.c_str());
-	    rout->pos = rec[idx]->pos;
-	    rout->qual = rec[idx]->qual;
-	    std::string id;
-	    if (c.files.size() == 1) id = std::string(rec[idx]->d.id); // Within one VCF file IDs are unique
-	    else {
-	      id += _addID(svtin);
-	      std::string padNumber = boost::lexical_cast<std::string>(c.svcounter++);
-	      padNumber.insert(padNumber.begin(), 8 - padNumber.length(), '0');
-	      id += padNumber;
-	    }
-	    bcf_update_id(hdr_out, rout, id.c_str());
-	    std::string refAllele = rec[idx]->d.allele[0];
-	    std::string altAllele = rec[idx]->d.allele[1];
-	    std::string alleles = refAllele + "," + altAllele;
-	    bcf_update_alleles_str(hdr_out, rout, alleles.c_str());
-	    int32_t tmppass = bcf_hdr_id2int(hdr_out, BCF_DT_ID, "PASS");
-	    bcf_update_filter(hdr_out, rout, &tmppass, 1);
-	    
-	    // Add INFO fields
-	    if (precise) bcf_update_info_flag(hdr_out, rout, "PRECISE", NULL, 1);
-	    else bcf_update_info_flag(hdr_out, rout, "IMPRECISE", NULL, 1);
-	    bcf_update_info_string(hdr_out, rout, "SVTYPE", _addID(svtin).c_str());
-	    std::string dellyVersion("EMBL.DELLYv");
-	    dellyVersion += dellyVersionNumber;
-	    bcf_update_info_string(hdr_out,rout, "SVMETHOD", dellyVersion.c_str());
-	    bcf_update_info_int32(hdr_out, rout, "END", &svEnd, 1);
-	    if (svtin >= DELLY_SVT_TRANS) {
-	      bcf_update_info_string(hdr_out,rout, "CHR2", chr2Name.c_str());
-	      bcf_update_info_int32(hdr_out, rout, "POS2", &pos2val, 1);
-	    }
-	    if (svtin == 4) {
-	      bcf_update_info_int32(hdr_out, rout, "SVLEN", &inslenVal, 1);
-	    }
-	    bcf_update_info_int32(hdr_out, rout, "PE", &peSupport, 1);
-	    int32_t tmpi = peMapQuality;
-	    bcf_update_info_int32(hdr_out, rout, "MAPQ", &tmpi, 1);
-	    bcf_update_info_string(hdr_out, rout, "CT", _addOrientation(svtin).c_str());
-	    bcf_update_info_int32(hdr_out, rout, "CIPOS", cipos, 2);
-	    bcf_update_info_int32(hdr_out, rout, "CIEND", ciend, 2);
-	    if (precise) {
-	      int32_t tmpi = srMapQuality;
-	      bcf_update_info_int32(hdr_out, rout, "SRMAPQ", &tmpi, 1);
-	      bcf_update_info_int32(hdr_out, rout, "INSLEN", &inslenVal, 1);
-	      bcf_update_info_int32(hdr_out, rout, "HOMLEN", &homlenVal, 1);
-	      bcf_update_info_int32(hdr_out, rout, "SR", &srSupport, 1);
-	      bcf_update_info_float(hdr_out, rout, "SRQ", &srAlignQuality, 1);
-	      if (consensus.size()) {
-		bcf_update_info_string(hdr_out, rout, "CONSENSUS", consensus.c_str());
-		bcf_update_info_float(hdr_out, rout, "CE", &ceVal, 1);
-	      }
-	    }
-	
-	    // Write record
-	    bcf_write1(fp, hdr_out, rout);
-	    bcf_clear1(rout);	  
-	    //std::cerr << bcf_hdr_id2name(hdr[idx], tid) << '\t' << svStart << '\t' << svEnd << std::endl;
-	  }
-	}
-      }
+    MergeInput* mi = acquireMergeInput(c, pool, mrec[k].file);
+    if (mi == NULL) {
+      std::cerr << "Error: Failed to open " << c.files[mrec[k].file].string() << std::endl;
+      valid = false;
+      break;
     }
-
-    // Fetch next record
-    if (bcf_read(ifile[idx], hdr[idx], rec[idx]) == 0) bcf_unpack(rec[idx], BCF_UN_INFO);
-    else {
-      ++allEOF;
-      eof[idx] = true;
+    if (!readMergeInput(*mi, mrec[k].offset)) {
+      std::cerr << "Error: Failed to read record of " << c.files[mrec[k].file].string() << std::endl;
+      valid = false;
+      break;
+    }
+    bcf_hdr_t* hdr = mi->hdr;
+    bcf1_t* rec = mi->rec;
+    int32_t recsvt = mrec[k].svt;
+    bool precise = false;
+    if (bcf_get_info_flag(hdr, rec, "PRECISE", 0, 0) > 0) precise=true;
+    std::string chrName = rMap[mrec[k].tid];
+    uint32_t svEnd = mrec[k].end;
+    unsigned int inslenVal = 0;
+    if (bcf_get_info_int32(hdr, rec, "INSLEN", &inslen, &ninslen) > 0) inslenVal = *inslen;
+
+    // Parse INFO fields
+    unsigned int peSupport = 0;
+    if (bcf_get_info_int32(hdr, rec, "PE", &pe, &npe) > 0) peSupport = *pe;
+    unsigned int srSupport = 0;
+    if (bcf_get_info_int32(hdr, rec, "SR", &sr, &nsr) > 0) srSupport = *sr;
+    int32_t peMapQuality = 0;
+    if (bcf_get_info_int32(hdr, rec, "MAPQ", &mapq, &nmapq) > 0) peMapQuality = *mapq;
+    int32_t srMapQuality = 0;
+    if (bcf_get_info_int32(hdr, rec, "SRMAPQ", &srmapq, &nsrmapq) > 0) srMapQuality = *srmapq;
+    std::string chr2Name = chrName;
+    int32_t pos2val = 0;
+    if (bcf_get_info_string(hdr, rec, "CHR2", &chr2, &nchr2) > 0) {
+      chr2Name = std::string(chr2);
+      if (bcf_get_info_int32(hdr, rec, "POS2", &pos2, &npos2) > 0) pos2val = *pos2;
     }
+    unsigned int homlenVal = 0;
+    if (bcf_get_info_int32(hdr, rec, "HOMLEN", &homlen, &nhomlen) > 0) homlenVal = *homlen;
+    bcf_get_info_int32(hdr, rec, "CIPOS", &cipos, &ncipos);
+    bcf_get_info_int32(hdr, rec, "CIEND", &ciend, &nciend);
+    float srAlignQuality = 0;
+    if (bcf_get_info_float(hdr, rec, "SRQ", &srq, &nsrq) > 0) srAlignQuality = *srq;
+    std::string consensus;
+    float ceVal = 0;
+    if (precise) {
+      if (bcf_get_info_float(hdr, rec, "CE", &ce, &nce) > 0) ceVal = *ce;
+      if (bcf_get_info_string(hdr, rec, "CONSENSUS", &cons, &ncons) > 0) consensus = boost::to_upper_copy(std::string(cons));
+    }
+    
+    // Create new record, IDs of several input files are assigned in output order
+    bcf1_t* rout = bcf_init();
+    orec[k] = rout;
+    rout->rid = bcf_hdr_name2id(hdr_out, chrName.c_str());
+    rout->pos = rec->pos;
+    rout->qual = rec->qual;
+    if (c.files.size() == 1) bcf_update_id(hdr_out, rout, rec->d.id); // Within one VCF file IDs are unique
+    std::string refAllele = rec->d.allele[0];
+    std::string altAllele = rec->d.allele[1];
+    std::string alleles = refAllele + "," + altAllele;
+    bcf_update_alleles_str(hdr_out, rout, alleles.c_str());
+    int32_t tmppass = bcf_hdr_id2int(hdr_out, BCF_DT_ID, "PASS");
+    bcf_update_filter(hdr_out, rout, &tmppass, 1);
+    
+    // Add INFO fields
+    if (precise) bcf_update_info_flag(hdr_out, rout, "PRECISE", NULL, 1);
+    else bcf_update_info_flag(hdr_out, rout, "IMPRECISE", NULL, 1);
+    bcf_update_info_string(hdr_out, rout, "SVTYPE", _addID(recsvt).c_str());
+    std::string dellyVersion("EMBL.DELLYv");
+    dellyVersion += dellyVersionNumber;
+    bcf_update_info_string(hdr_out,rout, "SVMETHOD", dellyVersion.c_str());
+    bcf_update_info_int32(hdr_out, rout, "END", &svEnd, 1);
+    if (recsvt >= DELLY_SVT_TRANS) {
+      bcf_update_info_string(hdr_out,rout, "CHR2", chr2Name.c_str());
+      bcf_update_info_int32(hdr_out, rout, "POS2", &pos2val, 1);
+    }
+    if (recsvt == 4) {
+      bcf_update_info_int32(hdr_out, rout, "SVLEN", &inslenVal, 1);
+    }
+    bcf_update_info_int32(hdr_out, rout, "PE", &peSupport, 1);
+    int32_t tmpi = peMapQuality;
+    bcf_update_info_int32(hdr_out, rout, "MAPQ", &tmpi, 1);
+    bcf_update_info_string(hdr_out, rout, "CT", _addOrientation(recsvt).c_str());
+    bcf_update_info_int32(hdr_out, rout, "CIPOS", cipos, 2);
+    bcf_update_info_int32(hdr_out, rout, "CIEND", ciend, 2);
+    if (precise) {
+      int32_t tmpi = srMapQuality;
+      bcf_update_info_int32(hdr_out, rout, "SRMAPQ", &tmpi, 1);
+      bcf_update_info_int32(hdr_out, rout, "INSLEN", &inslenVal, 1);
+      bcf_update_info_int32(hdr_out, rout, "HOMLEN", &homlenVal, 1);
+      bcf_update_info_int32(hdr_out, rout, "SR", &srSupport, 1);
+      bcf_update_info_float(hdr_out, rout, "SRQ", &srAlignQuality, 1);
+      if (consensus.size()) {
+	bcf_update_info_string(hdr_out, rout, "CONSENSUS", consensus.c_str());
+	bcf_update_info_float(hdr_out, rout, "CE", &ceVal, 1);
+      }
+    }
+	
   }
-  if (svend != NULL) free(svend);
+  closeMergeInputPool(pool);
   if (pe != NULL) free(pe);
   if (sr != NULL) free(sr);
   if (homlen != NULL) free(homlen);
@@ -530,38 +825,30 @@ void _outputSelectedIntervals(MergeConfig& c, TGenomeIntervals const& iSelected,
   if (pos2 != NULL) free(pos2);
   if (mapq != NULL) free(mapq);
   if (srmapq != NULL) free(srmapq);
-  if (ct != NULL) free(ct);
   if (srq != NULL) free(srq);
-  if (svt != NULL) free(svt);
   if (chr2 != NULL) free(chr2);
   if (cipos != NULL) free(cipos);
   if (ciend != NULL) free(ciend);
   if (ce != NULL) free(ce);
   if (cons != NULL) free(cons);
 
-  // Clean-up
-  for(unsigned int file_c = 0; file_c < c.files.size(); ++file_c) {
-    bcf_hdr_destroy(hdr[file_c]);
-    bcf_close(ifile[file_c]);
-    bcf_destroy(rec[file_c]);
-  }
+  // Write records of the last contig
+  if (valid) _writeMergeRecords(c, fp, hdr_out, mrec, orec, flushed, mrec.size());
+  else _destroyMergeRecords(orec);
 
   // Close VCF file
-  bcf_destroy(rout);
   bcf_hdr_destroy(hdr_out);
   hts_close(fp);
 
   // Build index
-  bcf_index_build(c.outfile.string().c_str(), 14);
+  if (valid) bcf_index_build(c.outfile.string().c_str(), 14);
+  return valid;
 }
 
 
 
   template<typename TGenomeIntervals, typename TContigMap>
-  void _outputSelectedIntervalsCNVs(MergeConfig& c, TGenomeIntervals const& iSelected, TContigMap& cMap) {
-    typedef typename TGenomeIntervals::value_type TIntervalScores;
-    typedef typename TIntervalScores::value_type IntervalScore;
-
+  bool _outputSelectedIntervalsCNVs(MergeConfig& c, TGenomeIntervals const& iSelected, TContigMap& cMap) {
     boost::posix_time::ptime now = boost::posix_time::second_clock::local_time();
     std::cout << '[' << boost::posix_time::to_simple_string(now) << "] " << "Filtering SVs" << std::endl;
 
@@ -597,288 +884,340 @@ void _outputSelectedIntervals(MergeConfig& c, TGenomeIntervals const& iSelected,
     bcf_hdr_add_sample(hdr_out, NULL);
     if (bcf_hdr_write(fp, hdr_out) != 0) std::cerr << "Error: Failed to write BCF header!" << std::endl;
 
-    // Duplicate filter (identical start, end, score values)
-    typedef std::pair<uint32_t, uint32_t> TStartEnd;
-    typedef std::set<TStartEnd> TIntervalSet;
-    typedef std::vector<TIntervalSet> TGenomicIntervalSet;
-    TGenomicIntervalSet gis(numseq);
-
-    // Parse input VCF files
-    bcf1_t *rout = bcf_init();
-    typedef std::vector<htsFile*> THtsFile;
-    typedef std::vector<bcf_hdr_t*> TBcfHeader;
-    typedef std::vector<bcf1_t*> TBcfRecord;
-    typedef std::vector<bool> TEof;
-    THtsFile ifile(c.files.size());
-    TBcfHeader hdr(c.files.size());
-    TBcfRecord rec(c.files.size());
-    TEof eof(c.files.size());
-    uint32_t allEOF = 0;
-    for(unsigned int file_c = 0; file_c < c.files.size(); ++file_c) {
-      ifile[file_c] = bcf_open(c.files[file_c].string().c_str(), "r");
-      hdr[file_c] = bcf_hdr_read(ifile[file_c]);
-      if (bcf_hdr_set_samples(hdr[file_c], NULL, false) != 0) std::cerr << "Error: Failed to set sample information!" << std::endl;
-      rec[file_c] = bcf_init();
-      if (bcf_read(ifile[file_c], hdr[file_c], rec[file_c]) == 0) {
-	bcf_unpack(rec[file_c], BCF_UN_INFO);
-	eof[file_c] = false;
-      } else {
-	++allEOF;
-	eof[file_c] = true;
-      }
-    }
+    // Selected records in output order
+    std::vector<MergeRecord> mrec;
+    _selectedRecords(9, iSelected, mrec);
+    std::sort(mrec.begin(), mrec.end(), SortMergeRecords<MergeRecord>());
+
+    // Build the output records, records of forward-only inputs are kept until their contig is written
+    MergeInputPool pool(c.files.size());
+    std::vector<uint32_t> readOrder;
+    uint32_t nforward = 0;
+    bool valid = _mergeReadOrder(c, mrec, pool, readOrder, nforward);
+    std::vector<bcf1_t*> orec(mrec.size(), NULL);
+    uint32_t flushed = 0;
 
-    int32_t nsvend = 0;
-    int32_t* svend = NULL;
     int32_t nmp = 0;
     float* mp = NULL;
-    int32_t nsvt = 0;
-    char* svt = NULL;
     int32_t ncipos = 0;
     int32_t* cipos = NULL;
     int32_t nciend = 0;
     int32_t* ciend = NULL;
-    while (allEOF < c.files.size()) {
-      // Find next sorted record
-      int32_t idx = -1;
-      for(unsigned int file_c = 0; file_c < c.files.size(); ++file_c) {
-	if (!eof[file_c]) {
-	  if ((idx < 0) || (rec[idx]->rid > rec[file_c]->rid) || ((rec[idx]->rid == rec[file_c]->rid) && (rec[idx]->pos > rec[file_c]->pos))) idx = file_c;
-	}
+    for(uint32_t i = 0; ((valid) && (i < readOrder.size())); ++i) {
+      uint32_t k = readOrder[i];
+
+      // Seekable inputs are read contig by contig, write the records of all previous contigs
+      if (i >= nforward) {
+	uint32_t contigStart = flushed;
+	for(; mrec[contigStart].tid < mrec[k].tid; ++contigStart);
+	_writeMergeRecords(c, fp, hdr_out, mrec, orec, flushed, contigStart);
+	flushed = contigStart;
       }
 
-      // Correct SV type
-      int32_t recsvt = -1;
-      if (bcf_get_info_string(hdr[idx], rec[idx], "SVTYPE", &svt, &nsvt) > 0) recsvt = _decodeOrientation(std::string("NA"), std::string(svt));
-      // CNV ?
-      if (recsvt == 9) {
-	// Check PASS
-	bool pass = true;
-	if (c.filterForPass) pass = (bcf_has_filter(hdr[idx], rec[idx], const_cast<char*>("PASS"))==1);
-
-	// Check PRECISE
-	bool precise = false;
-	bool passPrecise = true;
-	if (bcf_get_info_flag(hdr[idx], rec[idx], "PRECISE", 0, 0) > 0) precise=true;
-	if ((c.filterForPrecise) && (!precise)) passPrecise = false;
-
-	// Check PASS and precise
-	if ((passPrecise) && (pass)) {
-	  // Correct size
-	  std::string chrName(bcf_hdr_id2name(hdr[idx], rec[idx]->rid));
-	  uint32_t tid = cMap[chrName];
-	  uint32_t svStart = rec[idx]->pos;
-	  uint32_t svEnd = svStart + 1;
-	  if (bcf_get_info_int32(hdr[idx], rec[idx], "END", &svend, &nsvend) > 0) svEnd = *svend;
-	  
-	  // Parse INFO fields
-	  if ((svEnd - svStart >= c.minsize) && (svEnd - svStart <= c.maxsize)) {
-	    int32_t score = rec[idx]->qual;
-	  
-	    // Is this a selected interval
-	    typename TIntervalScores::const_iterator iter = std::lower_bound(iSelected[tid].begin(), iSelected[tid].end(), IntervalScore(svStart, svEnd, score), SortIScores<IntervalScore>());
-	    bool foundInterval = false;
-	    for(; (iter != iSelected[tid].end()) && (iter->start == svStart); ++iter) {
-	      if ((iter->start == svStart) && (iter->end == svEnd) && (iter->score == score)) {
-		// Duplicate?
-		if (gis[tid].find(std::make_pair(svStart, svEnd)) == gis[tid].end()) {
-		  foundInterval = true;
-		  gis[tid].insert(std::make_pair(svStart, svEnd));
-		}
-		break;
-	      }
-	    }
-	    if (foundInterval) {
-	      // Fetch missing INFO fields
-	      bcf_get_info_int32(hdr[idx], rec[idx], "CIPOS", &cipos, &ncipos);
-	      bcf_get_info_int32(hdr[idx], rec[idx], "CIEND", &ciend, &nciend);
-	      float mpval = 0;
-	      if (bcf_get_info_float(hdr[idx], rec[idx], "MP", &mp, &nmp) > 0) mpval = *mp;
+      MergeInput* mi = acquireMergeInput(c, pool, mrec[k].file);
+      if (mi == NULL) {
+	std::cerr << "Error: Failed to open " << c.files[mrec[k].file].string() << std::endl;
+	valid = false;
+	break;
+      }
+      if (!readMergeInput(*mi, mrec[k].offset)) {
+	std::cerr << "Error: Failed to read record of " << c.files[mrec[k].file].string() << std::endl;
+	valid = false;
+	break;
+      }
+      bcf_hdr_t* hdr = mi->hdr;
+      bcf1_t* rec = mi->rec;
+      int32_t recsvt = mrec[k].svt;
+      bool precise = false;
+      if (bcf_get_info_flag(hdr, rec, "PRECISE", 0, 0) > 0) precise=true;
+      std::string chrName = rMap[mrec[k].tid];
+      uint32_t svEnd = mrec[k].end;
+
+      // Fetch missing INFO fields
+      bcf_get_info_int32(hdr, rec, "CIPOS", &cipos, &ncipos);
+      bcf_get_info_int32(hdr, rec, "CIEND", &ciend, &nciend);
+      float mpval = 0;
+      if (bcf_get_info_float(hdr, rec, "MP", &mp, &nmp) > 0) mpval = *mp;
 	      
-	      // Create new record
-	      rout->rid = bcf_hdr_name2id(hdr_out, chrName.c_str());
-	      rout->pos = rec[idx]->pos;
-	      rout->qual = rec[idx]->qual;
-	      std::string id;
-	      if (c.files.size() == 1) id = std::string(rec[idx]->d.id); // Within one VCF file IDs are unique
-	      else {
-		id += _addID(recsvt);
-		std::string padNumber = boost::lexical_cast<std::string>(c.svcounter++);
-		padNumber.insert(padNumber.begin(), 8 - padNumber.length(), '0');
-		id += padNumber;
-	      }
-	      bcf_update_id(hdr_out, rout, id.c_str());
-	      std::string refAllele = rec[idx]->d.allele[0];
-	      std::string altAllele = rec[idx]->d.allele[1];
-	      std::string alleles = refAllele + "," + altAllele;
-	      bcf_update_alleles_str(hdr_out, rout, alleles.c_str());
-	      int32_t tmppass = bcf_hdr_id2int(hdr_out, BCF_DT_ID, "PASS");
-	      bcf_update_filter(hdr_out, rout, &tmppass, 1);
+      // Create new record, IDs of several input files are assigned in output order
+      bcf1_t* rout = bcf_init();
+      orec[k] = rout;
+      rout->rid = bcf_hdr_name2id(hdr_out, chrName.c_str());
+      rout->pos = rec->pos;
+      rout->qual = rec->qual;
+      if (c.files.size() == 1) bcf_update_id(hdr_out, rout, rec->d.id); // Within one VCF file IDs are unique
+      std::string refAllele = rec->d.allele[0];
+      std::string altAllele = rec->d.allele[1];
+      std::string alleles = refAllele + "," + altAllele;
+      bcf_update_alleles_str(hdr_out, rout, alleles.c_str());
+      int32_t tmppass = bcf_hdr_id2int(hdr_out, BCF_DT_ID, "PASS");
+      bcf_update_filter(hdr_out, rout, &tmppass, 1);
 	    
-	      // Add INFO fields
-	      if (precise) bcf_update_info_flag(hdr_out, rout, "PRECISE", NULL, 1);
-	      else bcf_update_info_flag(hdr_out, rout, "IMPRECISE", NULL, 1);
-	      bcf_update_info_string(hdr_out, rout, "SVTYPE", _addID(recsvt).c_str());
-	      std::string dellyVersion("EMBL.DELLYv");
-	      dellyVersion += dellyVersionNumber;
-	      bcf_update_info_string(hdr_out,rout, "SVMETHOD", dellyVersion.c_str());
-	      bcf_update_info_int32(hdr_out, rout, "END", &svEnd, 1);
-	      bcf_update_info_int32(hdr_out, rout, "CIPOS", cipos, 2);
-	      bcf_update_info_int32(hdr_out, rout, "CIEND", ciend, 2);
-	      bcf_update_info_float(hdr_out, rout, "MP", &mpval, 1);
-
-	      // Write record
-	      bcf_write1(fp, hdr_out, rout);
-	      bcf_clear1(rout);	  
-	      //std::cerr << bcf_hdr_id2name(hdr[idx], tid) << '\t' << svStart << '\t' << svEnd << std::endl;
-	    }
-	  }
-	}
-      }
+      // Add INFO fields
+      if (precise) bcf_update_info_flag(hdr_out, rout, "PRECISE", NULL, 1);
+      else bcf_update_info_flag(hdr_out, rout, "IMPRECISE", NULL, 1);
+      bcf_update_info_string(hdr_out, rout, "SVTYPE", _addID(recsvt).c_str());
+      std::string dellyVersion("EMBL.DELLYv");
+      dellyVersion += dellyVersionNumber;
+      bcf_update_info_string(hdr_out,rout, "SVMETHOD", dellyVersion.c_str());
+      bcf_update_info_int32(hdr_out, rout, "END", &svEnd, 1);
+      bcf_update_info_int32(hdr_out, rout, "CIPOS", cipos, 2);
+      bcf_update_info_int32(hdr_out, rout, "CIEND", ciend, 2);
+      bcf_update_info_float(hdr_out, rout, "MP", &mpval, 1);
 
-      // Fetch next record
-      if (bcf_read(ifile[idx], hdr[idx], rec[idx]) == 0) bcf_unpack(rec[idx], BCF_UN_INFO);
-      else {
-	++allEOF;
-	eof[idx] = true;
-      }
     }
-    if (svend != NULL) free(svend);
+    closeMergeInputPool(pool);
     if (mp != NULL) free(mp);
-    if (svt != NULL) free(svt);
     if (cipos != NULL) free(cipos);
     if (ciend != NULL) free(ciend);
 
-    // Clean-up
-    for(unsigned int file_c = 0; file_c < c.files.size(); ++file_c) {
-      bcf_hdr_destroy(hdr[file_c]);
-      bcf_close(ifile[file_c]);
-      bcf_destroy(rec[file_c]);
-    }
+    // Write records of the last contig
+    if (valid) _writeMergeRecords(c, fp, hdr_out, mrec, orec, flushed, mrec.size());
+    else _destroyMergeRecords(orec);
 
     // Close VCF file
-    bcf_destroy(rout);
     bcf_hdr_destroy(hdr_out);
     hts_close(fp);
 
     // Build index
-    bcf_index_build(c.outfile.string().c_str(), 14);
+    if (valid) bcf_index_build(c.outfile.string().c_str(), 14);
+    return valid;
   }
 
-inline void
-mergeBCFs(MergeConfig& c, std::vector<boost::filesystem::path> const& cts) {
-  boost::posix_time::ptime now = boost::posix_time::second_clock::local_time();
-  std::cout << '[' << boost::posix_time::to_simple_string(now) << "] " << "Merging SV types" << std::endl;
-  boost::progress_display show_progress( 1 );
-
-  // Parse temporary input VCF files
-  typedef std::vector<htsFile*> THtsFile;
-  typedef std::vector<bcf_hdr_t*> TBcfHeader;
-  typedef std::vector<bcf1_t*> TBcfRecord;
-  typedef std::vector<bool> TEof;
-  THtsFile ifile(cts.size());
-  TBcfHeader hdr(cts.size());
-  TBcfRecord rec(cts.size());
-  TEof eof(cts.size());
-  uint32_t allEOF = 0;
-  for(unsigned int file_c = 0; file_c < cts.size(); ++file_c) {
-    ifile[file_c] = bcf_open(cts[file_c].string().c_str(), "r");
-    hdr[file_c] = bcf_hdr_read(ifile[file_c]);
-    rec[file_c] = bcf_init();
-    if (bcf_read(ifile[file_c], hdr[file_c], rec[file_c]) == 0) {
-      bcf_unpack(rec[file_c], BCF_UN_INFO);
-      eof[file_c] = false;
-    } else {
-      ++allEOF;
-      eof[file_c] = true;
+// Selected intervals of a chunk: magic, version, then per SV type and contig: svt, tid, #intervals and the intervals
+template<typename TSVTypeIntervals>
+inline bool
+writeIntervals(boost::filesystem::path const& outfile, TSVTypeIntervals const& iSelected) {
+  std::ofstream out(outfile.string().c_str(), std::ios_base::out | std::ios_base::binary);
+  out.write(DELLY_MERGE_MAGIC, std::strlen(DELLY_MERGE_MAGIC));
+  _writeBin(out, (uint32_t) DELLY_MERGE_VERSION);
+  for(uint32_t svt = 0; svt < iSelected.size(); ++svt) {
+    for(uint32_t tid = 0; tid < iSelected[svt].size(); ++tid) {
+      if (iSelected[svt][tid].empty()) continue;
+      _writeBin(out, svt);
+      _writeBin(out, tid);
+      _writeBin(out, (uint64_t) iSelected[svt][tid].size());
+      for(uint32_t i = 0; i < iSelected[svt][tid].size(); ++i) {
+	_writeBin(out, iSelected[svt][tid][i].start);
+	_writeBin(out, iSelected[svt][tid][i].end);
+	_writeBin(out, iSelected[svt][tid][i].score);
+	_writeBin(out, iSelected[svt][tid][i].file);
+	_writeBin(out, iSelected[svt][tid][i].offset);
+      }
     }
   }
+  out.close();
+  if (!out) {
+    std::cerr << "Fail to write chunk file " << outfile.string() << std::endl;
+    return false;
+  }
+  return true;
+}
 
-  // Open output VCF file
-  htsFile *fp = hts_open(c.outfile.string().c_str(), "wb");
-  bcf_hdr_t *hdr_out = bcf_hdr_dup(hdr[0]);
-  if (bcf_hdr_write(fp, hdr_out) != 0) std::cerr << "Error: Failed to write BCF header!" << std::endl;
+// Append the intervals of a chunk file
+template<typename TSVTypeIntervals>
+inline bool
+readIntervals(boost::filesystem::path const& infile, TSVTypeIntervals& iScore) {
+  typedef typename TSVTypeIntervals::value_type TGenomeIntervals;
+  typedef typename TGenomeIntervals::value_type TIntervalScores;
+  typedef typename TIntervalScores::value_type IntervalScore;
 
-  // Merge files
-  while (allEOF < cts.size()) {
-    // Find next sorted record
-    int32_t idx = -1;
-    for(unsigned int file_c = 0; file_c < cts.size(); ++file_c) {
-      if (!eof[file_c]) {
-	if ((idx < 0) || (rec[idx]->rid > rec[file_c]->rid) || ((rec[idx]->rid == rec[file_c]->rid) && (rec[idx]->pos > rec[file_c]->pos))) idx = file_c;
-      }
+  std::ifstream in(infile.string().c_str(), std::ios_base::in | std::ios_base::binary);
+  std::string magic(std::strlen(DELLY_MERGE_MAGIC), ' ');
+  uint32_t version = 0;
+  in.read(&magic[0], magic.size());
+  _readBin(in, version);
+  if ((!in) || (magic != DELLY_MERGE_MAGIC) || (version != DELLY_MERGE_VERSION)) {
+    std::cerr << "Invalid chunk file " << infile.string() << std::endl;
+    return false;
+  }
+  uint32_t svt = 0;
+  uint32_t tid = 0;
+  uint64_t n = 0;
+  while ((in.peek() != EOF) && (in)) {
+    _readBin(in, svt);
+    _readBin(in, tid);
+    _readBin(in, n);
+    if ((!in) || (svt >= iScore.size()) || (tid >= iScore[svt].size())) break;
+    iScore[svt][tid].reserve(iScore[svt][tid].size() + n);
+    for(uint64_t i = 0; i < n; ++i) {
+      IntervalScore is(0, 0, 0, 0, 0);
+      _readBin(in, is.start);
+      _readBin(in, is.end);
+      _readBin(in, is.score);
+      _readBin(in, is.file);
+      _readBin(in, is.offset);
+      iScore[svt][tid].push_back(is);
     }
+  }
+  if ((!in) || (in.peek() != EOF)) {
+    std::cerr << "Truncated chunk file " << infile.string() << std::endl;
+    return false;
+  }
+  return true;
+}
 
-    // Write record
-    bcf_write1(fp, hdr_out, rec[idx]);
-
-    // Fetch next record
-    if (bcf_read(ifile[idx], hdr[idx], rec[idx]) == 0) bcf_unpack(rec[idx], BCF_UN_INFO);
-    else {
-      ++allEOF;
-      eof[idx] = true;
+// Merge the selected intervals of several chunk files, the sorted runs of all chunks are merged with a heap
+template<typename TSVTypeIntervals>
+inline bool
+_mergeChunks(MergeConfig const& c, std::vector<boost::filesystem::path> const& chunks, TSVTypeIntervals& iSelected) {
+  // Every chunk file holds one sorted run per SV type and contig
+  TSVTypeIntervals iScore(iSelected.size());
+  std::vector<std::vector<std::vector<uint64_t> > > bounds(iSelected.size());
+  for(uint32_t svt = 0; svt < iSelected.size(); ++svt) {
+    iScore[svt].resize(iSelected[svt].size());
+    bounds[svt].resize(iSelected[svt].size(), std::vector<uint64_t>(1, 0));
+  }
+  for(uint32_t i = 0; i < chunks.size(); ++i) {
+    if (!readIntervals(chunks[i], iScore)) return false;
+    for(uint32_t svt = 0; svt < iScore.size(); ++svt) {
+      for(uint32_t tid = 0; tid < iScore[svt].size(); ++tid) {
+	if (iScore[svt][tid].size() > bounds[svt][tid].back()) bounds[svt][tid].push_back(iScore[svt][tid].size());
+      }
     }
   }
-  ++show_progress;
-  
-  // Clean-up
-  for(unsigned int file_c = 0; file_c < cts.size(); ++file_c) {
-    bcf_hdr_destroy(hdr[file_c]);
-    bcf_close(ifile[file_c]);
-    bcf_destroy(rec[file_c]);
+  std::vector<std::pair<uint32_t, uint32_t> > slots;
+  for(uint32_t svt = 0; svt < iScore.size(); ++svt) {
+    for(uint32_t tid = 0; tid < iScore[svt].size(); ++tid) {
+      iSelected[svt][tid].clear();
+      if (!iScore[svt][tid].empty()) slots.push_back(std::make_pair(svt, tid));
+    }
+  }
+#pragma omp parallel for default(shared) schedule(dynamic)
+  for(uint32_t k = 0; k < slots.size(); ++k) {
+    _mergeSortedRuns(iScore[slots[k].first][slots[k].second], bounds[slots[k].first][slots[k].second]);
+    _selectIntervals(c, slots[k].first, iScore[slots[k].first][slots[k].second], iSelected[slots[k].first][slots[k].second]);
   }
+  return true;
+}
 
-  // Close VCF file
-  bcf_hdr_destroy(hdr_out);
-  hts_close(fp);
+// Tree merge: chunks of input files are merged into chunk files, chunk files are merged fanin at a time
+template<typename TSVTypeIntervals, typename TContigMap>
+inline bool
+_mergeTree(MergeConfig const& c, TContigMap& cMap, TSVTypeIntervals& iSelected) {
+  boost::uuids::uuid uuid = boost::uuids::random_generator()();
+  std::string prefix = "delly_merge_" + boost::lexical_cast<std::string>(uuid);
+  std::vector<boost::filesystem::path> level;
+  std::vector<boost::filesystem::path> garbage;
+  bool valid = true;
+
+  // Chunks of input files, the input files of a chunk are parsed in parallel
+  uint32_t chunks = ((c.files.size() - 1) / c.chunksize) + 1;
+  for(uint32_t ic = 0; ((valid) && (ic < chunks)); ++ic) {
+    TSVTypeIntervals iScore(iSelected.size());
+    TSVTypeIntervals iChunk(iSelected.size());
+    for(uint32_t svt = 0; svt < iSelected.size(); ++svt) {
+      iScore[svt].resize(iSelected[svt].size());
+      iChunk[svt].resize(iSelected[svt].size());
+    }
+    _fillIntervalMap(c, ic * c.chunksize, std::min((uint32_t) c.files.size(), (ic + 1) * c.chunksize), iScore, cMap);
+    _processIntervalMap(c, iScore, iChunk);
+    boost::filesystem::path chunkfile = c.scratch / (prefix + "_0_" + boost::lexical_cast<std::string>(ic) + ".bin");
+    garbage.push_back(chunkfile);
+    level.push_back(chunkfile);
+    valid = writeIntervals(chunkfile, iChunk);
+  }
 
-  // Build index
-  bcf_index_build(c.outfile.string().c_str(), 14);
+  // Merge chunk files level by level, the chunk files of one level are merged in parallel
+  for(uint32_t depth = 1; ((valid) && (level.size() > c.fanin)); ++depth) {
+    boost::posix_time::ptime now = boost::posix_time::second_clock::local_time();
+    std::cout << '[' << boost::posix_time::to_simple_string(now) << "] " << "Merging " << level.size() << " chunk files" << std::endl;
+    uint32_t nodes = ((level.size() - 1) / c.fanin) + 1;
+    std::vector<boost::filesystem::path> nextLevel(nodes);
+    for(uint32_t node = 0; node < nodes; ++node) {
+      nextLevel[node] = c.scratch / (prefix + "_" + boost::lexical_cast<std::string>(depth) + "_" + boost::lexical_cast<std::string>(node) + ".bin");
+      garbage.push_back(nextLevel[node]);
+    }
+#pragma omp parallel for default(shared) schedule(dynamic)
+    for(uint32_t node = 0; node < nodes; ++node) {
+      std::vector<boost::filesystem::path> nodeChunks;
+      for(uint32_t k = node * c.fanin; ((k < (node + 1) * c.fanin) && (k < level.size())); ++k) nodeChunks.push_back(level[k]);
+      TSVTypeIntervals iNode(iSelected.size());
+      for(uint32_t svt = 0; svt < iSelected.size(); ++svt) iNode[svt].resize(iSelected[svt].size());
+      bool nodeValid = ((_mergeChunks(c, nodeChunks, iNode)) && (writeIntervals(nextLevel[node], iNode)));
+      if (!nodeValid) {
+#pragma omp critical
+	{
+	  valid = false;
+	}
+      }
+    }
+    level = nextLevel;
+  }
 
-  // End
-  now = boost::posix_time::second_clock::local_time();
-  std::cout << '[' << boost::posix_time::to_simple_string(now) << "] Done." << std::endl;
+  // Root
+  if (valid) {
+    boost::posix_time::ptime now = boost::posix_time::second_clock::local_time();
+    std::cout << '[' << boost::posix_time::to_simple_string(now) << "] " << "Merging " << level.size() << " chunk files" << std::endl;
+    valid = _mergeChunks(c, level, iSelected);
+  }
+
+  // Clean-up
+  for(uint32_t i = 0; i < garbage.size(); ++i) {
+    if (boost::filesystem::exists(garbage[i])) boost::filesystem::remove(garbage[i]);
+  }
+  return valid;
 }
 
 inline int
-mergeRun(MergeConfig& c, int32_t const svt) {
+mergeRun(MergeConfig& c) {
 
-  // All files may use a different set of chromosomes
-  typedef std::map<std::string, uint32_t> TContigMap;
-  TContigMap contigMap;
-  uint32_t numseq = 0;
+  // All files may use a different set of chromosomes, headers are parsed in parallel
+  std::vector<std::vector<std::string> > fileSeqs(c.files.size());
+#pragma omp parallel for default(shared) schedule(dynamic)
   for(unsigned int file_c = 0; file_c < c.files.size(); ++file_c) {
     htsFile* ifile = bcf_open(c.files[file_c].string().c_str(), "r");
     bcf_hdr_t* hdr = bcf_hdr_read(ifile);
     int nseq=0;
     const char** seqnames = bcf_hdr_seqnames(hdr, &nseq);
-    for(int32_t i = 0; i<nseq;++i) {
-      std::string chrName(bcf_hdr_id2name(hdr, i));
-      if (contigMap.find(chrName) == contigMap.end()) contigMap[chrName] = numseq++;
-    }
+    for(int32_t i = 0; i<nseq;++i) fileSeqs[file_c].push_back(std::string(bcf_hdr_id2name(hdr, i)));
     if (seqnames!=NULL) free(seqnames);
     bcf_hdr_destroy(hdr);
     bcf_close(ifile);
   }
+  typedef std::map<std::string, uint32_t> TContigMap;
+  TContigMap contigMap;
+  uint32_t numseq = 0;
+  for(unsigned int file_c = 0; file_c < c.files.size(); ++file_c) {
+    for(uint32_t i = 0; i < fileSeqs[file_c].size(); ++i) {
+      if (contigMap.find(fileSeqs[file_c][i]) == contigMap.end()) contigMap[fileSeqs[file_c][i]] = numseq++;
+    }
+  }
+  fileSeqs.clear();
 
-  // Interval maps
+  // SV types to merge, CNVs are merged separately
+  int32_t minSVT = 0;
+  int32_t maxSVT = 9;
+  if (c.cnvMode) {
+    minSVT = 9;
+    maxSVT = 10;
+  }
+
+  // Best intervals of all SV types
   typedef std::vector<IntervalScore> TIntervalScores;
   typedef std::vector<TIntervalScores> TGenomeIntervals;
-  TGenomeIntervals iScore;
-  iScore.resize(numseq, TIntervalScores());
-  _fillIntervalMap(c, iScore, contigMap, svt);
-  for(uint32_t i = 0; i<numseq; ++i) std::sort(iScore[i].begin(), iScore[i].end(), SortIScores<IntervalScore>());
-
-  // Filter intervals
-  TGenomeIntervals iSelected;
-  iSelected.resize(numseq, TIntervalScores());
-  _processIntervalMap(c, iScore, iSelected, svt);
-  iScore.clear();
-  for(uint32_t i = 0; i<numseq; ++i) std::sort(iSelected[i].begin(), iSelected[i].end(), SortIScores<IntervalScore>());
-
-  // Output best intervals
-  if (svt == 9) _outputSelectedIntervalsCNVs(c, iSelected, contigMap);
-  else _outputSelectedIntervals(c, iSelected, contigMap, svt);
+  typedef std::vector<TGenomeIntervals> TSVTypeIntervals;
+  TSVTypeIntervals iSelected(maxSVT);
+  for(int32_t svt = minSVT; svt < maxSVT; ++svt) iSelected[svt].resize(numseq, TIntervalScores());
+  if (c.files.size() <= c.chunksize) {
+    // Sorted interval maps of all SV types, filled in a single pass over the input files
+    TSVTypeIntervals iScore(maxSVT);
+    for(int32_t svt = minSVT; svt < maxSVT; ++svt) iScore[svt].resize(numseq, TIntervalScores());
+    _fillIntervalMap(c, 0, c.files.size(), iScore, contigMap);
+
+    // Filter intervals
+    _processIntervalMap(c, iScore, iSelected);
+  } else {
+    // Merge in chunks
+    if (!_mergeTree(c, contigMap, iSelected)) return 1;
+  }
+
+  // Output best intervals of all SV types in a single pass
+  if (c.cnvMode) {
+    if (!_outputSelectedIntervalsCNVs(c, iSelected[9], contigMap)) return 1;
+  } else {
+    if (!_outputSelectedIntervals(c, iSelected, contigMap)) return 1;
+  }
 
   // End
   boost::posix_time::ptime now = boost::posix_time::second_clock::local_time();
@@ -897,6 +1236,9 @@ int merge(int argc, char **argv) {
     ("help,?", "show help message")
     ("outfile,o", boost::program_options::value<boost::filesystem::path>(&c.outfile)->default_value("sv.bcf"), "Merged SV BCF output file")
     ("chunks,u", boost::program_options::value<uint32_t>(&c.chunksize)->default_value(500), "max. chunk size to merge groups of BCF files")
+    ("fan-in,f", boost::program_options::value<uint32_t>(&c.fanin)->default_value(16), "max. number of chunk files merged at once")
+    ("scratch,s", boost::program_options::value<boost::filesystem::path>(&c.scratch)->default_value("."), "scratch directory for chunk files")
+    ("threads,t", boost::program_options::value<uint32_t>(&c.threads)->default_value(0), "max. threads (0: OMP_NUM_THREADS)")
     ("vaf,a", boost::program_options::value<float>(&c.vaf)->default_value(0.15), "min. fractional ALT support")
     ("coverage,v", boost::program_options::value<uint32_t>(&c.coverage)->default_value(10), "min. coverage")
     ("minsize,m", boost::program_options::value<uint32_t>(&c.minsize)->default_value(0), "min. SV size")
@@ -962,8 +1304,20 @@ int merge(int argc, char **argv) {
   for(int i=0; i<argc; ++i) { std::cout << argv[i] << ' '; }
   std::cout << std::endl;
 
-  // Check chunksize
+  // Check chunksize and fan-in
   if (c.chunksize < 100) c.chunksize = 100;
+  if (c.fanin < 2) c.fanin = 2;
+
+  // Check scratch directory
+  if (!boost::filesystem::is_directory(c.scratch)) {
+    std::cerr << "Scratch directory " << c.scratch.string() << " does not exist!" << std::endl;
+    return 1;
+  }
+
+  // Thread budget
+#ifdef OPENMP
+  if (c.threads > 0) omp_set_num_threads(c.threads);
+#endif
 
   // Check input BCF files
   if (c.files.size() == 1) {
@@ -1024,73 +1378,7 @@ int merge(int argc, char **argv) {
   }
   
   // Run merging
-  int32_t minSVT = 0;
-  int32_t maxSVT = 9;
-  if (c.cnvMode) {
-    minSVT = 9;
-    maxSVT = 10;
-  }
-  boost::filesystem::path oldPath = c.outfile;
-  std::vector<boost::filesystem::path> svtCollect(maxSVT);
-  for(int32_t svt = minSVT; svt < maxSVT; ++svt) {
-    boost::uuids::uuid uuid = boost::uuids::random_generator()();
-    std::string filename = "svt" + boost::lexical_cast<std::string>(svt) + "_" + boost::lexical_cast<std::string>(uuid) + ".bcf";
-    svtCollect[svt] = filename;
-    if (c.files.size() <= c.chunksize) {
-      // Merge in one go
-      c.outfile = svtCollect[svt];
-      mergeRun(c, svt);
-    } else {
-      // Merge in chunks
-      std::vector<boost::filesystem::path> fileRestore = c.files;
-      uint32_t chunks = ((c.files.size() - 1) / c.chunksize) + 1;
-      std::vector<boost::filesystem::path> chunkCollect(chunks);
-      for(uint32_t ic = 0; ic < chunks; ++ic) {
-	boost::uuids::uuid uuid = boost::uuids::random_generator()();
-	std::string chunkfile = "chunk" + boost::lexical_cast<std::string>(ic) + "_" + boost::lexical_cast<std::string>(uuid) + ".bcf";
-	chunkCollect[ic] = chunkfile;
-	c.files.clear();
-	for(uint32_t k = ic * c.chunksize; ((k < ((ic+1) * c.chunksize)) && (k < fileRestore.size())); ++k) c.files.push_back(fileRestore[k]);
-	c.outfile = chunkCollect[ic];
-	mergeRun(c, svt);
-      }
-      // Merge chunks
-      c.files = chunkCollect;
-      c.outfile = svtCollect[svt];
-      // Reset VAF and coverage because these are site lists!
-      float vafStore = c.vaf;
-      uint32_t coverageStore = c.coverage;
-      c.vaf = 0;
-      c.coverage = 0;
-      mergeRun(c, svt);
-      c.vaf = vafStore;
-      c.coverage = coverageStore;
-      // Clean-up
-      for(uint32_t ic = 0; ic < chunks; ++ic) {
-	boost::filesystem::remove(chunkCollect[ic]);
-	boost::filesystem::remove(boost::filesystem::path(chunkCollect[ic].string() + ".csi"));
-      }
-      c.files = fileRestore;
-    }
-  }
-  
-  // Merge temporary files
-  c.outfile = oldPath;
-  if (c.cnvMode) {
-    // Copy
-    boost::filesystem::copy_file(svtCollect[9], c.outfile);
-    boost::filesystem::copy_file(boost::filesystem::path(svtCollect[9].string() + ".csi"), boost::filesystem::path(c.outfile.string() + ".csi"));
-    // Delete
-    boost::filesystem::remove(svtCollect[9]);
-    boost::filesystem::remove(boost::filesystem::path(svtCollect[9].string() + ".csi"));
-  } else {
-    mergeBCFs(c, svtCollect);
-    for(int32_t svt = minSVT; svt < maxSVT; ++svt) {
-      boost::filesystem::remove(svtCollect[svt]);
-      boost::filesystem::remove(boost::filesystem::path(svtCollect[svt].string() + ".csi"));
-    }
-  }
-  return 0;
+  return mergeRun(c);
 }
 
 }
@@ -5,7 +5,10 @@
 
 #include <htslib/sam.h>
 #include <htslib/vcf.h>
+#include <htslib/thread_pool.h>
 #include <set>
+#include <vector>
+#include <cstring>
 
 #include "bolog.h"
 
@@ -14,6 +17,11 @@
 namespace torali
 {
 
+  // Records per read, process and write round of the streaming VCF/BCF pipelines
+  #ifndef DELLY_VCF_BATCH
+  #define DELLY_VCF_BATCH 1024
+  #endif
+
 
 void _remove_info_tag(bcf_hdr_t* hdr, bcf1_t* rec, std::string const& tag) {
   bcf_update_info(hdr, rec, tag.c_str(), NULL, 0, BCF_HT_INT);  // Type does not matter for n = 0
@@ -101,6 +109,180 @@ _isKeyPresent(bcf_hdr_t const* hdr, std::string const& key) {
   return (bcf_hdr_id2int(hdr, BCF_DT_ID, key.c_str())>=0);
 }
 
+// INFO lookups by header ID, the ID is resolved once per file using bcf_hdr_id2int
+inline bcf_info_t*
+_infoById(bcf1_t* rec, int32_t const id) {
+  if (id < 0) return NULL;
+  bcf_info_t* info = bcf_get_info_id(rec, id);
+  if ((info == NULL) || (info->vptr == NULL)) return NULL;
+  return info;
+}
+
+inline bool
+_getInfoFlag(bcf1_t* rec, int32_t const id) {
+  return (_infoById(rec, id) != NULL);
+}
+
+inline bool
+_getInfoInt32(bcf1_t* rec, int32_t const id, int32_t& val) {
+  bcf_info_t* info = _infoById(rec, id);
+  if ((info == NULL) || (info->len < 1)) return false;
+  if ((info->type != BCF_BT_INT8) && (info->type != BCF_BT_INT16) && (info->type != BCF_BT_INT32)) return false;
+  val = info->v1.i;
+  if (((info->type == BCF_BT_INT8) && (val == bcf_int8_missing)) || ((info->type == BCF_BT_INT16) && (val == bcf_int16_missing))) val = bcf_int32_missing;
+  return true;
+}
+
+inline bool
+_getInfoString(bcf1_t* rec, int32_t const id, std::string& val) {
+  bcf_info_t* info = _infoById(rec, id);
+  if ((info == NULL) || (info->type != BCF_BT_CHAR)) return false;
+  char const* str = reinterpret_cast<char const*>(info->vptr);
+  int32_t len = 0;
+  for(; (len < info->len) && (str[len] != '\0'); ++len);
+  val.assign(str, len);
+  return true;
+}
+
+// FORMAT field resolved once per header, values of sample i are at [i * n, (i + 1) * n) of the typed buffer
+struct FormatField {
+  int32_t id;
+  int32_t n;
+  bool isFloat;
+  std::vector<int32_t> ival;
+  std::vector<float> fval;
+
+  FormatField() : id(-1), n(0), isFloat(false) {}
+};
+
+// FORMAT columns of delly SV calls
+struct SVFormat {
+  FormatField gt;
+  FormatField gq;
+  FormatField rc;
+  FormatField rcl;
+  FormatField rcr;
+  FormatField dv;
+  FormatField dr;
+  FormatField rv;
+  FormatField rr;
+};
+
+inline void
+_formatField(bcf_hdr_t const* hdr, std::string const& key, FormatField& f) {
+  f.id = bcf_hdr_id2int(hdr, BCF_DT_ID, key.c_str());
+  if (!bcf_hdr_idinfo_exists(hdr, BCF_HL_FMT, f.id)) f.id = -1;
+  f.n = 0;
+}
+
+inline void
+_svFormat(bcf_hdr_t const* hdr, SVFormat& f) {
+  _formatField(hdr, "GT", f.gt);
+  _formatField(hdr, "GQ", f.gq);
+  _formatField(hdr, "RC", f.rc);
+  _formatField(hdr, "RCL", f.rcl);
+  _formatField(hdr, "RCR", f.rcr);
+  _formatField(hdr, "DV", f.dv);
+  _formatField(hdr, "DR", f.dr);
+  _formatField(hdr, "RV", f.rv);
+  _formatField(hdr, "RR", f.rr);
+}
+
+template<typename TValue>
+inline void
+_decodeFormatInt(bcf_fmt_t const* fmt, int32_t const nsmpl, TValue const missing, TValue const vectorEnd, std::vector<int32_t>& val) {
+  val.resize(nsmpl * fmt->n);
+  uint32_t k = 0;
+  for(int32_t i = 0; i < nsmpl; ++i) {
+    uint8_t const* p = fmt->p + i * fmt->size;
+    for(int32_t j = 0; j < fmt->n; ++j, ++k) {
+      TValue v;
+      std::memcpy(&v, p + j * sizeof(TValue), sizeof(TValue));
+      if (v == missing) val[k] = bcf_int32_missing;
+      else if (v == vectorEnd) val[k] = bcf_int32_vector_end;
+      else val[k] = v;
+    }
+  }
+}
+
+// Decode a numeric FORMAT field by its header ID, integers are widened to int32 with htslib's missing values
+inline bool
+_getFormat(bcf1_t* rec, FormatField& f) {
+  f.n = 0;
+  if (f.id < 0) return false;
+  if (!(rec->unpacked & BCF_UN_FMT)) bcf_unpack(rec, BCF_UN_FMT);
+  bcf_fmt_t* fmt = bcf_get_fmt_id(rec, f.id);
+  if ((fmt == NULL) || (fmt->p == NULL) || (fmt->n < 1)) return false;
+  int32_t nsmpl = rec->n_sample;
+  switch (fmt->type) {
+  case BCF_BT_INT8:
+    _decodeFormatInt(fmt, nsmpl, (int8_t) bcf_int8_missing, (int8_t) bcf_int8_vector_end, f.ival);
+    f.isFloat = false;
+    break;
+  case BCF_BT_INT16:
+    _decodeFormatInt(fmt, nsmpl, (int16_t) bcf_int16_missing, (int16_t) bcf_int16_vector_end, f.ival);
+    f.isFloat = false;
+    break;
+  case BCF_BT_INT32:
+    _decodeFormatInt(fmt, nsmpl, (int32_t) bcf_int32_missing, (int32_t) bcf_int32_vector_end, f.ival);
+    f.isFloat = false;
+    break;
+  case BCF_BT_FLOAT:
+    f.fval.resize(nsmpl * fmt->n);
+    std::memcpy(&f.fval[0], fmt->p, nsmpl * fmt->n * sizeof(float));
+    f.isFloat = true;
+    break;
+  default:
+    return false;
+  }
+  f.n = fmt->n;
+  return true;
+}
+
+inline bool
+_getFormatInt32(bcf1_t* rec, FormatField& f) {
+  return ((_getFormat(rec, f)) && (!f.isFloat));
+}
+
+inline bool
+_getFormatFloat(bcf1_t* rec, FormatField& f) {
+  return ((_getFormat(rec, f)) && (f.isFloat));
+}
+
+// Per-sample column views of a decoded FORMAT field
+inline int32_t*
+_formatInt32(FormatField& f, int32_t const sample) {
+  return &f.ival[sample * f.n];
+}
+
+inline float*
+_formatFloat(FormatField& f, int32_t const sample) {
+  return &f.fval[sample * f.n];
+}
+
+// First value of a sample as float, for fields written as Integer or Float (e.g. GQ)
+inline float
+_formatValue(FormatField const& f, int32_t const sample) {
+  if (f.isFloat) return f.fval[sample * f.n];
+  return f.ival[sample * f.n];
+}
+
+// Shared BGZF (de)compression thread pool for a streaming reader and writer
+inline void
+_vcfThreadPool(htsFile* ifile, htsFile* ofile, htsThreadPool& tpool) {
+  tpool.pool = NULL;
+  tpool.qsize = 0;
+  int32_t nthreads = 1;
+#ifdef OPENMP
+  nthreads = omp_get_max_threads();
+#endif
+  if (nthreads < 2) return;
+  tpool.pool = hts_tpool_init(nthreads);
+  if (tpool.pool == NULL) return;
+  hts_set_opt(ifile, HTS_OPT_THREAD_POOL, &tpool);
+  hts_set_opt(ofile, HTS_OPT_THREAD_POOL, &tpool);
+}
+
 inline bool
 _isDNA(std::string const& allele) {
   for(uint32_t i = 0; i<allele.size(); ++i) {
@@ -399,20 +581,10 @@ vcfParse(TConfig const& c, bam_hdr_t* hd, std::vector<TStructuralVariantRecord>&
 }
 
 
-template<typename TConfig, typename TStructuralVariantRecord, typename TJunctionCountMap, typename TReadCountMap, typename TCountMap>
-inline void
-vcfOutput(TConfig const& c, std::vector<TStructuralVariantRecord> const& svs, TJunctionCountMap const& jctCountMap, TReadCountMap const& readCountMap, TCountMap const& spanCountMap)
+template<typename TConfig>
+inline bcf_hdr_t*
+_vcfHeader(TConfig const& c, bam_hdr_t* bamhd)
 {
-  // BoLog class
-  BoLog<double> bl;
-
-  // Open one bam file header
-  samFile* samfile = sam_open(c.files[0].string().c_str(), "r");
-  hts_set_fai_filename(samfile, c.genome.string().c_str());
-  bam_hdr_t* bamhd = sam_hdr_read(samfile);
-
-  // Output all structural variants
-  htsFile *fp = hts_open(c.outfile.string().c_str(), "wb");
   bcf_hdr_t *hdr = bcf_hdr_init("w");
 
   // Print vcf header
@@ -484,9 +656,21 @@ vcfOutput(TConfig const& c, std::vector<TStructuralVariantRecord> const& svs, TJ
   // Add samples
   for(unsigned int file_c = 0; file_c < c.files.size(); ++file_c) bcf_hdr_add_sample(hdr, c.sampleName[file_c].c_str());
   bcf_hdr_add_sample(hdr, NULL);
-  if (bcf_hdr_write(fp, hdr) != 0) std::cerr << "Error: Failed to write BCF header!" << std::endl;
+  return hdr;
+}
+
+
+template<typename TConfig, typename TStructuralVariantRecord, typename TJunctionCountMap, typename TReadCountMap, typename TCountMap>
+inline void
+_vcfRecords(TConfig const& c, htsFile* fp, bcf_hdr_t* hdr, bam_hdr_t* bamhd, std::vector<TStructuralVariantRecord> const& svs, TJunctionCountMap const& jctCountMap, TReadCountMap const& readCountMap, TCountMap const& spanCountMap, int32_t const idOffset)
+{
+  // BoLog class
+  BoLog<double> bl;
 
   if (!svs.empty()) {
+    // HP fields declared in the header?
+    bool hapFields = (bcf_hdr_id2int(hdr, BCF_DT_ID, "HP1DR") >= 0);
+
     // Genotype arrays
     int32_t *gts = (int*) malloc(bcf_hdr_nsamples(hdr) * 2 * sizeof(int));
     float *gls = (float*) malloc(bcf_hdr_nsamples(hdr) * 3 * sizeof(float));
@@ -512,7 +696,7 @@ vcfOutput(TConfig const& c, std::vector<TStructuralVariantRecord> const& svs, TJ
     
     // Iterate all structural variants
     typedef std::vector<TStructuralVariantRecord> TSVs;
-    now = boost::posix_time::second_clock::local_time();
+    boost::posix_time::ptime now = boost::posix_time::second_clock::local_time();
     std::cout << '[' << boost::posix_time::to_simple_string(now) << "] " << "Genotyping" << std::endl;
     boost::progress_display show_progress( svs.size() );
     bcf1_t *rec = bcf_init();
@@ -537,7 +721,7 @@ vcfOutput(TConfig const& c, std::vector<TStructuralVariantRecord> const& svs, TJ
       if (svEndPos >= (int32_t) bamhd->target_len[svIter->chr2]) svEndPos = bamhd->target_len[svIter->chr2] - 1;
       rec->pos = svStartPos;
       std::string id(_addID(svIter->svt));
-      std::string padNumber = boost::lexical_cast<std::string>(svIter->id);
+      std::string padNumber = boost::lexical_cast<std::string>(svIter->id + idOffset);
       padNumber.insert(padNumber.begin(), 8 - padNumber.length(), '0');
       id += padNumber;
       bcf_update_id(hdr, rec, id.c_str());
@@ -635,7 +819,7 @@ vcfOutput(TConfig const& c, std::vector<TStructuralVariantRecord> const& svs, TJ
 	cnest[file_c] = 0;
 	drcount[file_c] = 0;
 	dvcount[file_c] = 0;
-	if (c.isHaplotagged) {
+	if (hapFields) {
 	  hp1drcount[file_c] = 0;
 	  hp2drcount[file_c] = 0;
 	  hp1dvcount[file_c] = 0;
@@ -643,7 +827,7 @@ vcfOutput(TConfig const& c, std::vector<TStructuralVariantRecord> const& svs, TJ
 	}
 	rrcount[file_c] = 0;
 	rvcount[file_c] = 0;
-	if (c.isHaplotagged) {
+	if (hapFields) {
 	  hp1rrcount[file_c] = 0;
 	  hp2rrcount[file_c] = 0;
 	  hp1rvcount[file_c] = 0;
@@ -651,7 +835,7 @@ vcfOutput(TConfig const& c, std::vector<TStructuralVariantRecord> const& svs, TJ
 	}
 	drcount[file_c] = spanCountMap[file_c][svIter->id].ref.size();
 	dvcount[file_c] = spanCountMap[file_c][svIter->id].alt.size();
-	if (c.isHaplotagged) {
+	if (hapFields) {
 	  hp1drcount[file_c] = spanCountMap[file_c][svIter->id].refh1;
 	  hp2drcount[file_c] = spanCountMap[file_c][svIter->id].refh2;
 	  hp1dvcount[file_c] = spanCountMap[file_c][svIter->id].alth1;
@@ -659,7 +843,7 @@ vcfOutput(TConfig const& c, std::vector<TStructuralVariantRecord> const& svs, TJ
 	}
 	rrcount[file_c] = jctCountMap[file_c][svIter->id].ref.size();
 	rvcount[file_c] = jctCountMap[file_c][svIter->id].alt.size();
-	if (c.isHaplotagged) {
+	if (hapFields) {
 	  hp1rrcount[file_c] = jctCountMap[file_c][svIter->id].refh1;
 	  hp2rrcount[file_c] = jctCountMap[file_c][svIter->id].refh2;
 	  hp1rvcount[file_c] = jctCountMap[file_c][svIter->id].alth1;
@@ -698,7 +882,7 @@ vcfOutput(TConfig const& c, std::vector<TStructuralVariantRecord> const& svs, TJ
       bcf_update_format_int32(hdr, rec, "RDCN", cnest, bcf_hdr_nsamples(hdr));
       bcf_update_format_int32(hdr, rec, "DR", drcount, bcf_hdr_nsamples(hdr));
       bcf_update_format_int32(hdr, rec, "DV", dvcount, bcf_hdr_nsamples(hdr));
-      if (c.isHaplotagged) {
+      if (hapFields) {
 	bcf_update_format_int32(hdr, rec, "HP1DR", hp1drcount, bcf_hdr_nsamples(hdr));
 	bcf_update_format_int32(hdr, rec, "HP2DR", hp2drcount, bcf_hdr_nsamples(hdr));
 	bcf_update_format_int32(hdr, rec, "HP1DV", hp1dvcount, bcf_hdr_nsamples(hdr));
@@ -706,7 +890,7 @@ vcfOutput(TConfig const& c, std::vector<TStructuralVariantRecord> const& svs, TJ
       }
       bcf_update_format_int32(hdr, rec, "RR", rrcount, bcf_hdr_nsamples(hdr));
       bcf_update_format_int32(hdr, rec, "RV", rvcount, bcf_hdr_nsamples(hdr));
-      if (c.isHaplotagged) {
+      if (hapFields) {
 	bcf_update_format_int32(hdr, rec, "HP1RR", hp1rrcount, bcf_hdr_nsamples(hdr));
 	bcf_update_format_int32(hdr, rec, "HP2RR", hp2rrcount, bcf_hdr_nsamples(hdr));
 	bcf_update_format_int32(hdr, rec, "HP1RV", hp1rvcount, bcf_hdr_nsamples(hdr));
@@ -738,6 +922,23 @@ vcfOutput(TConfig const& c, std::vector<TStructuralVariantRecord> const& svs, TJ
     free(hp2rvcount);
     free(gqval);
   }
+}
+
+
+template<typename TConfig, typename TStructuralVariantRecord, typename TJunctionCountMap, typename TReadCountMap, typename TCountMap>
+inline void
+vcfOutput(TConfig const& c, std::vector<TStructuralVariantRecord> const& svs, TJunctionCountMap const& jctCountMap, TReadCountMap const& readCountMap, TCountMap const& spanCountMap)
+{
+  // Open one bam file header
+  samFile* samfile = sam_open(c.files[0].string().c_str(), "r");
+  hts_set_fai_filename(samfile, c.genome.string().c_str());
+  bam_hdr_t* bamhd = sam_hdr_read(samfile);
+
+  // Output all structural variants
+  htsFile *fp = hts_open(c.outfile.string().c_str(), "wb");
+  bcf_hdr_t *hdr = _vcfHeader(c, bamhd);
+  if (bcf_hdr_write(fp, hdr) != 0) std::cerr << "Error: Failed to write BCF header!" << std::endl;
+  _vcfRecords(c, fp, hdr, bamhd, svs, jctCountMap, readCountMap, spanCountMap, 0);
 
   // Close BAM file
   bam_hdr_destroy(bamhd);
@@ -11,9 +11,13 @@
 #include <boost/progress.hpp>
 
 #include <htslib/sam.h>
+#include <htslib/faidx.h>
 
 #include "version.h"
 #include "util.h"
+#include "bed.h"
+#include "matetable.h"
+#include "tracks.h"
 
 
 namespace torali
@@ -75,171 +79,302 @@ namespace torali
     return std::make_pair(lowerBound, upperBound);
   }
 
-  template<typename TConfig>
+  // Fragment midpoint counts of one chromosome
+  //
+  // Single-end reads and pairs with a normal insert size have one midpoint for all consumers, these are
+  // stored as varint-coded (gap, count) runs over non-zero positions. Abnormal pairs are placed differently
+  // by the GC-bias estimation and the read-depth windows, so both midpoints are kept.
+  struct FragmentCounts {
+    bool counted;
+    std::vector<uint8_t> runs;
+    std::vector<int32_t> midGC;
+    std::vector<int32_t> midRD;
+
+    FragmentCounts() : counted(false) {}
+  };
+
   inline void
-  scan(TConfig const& c, LibraryInfo const& li, std::vector< std::vector<ScanWindow> >& scanCounts) {
+  _putVarint(std::vector<uint8_t>& buf, uint32_t val) {
+    while (val >= 0x80) {
+      buf.push_back((uint8_t) ((val & 0x7F) | 0x80));
+      val >>= 7;
+    }
+    buf.push_back((uint8_t) val);
+  }
 
-    // Load bam file
-    samFile* samfile = sam_open(c.bamFile.string().c_str(), "r");
-    hts_set_fai_filename(samfile, c.genome.string().c_str());
-    hts_idx_t* idx = sam_index_load(samfile, c.bamFile.string().c_str());
-    bam_hdr_t* hdr = sam_hdr_read(samfile);
+  inline uint32_t
+  _getVarint(uint8_t const*& p) {
+    uint32_t val = 0;
+    for(uint32_t shift = 0; ; shift += 7, ++p) {
+      val |= (uint32_t) (*p & 0x7F) << shift;
+      if (!(*p & 0x80)) break;
+    }
+    ++p;
+    return val;
+  }
 
-    // Pre-defined scanning windows
-    if (c.hasScanFile) {
-      typedef boost::icl::interval_set<uint32_t> TChrIntervals;
-      typedef std::vector<TChrIntervals> TRegionsGenome;
-      TRegionsGenome scanRegions;
-      if (!_parseBedIntervals(c.scanFile.string(), c.hasScanFile, hdr, scanRegions)) {
-	std::cerr << "Warning: Couldn't parse BED intervals. Do the chromosome names match?" << std::endl;
+  template<typename TCoverage>
+  inline void
+  _encodeCounts(TCoverage const& cov, FragmentCounts& fc) {
+    fc.runs.clear();
+    uint32_t last = 0;
+    for(uint32_t i = 0; i < cov.size(); ++i) {
+      if (cov[i]) {
+	_putVarint(fc.runs, i - last);
+	_putVarint(fc.runs, cov[i]);
+	last = i;
       }
-      for (int32_t refIndex = 0; refIndex < hdr->n_targets; ++refIndex) {
-	for(typename TChrIntervals::iterator it = scanRegions[refIndex].begin(); it != scanRegions[refIndex].end(); ++it) {
-	  if (it->lower() < it->upper()) {
-	    if ((it->lower() >= 0) && (it->upper() < hdr->target_len[refIndex])) {
-	      ScanWindow sw;
-	      sw.start = it->lower();
-	      sw.end = it->upper();
-	      sw.select = true;
-	      scanCounts[refIndex].push_back(sw);
-	    }
+    }
+    std::vector<uint8_t>(fc.runs).swap(fc.runs);
+  }
+
+  // Per-position coverage track as seen by the GC-bias estimation (gcEstimation = true) or the read-depth windows
+  template<typename TCoverage>
+  inline void
+  fragmentCoverage(FragmentCounts const& fc, uint32_t const reflen, bool const gcEstimation, TCoverage& cov) {
+    typedef typename TCoverage::value_type TCount;
+    uint32_t maxCoverage = std::numeric_limits<TCount>::max();
+    cov.assign(reflen, 0);
+    uint8_t const* p = fc.runs.empty() ? NULL : &fc.runs[0];
+    uint8_t const* end = p + fc.runs.size();
+    uint32_t pos = 0;
+    while (p < end) {
+      pos += _getVarint(p);
+      cov[pos] = std::min(_getVarint(p), maxCoverage - 1);
+    }
+    std::vector<int32_t> const& extra = (gcEstimation) ? fc.midGC : fc.midRD;
+    for(uint32_t i = 0; i < extra.size(); ++i) {
+      if (cov[extra[i]] < maxCoverage - 1) ++cov[extra[i]];
+    }
+  }
+
+  // Coverage track of the region [start, end), indexed from start
+  template<typename TCoverage>
+  inline void
+  fragmentCoverage(FragmentCounts const& fc, uint32_t const reflen, uint32_t const start, uint32_t const end, bool const gcEstimation, TCoverage& cov) {
+    if ((start == 0) && (end == reflen)) {
+      fragmentCoverage(fc, reflen, gcEstimation, cov);
+      return;
+    }
+    typedef typename TCoverage::value_type TCount;
+    uint32_t maxCoverage = std::numeric_limits<TCount>::max();
+    cov.assign(end - start, 0);
+    uint8_t const* p = fc.runs.empty() ? NULL : &fc.runs[0];
+    uint8_t const* runEnd = p + fc.runs.size();
+    uint32_t pos = 0;
+    while (p < runEnd) {
+      pos += _getVarint(p);
+      uint32_t val = _getVarint(p);
+      if (pos >= end) break;
+      if (pos >= start) cov[pos - start] = std::min(val, maxCoverage - 1);
+    }
+    std::vector<int32_t> const& extra = (gcEstimation) ? fc.midGC : fc.midRD;
+    for(uint32_t i = 0; i < extra.size(); ++i) {
+      if (((uint32_t) extra[i] >= start) && ((uint32_t) extra[i] < end) && (cov[extra[i] - start] < maxCoverage - 1)) ++cov[extra[i] - start];
+    }
+  }
+
+  // Scan windows of one chromosome and the position to window map for pre-defined windows
+  template<typename TConfig>
+  inline void
+  _scanBins(TConfig const& c, bam_hdr_t const* hdr, int32_t const refIndex, std::vector<ScanWindow>& scanWindows, std::vector<uint16_t>& binMap) {
+    if (!c.hasScanFile) {
+      uint32_t allbins = hdr->target_len[refIndex] / c.scanWindow;
+      scanWindows.resize(allbins, ScanWindow());
+      for(uint32_t i = 0; i < allbins; ++i) {
+	scanWindows[i].start = i * c.scanWindow;
+	scanWindows[i].end = (i+1) * c.scanWindow;
+      }
+    } else {
+      // Fill bin map
+      binMap.resize(hdr->target_len[refIndex], LAST_BIN);
+      for(uint32_t bin = 0;((bin < scanWindows.size()) && (bin < LAST_BIN)); ++bin) {
+	for(int32_t k = scanWindows[bin].start; k < scanWindows[bin].end; ++k) binMap[k] = bin;
+      }
+    }
+  }
+
+  template<typename TConfig>
+  inline void
+  _scanRegions(TConfig const& c, bam_hdr_t* hdr, std::vector< std::vector<ScanWindow> >& scanCounts) {
+    typedef boost::icl::interval_set<uint32_t> TChrIntervals;
+    typedef std::vector<TChrIntervals> TRegionsGenome;
+    TRegionsGenome scanRegions;
+    if (!_parseBedIntervals(c.scanFile.string(), c.hasScanFile, hdr, scanRegions)) {
+      std::cerr << "Warning: Couldn't parse BED intervals. Do the chromosome names match?" << std::endl;
+    }
+    for (int32_t refIndex = 0; refIndex < hdr->n_targets; ++refIndex) {
+      for(typename TChrIntervals::iterator it = scanRegions[refIndex].begin(); it != scanRegions[refIndex].end(); ++it) {
+	if (it->lower() < it->upper()) {
+	  if ((it->lower() >= 0) && (it->upper() < hdr->target_len[refIndex])) {
+	    ScanWindow sw;
+	    sw.start = it->lower();
+	    sw.end = it->upper();
+	    sw.select = true;
+	    scanCounts[refIndex].push_back(sw);
 	  }
 	}
-	// Sort scan windows
-	sort(scanCounts[refIndex].begin(), scanCounts[refIndex].end(), SortScanWindow<ScanWindow>());
+      }
+      // Sort scan windows
+      sort(scanCounts[refIndex].begin(), scanCounts[refIndex].end(), SortScanWindow<ScanWindow>());
+      if (scanCounts[refIndex].size() >= LAST_BIN) {
+	std::cerr << "Warning: Too many scan windows on " << hdr->target_name[refIndex] << std::endl;
       }
     }
+  }
+
+  // Single pass over the alignments: scan window statistics and fragment midpoint counts
+  template<typename TConfig>
+  inline void
+  scan(TConfig const& c, LibraryInfo const& li, std::vector< std::vector<ScanWindow> >& scanCounts, std::vector<FragmentCounts>& fragCounts) {
+
+    // Load bam header
+    samFile* samfile = sam_open(c.bamFile.string().c_str(), "r");
+    hts_set_fai_filename(samfile, c.genome.string().c_str());
+    bam_hdr_t* hdr = sam_hdr_read(samfile);
+
+    // Pre-defined scanning windows
+    if (c.hasScanFile) _scanRegions(c, hdr, scanCounts);
     
     // Parse BAM file
     boost::posix_time::ptime now = boost::posix_time::second_clock::local_time();
-    std::cout << '[' << boost::posix_time::to_simple_string(now) << "] " << "Scanning Windows" << std::endl;
+    std::cout << '[' << boost::posix_time::to_simple_string(now) << "] " << "Count fragments" << std::endl;
     boost::progress_display show_progress( hdr->n_targets );
 
-    // Iterate chromosomes
-    uint64_t totalCov = 0;
-    faidx_t* faiMap = fai_load(c.mapFile.string().c_str());
-    for(int32_t refIndex=0; refIndex < (int32_t) hdr->n_targets; ++refIndex) {
-      ++show_progress;
-      if (chrNoData(c, refIndex, idx)) continue;
-      // Exclude small chromosomes
-      if ((hdr->target_len[refIndex] < c.minChrLen) && (totalCov > 1000000)) continue;
-      // Exclude sex chromosomes
-      if ((std::string(hdr->target_name[refIndex]) == "chrX") || (std::string(hdr->target_name[refIndex]) == "chrY") || (std::string(hdr->target_name[refIndex]) == "X") || (std::string(hdr->target_name[refIndex]) == "Y")) continue;
-
-      // Check presence in mappability map
-      std::string tname(hdr->target_name[refIndex]);
-      int32_t seqlen = faidx_seq_len(faiMap, tname.c_str());
-      if (seqlen == -1) continue;
-      else seqlen = -1;
-      char* seq = faidx_fetch_seq(faiMap, tname.c_str(), 0, faidx_seq_len(faiMap, tname.c_str()), &seqlen);
-
-      // Get Mappability
-      std::vector<uint16_t> uniqContent(hdr->target_len[refIndex], 0);
-      {
-	// Mappability map
-	typedef boost::dynamic_bitset<> TBitSet;
-	TBitSet uniq(hdr->target_len[refIndex], false);
-	for(uint32_t i = 0; i < hdr->target_len[refIndex]; ++i) {
-	  if (seq[i] == 'C') uniq[i] = 1;
-	}
+    // Chromosomes with scan window counts
+    std::vector<uint8_t> scanned(hdr->n_targets, 0);
 
-	// Sum across fragments
-	int32_t halfwin = (int32_t) (c.meanisize / 2);
-	int32_t usum = 0;
-	for(int32_t pos = halfwin; pos < (int32_t) hdr->target_len[refIndex] - halfwin; ++pos) {
-	  if (pos == halfwin) {
-	    for(int32_t i = pos - halfwin; i<=pos+halfwin; ++i) usum += uniq[i];
-	  } else {
-	    usum -= uniq[pos - halfwin - 1];
-	    usum += uniq[pos + halfwin];
-	  }
-	  uniqContent[pos] = usum;
-	}
-      }
+    // Iterate chromosomes in parallel, each thread with its own readers
+#pragma omp parallel default(shared)
+    {
+      samFile* tsamfile = sam_open(c.bamFile.string().c_str(), "r");
+      hts_set_fai_filename(tsamfile, c.genome.string().c_str());
+      requiredFields(tsamfile, DELLY_FIELDS_COUNT);
+      hts_idx_t* tidx = sam_index_load(tsamfile, c.bamFile.string().c_str());
+      bam_hdr_t* thdr = sam_hdr_read(tsamfile);
+      faidx_t* faiMap = NULL;
+      if (!c.hasTrackFile) faiMap = fai_load(c.mapFile.string().c_str());
 
-      // Bins on this chromosome
-      std::vector<uint16_t> binMap;
-      if (!c.hasScanFile) {
-	uint32_t allbins = hdr->target_len[refIndex] / c.scanWindow;
-	scanCounts[refIndex].resize(allbins, ScanWindow());
-	for(uint32_t i = 0; i < allbins; ++i) {
-	  scanCounts[refIndex][i].start = i * c.scanWindow;
-	  scanCounts[refIndex][i].end = (i+1) * c.scanWindow;
-	}
-      } else {
-	// Fill bin map
-	binMap.resize(hdr->target_len[refIndex], LAST_BIN);
-	if (scanCounts[refIndex].size() >= LAST_BIN) {
-	  std::cerr << "Warning: Too many scan windows on " << hdr->target_name[refIndex] << std::endl;
+#pragma omp for schedule(dynamic)
+      for(int32_t refIndex=0; refIndex < (int32_t) hdr->n_targets; ++refIndex) {
+#pragma omp critical
+	{
+	  ++show_progress;
 	}
-	for(uint32_t bin = 0;((bin < scanCounts[refIndex].size()) && (bin < LAST_BIN)); ++bin) {
-	  for(int32_t k = scanCounts[refIndex][bin].start; k < scanCounts[refIndex][bin].end; ++k) binMap[k] = bin;
-	}
-      }
+	if (chrNoData(c, refIndex, tidx)) continue;
+
+	// Get Mappability
+	std::string tname(hdr->target_name[refIndex]);
+	WindowTrack uniqContent;
+	if (!uniqueTrack(c, faiMap, tname, hdr->target_len[refIndex], uniqContent)) continue;
+
+	// Exclude sex chromosomes from scan windows, small chromosomes are handled below
+	bool scanChr = true;
+	if ((tname == "chrX") || (tname == "chrY") || (tname == "X") || (tname == "Y")) scanChr = false;
+	scanned[refIndex] = scanChr;
+
+	// Bins on this chromosome
+	std::vector<uint16_t> binMap;
+	if (scanChr) _scanBins(c, hdr, refIndex, scanCounts[refIndex], binMap);
+
+	// Midpoint counts of single-end reads and normal pairs
+	typedef uint16_t TCount;
+	uint32_t maxCoverage = std::numeric_limits<TCount>::max();
+	std::vector<TCount> cov(hdr->target_len[refIndex], 0);
+	FragmentCounts& fc = fragCounts[refIndex];
 	
-      // Mate map
-      typedef boost::unordered_map<std::size_t, bool> TMateMap;
-      TMateMap mateMap;
-
-      // Count reads
-      hts_itr_t* iter = sam_itr_queryi(idx, refIndex, 0, hdr->target_len[refIndex]);
-      bam1_t* rec = bam_init1();
-      int32_t lastAlignedPos = 0;
-      std::set<std::size_t> lastAlignedPosReads;
-      while (sam_itr_next(samfile, iter, rec) >= 0) {
-	if (rec->core.flag & (BAM_FSECONDARY | BAM_FQCFAIL | BAM_FDUP | BAM_FSUPPLEMENTARY | BAM_FUNMAP)) continue;
-	if ((rec->core.flag & BAM_FPAIRED) && ((rec->core.flag & BAM_FMUNMAP) || (rec->core.tid != rec->core.mtid))) continue;
-	if (rec->core.qual < c.minQual) continue;
-	if (getSVType(rec) != 2) continue;
-
-	int32_t midPoint = rec->core.pos + halfAlignmentLength(rec);
-	if (rec->core.flag & BAM_FPAIRED) {
-	  // Clean-up the read store for identical alignment positions
-	  if (rec->core.pos > lastAlignedPos) {
-	    lastAlignedPosReads.clear();
-	    lastAlignedPos = rec->core.pos;
-	  }
+	// Mate map
+	MateTable<bool> mateMap(li.maxNormalISize);
+
+	// Count reads
+	hts_itr_t* iter = sam_itr_queryi(tidx, refIndex, 0, hdr->target_len[refIndex]);
+	bam1_t* rec = bam_init1();
+	int32_t lastAlignedPos = 0;
+	TAlignedReads lastAlignedPosReads;
+	while (sam_itr_next(tsamfile, iter, rec) >= 0) {
+	  if (rec->core.flag & (BAM_FSECONDARY | BAM_FQCFAIL | BAM_FDUP | BAM_FSUPPLEMENTARY | BAM_FUNMAP)) continue;
+	  if ((rec->core.flag & BAM_FPAIRED) && ((rec->core.flag & BAM_FMUNMAP) || (rec->core.tid != rec->core.mtid))) continue;
+	  if (rec->core.qual < c.minQual) continue;
+
+	  int32_t midPoint = rec->core.pos + halfAlignmentLength(rec);
+	  if (rec->core.flag & BAM_FPAIRED) {
+	    // Clean-up the read store for identical alignment positions
+	    if (rec->core.pos > lastAlignedPos) {
+	      lastAlignedPosReads.clear();
+	      lastAlignedPos = rec->core.pos;
+	    }
 	
-	  if ((rec->core.pos < rec->core.mpos) || ((rec->core.pos == rec->core.mpos) && (lastAlignedPosReads.find(hash_string(bam_get_qname(rec))) == lastAlignedPosReads.end()))) {
-	    // First read
-	    lastAlignedPosReads.insert(hash_string(bam_get_qname(rec)));
-	    std::size_t hv = hash_pair(rec);
-	    mateMap[hv] = true;
-	    continue;
-	  } else {
-	    // Second read
-	    std::size_t hv = hash_pair_mate(rec);
-	    if ((mateMap.find(hv) == mateMap.end()) || (!mateMap[hv])) continue; // Mate discarded
-	    mateMap[hv] = false;
+	    if ((rec->core.pos < rec->core.mpos) || ((rec->core.pos == rec->core.mpos) && (lastAlignedPosReads.find(hash_string(bam_get_qname(rec))) == lastAlignedPosReads.end()))) {
+	      // First read
+	      lastAlignedPosReads.insert(hash_string(bam_get_qname(rec)));
+	      std::size_t hv = hash_pair(rec);
+	      mateMap.insert(hv, rec->core.pos, rec->core.mpos, true);
+	      continue;
+	    } else {
+	      // Second read
+	      std::size_t hv = hash_pair_mate(rec);
+	      if (!mateMap.erase(hv)) continue; // Mate discarded
+	    }
+
+	    // Insert size filter
+	    int32_t isize = (rec->core.pos + alignmentLength(rec)) - rec->core.mpos;
+	    if ((li.minNormalISize < isize) && (isize < li.maxNormalISize)) midPoint = rec->core.mpos + (int32_t) (isize/2);
+	    else {
+	      // Abnormal pair, read-depth windows use the read and GC-bias estimation the expected fragment midpoint
+	      if ((midPoint >= 0) && (midPoint < (int32_t) hdr->target_len[refIndex])) fc.midRD.push_back(midPoint);
+	      if (rec->core.flag & BAM_FREVERSE) midPoint = rec->core.pos + alignmentLength(rec) - (c.meanisize / 2);
+	      else midPoint = rec->core.pos + (c.meanisize / 2);
+	      if ((midPoint >= 0) && (midPoint < (int32_t) hdr->target_len[refIndex])) fc.midGC.push_back(midPoint);
+	      continue;
+	    }
 	  }
 
-	  // Insert size filter
-	  int32_t isize = (rec->core.pos + alignmentLength(rec)) - rec->core.mpos;
-	  if ((li.minNormalISize < isize) && (isize < li.maxNormalISize)) midPoint = rec->core.mpos + (int32_t) (isize/2);
-	  else continue;
-	}
+	  // Count fragment
+	  if ((midPoint >= 0) && (midPoint < (int32_t) hdr->target_len[refIndex])) {
+	    if (cov[midPoint] < maxCoverage) ++cov[midPoint];
 
-	// Count fragment
-	if ((midPoint >= 0) && (midPoint < (int32_t) hdr->target_len[refIndex])) {
-	  int32_t bin = _findScanWindow(c, hdr->target_len[refIndex], binMap, midPoint);
-	  if (bin >= 0) {
-	    ++scanCounts[refIndex][bin].cov;
-	    
-	    if (uniqContent[midPoint] >= c.fragmentUnique * c.meanisize) ++scanCounts[refIndex][bin].uniqcov;
-	    ++totalCov;
+	    // Scan windows only count proper orientation
+	    if ((scanChr) && (getSVType(rec) == 2)) {
+	      int32_t bin = _findScanWindow(c, hdr->target_len[refIndex], binMap, midPoint);
+	      if (bin >= 0) {
+		++scanCounts[refIndex][bin].cov;
+		if (uniqContent[midPoint] >= c.fragmentUnique * c.meanisize) ++scanCounts[refIndex][bin].uniqcov;
+	      }
+	    }
 	  }
 	}
+	// Clean-up
+	bam_destroy1(rec);
+	hts_itr_destroy(iter);
+	_encodeCounts(cov, fc);
+	fc.counted = true;
       }
+
       // Clean-up
-      bam_destroy1(rec);
-      hts_itr_destroy(iter);
-      if (seq != NULL) free(seq);
+      if (faiMap != NULL) fai_destroy(faiMap);
+      bam_hdr_destroy(thdr);
+      hts_idx_destroy(tidx);
+      sam_close(tsamfile);
+    }
+
+    // Small chromosomes are only scanned until 1M fragments were counted, in chromosome order
+    uint64_t totalCov = 0;
+    for(int32_t refIndex=0; refIndex < (int32_t) hdr->n_targets; ++refIndex) {
+      if (!scanned[refIndex]) continue;
+      if ((hdr->target_len[refIndex] < c.minChrLen) && (totalCov > 1000000)) {
+	if (c.hasScanFile) {
+	  for(uint32_t i = 0; i < scanCounts[refIndex].size(); ++i) {
+	    scanCounts[refIndex][i].cov = 0;
+	    scanCounts[refIndex][i].uniqcov = 0;
+	  }
+	} else scanCounts[refIndex].clear();
+	continue;
+      }
+      for(uint32_t i = 0; i < scanCounts[refIndex].size(); ++i) totalCov += scanCounts[refIndex][i].cov;
     }
     
     // clean-up
-    fai_destroy(faiMap);
     bam_hdr_destroy(hdr);
-    hts_idx_destroy(idx);
     sam_close(samfile);
   }
 
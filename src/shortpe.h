@@ -32,6 +32,7 @@
 #include "bolog.h"
 #include "tags.h"
 #include "coverage.h"
+#include "matetable.h"
 #include "msa.h"
 #include "split.h"
 #include "junction.h"
@@ -287,8 +288,7 @@ namespace torali
     for(unsigned int file_c = 0; file_c < c.files.size(); ++file_c) {
       // Inter-chromosomal mate map and alignment length
       typedef std::pair<uint8_t, int32_t> TQualLen;
-      typedef boost::unordered_map<std::size_t, TQualLen> TMateMap;
-      std::vector<TMateMap> matetra(c.files.size());
+      TraMateTable<TQualLen> matetra(hdr->n_targets, sampleLib[file_c].maxISizeCutoff);
 
       // Split-read junctions
       typedef std::vector<Junction> TJunctionVector;
@@ -312,14 +312,14 @@ namespace torali
 	if (nodata) continue;
 
 	// Intra-chromosomal mate map and alignment length
-	TMateMap mateMap;
+	MateTable<TQualLen> mateMap(sampleLib[file_c].maxISizeCutoff);
 
 	// Read alignments
 	for(typename TChrIntervals::const_iterator vRIt = validRegions[refIndex].begin(); vRIt != validRegions[refIndex].end(); ++vRIt) {
 	  hts_itr_t* iter = sam_itr_queryi(idx[file_c], refIndex, vRIt->lower(), vRIt->upper());
 	  bam1_t* rec = bam_init1();
 	  int32_t lastAlignedPos = 0;
-	  std::set<std::size_t> lastAlignedPosReads;
+	  TAlignedReads lastAlignedPosReads;
 	  while (sam_itr_next(samfile[file_c], iter, rec) >= 0) {
 	    if (rec->core.flag & (BAM_FQCFAIL | BAM_FDUP | BAM_FUNMAP)) continue;
 	    if ((rec->core.qual < c.minMapQual) || (rec->core.tid<0)) continue;
@@ -390,28 +390,18 @@ namespace torali
 		// First read
 		lastAlignedPosReads.insert(seed);
 		std::size_t hv = hash_pair(rec);
-		if (_translocation(svt)) matetra[file_c][hv]= std::make_pair((uint8_t) rec->core.qual, alignmentLength(rec));
-		else mateMap[hv]= std::make_pair((uint8_t) rec->core.qual, alignmentLength(rec));
+		if (_translocation(svt)) matetra.insert(hv, rec->core.mtid, rec->core.mpos, std::make_pair((uint8_t) rec->core.qual, (int32_t) alignmentLength(rec)));
+		else mateMap.insert(hv, rec->core.pos, rec->core.mpos, std::make_pair((uint8_t) rec->core.qual, (int32_t) alignmentLength(rec)));
 	      } else {
 		// Second read
 		std::size_t hv = hash_pair_mate(rec);
-		int32_t alenmate = 0;
-		uint8_t pairQuality = 0;
-	        if (_translocation(svt)) {
-		  // Inter-chromosomal
-		  if ((matetra[file_c].find(hv) == matetra[file_c].end()) || (!matetra[file_c][hv].first)) continue; // Mate discarded
-		  TQualLen p = matetra[file_c][hv];
-		  pairQuality = std::min((uint8_t) p.first, (uint8_t) rec->core.qual);
-		  alenmate = p.second;
-		  matetra[file_c][hv].first = 0;
-		} else {
-		  // Intra-chromosomal
-		  if ((mateMap.find(hv) == mateMap.end()) || (!mateMap[hv].first)) continue; // Mate discarded
-		  TQualLen p = mateMap[hv];
-		  pairQuality = std::min((uint8_t) p.first, (uint8_t) rec->core.qual);
-		  alenmate = p.second;
-		  mateMap[hv].first = 0;
-		}
+		TQualLen* p = NULL;
+		if (_translocation(svt)) p = matetra.find(rec->core.tid, hv); // Inter-chromosomal
+		else p = mateMap.find(hv); // Intra-chromosomal
+		if ((p == NULL) || (!p->first)) continue; // Mate discarded
+		uint8_t pairQuality = std::min((uint8_t) p->first, (uint8_t) rec->core.qual);
+		int32_t alenmate = p->second;
+		p->first = 0;
 
 #pragma omp critical
 		{
@@ -424,6 +414,7 @@ namespace torali
 	  bam_destroy1(rec);
 	  hts_itr_destroy(iter);
 	}
+	matetra.release(refIndex);
       }
 
       // Process all junctions for this BAM file
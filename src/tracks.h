@@ -0,0 +1,586 @@
+#ifndef TRACKS_H
+#define TRACKS_H
+
+#include <iostream>
+#include <fstream>
+#include <cstring>
+
+#include <boost/program_options/cmdline.hpp>
+#include <boost/program_options/options_description.hpp>
+#include <boost/program_options/parsers.hpp>
+#include <boost/program_options/variables_map.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include <boost/iostreams/device/mapped_file.hpp>
+#include <boost/iostreams/device/array.hpp>
+#include <boost/iostreams/stream.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/progress.hpp>
+#include <boost/filesystem.hpp>
+
+#include <htslib/faidx.h>
+
+#include "version.h"
+#include "util.h"
+
+namespace torali
+{
+
+  // Binary GC and mappability track file
+  //
+  // magic, version, fragment window (0: bit tracks only), #sequences, directory of
+  // (name, length, byte offsets of GC bits, uniqueness bits, GC sums, uniqueness sums) and
+  // 8-byte aligned data blocks. Bits are packed 64 bases per word, LSB first, window sums are
+  // uint16 per base. All values are little-endian. The file is mapped read-only and its data blocks
+  // are used in place, so track files are only written and mapped on little-endian hosts.
+  #ifndef DELLY_TRACK_MAGIC
+  #define DELLY_TRACK_MAGIC "DELLYTRK"
+  #endif
+
+  #ifndef DELLY_TRACK_VERSION
+  #define DELLY_TRACK_VERSION 1
+  #endif
+
+  struct TrackConfig {
+    uint32_t meanisize;
+    boost::filesystem::path genome;
+    boost::filesystem::path mapFile;
+    boost::filesystem::path outfile;
+  };
+
+  // Byte offsets into the track file, 0 if absent
+  struct TrackEntry {
+    uint32_t len;
+    uint64_t gcBits;
+    uint64_t uniqBits;
+    uint64_t gcSum;
+    uint64_t uniqSum;
+
+    TrackEntry() : len(0), gcBits(0), uniqBits(0), gcSum(0), uniqSum(0) {}
+  };
+
+  // Mapped track file or tracks built in memory, copies share the data read-only
+  struct TrackFile {
+    uint32_t window;
+    boost::iostreams::mapped_file_source mf;
+    boost::shared_ptr< std::vector<char> > buffer;
+    std::map<std::string, TrackEntry> entries;
+
+    TrackFile() : window(0) {}
+
+    inline char const* data() const { return (buffer) ? &(*buffer)[0] : mf.data(); }
+    inline uint64_t size() const { return (buffer) ? buffer->size() : mf.size(); }
+
+    inline TrackEntry const*
+    find(std::string const& name) const {
+      std::map<std::string, TrackEntry>::const_iterator it = entries.find(name);
+      if (it == entries.end()) return NULL;
+      return &it->second;
+    }
+  };
+
+  // Packed per-base bits of a track
+  struct PackedBits {
+    uint64_t const* words;
+    uint32_t len;
+
+    PackedBits(uint64_t const* w, uint32_t const l) : words(w), len(l) {}
+
+    inline std::size_t size() const { return len; }
+    inline bool operator[](std::size_t const i) const { return (words[i >> 6] >> (i & 63)) & 1; }
+  };
+
+  // Per-base fragment window sums, either computed or pointing into a mapped track file
+  struct WindowTrack {
+    std::vector<uint16_t> buf;
+    uint16_t const* ptr;
+
+    WindowTrack() : ptr(NULL) {}
+
+    inline uint16_t operator[](std::size_t const i) const { return ptr[i]; }
+
+  private:
+    WindowTrack(WindowTrack const&);
+    WindowTrack& operator=(WindowTrack const&);
+  };
+
+  inline uint64_t
+  _trackWords(uint32_t const len) {
+    return ((uint64_t) len + 63) / 64;
+  }
+
+  inline uint64_t
+  _trackAlign(uint64_t const offset) {
+    return (offset + 7) & ~((uint64_t) 7);
+  }
+
+  // Base classes, GC of the reference and unique positions ('C') of the mappability map
+  #define TRACK_GC 1
+  #define TRACK_UNIQUE 2
+
+  struct TrackClassTable {
+    uint8_t cls[256];
+
+    TrackClassTable() {
+      std::memset(cls, 0, sizeof(cls));
+      cls[(uint8_t) 'c'] = TRACK_GC;
+      cls[(uint8_t) 'g'] = TRACK_GC;
+      cls[(uint8_t) 'G'] = TRACK_GC;
+      cls[(uint8_t) 'C'] = TRACK_GC | TRACK_UNIQUE;
+    }
+  };
+
+  inline TrackClassTable const&
+  _trackClassTable() {
+    static TrackClassTable const table;
+    return table;
+  }
+
+  // GC bits (gc = true) or unique bits of the mappability map (gc = false), branch-free scalar loop per 64-base word
+  inline void
+  _packTrack(char const* seq, uint32_t const len, bool const gc, std::vector<uint64_t>& words) {
+    words.assign(_trackWords(len), 0);
+    if (seq == NULL) return;
+    uint8_t const* cls = _trackClassTable().cls;
+    uint8_t mask = (gc) ? TRACK_GC : TRACK_UNIQUE;
+    uint8_t const* p = reinterpret_cast<uint8_t const*>(seq);
+    uint32_t nfull = len / 64;
+    for(uint32_t w = 0; w < nfull; ++w, p += 64) {
+      uint64_t word = 0;
+      for(uint32_t j = 0; j < 64; ++j) word |= (uint64_t) ((cls[p[j]] & mask) != 0) << j;
+      words[w] = word;
+    }
+    for(uint32_t j = 0; j < len - nfull * 64; ++j) words[nfull] |= (uint64_t) ((cls[p[j]] & mask) != 0) << j;
+  }
+
+  // 64 bits starting at bit position start, bits beyond the track are zero
+  inline uint64_t
+  _bitWindow(PackedBits const& bits, uint64_t const start) {
+    uint64_t w = start >> 6;
+    uint32_t sh = start & 63;
+    uint64_t nw = _trackWords(bits.len);
+    uint64_t val = (w < nw) ? (bits.words[w] >> sh) : 0;
+    if ((sh) && (w + 1 < nw)) val |= bits.words[w + 1] << (64 - sh);
+    return val;
+  }
+
+  // Number of set bits in [0, end)
+  inline uint32_t
+  _bitCount(PackedBits const& bits, uint32_t const end) {
+    uint32_t cnt = 0;
+    for(uint32_t w = 0; w < end / 64; ++w) cnt += __builtin_popcountll(bits.words[w]);
+    if (end & 63) cnt += __builtin_popcountll(bits.words[end / 64] & (((uint64_t) 1 << (end & 63)) - 1));
+    return cnt;
+  }
+
+  // Sum of a per-base indicator over the fragment window centered at each position
+  //
+  // The first window is seeded with word popcounts, then the bits entering and leaving the window
+  // are fetched 64 at a time and the running sum is updated with shifts only. Plain scalar code,
+  // release builds use -fno-tree-vectorize.
+  template<typename TConfig>
+  inline void
+  _fragmentSum(TConfig const& c, PackedBits const& bits, std::vector<uint16_t>& content) {
+    content.assign(bits.size(), 0);
+    int32_t halfwin = (int32_t) (c.meanisize / 2);
+    int32_t last = (int32_t) bits.size() - halfwin;
+    if (halfwin >= last) return;
+    int32_t sum = _bitCount(bits, 2 * halfwin + 1);
+    content[halfwin] = sum;
+    for(int32_t pos = halfwin + 1; pos < last; pos += 64) {
+      uint64_t in = _bitWindow(bits, pos + halfwin);
+      uint64_t out = _bitWindow(bits, pos - halfwin - 1);
+      int32_t n = std::min(64, last - pos);
+      uint16_t* dst = &content[pos];
+      for(int32_t j = 0; j < n; ++j) {
+	sum += (int32_t) ((in >> j) & 1) - (int32_t) ((out >> j) & 1);
+	dst[j] = sum;
+      }
+    }
+  }
+
+  // Window sums of a mapped track, zero-copy if the track file was built for this fragment window
+  template<typename TConfig>
+  inline void
+  _windowTrack(TConfig const& c, uint64_t const bitOffset, uint64_t const sumOffset, uint32_t const len, WindowTrack& content) {
+    char const* base = c.tracks.data();
+    if ((sumOffset) && (c.tracks.window == c.meanisize)) content.ptr = reinterpret_cast<uint16_t const*>(base + sumOffset);
+    else {
+      _fragmentSum(c, PackedBits(reinterpret_cast<uint64_t const*>(base + bitOffset), len), content.buf);
+      content.ptr = content.buf.empty() ? NULL : &content.buf[0];
+    }
+  }
+
+  // Window sums of a FASTA sequence
+  template<typename TConfig>
+  inline bool
+  _fastaTrack(TConfig const& c, faidx_t* fai, std::string const& tname, uint32_t const reflen, bool const gc, WindowTrack& content) {
+    int32_t seqlen = faidx_seq_len(fai, tname.c_str());
+    if (seqlen == - 1) return false;
+    else seqlen = -1;
+    char* seq = faidx_fetch_seq(fai, tname.c_str(), 0, faidx_seq_len(fai, tname.c_str()), &seqlen);
+    std::vector<uint64_t> words;
+    _packTrack(seq, reflen, gc, words);
+    if (seq != NULL) free(seq);
+    _fragmentSum(c, PackedBits(words.empty() ? NULL : &words[0], reflen), content.buf);
+    content.ptr = content.buf.empty() ? NULL : &content.buf[0];
+    return true;
+  }
+
+  // Window sums of [start, end) from the bits of [fs, fs + bits.size()), zero within halfwin of the chromosome ends
+  template<typename TConfig>
+  inline void
+  _regionSum(TConfig const& c, PackedBits const& bits, uint32_t const fs, uint32_t const reflen, uint32_t const start, uint32_t const end, WindowTrack& content) {
+    std::vector<uint16_t> local;
+    _fragmentSum(c, bits, local);
+    uint32_t halfwin = c.meanisize / 2;
+    content.buf.assign(end - start, 0);
+    for(uint32_t i = std::max(start, halfwin); ((i < end) && (i + halfwin < reflen)); ++i) content.buf[i - start] = local[i - fs];
+    content.ptr = content.buf.empty() ? NULL : &content.buf[0];
+  }
+
+  // Window sums of a mapped track for [start, end), indexed from start
+  template<typename TConfig>
+  inline void
+  _windowTrack(TConfig const& c, uint64_t const bitOffset, uint64_t const sumOffset, uint32_t const len, uint32_t const start, uint32_t const end, WindowTrack& content) {
+    char const* base = c.tracks.data();
+    if ((sumOffset) && (c.tracks.window == c.meanisize)) content.ptr = reinterpret_cast<uint16_t const*>(base + sumOffset) + start;
+    else {
+      uint32_t halfwin = c.meanisize / 2;
+      uint32_t fs = (start > halfwin) ? start - halfwin : 0;
+      uint32_t fe = std::min(len, end + halfwin);
+      PackedBits bits(reinterpret_cast<uint64_t const*>(base + bitOffset), len);
+      std::vector<uint64_t> words(_trackWords(fe - fs), 0);
+      for(uint32_t w = 0; w < words.size(); ++w) words[w] = _bitWindow(bits, fs + (uint64_t) w * 64);
+      if ((fe - fs) & 63) words.back() &= ((uint64_t) 1 << ((fe - fs) & 63)) - 1;
+      _regionSum(c, PackedBits(words.empty() ? NULL : &words[0], fe - fs), fs, len, start, end, content);
+    }
+  }
+
+  // Window sums of a FASTA sequence for [start, end), indexed from start
+  template<typename TConfig>
+  inline bool
+  _fastaTrack(TConfig const& c, faidx_t* fai, std::string const& tname, uint32_t const reflen, uint32_t const start, uint32_t const end, bool const gc, WindowTrack& content) {
+    if (faidx_seq_len(fai, tname.c_str()) == -1) return false;
+    uint32_t halfwin = c.meanisize / 2;
+    uint32_t fs = (start > halfwin) ? start - halfwin : 0;
+    uint32_t fe = std::min(reflen, end + halfwin);
+    int32_t seqlen = -1;
+    char* seq = faidx_fetch_seq(fai, tname.c_str(), fs, fe - 1, &seqlen);
+    std::vector<uint64_t> words;
+    _packTrack(seq, fe - fs, gc, words);
+    if (seq != NULL) free(seq);
+    _regionSum(c, PackedBits(words.empty() ? NULL : &words[0], fe - fs), fs, reflen, start, end, content);
+    return true;
+  }
+
+  template<typename TConfig>
+  inline bool
+  uniqueTrack(TConfig const& c, faidx_t* faiMap, std::string const& tname, uint32_t const reflen, WindowTrack& uniqContent) {
+    if (!c.hasTrackFile) return _fastaTrack(c, faiMap, tname, reflen, false, uniqContent);
+    TrackEntry const* te = c.tracks.find(tname);
+    if ((te == NULL) || (!te->uniqBits) || (te->len != reflen)) return false;
+    _windowTrack(c, te->uniqBits, te->uniqSum, reflen, uniqContent);
+    return true;
+  }
+
+  template<typename TConfig>
+  inline bool
+  gcTrack(TConfig const& c, faidx_t* faiRef, std::string const& tname, uint32_t const reflen, WindowTrack& gcContent) {
+    if (!c.hasTrackFile) return _fastaTrack(c, faiRef, tname, reflen, true, gcContent);
+    TrackEntry const* te = c.tracks.find(tname);
+    if ((te == NULL) || (!te->gcBits) || (te->len != reflen)) return false;
+    _windowTrack(c, te->gcBits, te->gcSum, reflen, gcContent);
+    return true;
+  }
+
+  // Region [start, end) of the unique track, indexed from start
+  template<typename TConfig>
+  inline bool
+  uniqueTrack(TConfig const& c, faidx_t* faiMap, std::string const& tname, uint32_t const reflen, uint32_t const start, uint32_t const end, WindowTrack& uniqContent) {
+    if ((start == 0) && (end == reflen)) return uniqueTrack(c, faiMap, tname, reflen, uniqContent);
+    if (!c.hasTrackFile) return _fastaTrack(c, faiMap, tname, reflen, start, end, false, uniqContent);
+    TrackEntry const* te = c.tracks.find(tname);
+    if ((te == NULL) || (!te->uniqBits) || (te->len != reflen)) return false;
+    _windowTrack(c, te->uniqBits, te->uniqSum, reflen, start, end, uniqContent);
+    return true;
+  }
+
+  // Region [start, end) of the GC track, indexed from start
+  template<typename TConfig>
+  inline bool
+  gcTrack(TConfig const& c, faidx_t* faiRef, std::string const& tname, uint32_t const reflen, uint32_t const start, uint32_t const end, WindowTrack& gcContent) {
+    if ((start == 0) && (end == reflen)) return gcTrack(c, faiRef, tname, reflen, gcContent);
+    if (!c.hasTrackFile) return _fastaTrack(c, faiRef, tname, reflen, start, end, true, gcContent);
+    TrackEntry const* te = c.tracks.find(tname);
+    if ((te == NULL) || (!te->gcBits) || (te->len != reflen)) return false;
+    _windowTrack(c, te->gcBits, te->gcSum, reflen, start, end, gcContent);
+    return true;
+  }
+
+  template<typename TValue>
+  inline bool
+  _trackBin(TrackFile const& tracks, uint64_t& offset, TValue& val) {
+    if (offset + sizeof(TValue) > tracks.size()) return false;
+    _decodeBin(tracks.data() + offset, val);
+    offset += sizeof(TValue);
+    return true;
+  }
+
+  inline bool
+  _parseTracks(std::string const& label, TrackFile& tracks) {
+    uint64_t offset = std::strlen(DELLY_TRACK_MAGIC);
+    if ((tracks.size() < offset) || (std::memcmp(tracks.data(), DELLY_TRACK_MAGIC, offset))) {
+      std::cerr << "Not a delly track file: " << label << std::endl;
+      return false;
+    }
+    uint32_t version = 0;
+    uint32_t nseq = 0;
+    if ((!_trackBin(tracks, offset, version)) || (version != DELLY_TRACK_VERSION)) {
+      std::cerr << "Unsupported track file version: " << label << std::endl;
+      return false;
+    }
+    bool valid = (_trackBin(tracks, offset, tracks.window) && _trackBin(tracks, offset, nseq));
+    for(uint32_t i = 0; ((valid) && (i < nseq)); ++i) {
+      uint32_t namelen = 0;
+      TrackEntry te;
+      valid = _trackBin(tracks, offset, namelen) && (offset + namelen <= tracks.size());
+      if (!valid) break;
+      std::string name(tracks.data() + offset, namelen);
+      offset += namelen;
+      valid = (_trackBin(tracks, offset, te.len) && _trackBin(tracks, offset, te.gcBits) && _trackBin(tracks, offset, te.uniqBits) && _trackBin(tracks, offset, te.gcSum) && _trackBin(tracks, offset, te.uniqSum));
+      if ((te.gcBits) && (te.gcBits + 8 * _trackWords(te.len) > tracks.size())) valid = false;
+      if ((te.uniqBits) && (te.uniqBits + 8 * _trackWords(te.len) > tracks.size())) valid = false;
+      if ((te.gcSum) && (te.gcSum + 2 * (uint64_t) te.len > tracks.size())) valid = false;
+      if ((te.uniqSum) && (te.uniqSum + 2 * (uint64_t) te.len > tracks.size())) valid = false;
+      if (valid) tracks.entries[name] = te;
+    }
+    if (!valid) {
+      std::cerr << "Truncated track file: " << label << std::endl;
+      return false;
+    }
+    return true;
+  }
+
+  inline bool
+  openTrackFile(boost::filesystem::path const& trackFile, TrackFile& tracks) {
+    if (!_hostLittleEndian()) {
+      std::cerr << "Track files require a little-endian host: " << trackFile.string() << std::endl;
+      return false;
+    }
+    try {
+      tracks.mf.open(trackFile.string());
+    } catch (std::exception const& e) {
+      std::cerr << "Fail to map track file " << trackFile.string() << ": " << e.what() << std::endl;
+      return false;
+    }
+    return _parseTracks(trackFile.string(), tracks);
+  }
+
+  inline void
+  _writePadding(std::ostream& out, uint64_t& offset) {
+    for(; offset != _trackAlign(offset); ++offset) out.put(0);
+  }
+
+  // Directory, one entry per sequence of the mappability map, returns the track size in bytes
+  template<typename TConfig>
+  inline uint64_t
+  _trackDirectory(TConfig const& c, faidx_t* faiMap, faidx_t* faiRef, std::vector<std::string>& names, std::vector<TrackEntry>& dir) {
+    uint64_t offset = std::strlen(DELLY_TRACK_MAGIC) + 3 * sizeof(uint32_t);
+    for(int32_t i = 0; i < faidx_nseq(faiMap); ++i) {
+      std::string tname(faidx_iseq(faiMap, i));
+      TrackEntry te;
+      te.len = faidx_seq_len(faiMap, tname.c_str());
+      if (faidx_seq_len(faiRef, tname.c_str()) == (int32_t) te.len) te.gcBits = 1;
+      else std::cerr << "Warning: " << tname << " is missing in the reference or differs in length, no GC track!" << std::endl;
+      names.push_back(tname);
+      dir.push_back(te);
+      offset += 2 * sizeof(uint32_t) + tname.size() + 4 * sizeof(uint64_t);
+    }
+    for(uint32_t i = 0; i < dir.size(); ++i) {
+      uint64_t bitBytes = 8 * _trackWords(dir[i].len);
+      uint64_t sumBytes = _trackAlign(2 * (uint64_t) dir[i].len);
+      offset = _trackAlign(offset);
+      if (dir[i].gcBits) {
+	dir[i].gcBits = offset;
+	offset += bitBytes;
+      }
+      dir[i].uniqBits = offset;
+      offset += bitBytes;
+      if (c.meanisize) {
+	if (dir[i].gcBits) {
+	  dir[i].gcSum = offset;
+	  offset += sumBytes;
+	}
+	dir[i].uniqSum = offset;
+	offset += sumBytes;
+      }
+    }
+    return offset;
+  }
+
+  template<typename TConfig>
+  inline void
+  _writeTracks(TConfig const& c, faidx_t* faiMap, faidx_t* faiRef, std::vector<std::string> const& names, std::vector<TrackEntry> const& dir, std::ostream& out) {
+    // Header
+    out.write(DELLY_TRACK_MAGIC, std::strlen(DELLY_TRACK_MAGIC));
+    _writeBin(out, (uint32_t) DELLY_TRACK_VERSION);
+    _writeBin(out, (uint32_t) c.meanisize);
+    _writeBin(out, (uint32_t) dir.size());
+    uint64_t offset = std::strlen(DELLY_TRACK_MAGIC) + 3 * sizeof(uint32_t);
+    for(uint32_t i = 0; i < dir.size(); ++i) {
+      _writeString(out, names[i]);
+      _writeBin(out, dir[i].len);
+      _writeBin(out, dir[i].gcBits);
+      _writeBin(out, dir[i].uniqBits);
+      _writeBin(out, dir[i].gcSum);
+      _writeBin(out, dir[i].uniqSum);
+      offset += 2 * sizeof(uint32_t) + names[i].size() + 4 * sizeof(uint64_t);
+    }
+
+    // Data blocks
+    boost::progress_display show_progress(dir.size());
+    for(uint32_t i = 0; i < dir.size(); ++i) {
+      ++show_progress;
+      std::vector<uint64_t> gcWords;
+      std::vector<uint64_t> uniqWords;
+      int32_t seqlen = -1;
+      if (dir[i].gcBits) {
+	char* ref = faidx_fetch_seq(faiRef, names[i].c_str(), 0, dir[i].len, &seqlen);
+	_packTrack(ref, dir[i].len, true, gcWords);
+	if (ref != NULL) free(ref);
+      }
+      char* seq = faidx_fetch_seq(faiMap, names[i].c_str(), 0, dir[i].len, &seqlen);
+      _packTrack(seq, dir[i].len, false, uniqWords);
+      if (seq != NULL) free(seq);
+
+      // Bits
+      _writePadding(out, offset);
+      if (dir[i].gcBits) {
+	out.write(reinterpret_cast<char const*>(gcWords.data()), 8 * gcWords.size());
+	offset += 8 * gcWords.size();
+      }
+      out.write(reinterpret_cast<char const*>(uniqWords.data()), 8 * uniqWords.size());
+      offset += 8 * uniqWords.size();
+
+      // Window sums
+      if (c.meanisize) {
+	std::vector<uint16_t> content;
+	if (dir[i].gcBits) {
+	  _fragmentSum(c, PackedBits(gcWords.data(), dir[i].len), content);
+	  out.write(reinterpret_cast<char const*>(content.data()), 2 * content.size());
+	  offset += 2 * content.size();
+	  _writePadding(out, offset);
+	}
+	_fragmentSum(c, PackedBits(uniqWords.data(), dir[i].len), content);
+	out.write(reinterpret_cast<char const*>(content.data()), 2 * content.size());
+	offset += 2 * content.size();
+      }
+    }
+  }
+
+  // Bit tracks of the reference and the mappability map built once in memory
+  inline bool
+  loadTracks(boost::filesystem::path const& genome, boost::filesystem::path const& mapFile, TrackFile& tracks) {
+    TrackConfig c;
+    c.meanisize = 0;
+    c.genome = genome;
+    c.mapFile = mapFile;
+    faidx_t* faiMap = fai_load(c.mapFile.string().c_str());
+    faidx_t* faiRef = fai_load(c.genome.string().c_str());
+    std::vector<std::string> names;
+    std::vector<TrackEntry> dir;
+    uint64_t tsize = _trackDirectory(c, faiMap, faiRef, names, dir);
+    tracks.buffer.reset(new std::vector<char>(tsize, 0));
+    boost::iostreams::stream<boost::iostreams::array_sink> out(&(*tracks.buffer)[0], tsize);
+    _writeTracks(c, faiMap, faiRef, names, dir, out);
+    out.close();
+    fai_destroy(faiRef);
+    fai_destroy(faiMap);
+    return _parseTracks(c.mapFile.string(), tracks);
+  }
+
+  template<typename TConfig>
+  inline int32_t
+  trackRun(TConfig const& c) {
+    if (!_hostLittleEndian()) {
+      std::cerr << "Track files require a little-endian host: " << c.outfile.string() << std::endl;
+      return 1;
+    }
+    faidx_t* faiMap = fai_load(c.mapFile.string().c_str());
+    faidx_t* faiRef = fai_load(c.genome.string().c_str());
+    std::vector<std::string> names;
+    std::vector<TrackEntry> dir;
+    _trackDirectory(c, faiMap, faiRef, names, dir);
+    std::ofstream out(c.outfile.string().c_str(), std::ios_base::out | std::ios_base::binary);
+    _writeTracks(c, faiMap, faiRef, names, dir, out);
+    out.close();
+    fai_destroy(faiRef);
+    fai_destroy(faiMap);
+    if (!out) {
+      std::cerr << "Fail to write track file " << c.outfile.string() << std::endl;
+      return 1;
+    }
+
+    // End
+    boost::posix_time::ptime now = boost::posix_time::second_clock::local_time();
+    std::cout << '[' << boost::posix_time::to_simple_string(now) << "] " << "Done." << std::endl;
+    return 0;
+  }
+
+
+  int tracks(int argc, char **argv) {
+    TrackConfig c;
+    uint32_t isize = 0;
+
+    // Define generic options
+    boost::program_options::options_description generic("Generic options");
+    generic.add_options()
+      ("help,?", "show help message")
+      ("genome,g", boost::program_options::value<boost::filesystem::path>(&c.genome), "genome file")
+      ("mappability,m", boost::program_options::value<boost::filesystem::path>(&c.mapFile), "input mappability map")
+      ("insert-size,i", boost::program_options::value<uint32_t>(&isize)->default_value(0), "median insert size of the samples to precompute window sums for, 0: bit tracks only")
+      ("outfile,o", boost::program_options::value<boost::filesystem::path>(&c.outfile)->default_value("tracks.bin"), "output track file")
+      ;
+
+    // Set the visibility
+    boost::program_options::options_description cmdline_options;
+    cmdline_options.add(generic);
+    boost::program_options::variables_map vm;
+    boost::program_options::store(boost::program_options::command_line_parser(argc, argv).options(cmdline_options).run(), vm);
+    boost::program_options::notify(vm);
+
+    // Check command line arguments
+    if ((vm.count("help")) || (!vm.count("genome")) || (!vm.count("mappability"))) {
+      std::cout << std::endl;
+      std::cout << "Usage: delly " << argv[0] << " [OPTIONS] -g <genome.fa> -m <genome.map>" << std::endl;
+      std::cout << generic << "\n";
+      return 0;
+    }
+
+    // Check input files
+    if (!(boost::filesystem::exists(c.genome) && boost::filesystem::is_regular_file(c.genome) && boost::filesystem::file_size(c.genome))) {
+      std::cerr << "Reference file is missing: " << c.genome.string() << std::endl;
+      return 1;
+    }
+    if (!(boost::filesystem::exists(c.mapFile) && boost::filesystem::is_regular_file(c.mapFile) && boost::filesystem::file_size(c.mapFile))) {
+      std::cerr << "Mappability map is missing: " << c.mapFile.string() << std::endl;
+      return 1;
+    }
+
+    // Fragment window as used by delly cnv
+    c.meanisize = 0;
+    if (isize) c.meanisize = ((int32_t) (isize / 2)) * 2 + 1;
+
+    // Show cmd
+    boost::posix_time::ptime now = boost::posix_time::second_clock::local_time();
+    std::cout << '[' << boost::posix_time::to_simple_string(now) << "] ";
+    std::cout << "delly ";
+    for(int i=0; i<argc; ++i) { std::cout << argv[i] << ' '; }
+    std::cout << std::endl;
+
+    return trackRun(c);
+  }
+
+}
+
+#endif
@@ -4,11 +4,14 @@
 #include <boost/multi_array.hpp>
 #include <boost/unordered_map.hpp>
 #include <boost/algorithm/string.hpp>
+#include <boost/static_assert.hpp>
+#include <boost/type_traits/is_integral.hpp>
 #include <boost/iostreams/filtering_streambuf.hpp>
 #include <boost/iostreams/copy.hpp>
 #include <boost/iostreams/filter/gzip.hpp>
 #include <htslib/sam.h>
 #include <sstream>
+#include <cstring>
 #include <math.h>
 #include "tags.h"
 
@@ -23,6 +26,19 @@ namespace torali
   #ifndef MAX_CN
   #define MAX_CN 10
   #endif
+
+  // Alignment fields decoded by each consumer (CRAM only decodes the requested data series)
+  #ifndef DELLY_FIELDS_COUNT
+  #define DELLY_FIELDS_COUNT (SAM_QNAME | SAM_FLAG | SAM_RNAME | SAM_POS | SAM_MAPQ | SAM_CIGAR | SAM_RNEXT | SAM_PNEXT)
+  #endif
+
+  #ifndef DELLY_FIELDS_LIBRARY
+  #define DELLY_FIELDS_LIBRARY (SAM_FLAG | SAM_RNAME | SAM_POS | SAM_CIGAR | SAM_RNEXT | SAM_PNEXT | SAM_TLEN | SAM_SEQ)
+  #endif
+
+  #ifndef DELLY_FIELDS_GENOTYPE
+  #define DELLY_FIELDS_GENOTYPE (SAM_QNAME | SAM_FLAG | SAM_RNAME | SAM_POS | SAM_MAPQ | SAM_CIGAR | SAM_RNEXT | SAM_PNEXT | SAM_SEQ | SAM_QUAL | SAM_AUX | SAM_RGAUX)
+  #endif
   
   struct LibraryInfo {
     int32_t rs;
@@ -290,6 +306,79 @@ namespace torali
     return seed;
   }
 
+  // Phasing tags (HP, PS) of one alignment record, parsed lazily in a single walk over the aux block
+  struct PhaseTags {
+    bool parsed;
+    uint8_t hp;   // 0: untagged, 1: HP=1, 2: any other HP value
+    int64_t ps;   // -1: no phase set
+
+    PhaseTags() : parsed(false), hp(0), ps(-1) {}
+  };
+
+  inline int64_t
+  _auxInt(uint8_t const type, uint8_t const* s) {
+    switch (type) {
+    case 'c': return (int8_t) *s;
+    case 'C': return *s;
+    case 's': { int16_t v; memcpy(&v, s, 2); return v; }
+    case 'S': { uint16_t v; memcpy(&v, s, 2); return v; }
+    case 'i': { int32_t v; memcpy(&v, s, 4); return v; }
+    case 'I': { uint32_t v; memcpy(&v, s, 4); return v; }
+    default: return 0;
+    }
+  }
+
+  inline void
+  _parsePhase(bam1_t const* rec, PhaseTags& pt) {
+    pt.parsed = true;
+    uint8_t const* s = bam_get_aux(rec);
+    uint8_t const* end = rec->data + rec->l_data;
+    while (s + 3 <= end) {
+      bool isHP = ((s[0] == 'H') && (s[1] == 'P'));
+      bool isPS = ((s[0] == 'P') && (s[1] == 'S'));
+      uint8_t type = s[2];
+      s += 3;
+      int32_t size = 0;
+      switch (type) {
+      case 'A': case 'c': case 'C': size = 1; break;
+      case 's': case 'S': size = 2; break;
+      case 'i': case 'I': case 'f': size = 4; break;
+      case 'd': size = 8; break;
+      case 'Z': case 'H':
+	while ((s < end) && (*s)) ++s;
+	++s;
+	break;
+      case 'B':
+	{
+	  if (s + 5 > end) return;
+	  int32_t esize = 0;
+	  switch (s[0]) {
+	  case 'c': case 'C': esize = 1; break;
+	  case 's': case 'S': esize = 2; break;
+	  case 'i': case 'I': case 'f': esize = 4; break;
+	  default: return;
+	  }
+	  uint32_t n = 0;
+	  memcpy(&n, s + 1, 4);
+	  s += 5 + (std::size_t) n * esize;
+	}
+	break;
+      default: return; // Corrupt aux block
+      }
+      if (s + size > end) return;
+      if ((isHP) && (!pt.hp)) pt.hp = (_auxInt(type, s) == 1) ? 1 : 2;
+      else if ((isPS) && (pt.ps == -1)) pt.ps = _auxInt(type, s);
+      s += size;
+    }
+  }
+
+  // Haplotype of a record, the aux block is only scanned on first use
+  inline uint8_t
+  _haplotype(bam1_t const* rec, PhaseTags& pt) {
+    if (!pt.parsed) _parsePhase(rec, pt);
+    return pt.hp;
+  }
+
   inline void
   reverseComplement(std::string& sequence) {
     std::string rev = boost::to_upper_copy(std::string(sequence.rbegin(), sequence.rend()));
@@ -561,6 +650,12 @@ namespace torali
     stdDev = sqrt(stdDev / (TValue) count);
   }
 
+  // Restrict CRAM decoding to the given field set, BAM records are always fully decoded
+  inline void
+  requiredFields(samFile* fp, int32_t const fields) {
+    if (fp->is_cram) hts_set_opt(fp, CRAM_OPT_REQUIRED_FIELDS, fields);
+  }
+
   template<typename TConfig, typename TValidRegion, typename TSampleLibrary>
   inline void
   getLibraryParams(TConfig const& c, TValidRegion const& validRegions, TSampleLibrary& sampleLib) {
@@ -576,6 +671,7 @@ namespace torali
     for(unsigned int file_c = 0; file_c < c.files.size(); ++file_c) {
       samfile[file_c] = sam_open(c.files[file_c].string().c_str(), "r");
       hts_set_fai_filename(samfile[file_c], c.genome.string().c_str());
+      requiredFields(samfile[file_c], DELLY_FIELDS_LIBRARY);
       idx[file_c] = sam_index_load(samfile[file_c], c.files[file_c].string().c_str());
       hdr[file_c] = sam_hdr_read(samfile[file_c]);
     }
@@ -706,6 +802,54 @@ namespace torali
     return leadCrop;
   }
 
+  // Fixed-width integers in little-endian byte order, independent of the host
+  template<typename TValue>
+  inline void
+  _writeBin(std::ostream& out, TValue const& val) {
+    BOOST_STATIC_ASSERT(boost::is_integral<TValue>::value);
+    char buf[sizeof(TValue)];
+    uint64_t v = (uint64_t) val;
+    for(uint32_t i = 0; i < sizeof(TValue); ++i) buf[i] = (char) ((v >> (8 * i)) & 0xff);
+    out.write(buf, sizeof(TValue));
+  }
+
+  template<typename TValue>
+  inline void
+  _decodeBin(char const* buf, TValue& val) {
+    BOOST_STATIC_ASSERT(boost::is_integral<TValue>::value);
+    uint64_t v = 0;
+    for(uint32_t i = 0; i < sizeof(TValue); ++i) v |= (uint64_t) (uint8_t) buf[i] << (8 * i);
+    val = (TValue) v;
+  }
+
+  template<typename TValue>
+  inline void
+  _readBin(std::istream& in, TValue& val) {
+    char buf[sizeof(TValue)];
+    in.read(buf, sizeof(TValue));
+    _decodeBin(buf, val);
+  }
+
+  // Host byte order of the little-endian binary files
+  inline bool
+  _hostLittleEndian() {
+    uint16_t const one = 1;
+    return (*reinterpret_cast<uint8_t const*>(&one) == 1);
+  }
+
+  inline void
+  _writeString(std::ostream& out, std::string const& str) {
+    _writeBin(out, (uint32_t) str.size());
+    out.write(str.c_str(), str.size());
+  }
+
+  inline void
+  _readString(std::istream& in, std::string& str) {
+    uint32_t len = 0;
+    _readBin(in, len);
+    str.resize(len);
+    if (len) in.read(&str[0], len);
+  }
 
 }
 